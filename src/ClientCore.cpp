@@ -20,6 +20,10 @@
 #include "ClientCore.h"
 #include "MediaSourceManager.h"
 #include "RootNode.h"
+#include "FileSystemNode.h"
+#include "LibraryWatcher.h"
+#include "DaisyNavi.h"
+#include "InteractionTrace.h"
 #include "Defines.h"
 #include "Navi.h"
 #include "Utils.h"
@@ -28,7 +32,12 @@
 #include "Commands/NotifyCommands.h"
 #include "Commands/InternalCommands.h"
 #include "Commands/JumpCommand.h"
+#include "Commands/TimerCommands.h"
+#include "Commands/MountCommand.h"
+#include "Commands/LibraryCommand.h"
 #include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/WorkerPool.h"
+#include "NarratorCompletion.h"
 #include "Settings/Settings.h"
 
 #include <Narrator.h>
@@ -39,6 +48,8 @@
 #include <dbus/dbus-glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <iostream>
 #include <sstream>
 #include <boost/regex.hpp>
@@ -50,16 +61,137 @@ log4cxx::LoggerPtr clientcoreLog(log4cxx::Logger::getLogger("kolibre.clientcore.
 
 using namespace std;
 
-#define INFO_TIMEOUT 10;
+#define INFO_TIMEOUT 10
+// Interval in milliseconds for checking narrator/player activity while audio is active
+#define AUDIO_ACTIVITY_INTERVAL 1000
+// Delay in milliseconds before the player is stopped when help or about is opened
+#define HELP_PLAYER_STOP_DELAY 500
+// Time in milliseconds the destructor waits for a clientcore thread that missed the shutdown deadline
+#define SHUTDOWN_HARD_DEADLINE 2000
 static DBusHandlerResult dbusFilter(DBusConnection*, DBusMessage*, void*);
+static DBusConnection* connectDBus(GMainContext*);
+
+// The steps of the shutdown, in the order they run
+enum ShutdownStep
+{
+    SHUTDOWN_POSITION,
+    SHUTDOWN_PLAYBACK,
+    SHUTDOWN_JOBS,
+    SHUTDOWN_NAVIGATION,
+    SHUTDOWN_PLAYER,
+    SHUTDOWN_GOODBYE,
+    SHUTDOWN_NARRATOR,
+    SHUTDOWN_STEPS
+};
+
+static const char* shutdownStepNames[SHUTDOWN_STEPS] = { "book position", "playback", "background jobs", "navigation", "player",
+        "goodbye message", "narrator" };
+
+// Progress of the shutdown, shared with the clientcore thread
+struct ClientCore::ShutdownState
+{
+    ShutdownState() :
+            deadline(0), finished(false)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cond, &attr);
+        pthread_condattr_destroy(&attr);
+        for (int step = 0; step < SHUTDOWN_STEPS; step++)
+            done[step] = false;
+    }
+
+    ~ShutdownState()
+    {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    // Record that a step has finished
+    void finishStep(ShutdownStep step)
+    {
+        pthread_mutex_lock(&mutex);
+        done[step] = true;
+        pthread_mutex_unlock(&mutex);
+        LOG4CXX_DEBUG(clientcoreLog, "Shutdown step '" << shutdownStepNames[step] << "' finished");
+    }
+
+    // Record that the clientcore thread is about to exit
+    void finish()
+    {
+        pthread_mutex_lock(&mutex);
+        finished = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // Wait until the clientcore thread is about to exit, false if it doesn't within the given milliseconds
+    bool waitFinished(long milliseconds)
+    {
+        struct timespec ts = cq2::monotonicTimespec(cq2::monotonicMicroseconds() + milliseconds * 1000LL);
+        pthread_mutex_lock(&mutex);
+        while (not finished)
+        {
+            if (pthread_cond_timedwait(&cond, &mutex, &ts) == ETIMEDOUT)
+                break;
+        }
+        bool result = finished;
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+    // Milliseconds left until the deadline, -1 if there is no deadline
+    long remaining()
+    {
+        pthread_mutex_lock(&mutex);
+        long long end = deadline;
+        pthread_mutex_unlock(&mutex);
+
+        if (end == 0)
+            return -1;
+        long long left = end - cq2::monotonicMicroseconds();
+        return left > 0 ? left / 1000 : 0;
+    }
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long long deadline; // monotonic clock, microseconds, 0 if there is none
+    bool done[SHUTDOWN_STEPS];
+    bool finished;
+};
 
 /**
  * Constructor
  *
  * @param useragent The user-agent property in HTTP headers this application shall use
  */
-ClientCore::ClientCore(const std::string useragent)
+ClientCore::ClientCore(const std::string useragent) :
+        clientcoreRunning(false),
+        clientcoreThreadStarted(false),
+        sleepTimerStart(0),
+        sleepTimerEnd(0),
+        sleepTimerId(0),
+        sleepTimerSetting(-1),
+        sleepTimerState(SLEEP_TIMER_OFF)
 {
+    // Create the interaction trace before any thread can use it
+    InteractionTrace::Instance();
+
+    // Initialize mutexes, the destructor uses them even if the player fails
+    pthread_mutex_init(&clientcoreMutex, NULL);
+    pthread_mutex_init(&sleepTimerMutex, NULL);
+
+    // Initialize startup timeline
+    pthread_mutex_init(&startupMutex, NULL);
+    startupBegin = cq2::monotonicMicroseconds();
+    playerEnabled = false;
+
+    // Initialize shutdown state
+    shutdownState.reset(new ShutdownState());
+    shutdownTimedOut = false;
+
     LOG4CXX_INFO(clientcoreLog, VERSION_PACKAGE_NAME << " " << VERSION_PACKAGE_VERSION << " built " << __DATE__ << " " << __TIME__);
 
     // If no versioning info comes from above, use package name and version as UserAgent
@@ -78,16 +210,17 @@ ClientCore::ClientCore(const std::string useragent)
 
     LOG4CXX_INFO(clientcoreLog, "Setting up Settings");
     Settings *settings = Settings::Instance();
+    markStartup("settings loaded");
 
+    // Enabling the player builds its pipeline, do it while the narrator is
+    // set up since they don't depend on each other
     LOG4CXX_INFO(clientcoreLog, "Setting up Player");
     Player *player = Player::Instance();
     player->setUseragent(useragent);
-    if (player->enable(NULL, NULL))
-    { //&argc, &argv)) {
-        LOG4CXX_ERROR(clientcoreLog, "Failed to enable player");
-        return;
-    }
-    player->setTempo(settings->read<double>("playbackspeed", 1.0));
+    pthread_t playerSetupThread;
+    bool playerSetupThreadStarted = (pthread_create(&playerSetupThread, NULL, &ClientCore::player_setup_thread, this) == 0);
+    if (not playerSetupThreadStarted)
+        player_setup_thread(this);
 
     LOG4CXX_INFO(clientcoreLog, "Setting up Narrator");
     Narrator *narrator = Narrator::Instance();
@@ -96,21 +229,39 @@ ClientCore::ClientCore(const std::string useragent)
     narrator->connectAudioFinished(boost::bind(&ClientCore::narratorFinished, this));
     narrator->setTempo(settings->read<double>("playbackspeed", 1.0));
     narrator->setLanguage(settings->read<std::string>("language", "sv"));
+    markStartup("narrator ready");
 
-    bindtextdomain(PACKAGE, "locale");
-
-    // Initialize mutex
-    pthread_mutex_init(&clientcoreMutex, NULL);
+    if (playerSetupThreadStarted)
+        pthread_join(playerSetupThread, NULL);
+    if (not playerEnabled)
+    {
+        LOG4CXX_ERROR(clientcoreLog, "Failed to enable player");
+        return;
+    }
+    player->setTempo(settings->read<double>("playbackspeed", 1.0));
+    markStartup("player ready");
 
-    // Initialize sleep timer
-    setSleepTimerState(SLEEP_TIMER_OFF);
+    bindtextdomain(PACKAGE, "locale");
 
-    // Initialize thread variables
-    clientcoreRunning = false;
-    clientcoreThreadStarted = false;
-    dbusmonitorRunning = false;
-    dbusmonitorThreadStarted = false;
-    gMainLoop = g_main_loop_new(NULL, FALSE);
+    // Only the latest playback position, page and section are of interest,
+    // don't let stale updates pile up when the clientcore thread is busy
+    cq2::CommandQueue<BookPositionInfo>::instance().setCoalescing(true);
+    cq2::CommandQueue<BookPageInfo>::instance().setCoalescing(true);
+    cq2::CommandQueue<BookSectionInfo>::instance().setCoalescing(true);
+
+    // Serve user input before internal commands, and informational updates
+    // for the application last
+    cq2::CommandQueue<ClientCore::COMMAND>::instance().setLane(cq2::LANE_HIGH);
+    cq2::CommandQueue<JumpCommand<unsigned int> >::instance().setLane(cq2::LANE_HIGH);
+    cq2::CommandQueue<JumpCommand<std::string> >::instance().setLane(cq2::LANE_HIGH);
+    cq2::CommandQueue<BookPositionInfo>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<BookPageInfo>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<BookSectionInfo>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<ClientCore::BookDataPtr>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<DaisyNaviLevel>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<BookOpenProgress>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<NaviListPtr>::instance().setLane(cq2::LANE_LOW);
+    cq2::CommandQueue<NaviListItem>::instance().setLane(cq2::LANE_LOW);
 
     // Initialize class member variables
     mManualOggfile = "";
@@ -118,6 +269,16 @@ ClientCore::ClientCore(const std::string useragent)
     mDownloadFolder = "";
 }
 
+/**
+ * Enable the player, runs concurrently with the narrator setup
+ */
+void *ClientCore::player_setup_thread(void *ctx)
+{
+    ClientCore* ctxptr = (ClientCore*) ctx;
+    ctxptr->playerEnabled = not Player::Instance()->enable(NULL, NULL);
+    return NULL;
+}
+
 /**
  * Destructor
  */
@@ -125,8 +286,28 @@ ClientCore::~ClientCore()
 {
     pthread_mutex_lock(&clientcoreMutex);
     clientcoreRunning = false;
-    dbusmonitorRunning = false;
     pthread_mutex_unlock(&clientcoreMutex);
+    cq2::Dispatcher::instance().wakeup();
+
+    pthread_mutex_lock(&sleepTimerMutex);
+    if (sleepTimerId != 0)
+        cq2::Dispatcher::instance().cancel(sleepTimerId);
+    sleepTimerId = 0;
+    pthread_mutex_unlock(&sleepTimerMutex);
+
+    if (clientcoreThreadStarted && shutdownTimedOut)
+    {
+        // The thread is stuck, e.g. storing the book position. It gets a last
+        // chance to finish, if it doesn't it is left running together with
+        // the singletons it may still use.
+        LOG4CXX_WARN(clientcoreLog, "The shutdown deadline has passed, waiting " << SHUTDOWN_HARD_DEADLINE << " ms more for clientcoreThread");
+        if (not shutdownState->waitFinished(SHUTDOWN_HARD_DEADLINE))
+        {
+            LOG4CXX_ERROR(clientcoreLog, "clientcoreThread did not finish, leaving it behind");
+            pthread_detach(clientcoreThread);
+            return;
+        }
+    }
 
     if (clientcoreThreadStarted)
     {
@@ -135,16 +316,6 @@ ClientCore::~ClientCore()
         pthread_join(clientcoreThread, NULL);
     }
 
-    if (dbusmonitorThreadStarted)
-    {
-        // quit glib loop
-        g_main_loop_quit(gMainLoop);
-
-        // Wait until DBusMonitor thread stops
-        LOG4CXX_INFO(clientcoreLog, "Waiting for dbusmonitorThread to join");
-        pthread_join(dbusmonitorThread, NULL);
-    }
-
     LOG4CXX_DEBUG(clientcoreLog, "Deleting Settings");
     Settings::Instance()->DeleteInstance();
 
@@ -345,7 +516,10 @@ std::string ClientCore::getSerialNumber()
  */
 int ClientCore::getSleepTimerSetting()
 {
-    return sleepTimerSetting;
+    pthread_mutex_lock(&sleepTimerMutex);
+    int setting = sleepTimerSetting;
+    pthread_mutex_unlock(&sleepTimerMutex);
+    return setting;
 }
 
 /**
@@ -356,10 +530,15 @@ int ClientCore::getSleepTimerSetting()
  */
 int ClientCore::getSleepTimerTimeLeft()
 {
-    if (sleepTimerState == SLEEP_TIMER_OFF)
+    pthread_mutex_lock(&sleepTimerMutex);
+    int state = sleepTimerState;
+    long long end = sleepTimerEnd;
+    pthread_mutex_unlock(&sleepTimerMutex);
+
+    if (state == SLEEP_TIMER_OFF)
         return -1;
 
-    return sleepTimerEnd - time(NULL);
+    return (end - cq2::nowMicroseconds()) / 1000000;
 }
 
 /**
@@ -382,10 +561,12 @@ void ClientCore::setSleepTimerTimeLeft(int minutes)
     }
     else if (minutes > 0)
     {
-        setSleepTimerState(SLEEP_TIMER_ON);
-        sleepTimerStart = time(NULL);
-        sleepTimerEnd = sleepTimerStart + minutes * 60;
+        pthread_mutex_lock(&sleepTimerMutex);
+        sleepTimerStart = cq2::nowMicroseconds();
+        sleepTimerEnd = sleepTimerStart + minutes * 60 * 1000000LL;
         sleepTimerSetting = minutes;
+        pthread_mutex_unlock(&sleepTimerMutex);
+        setSleepTimerState(SLEEP_TIMER_ON);
         LOG4CXX_INFO(clientcoreLog, "SleepTimer set to " << minutes << " minutes");
         narrator->stop();
         player->pause();
@@ -394,6 +575,22 @@ void ClientCore::setSleepTimerTimeLeft(int minutes)
     }
 }
 
+/**
+ * Schedule a sleep timer command
+ *
+ * @param command The command to send
+ * @param end Time in microseconds on the cq2 clock when the sleep timer runs out
+ * @param secondsLeft Number of seconds before the end to send the command
+ *
+ * @return The id of the timer
+ */
+static cq2::TimerId scheduleSleepTimer(TIMER_COMMAND command, long long end, int secondsLeft)
+{
+    long long delay = (end - secondsLeft * 1000000LL - cq2::nowMicroseconds()) / 1000;
+    cq2::Command<TIMER_COMMAND> c(command);
+    return cq2::Dispatcher::instance().schedule(c, delay > 0 ? (long) delay : 0);
+}
+
 /**
  * Set the state for the sleep timer
  *
@@ -401,7 +598,16 @@ void ClientCore::setSleepTimerTimeLeft(int minutes)
  */
 void ClientCore::setSleepTimerState(SleepTimerStates state)
 {
+    ScopeLock lock(sleepTimerMutex);
     sleepTimerState = state;
+
+    // Schedule the next state change, it is handled in the clientcore thread
+    if (sleepTimerId != 0)
+    {
+        cq2::Dispatcher::instance().cancel(sleepTimerId);
+        sleepTimerId = 0;
+    }
+
     switch (state)
     {
     case SLEEP_TIMER_OFF:
@@ -409,6 +615,12 @@ void ClientCore::setSleepTimerState(SleepTimerStates state)
         sleepTimerEnd = 0;
         sleepTimerSetting = -1;
         break;
+    case SLEEP_TIMER_ON:
+        sleepTimerId = scheduleSleepTimer(TIMER_SLEEP_NEAR_TIMEOUT, sleepTimerEnd, SLEEP_TIMER_NEAR_TIMEOUT);
+        break;
+    case SLEEP_TIMER_NEAR_TIMEOUT:
+        sleepTimerId = scheduleSleepTimer(TIMER_SLEEP_TIMEOUT, sleepTimerEnd, SLEEP_TIMER_TIMED_OUT);
+        break;
     default:
         break;
     }
@@ -421,9 +633,15 @@ void ClientCore::setSleepTimerState(SleepTimerStates state)
  */
 SleepTimerStates ClientCore::getSleepTimerState()
 {
+    ScopeLock lock(sleepTimerMutex);
     return (SleepTimerStates) sleepTimerState;
 }
 
+// Names of the push commands, used in interaction traces
+static const char* commandNames[] = { "HOME", "UP", "DOWN", "LEFT", "RIGHT", "BACK", "EXIT", "PAUSE", "BOOKMARK", "CONTEXTMENU", "HELP",
+        "HELP_CLOSE", "ABOUT", "ABOUT_CLOSE", "RETRY_LOGIN", "SPEEDDOWN", "SPEEDUP", "SLEEP_OFF", "SLEEP_15", "SLEEP_30", "SLEEP_60",
+        "NARRATOR_CONTROL_STOP", "NARRATOR_CONTROL_CONTINUE", "BOOKINFO", "GOTO_TIME", "GOTO_PERCENT", "GOTO_PAGE" };
+
 /**
  * Execute a command
  *
@@ -431,16 +649,14 @@ SleepTimerStates ClientCore::getSleepTimerState()
  */
 void ClientCore::pushCommand(COMMAND command)
 {
-    // only a push command can deactivate the sleep timer
-    if (sleepTimerState == SLEEP_TIMER_NEAR_TIMEOUT)
-    {
-        LOG4CXX_INFO(clientcoreLog, "SleepTimer deactivated by user");
-        setSleepTimerTimeLeft(-1);
-        Player::Instance()->resume();
-    }
+    // start an interaction, the command carries its trace id
+    long previousTraceId = cq2::currentTraceId();
+    if (command >= 0 && command < (int) (sizeof(commandNames) / sizeof(commandNames[0])))
+        InteractionTrace::Instance()->begin(commandNames[command]);
 
     cq2::Command<ClientCore::COMMAND> c(command);
     c();
+    cq2::setCurrentTraceId(previousTraceId);
 }
 
 /**
@@ -493,18 +709,7 @@ bool ClientCore::isRunning()
  */
 void ClientCore::start()
 {
-    // Start dbus monitor thread
-    LOG4CXX_INFO(clientcoreLog, "Setting up dbusmonitorThread");
-    dbusmonitorRunning = true;
-    dbusmonitorThreadStarted = true;
-    if (pthread_create(&dbusmonitorThread, NULL, &ClientCore::dbusmonitor_thread, this))
-    {
-        LOG4CXX_WARN(clientcoreLog, "Failed to start dbusmonitorThread");
-        dbusmonitorRunning = false;
-        dbusmonitorThreadStarted = false;
-    }
-
-    // Start main thread
+    // Start main thread, it also monitors D-Bus for mounted file systems
     LOG4CXX_INFO(clientcoreLog, "Setting up clientcoreThread");
     if (pthread_create(&clientcoreThread, NULL, &ClientCore::clientcore_thread, this))
     {
@@ -524,28 +729,247 @@ void ClientCore::shutdown()
     pthread_mutex_lock(&clientcoreMutex);
     clientcoreRunning = false;
     pthread_mutex_unlock(&clientcoreMutex);
+    cq2::Dispatcher::instance().wakeup();
+}
+
+/**
+ * Shut down the application within a deadline
+ *
+ * The book position is stored first, then playback is stopped, queued
+ * network requests are dropped, running ones give up at their next step
+ * and the remaining resources are released. Steps that would block past
+ * the deadline are skipped. If the clientcore thread is still running at
+ * the deadline the report says so, and the destructor waits
+ * SHUTDOWN_HARD_DEADLINE milliseconds more for it. A thread that doesn't
+ * finish then is left running and the destructor returns without deleting
+ * the singletons it may still use.
+ *
+ * @param deadline Maximum time to wait in milliseconds
+ * @return The steps that did not finish before the deadline
+ */
+ClientCore::ShutdownReport ClientCore::shutdown(long deadline)
+{
+    long long begin = cq2::monotonicMicroseconds();
+    long long end = begin + deadline * 1000LL;
+    ShutdownState* state = shutdownState.get();
+
+    pthread_mutex_lock(&state->mutex);
+    state->deadline = end;
+    pthread_mutex_unlock(&state->mutex);
+
+    LOG4CXX_INFO(clientcoreLog, "Shutting down within " << deadline << " ms");
+    shutdown();
+
+    ShutdownReport report;
+    report.overrun = false;
+    if (clientcoreThreadStarted)
+    {
+        pthread_mutex_lock(&state->mutex);
+        struct timespec ts = cq2::monotonicTimespec(end);
+        while (not state->finished)
+        {
+            if (pthread_cond_timedwait(&state->cond, &state->mutex, &ts) == ETIMEDOUT)
+                break;
+        }
+        for (int step = 0; step < SHUTDOWN_STEPS; step++)
+        {
+            if (not state->done[step])
+                report.unfinished.push_back(shutdownStepNames[step]);
+        }
+        shutdownTimedOut = report.overrun = not state->finished;
+        pthread_mutex_unlock(&state->mutex);
+    }
+
+    report.completed = report.unfinished.empty();
+    report.milliseconds = (cq2::monotonicMicroseconds() - begin) / 1000;
+    if (report.completed)
+    {
+        LOG4CXX_INFO(clientcoreLog, "Shutdown finished after " << report.milliseconds << " ms");
+    }
+    else
+    {
+        for (size_t i = 0; i < report.unfinished.size(); i++)
+            LOG4CXX_WARN(clientcoreLog, "Shutdown step '" << report.unfinished[i] << "' did not finish within " << deadline << " ms");
+        if (report.overrun)
+            LOG4CXX_WARN(clientcoreLog, "clientcoreThread is still running after " << report.milliseconds << " ms");
+    }
+    return report;
+}
+
+/**
+ * Get command queue statistics for the commands sent so far
+ *
+ * Statistics are only collected when the library is configured with
+ * --enable-cq2-stats, otherwise the result is always empty.
+ *
+ * @return One entry per command type, or per enum value for enum command types
+ */
+std::vector<ClientCore::CommandStats> ClientCore::getCommandStats()
+{
+    std::vector<CommandStats> result;
+#ifdef CQ2_STATS
+    std::vector<cq2::CommandStats> stats = cq2::Dispatcher::instance().stats();
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        CommandStats entry;
+        entry.type = stats[i].type;
+        entry.value = stats[i].value;
+        entry.enqueued = stats[i].enqueued;
+        entry.depth = stats[i].depth;
+        entry.maxDepth = stats[i].maxDepth;
+        entry.dispatched = stats[i].dispatched;
+        entry.waitHistogram.assign(stats[i].wait.counts, stats[i].wait.counts + cq2::Histogram::BUCKETS);
+        entry.maxWait = stats[i].wait.max;
+        entry.handleHistogram.assign(stats[i].handling.counts, stats[i].handling.counts + cq2::Histogram::BUCKETS);
+        entry.maxHandle = stats[i].handling.max;
+        result.push_back(entry);
+    }
+#endif
+    return result;
+}
+
+/**
+ * Enable or disable tracing of interactions
+ *
+ * Each pushCommand starts an interaction that is traced through dispatch,
+ * navigation and playback until its first audio.
+ *
+ * @param enable true to start recording, false to stop
+ */
+void ClientCore::setTracing(bool enable)
+{
+    InteractionTrace::Instance()->setEnabled(enable);
+}
+
+/**
+ * Write the recorded interaction trace in the Chrome trace event format
+ *
+ * @param path The file to write, e.g. for chrome://tracing
+ * @return true on success
+ */
+bool ClientCore::writeTrace(const std::string path)
+{
+    return InteractionTrace::Instance()->writeChromeTrace(path);
+}
+
+/**
+ * Get the latency from pushCommand to the first audio for the recorded
+ * interactions
+ *
+ * @return One entry per command, only commands that reached audio are included
+ */
+std::vector<ClientCore::InteractionLatency> ClientCore::getInteractionLatencies()
+{
+    std::vector<InteractionLatency> result;
+    std::vector<InteractionTrace::Latency> latencies = InteractionTrace::Instance()->latencies();
+    for (size_t i = 0; i < latencies.size(); i++)
+    {
+        InteractionLatency entry;
+        entry.command = latencies[i].name;
+        entry.count = latencies[i].count;
+        entry.p50 = latencies[i].p50;
+        entry.p99 = latencies[i].p99;
+        entry.max = latencies[i].max;
+        result.push_back(entry);
+    }
+    return result;
+}
+
+/**
+ * Get the time it took to reach each phase of the startup
+ *
+ * The timeline starts when the ClientCore is constructed. The menu is
+ * usable when it contains the phase "root menu open", the timeline is
+ * complete with "welcome finished" when the narrator has spoken the welcome
+ * message and the menu announcement.
+ *
+ * @return The phases reached so far, in the order they were reached
+ */
+std::vector<ClientCore::StartupPhase> ClientCore::getStartupTimeline()
+{
+    pthread_mutex_lock(&startupMutex);
+    std::vector<StartupPhase> result = startupTimeline;
+    pthread_mutex_unlock(&startupMutex);
+    return result;
+}
+
+/**
+ * Get the time it took to open each book since the start
+ *
+ * Only books that were opened completely are included, not books that
+ * failed to open or whose opening was cancelled.
+ *
+ * @return The books in the order they were opened
+ */
+std::vector<ClientCore::BookOpenTime> ClientCore::getBookOpenTimes()
+{
+    return DaisyNavi::getOpenTimes();
+}
+
+/**
+ * Record that a startup phase has been reached
+ *
+ * @param phase The name of the phase
+ */
+void ClientCore::markStartup(const std::string &phase)
+{
+    StartupPhase entry;
+    entry.name = phase;
+    entry.milliseconds = (cq2::monotonicMicroseconds() - startupBegin) / 1000;
+    LOG4CXX_DEBUG(clientcoreLog, "Startup phase '" << phase << "' reached after " << entry.milliseconds << " ms");
+
+    pthread_mutex_lock(&startupMutex);
+    startupTimeline.push_back(entry);
+    pthread_mutex_unlock(&startupMutex);
 }
 
 // struct ClientCoreState (read global variables)
 // The handlers operate on this state, only for internal use
 struct ClientCoreState
 {
-    time_t infoTimer;
+    cq2::TimerId infoTimer;
+    bool audioActive;
     bool bHelpmode;
     bool retryLogin;
     bool commandQueueEmpty;
-    bool sleepTimerTimeout;
 
     ClientCoreState() :
+            infoTimer(0),
+            audioActive(false),
             bHelpmode(false),
             retryLogin(false),
-            commandQueueEmpty(true),
-            sleepTimerTimeout(false)
+            commandQueueEmpty(true)
     {
-        infoTimer = time(NULL) + INFO_TIMEOUT;
     }
 };
 
+/**
+ * Restart the info timer
+ *
+ * @param state The ClientCoreState owning the timer
+ * @param delay Number of milliseconds until the timer expires
+ */
+static void armInfoTimer(ClientCoreState* state, long delay)
+{
+    if (state->infoTimer != 0)
+        cq2::Dispatcher::instance().cancel(state->infoTimer);
+
+    cq2::Command<TIMER_COMMAND> c(TIMER_INFO);
+    state->infoTimer = cq2::Dispatcher::instance().schedule(c, delay);
+}
+
+/**
+ * Restart the info timer on a user command or when audio starts, it then
+ * expires INFO_TIMEOUT seconds after the audio has stopped
+ *
+ * @param state The ClientCoreState owning the timer
+ */
+static void restartInfoTimer(ClientCoreState* state)
+{
+    state->audioActive = true;
+    armInfoTimer(state, AUDIO_ACTIVITY_INTERVAL);
+}
+
 // command handlers
 
 struct Handle_ClientCoreCommands: public cq2::Handler<ClientCore::COMMAND>
@@ -562,10 +986,21 @@ private:
 
     void handle(ClientCore::COMMAND command)
     {
+        InteractionTrace::Instance()->point("cq2 dispatch");
         Narrator* narrator = Narrator::Instance();
         Player* player = Player::Instance();
         Settings* settings = Settings::Instance();
 
+        restartInfoTimer(state_);
+
+        // only a push command can deactivate the sleep timer
+        if (clientcore_->getSleepTimerState() == SLEEP_TIMER_NEAR_TIMEOUT)
+        {
+            LOG4CXX_INFO(clientcoreLog, "SleepTimer deactivated by user");
+            clientcore_->setSleepTimerTimeLeft(-1);
+            player->resume();
+        }
+
         switch (command)
         {
         case ClientCore::EXIT:
@@ -573,7 +1008,8 @@ private:
             LOG4CXX_INFO(clientcoreLog, "ClientCore::EXIT received");
             if (state_->retryLogin)
             {
-                usleep(50000); while (Narrator::Instance()->isSpeaking()) usleep(100000);
+                NarratorCompletion done(narrator);
+                done.wait();
             }
             clientcore_->shutdown();
         }
@@ -591,9 +1027,9 @@ private:
             if (manual != "")
             {
                 narrator->playFile(manual);
-                // Wait a while, then stop player so that it doesn't start when narrator finishes
-                usleep(500000);
-                player->stop();
+                // Stop player a while later so that it doesn't start when narrator finishes
+                cq2::Command<TIMER_COMMAND> stop(TIMER_HELP_PLAYER_STOP);
+                cq2::Dispatcher::instance().schedule(stop, HELP_PLAYER_STOP_DELAY);
             }
             else
             {
@@ -607,7 +1043,7 @@ private:
         {
             LOG4CXX_INFO(clientcoreLog, "ClientCore::HELP_CLOSE received");
             state_->bHelpmode = false;
-            state_->infoTimer = time(NULL);
+            armInfoTimer(state_, AUDIO_ACTIVITY_INTERVAL);
             narrator->stop();
             narrator->play(_N("continuing"));
             navi_->process(COMMAND_LAST);
@@ -642,9 +1078,9 @@ private:
                     }
                 }
                 narrator->playFile(about);
-                // Wait a while, then stop player so that it doesn't start when narrator finishes
-                usleep(500000);
-                player->stop();
+                // Stop player a while later so that it doesn't start when narrator finishes
+                cq2::Command<TIMER_COMMAND> stop(TIMER_HELP_PLAYER_STOP);
+                cq2::Dispatcher::instance().schedule(stop, HELP_PLAYER_STOP_DELAY);
             }
             else
             {
@@ -658,7 +1094,7 @@ private:
         {
             LOG4CXX_INFO(clientcoreLog, "ClientCore::ABOUT_CLOSE received");
             state_->bHelpmode = false;
-            state_->infoTimer = time(NULL);
+            armInfoTimer(state_, AUDIO_ACTIVITY_INTERVAL);
             narrator->stop();
             narrator->play(_N("continuing"));
             navi_->process(COMMAND_LAST);
@@ -888,6 +1324,115 @@ private:
     }
 };
 
+struct Handle_TimerCommands: public cq2::Handler<TIMER_COMMAND>
+{
+    Handle_TimerCommands(ClientCore* clientcore, ClientCoreState* state) :
+            clientcore_(clientcore), state_(state)
+    {
+    }
+
+private:
+    ClientCore* clientcore_;
+    ClientCoreState* state_;
+
+    void handle(TIMER_COMMAND command)
+    {
+        Narrator* narrator = Narrator::Instance();
+        Player* player = Player::Instance();
+
+        switch (command)
+        {
+        case TIMER_INFO:
+        {
+            // HELP_CLOSE and ABOUT_CLOSE restart the timer when help mode ends
+            if (state_->bHelpmode)
+                break;
+
+            // The info timer expires INFO_TIMEOUT seconds after audio has
+            // stopped, check again later while speaking or playing
+            if (narrator->isSpeaking() || player->isPlaying())
+            {
+                state_->audioActive = true;
+                armInfoTimer(state_, AUDIO_ACTIVITY_INTERVAL);
+                break;
+            }
+            if (state_->audioActive)
+            {
+                state_->audioActive = false;
+                armInfoTimer(state_, INFO_TIMEOUT * 1000);
+                break;
+            }
+
+            LOG4CXX_DEBUG(clientcoreLog, "infoTimer timeout occurred");
+            armInfoTimer(state_, INFO_TIMEOUT * 1000);
+
+            // send info events unless sleep timer is about to run out
+            if (clientcore_->getSleepTimerState() != SLEEP_TIMER_NEAR_TIMEOUT)
+            {
+                // retryLogin
+                if (state_->retryLogin)
+                {
+                    LOG4CXX_DEBUG(clientcoreLog, "SEND RETRY_LOGING command");
+                    cq2::Command<INTERNAL_COMMAND> c(COMMAND_RETRY_LOGIN);
+                    c();
+                }
+                else
+                {
+                    LOG4CXX_DEBUG(clientcoreLog, "SEND INFO command");
+                    cq2::Command<INTERNAL_COMMAND> c(COMMAND_INFO);
+                    c();
+                }
+                clientcore_->infoTimeout_signal();
+            }
+        }
+            break;
+
+        case TIMER_SLEEP_NEAR_TIMEOUT:
+        {
+            // Ignore a command sent before the sleep timer was changed
+            if (clientcore_->getSleepTimerState() != SLEEP_TIMER_ON
+                    || clientcore_->getSleepTimerTimeLeft() > SLEEP_TIMER_NEAR_TIMEOUT)
+                break;
+
+            // Inform user that SleepTimer is about to run out
+            LOG4CXX_INFO(clientcoreLog, "SleepTimer near timeout");
+            clientcore_->setSleepTimerState(SLEEP_TIMER_NEAR_TIMEOUT);
+            cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_SLEEP_NEAR_TIMEOUT);
+            notify();
+            player->pause();
+            narrator->stop();
+            narrator->play(_N("Sleep timer is running out. Application will close soon."));
+            narrator->play(_N("Turn off automatic shutdown by pressing an application button."));
+        }
+            break;
+
+        case TIMER_SLEEP_TIMEOUT:
+        {
+            // Ignore a command sent before the sleep timer was changed
+            if (clientcore_->getSleepTimerState() != SLEEP_TIMER_NEAR_TIMEOUT
+                    || clientcore_->getSleepTimerTimeLeft() > SLEEP_TIMER_TIMED_OUT)
+                break;
+
+            // Inform user that SleepTimer has run out and exit
+            LOG4CXX_INFO(clientcoreLog, "SleepTimer timeout occurred");
+            clientcore_->setSleepTimerState(SLEEP_TIMER_TIMED_OUT);
+            cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_SLEEP_TIMEOUT);
+            notify();
+            cq2::Command<ClientCore::COMMAND> exit(ClientCore::EXIT);
+            exit();
+        }
+            break;
+
+        case TIMER_HELP_PLAYER_STOP:
+            // Stop the paused player so that it doesn't start when the
+            // manual or about sound finishes, unless help was closed already
+            if (state_->bHelpmode)
+                player->stop();
+            break;
+        }
+    }
+};
+
 struct Handle_JumpToUri: public cq2::Handler<JumpCommand<std::string> >
 {
     Handle_JumpToUri(Navi* navi) :
@@ -922,7 +1467,7 @@ private:
     }
 };
 
-struct Handle_BookData: public cq2::Handler<ClientCore::BookData>
+struct Handle_BookData: public cq2::Handler<ClientCore::BookDataPtr>
 {
     Handle_BookData(ClientCore* clientcore) :
             clientcore_(clientcore)
@@ -932,10 +1477,10 @@ struct Handle_BookData: public cq2::Handler<ClientCore::BookData>
 private:
     ClientCore* clientcore_;
 
-    void handle(ClientCore::BookData bookData)
+    void handle(ClientCore::BookDataPtr bookData)
     {
         LOG4CXX_DEBUG(clientcoreLog, "ClientCore::BookData received");
-        clientcore_->bookData_signal(bookData);
+        clientcore_->bookData_signal(*bookData);
     }
 };
 
@@ -1007,7 +1552,24 @@ private:
     }
 };
 
-struct Handle_NaviList: public cq2::Handler<NaviList>
+struct Handle_BookOpenProgress: public cq2::Handler<BookOpenProgress>
+{
+    Handle_BookOpenProgress(ClientCore* clientcore) :
+            clientcore_(clientcore)
+    {
+    }
+
+private:
+    ClientCore* clientcore_;
+
+    void handle(BookOpenProgress progress)
+    {
+        LOG4CXX_DEBUG(clientcoreLog, "BookOpenProgress received");
+        clientcore_->bookOpenProgress_signal(progress);
+    }
+};
+
+struct Handle_NaviList: public cq2::Handler<NaviListPtr>
 {
     Handle_NaviList(ClientCore* clientcore) :
             clientcore_(clientcore)
@@ -1017,10 +1579,10 @@ struct Handle_NaviList: public cq2::Handler<NaviList>
 private:
     ClientCore* clientcore_;
 
-    void handle(NaviList list)
+    void handle(NaviListPtr list)
     {
         LOG4CXX_DEBUG(clientcoreLog, "NaviList received");
-        clientcore_->naviList_signal(list);
+        clientcore_->naviList_signal(*list);
     }
 };
 
@@ -1041,19 +1603,114 @@ private:
     }
 };
 
+struct Handle_MountCommand: public cq2::Handler<MountCommand>
+{
+private:
+    void handle(MountCommand command)
+    {
+        std::string fsPath = command.mountPoint_;
+        LOG4CXX_DEBUG(clientcoreLog, "MountCommand received for " << fsPath);
+
+        // check if path already added
+        for (int i=0; i<MediaSourceManager::Instance()->getFileSystemPaths(); i++)
+        {
+            if (MediaSourceManager::Instance()->getFSPpath(i) == fsPath)
+            {
+                LOG4CXX_INFO(clientcoreLog, "path " << fsPath << " already added");
+                return;
+            }
+        }
+
+        // add new path
+        int i = 1;
+        std::stringstream fsName;
+        fsName << "external " << i;
+        while (MediaSourceManager::Instance()->getFileSystemPathIndex(fsName.str()) != -1)
+        {
+            i++;
+            fsName.str("");
+            fsName << "external " << i;
+        }
+        LOG4CXX_INFO(clientcoreLog, "adding " << fsPath << " (" << fsName.str() << ") as new file system path");
+        MediaSourceManager::Instance()->addFileSystemPath(fsName.str(), fsPath);
+        if (Utils::isDir(fsPath))
+            LibraryWatcher::Instance()->watch(fsPath);
+    }
+};
+
+struct Handle_LibraryCommand: public cq2::Handler<LibraryCommand>
+{
+    Handle_LibraryCommand(Navi* navi) :
+            navi_(navi)
+    {
+    }
+
+private:
+    Navi* navi_;
+
+    void handle(LibraryCommand command)
+    {
+        LOG4CXX_DEBUG(clientcoreLog, "LibraryCommand received for " << command.media_);
+        FileSystemNode::libraryChanged(*navi_, command.media_);
+    }
+};
+
 // command handlers end
 
+// event loop
+
+// Wakes up the GMainContext of the clientcore thread, called by cq2 from any thread
+static void wakeupMainContext(void* context)
+{
+    g_main_context_wakeup((GMainContext*) context);
+}
+
+// The command source makes the GMainContext wait for cq2 commands and timers
+// together with the D-Bus connection. Commands are dispatched by the loop in
+// clientcore_thread, the source only provides the timeout.
+static gboolean commandSourcePrepare(GSource*, gint* timeout)
+{
+    long wait = cq2::Dispatcher::instance().prepareWait();
+    *timeout = wait;
+    return wait == 0;
+}
+
+static gboolean commandSourceCheck(GSource*)
+{
+    return FALSE;
+}
+
+static gboolean commandSourceDispatch(GSource*, GSourceFunc, gpointer)
+{
+    return TRUE;
+}
+
+static GSourceFuncs commandSourceFuncs = { commandSourcePrepare, commandSourceCheck, commandSourceDispatch, NULL };
+
+// event loop end
+
 void *ClientCore::clientcore_thread(void *ctx)
 {
     ClientCore* ctxptr = (ClientCore*) ctx;
+    ctxptr->markStartup("clientcore thread started");
 
-    // say welcome
+    // The ClientCore may be gone when the shutdown ends after its deadline
+    boost::shared_ptr<ShutdownState> shutdownProgress = ctxptr->shutdownState;
+
+    // say welcome, the rest of the startup is done while it plays
     Narrator::Instance()->play(_N("welcome"));
-    usleep(500000);
-    while (Narrator::Instance()->isSpeaking())
+    NarratorCompletion welcome(Narrator::Instance());
+
+    // Start updating the library index of the file systems and watching them
+    // for new publications
+    int fileSystemPaths = MediaSourceManager::Instance()->getFileSystemPaths();
+    for (int i = 0; i < fileSystemPaths; i++)
     {
-        usleep(20000);
+        std::string path = MediaSourceManager::Instance()->getFSPpath(i);
+        if (Utils::isDir(path))
+            LibraryWatcher::Instance()->watch(path);
     }
+    ctxptr->markStartup("file system scans started");
 
     // Default to running
     bool running = true;
@@ -1067,15 +1724,6 @@ void *ClientCore::clientcore_thread(void *ctx)
     RootNode *rootNode = new RootNode(userAgent);
 
     Navi *navi = new Navi(ctxptr);
-    navi->openMenu(rootNode, true);
-    if (not navi->good())
-    {
-        // Failed to open the root node.
-        LOG4CXX_ERROR(clientcoreLog, "failed to root node");
-        pthread_mutex_lock(&ctxptr->clientcoreMutex);
-        running = ctxptr->clientcoreRunning = false;
-        pthread_mutex_unlock(&ctxptr->clientcoreMutex);
-    }
 
     ClientCoreState state;
 
@@ -1089,6 +1737,9 @@ void *ClientCore::clientcore_thread(void *ctx)
     Handle_NotifyCommands notifyHandler(ctxptr, &state);
     notifyHandler.listen();
 
+    Handle_TimerCommands timerHandler(ctxptr, &state);
+    timerHandler.listen();
+
     Handle_JumpToUri jumpUriHandler(navi);
     jumpUriHandler.listen();
 
@@ -1110,59 +1761,75 @@ void *ClientCore::clientcore_thread(void *ctx)
     Handle_DaisyNaviLevel daisyLevelHandler(ctxptr);
     daisyLevelHandler.listen();
 
+    Handle_BookOpenProgress bookOpenHandler(ctxptr);
+    bookOpenHandler.listen();
+
     Handle_NaviList naviListHandler(ctxptr);
     naviListHandler.listen();
 
     Handle_NaviListItem naviItemHandler(ctxptr);
     naviItemHandler.listen();
 
-    // Command loop
+    Handle_MountCommand mountHandler;
+    mountHandler.listen();
 
-    while (running)
+    Handle_LibraryCommand libraryHandler(navi);
+    libraryHandler.listen();
+
+    // Startup phases reached after the command loop has started
+    cq2::Handler<StartupPhase> startupHandler(boost::bind(&ClientCore::markStartup, ctxptr, boost::bind(&StartupPhase::name, _1)));
+    startupHandler.listen();
+
+    // One event loop for commands, timers and D-Bus signals. D-Bus messages
+    // are handled on this thread and mounts are sent as commands, ordered
+    // with the other commands.
+    GMainContext* mainContext = g_main_context_new();
+    GSource* commandSource = g_source_new(&commandSourceFuncs, sizeof(GSource));
+    g_source_attach(commandSource, mainContext);
+    cq2::Dispatcher::instance().setWakeupFunction(&wakeupMainContext, mainContext);
+    DBusConnection* dbusConnection = connectDBus(mainContext);
+    ctxptr->markStartup("handlers ready");
+
+    // Build and open the root menu while the welcome message plays, the
+    // narrator announces the menu after the message
+    rootNode->prepare();
+    ctxptr->markStartup("root menu built");
+
+    navi->openMenu(rootNode, true);
+    if (not navi->good())
     {
-        // process SleepTimer
-        int sleepTimerTimeLeft = ctxptr->getSleepTimerTimeLeft();
-        SleepTimerStates sleepTimerState = ctxptr->getSleepTimerState();
-        switch (sleepTimerState)
-        {
-        case SLEEP_TIMER_ON:
-            // Inform user that SleepTimer is about to run out
-            if (sleepTimerTimeLeft < SLEEP_TIMER_NEAR_TIMEOUT)
-            {
-                LOG4CXX_INFO(clientcoreLog, "SleepTimer near timeout");
-                ctxptr->setSleepTimerState(SLEEP_TIMER_NEAR_TIMEOUT);
-                cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_SLEEP_NEAR_TIMEOUT);
-                notify();
-                player->pause();
-                narrator->stop();
-                narrator->play(_N("Sleep timer is running out. Application will close soon."));
-                narrator->play(_N("Turn off automatic shutdown by pressing an application button."));
-            }
-            break;
-        case SLEEP_TIMER_NEAR_TIMEOUT:
-            // Inform user that SleepTimer has run out
-            if (sleepTimerTimeLeft < SLEEP_TIMER_TIMED_OUT)
-            {
-                LOG4CXX_INFO(clientcoreLog, "SleepTimer timeout occurred");
-                ctxptr->setSleepTimerState(SLEEP_TIMER_TIMED_OUT);
-                cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_SLEEP_TIMEOUT);
-                notify();
-            }
-            break;
-        case SLEEP_TIMER_TIMED_OUT:
-            // Exit when SleepTimer has run out
-            if (not state.sleepTimerTimeout)
-            {
-                state.sleepTimerTimeout = true;
-                cq2::Command<ClientCore::COMMAND> exit(ClientCore::EXIT);
-                exit();
-            }
-            break;
-        }
+        // Failed to open the root node.
+        LOG4CXX_ERROR(clientcoreLog, "failed to root node");
+        pthread_mutex_lock(&ctxptr->clientcoreMutex);
+        running = ctxptr->clientcoreRunning = false;
+        pthread_mutex_unlock(&ctxptr->clientcoreMutex);
+    }
+    ctxptr->markStartup("root menu open");
+
+    // The narrator finishes the welcome message and the menu announcement
+    // while commands are handled
+    StartupPhase welcomeFinished;
+    welcomeFinished.name = "welcome finished";
+    welcome.whenDone(cq2::Command<StartupPhase>(welcomeFinished));
+
+    std::vector<StartupPhase> timeline = ctxptr->getStartupTimeline();
+    for (size_t i = 0; i < timeline.size(); i++)
+        LOG4CXX_INFO(clientcoreLog, "Startup: " << timeline[i].name << " after " << timeline[i].milliseconds << " ms");
+
+    // Start the info timer, the sleep timer is started by setSleepTimerTimeLeft
+    armInfoTimer(&state, INFO_TIMEOUT * 1000);
 
+    // Command loop, sleeps until a command is sent, a timer expires, a D-Bus
+    // message arrives or shutdown is requested
+
+    while (running)
+    {
         if (cq2::Dispatcher::instance().dispatchCommand())
         {
             state.commandQueueEmpty = false;
+            // narration and playback are started by commands, restart the info timer when they start
+            if (not state.audioActive && (narrator->isSpeaking() || player->isPlaying()))
+                restartInfoTimer(&state);
             continue;
         }
 
@@ -1174,90 +1841,126 @@ void *ClientCore::clientcore_thread(void *ctx)
             ctxptr->queueEmpty_signal();
         }
 
-        if (time(NULL) > state.infoTimer && !state.bHelpmode)
-        {
-            LOG4CXX_DEBUG(clientcoreLog, "infoTimer timeout occurred");
-            state.infoTimer = time(NULL) + INFO_TIMEOUT;
-
-            // send info events unless sleep timer is about to run out
-            if (sleepTimerState != SLEEP_TIMER_NEAR_TIMEOUT)
-            {
-                // retryLogin
-                if (state.retryLogin)
-                {
-                    LOG4CXX_DEBUG(clientcoreLog, "SEND RETRY_LOGING command");
-                    cq2::Command<INTERNAL_COMMAND> c(COMMAND_RETRY_LOGIN);
-                    c();
-                }
-                else
-                {
-                    LOG4CXX_DEBUG(clientcoreLog, "SEND INFO command");
-                    cq2::Command<INTERNAL_COMMAND> c(COMMAND_INFO);
-                    c();
-                }
-                ctxptr->infoTimeout_signal();
-            }
-        }
-
-        usleep(20000);
-
-        // While speaking or playing, push infoTimer forward
-        if (narrator->isSpeaking() || player->isPlaying())
-            state.infoTimer = time(NULL) + INFO_TIMEOUT;
-
         pthread_mutex_lock(&ctxptr->clientcoreMutex);
         running = ctxptr->clientcoreRunning;
         pthread_mutex_unlock(&ctxptr->clientcoreMutex);
 
         if (!running)
             break;
+
+        g_main_context_iteration(mainContext, TRUE);
+        cq2::Dispatcher::instance().finishWait();
     }
 
+    cq2::Dispatcher::instance().cancel(state.infoTimer);
+
+    // Stop monitoring D-Bus and detach the dispatcher from the event loop
+    if (dbusConnection != NULL)
+    {
+        dbus_connection_remove_filter(dbusConnection, dbusFilter, NULL);
+        dbus_connection_close(dbusConnection);
+        dbus_connection_unref(dbusConnection);
+    }
+    cq2::Dispatcher::instance().setWakeupFunction(NULL, NULL);
+    g_source_destroy(commandSource);
+    g_source_unref(commandSource);
+    g_main_context_unref(mainContext);
+
+    LOG4CXX_DEBUG(clientcoreLog, "Coalesced updates: position " << cq2::CommandQueue<BookPositionInfo>::instance().coalesced()
+            << ", page " << cq2::CommandQueue<BookPageInfo>::instance().coalesced()
+            << ", section " << cq2::CommandQueue<BookSectionInfo>::instance().coalesced());
+    const char* laneNames[] = { "high", "normal", "low" };
+    for (int lane = 0; lane < cq2::LANE_COUNT; lane++)
+    {
+        cq2::LaneStats stats = cq2::Dispatcher::instance().laneStats((cq2::Lane) lane);
+        LOG4CXX_DEBUG(clientcoreLog, "Dispatch lane " << laneNames[lane] << ": " << stats.dispatched << " commands, max depth "
+                << stats.maxDepth << ", max wait " << stats.maxWait << " us, total wait " << stats.totalWait << " us");
+    }
+#ifdef CQ2_STATS
+    std::vector<cq2::CommandStats> commandStats = cq2::Dispatcher::instance().stats();
+    for (size_t i = 0; i < commandStats.size(); i++)
+    {
+        LOG4CXX_DEBUG(clientcoreLog, "Command " << commandStats[i].type << "(" << commandStats[i].value << "): "
+                << commandStats[i].dispatched << " dispatched, max wait " << commandStats[i].wait.max
+                << " us, max handling " << commandStats[i].handling.max << " us");
+    }
+#endif
+
+    // Store the position of the open book first, the deadline may pass
+    // before the rest of the shutdown is done
+    DaisyNavi::closeOpenBook();
+    shutdownProgress->finishStep(SHUTDOWN_POSITION);
+
     narrator->stop();
     player->stop();
+    shutdownProgress->finishStep(SHUTDOWN_PLAYBACK);
 
     narrator->play(_N("shutting down"));
+    NarratorCompletion goodbye(narrator);
+
+    // Drop queued background jobs, e.g. network requests. Running jobs give
+    // up at their next step, see WorkerPool::isClosed().
+    long dropped = cq2::WorkerPool::instance().close();
+    LOG4CXX_DEBUG(clientcoreLog, "Dropped " << dropped << " queued background jobs");
+    if (cq2::WorkerPool::instance().waitIdle(shutdownProgress->remaining()))
+        shutdownProgress->finishStep(SHUTDOWN_JOBS);
+    else
+        LOG4CXX_WARN(clientcoreLog, "Background jobs still running");
 
+    // A job that is still running doesn't use the nodes, the DaisyOnline
+    // nodes release their requests without waiting for them
     LOG4CXX_DEBUG(clientcoreLog, "Deleting navi");
     delete navi;
+    shutdownProgress->finishStep(SHUTDOWN_NAVIGATION);
+
     LOG4CXX_DEBUG(clientcoreLog, "Deleting player");
     delete player;
+    shutdownProgress->finishStep(SHUTDOWN_PLAYER);
 
     // Wait for narrator to finish before deleting it
-    usleep(500000);
-    while (Narrator::Instance()->isSpeaking())
-    {
-        usleep(20000);
-    }
+    long left = shutdownProgress->remaining();
+    if (goodbye.wait(left < 0 ? NARRATOR_COMPLETION_TIMEOUT : left))
+        shutdownProgress->finishStep(SHUTDOWN_GOODBYE);
+    else
+        narrator->stop();
 
     LOG4CXX_DEBUG(clientcoreLog, "Deleting narrator");
     delete narrator;
+    shutdownProgress->finishStep(SHUTDOWN_NARRATOR);
 
+    shutdownProgress->finish();
     return NULL;
 }
 
-void *ClientCore::dbusmonitor_thread(void *ctx)
+/**
+ * Connect to the system bus and watch for mounted file systems
+ *
+ * @param context The GMainContext that dispatches the D-Bus messages
+ * @return A private connection, or NULL if the bus is not available
+ */
+static DBusConnection* connectDBus(GMainContext* context)
 {
-    ClientCore* ctxptr = (ClientCore*) ctx;
-
-    // Setup dbus connection
+    // Setup dbus connection, a private one so that it can be closed on exit
     DBusConnection *dbusConnection;
     DBusError dbusError;
     dbus_error_init(&dbusError);
-    dbusConnection = dbus_bus_get(DBUS_BUS_SYSTEM, &dbusError);
+    dbusConnection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &dbusError);
     if (dbus_error_is_set(&dbusError))
     {
         LOG4CXX_WARN(clientcoreLog, "Failed to connect to dbus " << std::string(dbusError.message));
         dbus_error_free(&dbusError);
     }
+    if (dbusConnection == NULL)
+        return NULL;
+    dbus_connection_set_exit_on_disconnect(dbusConnection, FALSE);
 
     // Add filter
     dbus_bus_add_match(dbusConnection, "type='signal',interface='org.freedesktop.DBus.Properties'", NULL);
-    dbus_connection_add_filter(dbusConnection, dbusFilter, ctx, NULL);
+    dbus_connection_add_filter(dbusConnection, dbusFilter, NULL, NULL);
 
-    // Connect with glib and start loop
-    dbus_connection_setup_with_g_main(dbusConnection, NULL);
-    g_main_loop_run(ctxptr->gMainLoop);
+    // Connect with the glib context of the clientcore thread
+    dbus_connection_setup_with_g_main(dbusConnection, context);
+    return dbusConnection;
 }
 
 static DBusHandlerResult dbusFilter(DBusConnection *connection, DBusMessage *message, void *user_data)
@@ -1414,29 +2117,9 @@ static DBusHandlerResult dbusFilter(DBusConnection *connection, DBusMessage *mes
         }
         LOG4CXX_DEBUG(dbusFilterLog, "got array of bytes value " << mountPoint.str());
 
-        // check if path already added
-        std::string fsPath = mountPoint.str();
-        for (int i=0; i<MediaSourceManager::Instance()->getFileSystemPaths(); i++)
-        {
-            if (MediaSourceManager::Instance()->getFSPpath(i) == fsPath)
-            {
-                LOG4CXX_INFO(dbusFilterLog, "path " << fsPath << " already added");
-                return DBUS_HANDLER_RESULT_HANDLED;
-            }
-        }
-
-        // add new path
-        int i = 1;
-        std::stringstream fsName;
-        fsName << "external " << i;
-        while (MediaSourceManager::Instance()->getFileSystemPathIndex(fsName.str()) != -1)
-        {
-            i++;
-            fsName.str("");
-            fsName << "external " << i;
-        }
-        LOG4CXX_INFO(dbusFilterLog, "adding " << fsPath << " (" << fsName.str() << ") as new file system path");
-        MediaSourceManager::Instance()->addFileSystemPath(fsName.str(), fsPath);
+        // the mount is handled like any other command
+        cq2::Command<MountCommand> mount(MountCommand(mountPoint.str()));
+        mount();
 
         return DBUS_HANDLER_RESULT_HANDLED;
     }
@@ -132,6 +132,58 @@ struct DaisyNaviLevel
     DaisyNaviLevel() : level_("") {}
 };
 
+/**
+ * A data type to hold the progress of opening a book
+ */
+struct BookOpenProgress
+{
+    /**
+     * The phases of opening a book, in the order they are reached
+     */
+    enum Phase
+    {
+        /**
+         * Parsing the navigation file, NCC or NCX
+         */
+        OPEN_NAVIGATION,
+        /**
+         * Loading the SMIL index and the bookmarks
+         */
+        OPEN_SETUP,
+        /**
+         * Restoring the last position
+         */
+        OPEN_LASTMARK,
+        /**
+         * The book is open
+         */
+        OPEN_DONE,
+        /**
+         * The book could not be opened
+         */
+        OPEN_FAILED,
+        /**
+         * Opening was cancelled by the user
+         */
+        OPEN_CANCELLED
+    };
+
+    /**
+     * The uri of the book
+     */
+    std::string uri;
+    /**
+     * The phase that was reached
+     */
+    Phase phase;
+    /**
+     * Milliseconds since opening started
+     */
+    long milliseconds;
+    BookOpenProgress(std::string u, Phase p, long ms) : uri(u), phase(p), milliseconds(ms) {}
+    BookOpenProgress() : uri(""), phase(OPEN_NAVIGATION), milliseconds(-1) {}
+};
+
 // data structures for events end
 
 enum SleepTimerStates
@@ -289,6 +341,175 @@ public:
         std::vector<Section> sections;
     };
 
+    /**
+     * An immutable, reference counted BookData
+     */
+    typedef boost::shared_ptr<const BookData> BookDataPtr;
+
+    /**
+     * A data type to hold command queue statistics for one command type, or
+     * for one value of a command type that is an enum
+     *
+     * Durations are kept in histograms where bucket 0 counts durations below
+     * 1 microsecond, bucket i durations from 2^(i-1) up to 2^i microseconds
+     * and the last bucket all longer durations.
+     */
+    struct CommandStats
+    {
+        /**
+         * The name of the command type
+         */
+        std::string type;
+
+        /**
+         * The enum value, -1 if the command type is not an enum
+         */
+        long value;
+
+        /**
+         * Number of commands sent, including commands merged by coalescing
+         */
+        long enqueued;
+
+        /**
+         * Number of commands currently waiting
+         */
+        long depth;
+
+        /**
+         * Highest number of commands waiting at once
+         */
+        long maxDepth;
+
+        /**
+         * Number of commands dispatched
+         */
+        long dispatched;
+
+        /**
+         * Histogram of the time from sending to dispatching a command
+         */
+        std::vector<long> waitHistogram;
+
+        /**
+         * Longest time from sending to dispatching a command in microseconds
+         */
+        long long maxWait;
+
+        /**
+         * Histogram of the time spent handling a command
+         */
+        std::vector<long> handleHistogram;
+
+        /**
+         * Longest time spent handling a command in microseconds
+         */
+        long long maxHandle;
+    };
+
+    /**
+     * A data type to hold one entry of the startup timeline
+     */
+    struct StartupPhase
+    {
+        /**
+         * The name of the phase, e.g. "root menu open"
+         */
+        std::string name;
+
+        /**
+         * Milliseconds from entering the constructor until the phase was reached
+         */
+        long milliseconds;
+    };
+
+    /**
+     * A data type to hold the time it took to open a book
+     */
+    struct BookOpenTime
+    {
+        /**
+         * The uri of the book
+         */
+        std::string uri;
+
+        /**
+         * Milliseconds from starting to open the book until it was open
+         */
+        long milliseconds;
+    };
+
+    /**
+     * A data type to hold the result of a shutdown with a deadline
+     */
+    struct ShutdownReport
+    {
+        /**
+         * True if every shutdown step finished before the deadline
+         */
+        bool completed;
+
+        /**
+         * Milliseconds from the shutdown request until the shutdown finished or the deadline passed
+         */
+        long milliseconds;
+
+        /**
+         * The steps that did not finish in time, in the order they run
+         */
+        std::vector<std::string> unfinished;
+
+        /**
+         * True if the clientcore thread was still running at the deadline,
+         * the destructor leaves it behind if it doesn't finish soon after
+         */
+        bool overrun;
+    };
+
+    // shut down within a deadline
+    ShutdownReport shutdown(long deadline);
+
+    /**
+     * A data type to hold the latency of one kind of interaction
+     */
+    struct InteractionLatency
+    {
+        /**
+         * The command that started the interaction, e.g. "RIGHT"
+         */
+        std::string command;
+
+        /**
+         * Number of interactions that reached audio
+         */
+        long count;
+
+        /**
+         * Median time from pushCommand to the first audio in microseconds
+         */
+        long long p50;
+
+        /**
+         * 99th percentile of the time from pushCommand to the first audio in microseconds
+         */
+        long long p99;
+
+        /**
+         * Longest time from pushCommand to the first audio in microseconds
+         */
+        long long max;
+    };
+
+    // interaction tracing
+    void setTracing(bool enable);
+    bool writeTrace(const std::string path);
+    std::vector<InteractionLatency> getInteractionLatencies();
+
+    // diagnostics
+    std::vector<CommandStats> getCommandStats();
+    std::vector<StartupPhase> getStartupTimeline();
+    std::vector<BookOpenTime> getBookOpenTimes();
+
     // signals and slots
     /**
      * Info timer timeout events are emitted via this signal
@@ -315,9 +536,9 @@ public:
      */
     boost::signals2::signal<void(ErrorMessage)> errorMessage_signal;
     /**
-     * Book data is emitted via this signal
+     * Book data is emitted via this signal, the data is shared and must not be modified
      */
-    boost::signals2::signal<void(BookData)> bookData_signal;
+    boost::signals2::signal<void(const BookData&)> bookData_signal;
     /**
      * Book position changes are emitted via this signal
      */
@@ -335,9 +556,13 @@ public:
      */
     boost::signals2::signal<void(DaisyNaviLevel)> daisyNaviLevel_signal;
     /**
-     * Navigation list changes are emitted via this signal
+     * Progress of opening a book is emitted via this signal
+     */
+    boost::signals2::signal<void(BookOpenProgress)> bookOpenProgress_signal;
+    /**
+     * Navigation list changes are emitted via this signal, the list is shared and must not be modified
      */
-    boost::signals2::signal<void(NaviList)> naviList_signal;
+    boost::signals2::signal<void(const NaviList&)> naviList_signal;
     /**
      * Navigation item changes are emitted via this signal
      */
@@ -346,18 +571,24 @@ public:
 
 private:
     static void *clientcore_thread(void *ctx);
-    static void *dbusmonitor_thread(void *ctx);
+    static void *player_setup_thread(void *ctx);
+    void markStartup(const std::string &phase);
+    struct ShutdownState;
 
     pthread_mutex_t clientcoreMutex;
     pthread_t clientcoreThread;
-    pthread_t dbusmonitorThread;
     bool clientcoreRunning;
-    bool dbusmonitorRunning;
     bool clientcoreThreadStarted;
-    bool dbusmonitorThreadStarted;
-    GMainLoop *gMainLoop;
-    time_t sleepTimerStart;
-    time_t sleepTimerEnd;
+    pthread_mutex_t startupMutex;
+    long long startupBegin; // monotonic clock, microseconds
+    std::vector<StartupPhase> startupTimeline;
+    bool playerEnabled;
+    boost::shared_ptr<ShutdownState> shutdownState;
+    bool shutdownTimedOut;
+    pthread_mutex_t sleepTimerMutex; // the sleep timer is set by the application and the clientcore thread
+    long long sleepTimerStart; // cq2 clock, microseconds
+    long long sleepTimerEnd; // cq2 clock, microseconds
+    unsigned long sleepTimerId;
     int sleepTimerSetting;
     int sleepTimerState;
     std::string mManualOggfile;
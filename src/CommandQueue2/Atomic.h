@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_ATOMIC_H
+#define COMMANDQUEUE2_ATOMIC_H
+
+/**
+ * Minimal set of atomic operations used by the lock-free parts of cq2.
+ *
+ * The __atomic builtins are used when the compiler provides them, older
+ * compilers fall back to the __sync builtins with full memory barriers.
+ */
+
+namespace cq2
+{
+namespace atomic
+{
+
+/**
+ * Full memory barrier
+ */
+inline void fullBarrier()
+{
+    __sync_synchronize();
+}
+
+/**
+ * Load a value with acquire semantics
+ */
+template<typename T>
+inline T load(T volatile* ptr)
+{
+#ifdef __ATOMIC_ACQUIRE
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#else
+    T value = *ptr;
+    __sync_synchronize();
+    return value;
+#endif
+}
+
+/**
+ * Store a value with release semantics
+ */
+template<typename T>
+inline void store(T volatile* ptr, T value)
+{
+#ifdef __ATOMIC_RELEASE
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#else
+    __sync_synchronize();
+    *ptr = value;
+#endif
+}
+
+/**
+ * Replace a value and return the previous one, acts as a full barrier
+ */
+template<typename T>
+inline T exchange(T volatile* ptr, T value)
+{
+#ifdef __ATOMIC_SEQ_CST
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#else
+    __sync_synchronize();
+    return __sync_lock_test_and_set(ptr, value);
+#endif
+}
+
+/**
+ * Replace a value if it equals expected, acts as a full barrier
+ *
+ * @returns true if the value was replaced
+ */
+template<typename T>
+inline bool compareAndSwap(T volatile* ptr, T expected, T value)
+{
+    return __sync_bool_compare_and_swap(ptr, expected, value);
+}
+
+/**
+ * Add to a value and return the result, acts as a full barrier
+ */
+template<typename T>
+inline T add(T volatile* ptr, T value)
+{
+    return __sync_add_and_fetch(ptr, value);
+}
+
+}
+}
+
+#endif
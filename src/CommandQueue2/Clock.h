@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_CLOCK_H
+#define COMMANDQUEUE2_CLOCK_H
+
+#include <time.h>
+#include <unistd.h>
+
+namespace cq2
+{
+
+/**
+ * Current time in microseconds on the monotonic clock, which is not affected
+ * by changes to the system time. Only useful for measuring intervals.
+ */
+inline long long monotonicMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Convert a time in microseconds on the monotonic clock to a timespec, e.g.
+ * for pthread_cond_timedwait() on a condition that uses CLOCK_MONOTONIC
+ */
+inline struct timespec monotonicTimespec(long long microseconds)
+{
+    struct timespec ts;
+    ts.tv_sec = microseconds / 1000000LL;
+    ts.tv_nsec = (microseconds % 1000000LL) * 1000;
+    return ts;
+}
+
+/**
+ * Source of the time used for timers and timeouts, see setClockSource().
+ * The default is the monotonic clock, a simulation installs a VirtualClock
+ * so that timers fire without waiting for them in real time.
+ */
+class ClockSource
+{
+public:
+    virtual ~ClockSource() {}
+
+    /**
+     * Current time in microseconds
+     */
+    virtual long long now() = 0;
+
+    /**
+     * Let the calling thread sleep for a number of microseconds
+     */
+    virtual void sleep(long long microseconds) = 0;
+
+    /**
+     * Called by a thread that has nothing to do until a deadline
+     *
+     * @return true if the time was advanced to the deadline, false if the
+     * thread has to wait for it. A source that returns false must report
+     * the time of the monotonic clock since the wait is done on that clock.
+     */
+    virtual bool skipTo(long long deadline) = 0;
+};
+
+// Storage for the installed clock source, shared by all translation units
+inline ClockSource*& clockSourceSlot()
+{
+    static ClockSource* source = NULL;
+    return source;
+}
+
+/**
+ * Install a clock source, NULL restores the monotonic clock. Must be called
+ * before any timers are added, the source is not deleted.
+ */
+inline void setClockSource(ClockSource* source)
+{
+    clockSourceSlot() = source;
+}
+
+/**
+ * Current time in microseconds on the installed clock source. Use this for
+ * timers and timeouts, and monotonicMicroseconds() for measurements.
+ */
+inline long long nowMicroseconds()
+{
+    ClockSource* source = clockSourceSlot();
+    if (source != NULL)
+        return source->now();
+    return monotonicMicroseconds();
+}
+
+/**
+ * Sleep for a number of microseconds on the installed clock source
+ */
+inline void sleepMicroseconds(long long microseconds)
+{
+    ClockSource* source = clockSourceSlot();
+    if (source != NULL)
+        source->sleep(microseconds);
+    else if (microseconds > 0)
+        usleep((useconds_t) microseconds);
+}
+
+/**
+ * Let a thread that has nothing to do until a deadline skip the wait if the
+ * installed clock source allows it
+ *
+ * @return true if the deadline has been reached without waiting
+ */
+inline bool skipToMicroseconds(long long deadline)
+{
+    ClockSource* source = clockSourceSlot();
+    return source != NULL && source->skipTo(deadline);
+}
+
+}
+
+#endif
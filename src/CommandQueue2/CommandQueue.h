@@ -20,8 +20,18 @@
 #ifndef COMMANDQUEUE2_COMMANDQUEUE_H
 #define COMMANDQUEUE2_COMMANDQUEUE_H
 
-#include <list>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <sched.h>
 #include "ScopeLock.h"
+#include "Atomic.h"
+#include "NodePool.h"
+#include "Clock.h"
+#include "Trace.h"
+#ifdef CQ2_STATS
+#include "Stats.h"
+#endif
 
 #include <boost/function.hpp>
 
@@ -49,6 +59,34 @@
  *
  * @class cq2::ICommand
  * used internally by Dispatcher to keep track of dipatching order.
+ *
+ * Commands are dispatched in FIFO order within a Lane. Each command type
+ * belongs to one lane, see CommandQueue::setLane(). Lanes with higher
+ * priority are served first, but a lane that has commands waiting is never
+ * passed over more than Dispatcher::setStarvationLimit() times in a row.
+ *
+ * Commands may be sent from any number of threads, but they must be
+ * dispatched from one thread at a time. Sending a command never takes a lock
+ * unless the dispatching thread is sleeping in Dispatcher::waitAndDispatch
+ * or coalescing is enabled for the command type.
+ *
+ * Commands can also be sent at a later time, once or repeatedly, see
+ * Dispatcher::schedule(). Timers expire in the dispatching thread.
+ *
+ * Instead of sleeping in Dispatcher::waitAndDispatch the dispatching thread
+ * may run an external event loop, e.g. a GMainContext or poll(), that waits
+ * for commands and timers together with its own file descriptors. See
+ * Dispatcher::setWakeupFunction() and Dispatcher::prepareWait().
+ *
+ * Handlers may listen() and ignore() at any time, also from within a
+ * handler. Dispatching reads an immutable snapshot of the handlers and does
+ * not take a lock or allocate memory.
+ *
+ * When CQ2_STATS is defined, queue depths, wait times and handler durations
+ * are recorded per command type and enum value, see Dispatcher::stats().
+ *
+ * A command carries the trace id of the thread that sent it, and the
+ * handlers run with that id as their current trace id, see Trace.h.
  */
 
 namespace cq2
@@ -56,10 +94,20 @@ namespace cq2
 
 class ICommand;
 
+template<typename DataT>
+class CommandQueue;
+
 class IQueue
 {
 private:
+    // Handle a dequeued command and give it back to its queue
     virtual void emit(ICommand*) = 0;
+    // Give a dequeued command back to its queue without handling it
+    virtual void release(ICommand*) = 0;
+#ifdef CQ2_STATS
+    // Append statistics for this command type
+    virtual void collectStats(std::vector<CommandStats>&) = 0;
+#endif
     friend class Dispatcher;
 };
 
@@ -67,12 +115,45 @@ class ICommand
 {
 public:
     IQueue* queue; /**< Used by Dispatcher to find the containing CommandQueue */
-    ICommand* nextCommand; /**< Used by Dispatcher to keep track of dispatch order */
+    ICommand* volatile nextCommand; /**< Used by Dispatcher to keep track of dispatch order */
+    long long enqueued; /**< Time in microseconds when the command was queued */
+    long traceId; /**< Trace id of the sending thread, see Trace.h */
+#ifdef CQ2_STATS
+    int statsSlot; /**< Used by CommandQueue to find the statistics for the command */
+#endif
 
     /**
      * Constructor
      */
-    ICommand() : nextCommand(0) {}
+    ICommand() : queue(0), nextCommand(0), enqueued(0), traceId(0)
+    {
+#ifdef CQ2_STATS
+        statsSlot = 0;
+#endif
+    }
+};
+
+/**
+ * Dispatch priority classes, lower values are served first
+ */
+enum Lane
+{
+    LANE_HIGH = 0, /**< User input */
+    LANE_NORMAL, /**< Default for all command types */
+    LANE_LOW, /**< Informational updates */
+    LANE_COUNT
+};
+
+/**
+ * Statistics for one dispatch lane
+ */
+struct LaneStats
+{
+    long depth; /**< Commands currently waiting */
+    long maxDepth; /**< Highest number of commands waiting at once */
+    long dispatched; /**< Commands dispatched or flushed */
+    long long totalWait; /**< Accumulated wait time in microseconds */
+    long long maxWait; /**< Longest wait time in microseconds */
 };
 
 template<typename DataT>
@@ -92,6 +173,35 @@ public:
     void operator()();
 };
 
+/**
+ * Identifies a timer created with Dispatcher::schedule(), 0 is never used
+ */
+typedef unsigned long TimerId;
+
+class IScheduled
+{
+public:
+    virtual ~IScheduled() {}
+
+    // Send the scheduled command, used by Dispatcher when the timer expires
+    virtual void send() = 0;
+};
+
+template<typename DataT>
+class ScheduledCommand: public IScheduled
+{
+public:
+    ScheduledCommand(const Command<DataT>& c) : command(c.data) {}
+
+    void send()
+    {
+        command();
+    }
+
+private:
+    Command<DataT> command;
+};
+
 class Dispatcher
 {
 public:
@@ -112,58 +222,676 @@ public:
      */
     bool dispatchCommand()
     {
-        ICommand* toHandle = 0;
+        fireTimers();
+
+        ICommand* toHandle = dequeue();
+
+        if (toHandle == NULL)
+            return false;
+
+        TraceScope trace(toHandle->traceId);
+        toHandle->queue->emit(toHandle);
+
+        return true;
+    }
+
+    /**
+     * Wait for a command and dispatch it in this thread context.
+     *
+     * The calling thread sleeps until a command is enqueued, a timer
+     * expires, wakeup() is called or the timeout expires. No polling is
+     * involved. With a VirtualClock installed the time until the next timer
+     * or the timeout is skipped instead of waited for.
+     *
+     * @param timeout Maximum time to wait in milliseconds, a negative value waits forever
+     *
+     * @returns false if no command was dispatched (timeout or wakeup)
+     * @returns true if one command was dispatched
+     */
+    bool waitAndDispatch(long timeout = -1)
+    {
+        fireTimers();
 
+        if (atomic::load(&pendingCount) == 0 && timeout != 0)
         {
-            ScopeLock lock(dispatcherMutex);
+            long long until = -1;
+            if (timeout > 0)
+                until = nowMicroseconds() + timeout * 1000LL;
+
+            ScopeLock lock(waitMutex);
+
+            // Announce that we are about to sleep before checking the queue
+            // one more time, enqueue() does the same in the opposite order
+            atomic::exchange(&sleeping, 1);
+
+            while (atomic::load(&pendingCount) == 0 && not wakeupPending)
+            {
+                // Sleep until the timeout or the next timer, whichever comes
+                // first. The deadline is recalculated when a timer is added.
+                long long deadline = nextTimerDeadline();
+                if (until >= 0 && (deadline < 0 || until < deadline))
+                    deadline = until;
 
-            if (first == NULL)
-                return false;
+                if (deadline < 0)
+                {
+                    pthread_cond_wait(&waitCond, &waitMutex);
+                }
+                else if (deadline <= nowMicroseconds() || skipToMicroseconds(deadline))
+                {
+                    break;
+                }
+                else
+                {
+                    struct timespec ts = monotonicTimespec(deadline);
+                    pthread_cond_timedwait(&waitCond, &waitMutex, &ts);
+                }
+            }
 
-            toHandle = first;
-            first = toHandle->nextCommand;
+            atomic::store(&sleeping, 0);
+            wakeupPending = false;
         }
 
-        toHandle->queue->emit(toHandle);
+        return dispatchCommand();
+    }
 
-        return true;
+    /**
+     * Make a thread blocked in waitAndDispatch() return without dispatching a
+     * command, e.g. when state checked by the dispatching thread has changed.
+     */
+    void wakeup()
+    {
+        ScopeLock lock(waitMutex);
+        wakeupPending = true;
+        pthread_cond_broadcast(&waitCond);
+        if (wakeupFunction != NULL)
+            wakeupFunction(wakeupContext);
+    }
+
+    /**
+     * Set a function that wakes up an external event loop, e.g.
+     * g_main_context_wakeup() or a write to an eventfd. It is called from
+     * any thread while the loop is waiting, between prepareWait() and
+     * finishWait(), when a command is sent, a timer is added or wakeup() is
+     * called. It must not block or send commands.
+     *
+     * @param function Wakeup function, NULL to remove it
+     * @param context Argument passed to the function
+     */
+    void setWakeupFunction(void (*function)(void*), void* context)
+    {
+        ScopeLock lock(waitMutex);
+        wakeupFunction = function;
+        wakeupContext = context;
+    }
+
+    /**
+     * Called by an external event loop on the dispatching thread before it
+     * waits. Commands sent after this call invoke the wakeup function until
+     * finishWait() is called.
+     *
+     * @returns Maximum time to wait in milliseconds, 0 if a command or timer
+     * is due or wakeup() has been called, -1 if nothing is scheduled
+     */
+    long prepareWait()
+    {
+        // Announce that we are about to wait before checking the queue, see
+        // waitAndDispatch()
+        atomic::exchange(&sleeping, 1);
+
+        if (atomic::load(&pendingCount) > 0)
+            return 0;
+
+        { // LOCK
+            ScopeLock lock(waitMutex);
+            if (wakeupPending)
+                return 0;
+        } // UNLOCK
+
+        long long deadline = nextTimerDeadline();
+        if (deadline < 0)
+            return -1;
+
+        long long left = deadline - nowMicroseconds();
+        if (left <= 0 || skipToMicroseconds(deadline))
+            return 0;
+
+        // Round up so that the loop does not wake up just before the deadline
+        return (long) ((left + 999) / 1000);
+    }
+
+    /**
+     * Called by an external event loop on the dispatching thread when it has
+     * stopped waiting, before dispatching with dispatchCommand().
+     */
+    void finishWait()
+    {
+        atomic::store(&sleeping, 0);
+        ScopeLock lock(waitMutex);
+        wakeupPending = false;
+    }
+
+    /**
+     * Send a command after a delay, and optionally repeat it with a fixed
+     * interval.
+     *
+     * When the timer expires the command is sent like any other command of
+     * its type, i.e. in the lane of the type and subject to coalescing.
+     * Timers are measured on the monotonic clock and expire in the
+     * dispatching thread, in dispatchCommand() or waitAndDispatch(). A
+     * repeating timer that falls behind skips the missed repetitions.
+     *
+     * May be called from any thread.
+     *
+     * @param command The command to send, it is copied
+     * @param delay Time in milliseconds until the command is sent
+     * @param interval Time in milliseconds between repetitions, 0 sends the command once
+     *
+     * @returns An id for cancel()
+     */
+    template<typename DataT>
+    TimerId schedule(const Command<DataT>& command, long delay, long interval = 0)
+    {
+        return addTimer(new ScheduledCommand<DataT>(command), delay, interval);
+    }
+
+    /**
+     * Cancel a timer. The command is not sent after this function returns,
+     * but a command already sent by the timer is still dispatched.
+     *
+     * May be called from any thread.
+     *
+     * @returns true if the timer was cancelled
+     * @returns false if the timer has already expired or was cancelled before
+     */
+    bool cancel(TimerId id)
+    {
+        IScheduled* scheduled = NULL;
+
+        { // LOCK
+            ScopeLock lock(timerMutex);
+            for (size_t i = 0; i < timerHeap.size(); i++)
+            {
+                if (timerHeap[i].id == id)
+                {
+                    scheduled = timerHeap[i].scheduled;
+                    timerHeap.erase(timerHeap.begin() + i);
+                    std::make_heap(timerHeap.begin(), timerHeap.end());
+                    atomic::store(&timerCount, (long) timerHeap.size());
+                    break;
+                }
+            }
+        } // UNLOCK
+
+        delete scheduled;
+        return scheduled != NULL;
+    }
+
+    /**
+     * Number of timers that have not expired or been cancelled
+     */
+    long timers()
+    {
+        return atomic::load(&timerCount);
     }
 
     /**
      * Flush all commands in the queue.
+     *
+     * Must be called from the dispatching thread, like the flush<>() functions.
      */
     void flushQueue()
     {
-        ScopeLock lock(dispatcherMutex);
-        if (first != NULL)
-            first = NULL;
+        ICommand* command;
+        while ((command = dequeue()) != NULL)
+            command->queue->release(command);
     }
+
+    /**
+     * Flush all queued commands of one type, commands of other types keep
+     * their order.
+     *
+     * @returns the number of flushed commands
+     */
+    template<typename DataT>
+    long flush()
+    {
+        return flush<DataT>(MatchAll<DataT>());
+    }
+
+    /**
+     * Flush the queued commands of one type that match a predicate, other
+     * commands keep their order.
+     *
+     * For a coalescing type the predicate is called with the coalescing
+     * lock held, so it must not send commands of the same type.
+     *
+     * @param matches Function or function object called as bool matches(const DataT&)
+     *
+     * @returns the number of flushed commands
+     */
+    template<typename DataT, typename Predicate>
+    long flush(Predicate matches)
+    {
+        CommandQueue<DataT>& commands = CommandQueue<DataT>::instance();
+        IQueue* queue = &commands;
+        long flushed = 0;
+
+        for (int i = 0; i < LANE_COUNT; i++)
+        {
+            LaneQueue& lane = lanes[i];
+            lane.drain();
+
+            ICommand* prev = NULL;
+            ICommand* command = lane.held;
+            while (command != NULL)
+            {
+                ICommand* next = command->nextCommand;
+                if (command->queue == queue && commands.flushMatches(command, matches))
+                {
+                    lane.unhold(prev, command);
+                    atomic::add(&lane.depth, -1L);
+                    atomic::add(&pendingCount, -1L);
+                    atomic::add(&lane.dispatched, 1L);
+                    queue->release(command);
+                    flushed++;
+                }
+                else
+                {
+                    prev = command;
+                }
+                command = next;
+            }
+        }
+
+        return flushed;
+    }
+
+    /**
+     * Number of commands waiting to be dispatched
+     */
+    long pending()
+    {
+        return atomic::load(&pendingCount);
+    }
+
+    /**
+     * Set how many times in a row a lane with waiting commands may be passed
+     * over in favour of lanes with higher priority.
+     */
+    void setStarvationLimit(int limit)
+    {
+        starvationLimit = limit;
+    }
+
+    /**
+     * Get statistics for a lane
+     */
+    LaneStats laneStats(Lane lane)
+    {
+        LaneQueue& queue = lanes[lane];
+        LaneStats stats;
+        stats.depth = atomic::load(&queue.depth);
+        stats.maxDepth = atomic::load(&queue.maxDepth);
+        stats.dispatched = atomic::load(&queue.dispatched);
+        stats.totalWait = atomic::load(&queue.totalWait);
+        stats.maxWait = atomic::load(&queue.maxWait);
+        return stats;
+    }
+
+#ifdef CQ2_STATS
+    /**
+     * Get statistics for all command types and enum values that have been
+     * sent. May be called from any thread, the values are not updated
+     * atomically as a whole.
+     */
+    std::vector<CommandStats> stats()
+    {
+        std::vector<CommandStats> result;
+        ScopeLock lock(statsMutex);
+        for (size_t i = 0; i < statsQueues.size(); i++)
+            statsQueues[i]->collectStats(result);
+        return result;
+    }
+#endif
+
 private:
-    Dispatcher()
+    template<typename DataT>
+    struct MatchAll
+    {
+        bool operator()(const DataT&) const
+        {
+            return true;
+        }
+    };
+
+    // Intrusive multi-producer/single-consumer queue with a stub node,
+    // producers only touch the head and the consumer only touches the tail.
+    // Commands the consumer has taken from the queue without dispatching
+    // them, see flush(), are kept in order on the held list.
+    struct LaneQueue
     {
-        pthread_mutex_init(&dispatcherMutex, NULL);
+        ICommand stub;
+        ICommand* volatile head;
+        long volatile depth;
+        long volatile maxDepth;
+        // keep the producer and consumer ends on separate cache lines
+        char padding[64];
+        ICommand* tail;
+        ICommand* held;
+        ICommand* heldTail;
+        int skipped;
+
+        // Consumer side statistics, only the dispatching thread updates them
+        long volatile dispatched;
+        long long volatile totalWait;
+        long long volatile maxWait;
+
+        LaneQueue() :
+                head(&stub), depth(0), maxDepth(0), tail(&stub), held(NULL), heldTail(NULL), skipped(0),
+                dispatched(0), totalWait(0), maxWait(0)
+        {
+        }
+
+        void push(ICommand* command)
+        {
+            command->nextCommand = NULL;
+            ICommand* prev = atomic::exchange(&head, command);
+            atomic::store(&prev->nextCommand, command);
+        }
+
+        ICommand* pop()
+        {
+            ICommand* first = tail;
+            ICommand* next = atomic::load(&first->nextCommand);
+
+            if (first == &stub)
+            {
+                if (next == NULL)
+                    return NULL;
+                tail = next;
+                first = next;
+                next = atomic::load(&next->nextCommand);
+            }
+
+            if (next != NULL)
+            {
+                tail = next;
+                return first;
+            }
+
+            if (first != atomic::load(&head))
+                return NULL;
+
+            // first is the last command, put the stub behind it so it can be taken
+            push(&stub);
+
+            next = atomic::load(&first->nextCommand);
+            if (next != NULL)
+            {
+                tail = next;
+                return first;
+            }
+
+            return NULL;
+        }
+
+        // Move all linked commands to the held list
+        void drain()
+        {
+            ICommand* command;
+            while ((command = pop()) != NULL)
+            {
+                command->nextCommand = NULL;
+                if (heldTail != NULL)
+                    heldTail->nextCommand = command;
+                else
+                    held = command;
+                heldTail = command;
+            }
+        }
+
+        // Remove a command from the held list, prev is the command before it
+        void unhold(ICommand* prev, ICommand* command)
+        {
+            if (prev != NULL)
+                prev->nextCommand = command->nextCommand;
+            else
+                held = command->nextCommand;
+            if (heldTail == command)
+                heldTail = prev;
+        }
+
+        // Take the next command, held commands were queued first
+        ICommand* next()
+        {
+            if (held == NULL)
+                return pop();
+
+            ICommand* command = held;
+            unhold(NULL, command);
+            return command;
+        }
+    };
+
+    // A scheduled command, timerHeap keeps the earliest deadline on top
+    struct Timer
+    {
+        long long deadline;
+        long long interval;
+        TimerId id;
+        IScheduled* scheduled;
+
+        // std::push_heap builds a max-heap, so order by descending deadline.
+        // Timers with the same deadline expire in the order they were added.
+        bool operator<(const Timer& other) const
+        {
+            if (deadline != other.deadline)
+                return deadline > other.deadline;
+            return id > other.id;
+        }
+    };
+
+    Dispatcher() :
+            pendingCount(0), starvationLimit(8), sleeping(0), wakeupPending(false),
+            wakeupFunction(NULL), wakeupContext(NULL), lastTimerId(0), timerCount(0)
+    {
+        pthread_mutex_init(&waitMutex, NULL);
+        pthread_mutex_init(&timerMutex, NULL);
+#ifdef CQ2_STATS
+        pthread_mutex_init(&statsMutex, NULL);
+#endif
+
+        // Timeouts are measured on the monotonic clock so that they are not
+        // affected by changes to the system time
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&waitCond, &attr);
+        pthread_condattr_destroy(&attr);
     }
 
-    // Locked in CommandQueue<DataT>
-    void queueCommand(ICommand* ev)
+    // Used by CommandQueue<DataT>, may be called from any thread
+    void queueCommand(ICommand* command, Lane lane)
     {
-        if (first == NULL)
+        LaneQueue& queue = lanes[lane];
+
+        command->enqueued = monotonicMicroseconds();
+        command->traceId = currentTraceId();
+        queue.push(command);
+
+        // Count the command after it has been linked, then check if the
+        // dispatching thread needs to be woken up
+        long depth = atomic::add(&queue.depth, 1L);
+        long maxDepth = atomic::load(&queue.maxDepth);
+        while (depth > maxDepth && not atomic::compareAndSwap(&queue.maxDepth, maxDepth, depth))
+            maxDepth = atomic::load(&queue.maxDepth);
+
+        atomic::add(&pendingCount, 1L);
+        if (atomic::load(&sleeping))
         {
-            first = ev;
-            last = ev;
+            ScopeLock lock(waitMutex);
+            pthread_cond_signal(&waitCond);
+            if (wakeupFunction != NULL)
+                wakeupFunction(wakeupContext);
+        }
+    }
+
+#ifdef CQ2_STATS
+    // Used by CommandQueue<DataT> when it is created
+    void registerQueue(IQueue* queue)
+    {
+        ScopeLock lock(statsMutex);
+        statsQueues.push_back(queue);
+    }
+#endif
+
+    TimerId addTimer(IScheduled* scheduled, long delay, long interval)
+    {
+        Timer timer;
+        timer.deadline = nowMicroseconds() + (delay > 0 ? delay : 0) * 1000LL;
+        timer.interval = (interval > 0 ? interval : 0) * 1000LL;
+        timer.scheduled = scheduled;
+
+        { // LOCK
+            ScopeLock lock(timerMutex);
+            timer.id = ++lastTimerId;
+            timerHeap.push_back(timer);
+            std::push_heap(timerHeap.begin(), timerHeap.end());
+            atomic::store(&timerCount, (long) timerHeap.size());
+        } // UNLOCK
+
+        // Let a sleeping dispatching thread recalculate its deadline
+        ScopeLock lock(waitMutex);
+        pthread_cond_broadcast(&waitCond);
+        if (wakeupFunction != NULL && atomic::load(&sleeping))
+            wakeupFunction(wakeupContext);
+
+        return timer.id;
+    }
+
+    // Deadline of the next timer in microseconds, -1 if there are no timers
+    long long nextTimerDeadline()
+    {
+        ScopeLock lock(timerMutex);
+        if (timerHeap.empty())
+            return -1;
+        return timerHeap.front().deadline;
+    }
+
+    // Send the commands of expired timers, only called from the dispatching
+    // thread. Commands are sent while holding timerMutex so that a timer
+    // never fires after cancel() has returned.
+    void fireTimers()
+    {
+        if (atomic::load(&timerCount) == 0)
             return;
+
+        ScopeLock lock(timerMutex);
+        long long now = nowMicroseconds();
+        while (not timerHeap.empty() && timerHeap.front().deadline <= now)
+        {
+            std::pop_heap(timerHeap.begin(), timerHeap.end());
+            Timer& timer = timerHeap.back();
+            timer.scheduled->send();
+
+            if (timer.interval > 0)
+            {
+                timer.deadline += timer.interval;
+                if (timer.deadline <= now)
+                    timer.deadline = now + timer.interval;
+                std::push_heap(timerHeap.begin(), timerHeap.end());
+            }
+            else
+            {
+                delete timer.scheduled;
+                timerHeap.pop_back();
+            }
+        }
+        atomic::store(&timerCount, (long) timerHeap.size());
+    }
+
+    // Take the next command, only called from the dispatching thread
+    ICommand* dequeue()
+    {
+        if (atomic::load(&pendingCount) == 0)
+            return NULL;
+
+        // Pick the lane with the highest priority, unless a lower lane has
+        // been passed over too many times
+        int chosen = -1;
+        int starved = -1;
+        for (int i = 0; i < LANE_COUNT; i++)
+        {
+            if (atomic::load(&lanes[i].depth) == 0)
+            {
+                lanes[i].skipped = 0;
+                continue;
+            }
+
+            if (chosen < 0)
+                chosen = i;
+            else if (starved < 0 && lanes[i].skipped >= starvationLimit)
+                starved = i;
+        }
+
+        if (chosen < 0)
+            return NULL;
+
+        if (starved >= 0)
+            chosen = starved;
+
+        for (int i = chosen + 1; i < LANE_COUNT; i++)
+        {
+            if (atomic::load(&lanes[i].depth) > 0)
+                lanes[i].skipped++;
         }
+        lanes[chosen].skipped = 0;
+
+        // A command has been queued, but a producer that published its
+        // command before it may not have linked it yet
+        LaneQueue& queue = lanes[chosen];
+        ICommand* command;
+        while ((command = queue.next()) == NULL)
+            sched_yield();
+
+        atomic::add(&queue.depth, -1L);
+        atomic::add(&pendingCount, -1L);
 
-        last->nextCommand = ev;
-        last = ev;
+        long long wait = monotonicMicroseconds() - command->enqueued;
+        atomic::add(&queue.dispatched, 1L);
+        atomic::add(&queue.totalWait, wait);
+        if (wait > atomic::load(&queue.maxWait))
+            atomic::store(&queue.maxWait, wait);
+
+        return command;
     }
 
 private:
-    // Used as a global lock for simplicity. Avoids live-lock scenarios.
-    pthread_mutex_t dispatcherMutex;
+    LaneQueue lanes[LANE_COUNT];
+
+    long volatile pendingCount;
+    int starvationLimit;
 
-    ICommand* first;
-    ICommand* last;
+    // Used when the dispatching thread is sleeping in waitAndDispatch or
+    // in an external event loop
+    pthread_mutex_t waitMutex;
+    pthread_cond_t waitCond;
+    int volatile sleeping;
+    bool wakeupPending;
+    void (*wakeupFunction)(void*);
+    void* wakeupContext;
+
+    // Timers created with schedule()
+    std::vector<Timer> timerHeap;
+    TimerId lastTimerId;
+    long volatile timerCount;
+    pthread_mutex_t timerMutex;
+
+#ifdef CQ2_STATS
+    // Command queues that have statistics
+    std::vector<IQueue*> statsQueues;
+    pthread_mutex_t statsMutex;
+#endif
 
     template<typename DataT>
     friend class CommandQueue;
@@ -214,8 +942,35 @@ private:
 template<typename DataT>
 class CommandQueue: public IQueue
 {
-    std::list<Handler<DataT>*> handlers;
-    std::list<Command<DataT> > commands;
+    // Immutable snapshot of the registered handlers. Adding or removing a
+    // handler publishes a new snapshot, the replaced one is retired and
+    // deleted as soon as no emit() is using it, by the thread that replaced
+    // it or by the dispatching thread when emit() returns.
+    struct HandlerList
+    {
+        std::vector<Handler<DataT>*> handlers;
+        HandlerList* nextRetired;
+
+        HandlerList() : nextRetired(NULL) {}
+    };
+
+    HandlerList* volatile handlers;
+    HandlerList* volatile retired;
+    long volatile emitting;
+    pthread_mutex_t handlersMutex;
+    NodePool<Command<DataT> > pool;
+
+    Lane lane;
+
+    // Coalescing, see setCoalescing()
+    bool coalescing;
+    Command<DataT>* queuedNode;
+    long coalescedCount;
+    pthread_mutex_t coalesceMutex;
+
+#ifdef CQ2_STATS
+    std::vector<StatsSlot> stats;
+#endif
 public:
     /**
      * Singleton instance
@@ -226,60 +981,278 @@ public:
         return inst;
     }
 
+    /**
+     * Enable or disable coalescing for this command type.
+     *
+     * With coalescing enabled the latest value wins, i.e. a command sent
+     * while another command of this type is still waiting to be dispatched
+     * replaces the data of the waiting command instead of being queued. The
+     * waiting command keeps its position in the queue. Intended for state
+     * updates where only the current value matters.
+     */
+    void setCoalescing(bool enable)
+    {
+        ScopeLock lock(coalesceMutex);
+        coalescing = enable;
+    }
+
+    /**
+     * Set the dispatch lane for this command type, the default is LANE_NORMAL.
+     * Should be set before commands of this type are sent.
+     */
+    void setLane(Lane l)
+    {
+        lane = l;
+    }
+
+    /**
+     * Number of commands that have been merged into a waiting command
+     */
+    long coalesced()
+    {
+        ScopeLock lock(coalesceMutex);
+        return coalescedCount;
+    }
+
+    /**
+     * Number of handlers receiving commands of this type
+     */
+    size_t handlerCount()
+    {
+        ScopeLock lock(handlersMutex);
+        return handlers->handlers.size();
+    }
+
     // Used by Handler
     void addHandler(Handler<DataT>* handler)
     {
-        ScopeLock lock(Dispatcher::instance().dispatcherMutex);
-        handlers.push_back(handler);
+        ScopeLock lock(handlersMutex);
+        HandlerList* list = new HandlerList(*handlers);
+        list->handlers.push_back(handler);
+        publish(list);
     }
 
     // Used by Handler
     void removeHandler(Handler<DataT>* handler)
     {
-        ScopeLock lock(Dispatcher::instance().dispatcherMutex);
-        handlers.remove(handler);
+        ScopeLock lock(handlersMutex);
+        const std::vector<Handler<DataT>*>& current = handlers->handlers;
+        if (std::find(current.begin(), current.end(), handler) == current.end())
+            return;
+
+        HandlerList* list = new HandlerList();
+        for (size_t i = 0; i < current.size(); i++)
+        {
+            if (current[i] != handler)
+                list->handlers.push_back(current[i]);
+        }
+        publish(list);
     }
 
     // Used by Command
-    void enqueue(Command<DataT> command)
+    void enqueue(const Command<DataT>& command)
     {
-        command.queue = this;
+#ifdef CQ2_STATS
+        int slot = StatsKey<DataT>::slot(command.data);
+        atomic::add(&stats[slot].enqueued, 1L);
+#endif
 
+        if (coalescing)
         {
-            ScopeLock lock(Dispatcher::instance().dispatcherMutex);
-            commands.push_back(command);
-            Dispatcher::instance().queueCommand(&commands.back());
+            ScopeLock lock(coalesceMutex);
+            if (queuedNode != NULL)
+            {
+                // replace the data of the waiting command
+                queuedNode->data = command.data;
+                coalescedCount++;
+                return;
+            }
+
+            queuedNode = pool.acquire();
+            queuedNode->data = command.data;
+            queuedNode->queue = this;
+#ifdef CQ2_STATS
+            queuedNode->statsSlot = slot;
+            stats[slot].queued();
+#endif
+            Dispatcher::instance().queueCommand(queuedNode, lane);
+            return;
         }
 
+        Command<DataT>* node = pool.acquire();
+        node->data = command.data;
+        node->queue = this;
+#ifdef CQ2_STATS
+        node->statsSlot = slot;
+        stats[slot].queued();
+#endif
+
+        Dispatcher::instance().queueCommand(node, lane);
+    }
+
+    // Used by Dispatcher::flush(). With coalescing the predicate is
+    // evaluated under coalesceMutex, so the data can't be replaced while it
+    // is being matched, and a matching command takes no more coalesced data.
+    template<typename Predicate>
+    bool flushMatches(ICommand* command, Predicate& matches)
+    {
+        Command<DataT>* node = static_cast<Command<DataT>*>(command);
+        if (not coalescing)
+            return matches(static_cast<const DataT&>(node->data));
+
+        ScopeLock lock(coalesceMutex);
+        if (not matches(static_cast<const DataT&>(node->data)))
+            return false;
+        if (queuedNode == node)
+            queuedNode = NULL;
+        return true;
     }
 
 private:
+    CommandQueue() :
+            handlers(new HandlerList()), retired(NULL), emitting(0),
+            lane(LANE_NORMAL), coalescing(false), queuedNode(NULL), coalescedCount(0)
+    {
+        pthread_mutex_init(&handlersMutex, NULL);
+        pthread_mutex_init(&coalesceMutex, NULL);
+#ifdef CQ2_STATS
+        stats.resize(StatsKey<DataT>::SLOTS);
+        Dispatcher::instance().registerQueue(this);
+#endif
+    }
+
+    ~CommandQueue()
+    {
+        reclaim();
+        delete handlers;
+    }
+
+    // Replace the handler snapshot, called with handlersMutex locked
+    void publish(HandlerList* list)
+    {
+        list->nextRetired = NULL;
+        HandlerList* old = atomic::exchange(&handlers, list);
+
+        // handlersMutex serializes the producers, the dispatching thread
+        // only ever takes the whole retired list
+        HandlerList* head;
+        do
+        {
+            head = atomic::load(&retired);
+            old->nextRetired = head;
+        } while (not atomic::compareAndSwap(&retired, head, old));
+
+        // An emit() that starts from here on loads the new snapshot, so the
+        // retired ones can go unless an emit() is already running
+        atomic::fullBarrier();
+        if (atomic::load(&emitting) == 0)
+            reclaim();
+    }
+
+    // Delete retired snapshots, only called when no emit() is in progress.
+    // The retired list is taken as a whole, so concurrent calls delete
+    // different snapshots.
+    void reclaim()
+    {
+        HandlerList* list = atomic::exchange(&retired, (HandlerList*) NULL);
+        while (list != NULL)
+        {
+            HandlerList* next = list->nextRetired;
+            delete list;
+            list = next;
+        }
+    }
+
+    // Stop coalescing into a node that has been taken from the queue
+    void detach(Command<DataT>* node)
+    {
+        ScopeLock lock(coalesceMutex);
+        if (queuedNode == node)
+            queuedNode = NULL;
+    }
 
-    // Used by Dispatcher to dispatch command
+    // Used by Dispatcher to dispatch command. Handlers added or removed by
+    // a handler take effect from the next command on.
     void emit(ICommand* command)
     {
-        std::list<Handler<DataT>*> tmp_handlers;
-        DataT tmp_eventData;
+        Command<DataT>* node = static_cast<Command<DataT>*>(command);
 
-        { // LOCK and make a copy of the handlers
-            ScopeLock lock(Dispatcher::instance().dispatcherMutex);
+        if (coalescing)
+            detach(node);
 
-            assert( &commands.front() == command);
-            // make copies
-            tmp_handlers = handlers;
-            tmp_eventData = commands.front().data;
+        // The snapshot stays valid until emit() returns, even if handlers
+        // are added or removed meanwhile
+        atomic::add(&emitting, 1L);
+        HandlerList* snapshot = atomic::load(&handlers);
 
-            commands.pop_front();
-        } // UNLOCK
+#ifdef CQ2_STATS
+        StatsSlot& slot = stats[node->statsSlot];
+        long long start = monotonicMicroseconds();
+        atomic::add(&slot.depth, -1L);
+        slot.dispatched++;
+        slot.wait.add(start - node->enqueued);
+#endif
+
+        const std::vector<Handler<DataT>*>& current = snapshot->handlers;
+        for (size_t i = 0; i < current.size(); i++)
+            current[i]->handle(node->data);
+
+#ifdef CQ2_STATS
+        slot.handling.add(monotonicMicroseconds() - start);
+#endif
+
+        if (atomic::add(&emitting, -1L) == 0 && atomic::load(&retired) != NULL)
+            reclaim();
+
+        recycle(node);
+    }
+
+    // Used by Dispatcher to drop a command without dispatching it
+    void release(ICommand* command)
+    {
+        Command<DataT>* node = static_cast<Command<DataT>*>(command);
 
-        typename std::list<Handler<DataT>*>::iterator handler_it = tmp_handlers.begin();
+        if (coalescing)
+            detach(node);
 
-        while (handler_it != tmp_handlers.end())
+#ifdef CQ2_STATS
+        atomic::add(&stats[node->statsSlot].depth, -1L);
+#endif
+
+        recycle(node);
+    }
+
+#ifdef CQ2_STATS
+    // Used by Dispatcher::stats()
+    void collectStats(std::vector<CommandStats>& result)
+    {
+        std::string name = typeName(typeid(DataT));
+        for (size_t i = 0; i < stats.size(); i++)
         {
-            (*handler_it)->handle(tmp_eventData);
-            handler_it++;
+            StatsSlot& slot = stats[i];
+            if (atomic::load(&slot.enqueued) == 0)
+                continue;
+
+            CommandStats entry;
+            entry.type = name;
+            entry.value = StatsKey<DataT>::value(i);
+            entry.enqueued = atomic::load(&slot.enqueued);
+            entry.depth = atomic::load(&slot.depth);
+            entry.maxDepth = atomic::load(&slot.maxDepth);
+            entry.dispatched = slot.dispatched;
+            entry.wait = slot.wait;
+            entry.handling = slot.handling;
+            result.push_back(entry);
         }
     }
+#endif
+
+    void recycle(Command<DataT>* node)
+    {
+        // don't keep the payload alive while the node is pooled
+        node->data = DataT();
+        pool.release(node);
+    }
 };
 
 // Member functions, use of CommandQueue<> requires them to be after CommandQueue
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_NODEPOOL_H
+#define COMMANDQUEUE2_NODEPOOL_H
+
+#include <stddef.h>
+
+#include "Atomic.h"
+
+namespace cq2
+{
+
+/**
+ * @class cq2::NodePool
+ * Lock-free pool of recycled nodes, used by CommandQueue to avoid a heap
+ * allocation for every queued command.
+ *
+ * The free nodes are kept in a bounded multi-producer/multi-consumer ring
+ * where each cell carries a sequence number, which makes it immune to the
+ * ABA problem of a linked free list. When the ring is empty a new node is
+ * allocated, when it is full a released node is deleted.
+ */
+template<typename NodeT>
+class NodePool
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param capacity Maximum number of free nodes kept, rounded up to a power of two
+     */
+    NodePool(size_t capacity = 256) :
+            enqueuePos(0), dequeuePos(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+
+        mask = size - 1;
+        cells = new Cell[size];
+        for (size_t i = 0; i < size; i++)
+            cells[i].sequence = i;
+    }
+
+    /**
+     * Destructor, deletes all free nodes
+     */
+    ~NodePool()
+    {
+        NodeT* node;
+        while (pop(node))
+            delete node;
+        delete[] cells;
+    }
+
+    /**
+     * Get a free node, allocates a new node if none is available
+     */
+    NodeT* acquire()
+    {
+        NodeT* node;
+        if (pop(node))
+            return node;
+        return new NodeT();
+    }
+
+    /**
+     * Return a node to the pool, deletes the node if the pool is full
+     */
+    void release(NodeT* node)
+    {
+        if (not push(node))
+            delete node;
+    }
+
+private:
+    struct Cell
+    {
+        size_t volatile sequence;
+        NodeT* node;
+    };
+
+    bool push(NodeT* node)
+    {
+        Cell* cell;
+        size_t pos = atomic::load(&enqueuePos);
+        for (;;)
+        {
+            cell = &cells[pos & mask];
+            long diff = (long) atomic::load(&cell->sequence) - (long) pos;
+            if (diff == 0)
+            {
+                if (atomic::compareAndSwap(&enqueuePos, pos, pos + 1))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // full
+                return false;
+            }
+            pos = atomic::load(&enqueuePos);
+        }
+
+        cell->node = node;
+        atomic::store(&cell->sequence, pos + 1);
+        return true;
+    }
+
+    bool pop(NodeT*& node)
+    {
+        Cell* cell;
+        size_t pos = atomic::load(&dequeuePos);
+        for (;;)
+        {
+            cell = &cells[pos & mask];
+            long diff = (long) atomic::load(&cell->sequence) - (long) (pos + 1);
+            if (diff == 0)
+            {
+                if (atomic::compareAndSwap(&dequeuePos, pos, pos + 1))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // empty
+                return false;
+            }
+            pos = atomic::load(&dequeuePos);
+        }
+
+        node = cell->node;
+        atomic::store(&cell->sequence, pos + mask + 1);
+        return true;
+    }
+
+    // Not copyable
+    NodePool(const NodePool&);
+    NodePool& operator=(const NodePool&);
+
+    Cell* cells;
+    size_t mask;
+    size_t volatile enqueuePos;
+    // keep producers and consumers of free nodes on separate cache lines
+    char padding[64];
+    size_t volatile dequeuePos;
+};
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_STATS_H
+#define COMMANDQUEUE2_STATS_H
+
+#include <string>
+#include <vector>
+#include <typeinfo>
+#include <stdlib.h>
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
+#include <boost/type_traits/is_enum.hpp>
+
+#include "Atomic.h"
+
+/**
+ * Instrumentation of the command queue, only compiled in when CQ2_STATS is
+ * defined (configure --enable-cq2-stats).
+ *
+ * Statistics are kept per command type, and for enum command types per
+ * enum value. Producers update the enqueue counters atomically, everything
+ * else is only written by the dispatching thread.
+ */
+
+namespace cq2
+{
+
+/**
+ * Histogram of durations in microseconds with power of two buckets.
+ * Bucket 0 counts durations below 1 us, bucket i durations in
+ * [2^(i-1), 2^i) us and the last bucket everything longer.
+ */
+struct Histogram
+{
+    enum
+    {
+        BUCKETS = 24
+    };
+
+    long counts[BUCKETS]; /**< Number of durations per bucket */
+    long long max; /**< Longest duration */
+
+    Histogram() : max(0)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+            counts[i] = 0;
+    }
+
+    /**
+     * Add a duration
+     */
+    void add(long long microseconds)
+    {
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && (1LL << bucket) <= microseconds)
+            bucket++;
+        counts[bucket]++;
+        if (microseconds > max)
+            max = microseconds;
+    }
+
+    /**
+     * Upper bound of the bucket containing a percentile, e.g. 0.99
+     */
+    long long percentile(double fraction) const
+    {
+        long total = 0;
+        for (int i = 0; i < BUCKETS; i++)
+            total += counts[i];
+        if (total == 0)
+            return 0;
+
+        long seen = 0;
+        for (int i = 0; i < BUCKETS - 1; i++)
+        {
+            seen += counts[i];
+            if (seen >= total * fraction)
+                return (1LL << i) < max ? (1LL << i) : max;
+        }
+        return max;
+    }
+};
+
+/**
+ * Statistics for one command type or enum value
+ */
+struct CommandStats
+{
+    std::string type; /**< Name of the command type */
+    long value; /**< Enum value, -1 for other command types */
+    long enqueued; /**< Commands sent, including coalesced ones */
+    long depth; /**< Commands currently waiting */
+    long maxDepth; /**< Highest number of commands waiting at once */
+    long dispatched; /**< Commands dispatched to the handlers */
+    Histogram wait; /**< Time from enqueue to dispatch */
+    Histogram handling; /**< Time spent in the handlers */
+};
+
+// Counters for one command type or enum value
+struct StatsSlot
+{
+    long volatile enqueued;
+    long volatile depth;
+    long volatile maxDepth;
+    long dispatched;
+    Histogram wait;
+    Histogram handling;
+
+    StatsSlot() : enqueued(0), depth(0), maxDepth(0), dispatched(0) {}
+
+    void queued()
+    {
+        long current = atomic::add(&depth, 1L);
+        long highest = atomic::load(&maxDepth);
+        while (current > highest && not atomic::compareAndSwap(&maxDepth, highest, current))
+            highest = atomic::load(&maxDepth);
+    }
+};
+
+// Maps command data to a StatsSlot index, enum values get a slot each
+template<typename DataT, bool isEnum = boost::is_enum<DataT>::value>
+struct StatsKey
+{
+    enum
+    {
+        SLOTS = 1
+    };
+
+    static int slot(const DataT&)
+    {
+        return 0;
+    }
+
+    static long value(int)
+    {
+        return -1;
+    }
+};
+
+template<typename DataT>
+struct StatsKey<DataT, true>
+{
+    // enum values from SLOTS - 1 and up share the last slot
+    enum
+    {
+        SLOTS = 64
+    };
+
+    static int slot(const DataT& data)
+    {
+        long value = (long) data;
+        return (value >= 0 && value < SLOTS - 1) ? (int) value : SLOTS - 1;
+    }
+
+    static long value(int slot)
+    {
+        return slot;
+    }
+};
+
+/**
+ * Readable name of a type
+ */
+inline std::string typeName(const std::type_info& type)
+{
+#ifdef __GNUC__
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(type.name(), NULL, NULL, &status);
+    if (status == 0 && demangled != NULL)
+    {
+        std::string name(demangled);
+        free(demangled);
+        return name;
+    }
+#endif
+    return type.name();
+}
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_TRACE_H
+#define COMMANDQUEUE2_TRACE_H
+
+/**
+ * Trace ids correlate the work done for one interaction, e.g. a key press,
+ * across threads. A thread that starts an interaction sets its current
+ * trace id. Commands sent by the thread carry the id, and the dispatching
+ * thread takes it over while the command is handled. Commands sent by the
+ * handler thus carry it further. Commands sent by timers carry no id.
+ */
+
+namespace cq2
+{
+
+// Storage for the trace id of the calling thread
+inline long& traceIdSlot()
+{
+    static __thread long id = 0;
+    return id;
+}
+
+/**
+ * Trace id of the interaction the calling thread works on, 0 if none
+ */
+inline long currentTraceId()
+{
+    return traceIdSlot();
+}
+
+/**
+ * Set the trace id of the calling thread, 0 to clear it
+ */
+inline void setCurrentTraceId(long id)
+{
+    traceIdSlot() = id;
+}
+
+/**
+ * Sets the trace id of the calling thread for the lifetime of the scope
+ */
+class TraceScope
+{
+public:
+    TraceScope(long id) : previous(currentTraceId())
+    {
+        setCurrentTraceId(id);
+    }
+
+    ~TraceScope()
+    {
+        setCurrentTraceId(previous);
+    }
+
+private:
+    long previous;
+};
+
+}
+
+#endif
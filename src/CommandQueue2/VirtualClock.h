@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_VIRTUALCLOCK_H
+#define COMMANDQUEUE2_VIRTUALCLOCK_H
+
+#include <pthread.h>
+
+#include "Clock.h"
+#include "ScopeLock.h"
+
+/**
+ * @class cq2::VirtualClock
+ * Clock source for simulations. Time only moves when it is advanced:
+ * explicitly with advance(), by a thread calling sleepMicroseconds(), or by
+ * the dispatching thread skipping ahead to the next timer when it has no
+ * commands to dispatch. A session that would take minutes in real time thus
+ * runs as fast as the commands can be handled.
+ *
+ * Threads are not interleaved in virtual time, a sleeping thread advances
+ * the clock for every thread. Simulations should therefore do their work
+ * on the dispatching thread, driven by timers and commands.
+ *
+ * Only cq2 and the code reading the time through it follow a VirtualClock.
+ * The narrator and player libraries play real audio in real time, so a
+ * ClientCore session cannot be simulated with it.
+ */
+
+namespace cq2
+{
+
+class VirtualClock: public ClockSource
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param start Initial time in microseconds
+     */
+    VirtualClock(long long start = 0) : time(start)
+    {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~VirtualClock()
+    {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    long long now()
+    {
+        ScopeLock lock(mutex);
+        return time;
+    }
+
+    void sleep(long long microseconds)
+    {
+        advance(microseconds);
+    }
+
+    bool skipTo(long long deadline)
+    {
+        ScopeLock lock(mutex);
+        if (deadline > time)
+            time = deadline;
+        return true;
+    }
+
+    /**
+     * Move the time forward
+     */
+    void advance(long long microseconds)
+    {
+        ScopeLock lock(mutex);
+        if (microseconds > 0)
+            time += microseconds;
+    }
+
+private:
+    // Not copyable
+    VirtualClock(const VirtualClock&);
+    VirtualClock& operator=(const VirtualClock&);
+
+    pthread_mutex_t mutex;
+    long long time;
+};
+
+}
+
+#endif
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDQUEUE2_WORKERPOOL_H
+#define COMMANDQUEUE2_WORKERPOOL_H
+
+#include <deque>
+#include <algorithm>
+#include <pthread.h>
+
+#include "CommandQueue.h"
+#include "ScopeLock.h"
+#include "Clock.h"
+
+#include <boost/function.hpp>
+
+/**
+ * @class cq2::WorkerPool
+ * Bounded pool of threads running the jobs of WorkerHandler instances.
+ *
+ * @class cq2::WorkerHandler
+ * Handler for commands whose handling may block, e.g. on network calls.
+ * The dispatching thread only queues the data, the work is done on a
+ * thread in the WorkerPool. Results are posted back to the dispatching
+ * thread by sending commands from the worker.
+ *
+ * Ordering: one WorkerHandler runs its jobs one at a time, in the order
+ * they were dispatched or posted, so its work needs no locking of its own.
+ * Jobs of different WorkerHandlers run concurrently on up to
+ * WorkerPool::setMaxThreads() threads. Commands sent from a worker are
+ * queued like commands from any other thread, i.e. in the lane of their
+ * type and in the order they are sent.
+ */
+
+namespace cq2
+{
+
+class WorkerPool
+{
+public:
+    /**
+     * Base class for anything that queues jobs in the pool. The job queue of
+     * a strand is protected by the pool mutex.
+     */
+    class Strand
+    {
+    public:
+        Strand() : scheduled(false), running(false), released(false) {}
+        virtual ~Strand() {}
+
+    protected:
+        // Number of queued jobs, called with the pool mutex locked
+        virtual size_t queuedJobs() = 0;
+        // Take the oldest job, called with the pool mutex locked
+        virtual void takeJob() = 0;
+        // Run the job taken by takeJob(), called on a worker thread without the lock
+        virtual void runJob() = 0;
+        // Forget all queued jobs, called with the pool mutex locked
+        virtual void dropJobs() = 0;
+
+    private:
+        bool scheduled;
+        bool running;
+        bool released; // deleted by the worker when the running job is done
+        friend class WorkerPool;
+    };
+
+    /**
+     * Singleton instance. The pool is never destroyed, a worker may be
+     * blocked in a job when the application exits.
+     */
+    static WorkerPool& instance()
+    {
+        static WorkerPool* inst = new WorkerPool();
+        return *inst;
+    }
+
+    /**
+     * Set the maximum number of worker threads, the default is 2. Threads are
+     * started when they are needed and are never stopped.
+     */
+    void setMaxThreads(int threads)
+    {
+        ScopeLock lock(mutex);
+        maxThreads = threads > 0 ? threads : 1;
+    }
+
+    /**
+     * Number of jobs that have been queued but not finished
+     */
+    long pending()
+    {
+        ScopeLock lock(mutex);
+        return pendingJobs;
+    }
+
+    /**
+     * Check if the pool has been closed. A job made of several blocking
+     * steps, e.g. network calls, should check this between them and give up
+     * so that the shutdown doesn't have to wait for it.
+     */
+    bool isClosed()
+    {
+        ScopeLock lock(mutex);
+        return closed;
+    }
+
+    /**
+     * Stop accepting jobs, used at shutdown. Queued jobs are dropped, jobs
+     * posted after this are ignored and running jobs are left to finish,
+     * see isClosed().
+     *
+     * @return The number of jobs that were dropped
+     */
+    long close()
+    {
+        ScopeLock lock(mutex);
+        closed = true;
+
+        long dropped = 0;
+        for (std::deque<Strand*>::iterator it = ready.begin(); it != ready.end(); ++it)
+        {
+            dropped += (*it)->queuedJobs();
+            (*it)->dropJobs();
+            (*it)->scheduled = false;
+        }
+        ready.clear();
+
+        // a running strand may have more jobs queued
+        for (std::deque<Strand*>::iterator it = busy.begin(); it != busy.end(); ++it)
+        {
+            dropped += (*it)->queuedJobs();
+            (*it)->dropJobs();
+        }
+        pendingJobs -= dropped;
+        return dropped;
+    }
+
+    /**
+     * Wait until no jobs are pending
+     *
+     * @param timeout Maximum time to wait in milliseconds, a negative value waits forever
+     * @return true if no jobs are pending, false on timeout
+     */
+    bool waitIdle(long timeout = -1)
+    {
+        long long deadline = monotonicMicroseconds() + timeout * 1000LL;
+        ScopeLock lock(mutex);
+        while (pendingJobs > 0)
+        {
+            if (timeout < 0)
+            {
+                pthread_cond_wait(&doneCond, &mutex);
+                continue;
+            }
+
+            if (monotonicMicroseconds() >= deadline)
+                return false;
+            struct timespec ts = monotonicTimespec(deadline);
+            pthread_cond_timedwait(&doneCond, &mutex, &ts);
+        }
+        return true;
+    }
+
+private:
+    WorkerPool() :
+            maxThreads(2), idleThreads(0), startedThreads(0), pendingJobs(0), closed(false)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&readyCond, NULL);
+
+        // waitIdle() measures timeouts on the monotonic clock
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&doneCond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    // Used by Strand owners after queueing a job, called with the mutex locked
+    void schedule(Strand* strand)
+    {
+        if (closed)
+        {
+            strand->dropJobs();
+            return;
+        }
+
+        pendingJobs++;
+        if (not strand->scheduled && not strand->running)
+        {
+            strand->scheduled = true;
+            ready.push_back(strand);
+        }
+
+        // Start another worker if every worker is busy
+        if (idleThreads == 0 && startedThreads < maxThreads)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, workerThread, this) == 0)
+            {
+                pthread_detach(thread);
+                startedThreads++;
+            }
+        }
+        pthread_cond_signal(&readyCond);
+    }
+
+    // Used by Strand owners, forget the jobs that have not started and wait
+    // for a running job to finish
+    void cancel(Strand* strand)
+    {
+        ScopeLock lock(mutex);
+        pendingJobs -= strand->queuedJobs();
+        strand->dropJobs();
+        if (strand->scheduled)
+        {
+            ready.erase(std::find(ready.begin(), ready.end(), strand));
+            strand->scheduled = false;
+        }
+
+        while (strand->running)
+            pthread_cond_wait(&doneCond, &mutex);
+    }
+
+    // Used by Strand owners, forget the jobs that have not started and
+    // delete the strand without waiting for a running job, the worker
+    // deletes it when the job is done
+    void release(Strand* strand)
+    {
+        {
+            ScopeLock lock(mutex);
+            pendingJobs -= strand->queuedJobs();
+            strand->dropJobs();
+            if (strand->scheduled)
+            {
+                ready.erase(std::find(ready.begin(), ready.end(), strand));
+                strand->scheduled = false;
+            }
+
+            if (strand->running)
+            {
+                strand->released = true;
+                return;
+            }
+        }
+        delete strand;
+    }
+
+    static void* workerThread(void* ctx)
+    {
+        static_cast<WorkerPool*>(ctx)->run();
+        return NULL;
+    }
+
+    void run()
+    {
+        ScopeLock lock(mutex);
+        for (;;)
+        {
+            idleThreads++;
+            while (ready.empty())
+                pthread_cond_wait(&readyCond, &mutex);
+            idleThreads--;
+
+            Strand* strand = ready.front();
+            ready.pop_front();
+            strand->scheduled = false;
+            strand->running = true;
+            strand->takeJob();
+            busy.push_back(strand);
+
+            pthread_mutex_unlock(&mutex);
+            strand->runJob();
+            pthread_mutex_lock(&mutex);
+
+            strand->running = false;
+            busy.erase(std::find(busy.begin(), busy.end(), strand));
+            pendingJobs--;
+
+            // Nobody owns a released strand, see release()
+            if (strand->released)
+            {
+                pthread_cond_broadcast(&doneCond);
+                pthread_mutex_unlock(&mutex);
+                delete strand;
+                pthread_mutex_lock(&mutex);
+                continue;
+            }
+
+            // Put the strand at the back so that busy strands take turns
+            if (strand->queuedJobs() > 0)
+            {
+                strand->scheduled = true;
+                ready.push_back(strand);
+            }
+            pthread_cond_broadcast(&doneCond);
+        }
+    }
+
+    // Not copyable
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    pthread_mutex_t mutex;
+    pthread_cond_t readyCond;
+    pthread_cond_t doneCond;
+    std::deque<Strand*> ready;
+    std::deque<Strand*> busy;
+    int maxThreads;
+    int idleThreads;
+    int startedThreads;
+    long pendingJobs;
+    bool closed;
+
+    template<typename DataT>
+    friend class WorkerHandler;
+};
+
+template<typename DataT>
+class WorkerHandler: public Handler<DataT>, public WorkerPool::Strand
+{
+public:
+    /**
+     * Constructor used to register an external work function
+     */
+    WorkerHandler(boost::function<void(DataT)> work) : work_p(work) {}
+
+    /**
+     * Constructor used by subclasses, a subclass must call cancel() in its
+     * destructor
+     */
+    WorkerHandler() {}
+
+    /**
+     * Override if inheritance is used, called on a worker thread
+     */
+    virtual void work(DataT data)
+    {
+        if (not work_p.empty())
+            (work_p)(data);
+    }
+
+    /**
+     * Queue a job directly, without sending a command. May be called from
+     * any thread.
+     */
+    void post(const DataT& data)
+    {
+        WorkerPool& pool = WorkerPool::instance();
+        ScopeLock lock(pool.mutex);
+        jobs.push_back(data);
+        pool.schedule(this);
+    }
+
+    /**
+     * Forget the jobs that have not started and wait for a running job to
+     * finish. Must not be called from within work().
+     */
+    void cancel()
+    {
+        WorkerPool::instance().cancel(this);
+    }
+
+    /**
+     * Delete a handler created with new without waiting for a running job.
+     * Jobs that have not started are forgotten, a running job finishes on
+     * its worker, which then deletes the handler. Such a job must not use
+     * the objects of whoever released the handler.
+     */
+    void release()
+    {
+        this->ignore();
+        WorkerPool::instance().release(this);
+    }
+
+    /**
+     * Stops receiving commands and waits for a running job
+     */
+    virtual ~WorkerHandler()
+    {
+        this->ignore();
+        cancel();
+    }
+
+private:
+    // Called on the dispatching thread
+    void handle(DataT data)
+    {
+        post(data);
+    }
+
+    size_t queuedJobs()
+    {
+        return jobs.size();
+    }
+
+    void takeJob()
+    {
+        current = jobs.front();
+        jobs.pop_front();
+    }
+
+    void runJob()
+    {
+        work(current);
+        current = DataT();
+    }
+
+    void dropJobs()
+    {
+        jobs.clear();
+    }
+
+    boost::function<void(DataT)> work_p;
+    std::deque<DataT> jobs;
+    DataT current;
+};
+
+}
+
+#endif
@@ -60,6 +60,7 @@ enum INTERNAL_COMMAND
      */
 
     COMMAND_NEXT,
+    COMMAND_READ_AHEAD,
     COMMAND_LAST,
     COMMAND_INFO,
     COMMAND_NARRATORFINISHED,
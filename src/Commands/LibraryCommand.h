@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDS_LIBRARYCOMMAND_H
+#define COMMANDS_LIBRARYCOMMAND_H
+
+#include <string>
+
+// Sent when the library index of a media path has changed, e.g. found by the
+// LibraryWatcher
+struct LibraryCommand
+{
+    LibraryCommand(std::string media) : media_(media) {}
+    LibraryCommand() {}
+    std::string media_;
+};
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMANDS_TIMER_H
+#define COMMANDS_TIMER_H
+
+// Commands scheduled on the cq2::Dispatcher by ClientCore
+enum TIMER_COMMAND
+{
+    TIMER_INFO,
+    TIMER_SLEEP_NEAR_TIMEOUT,
+    TIMER_SLEEP_TIMEOUT,
+    TIMER_HELP_PLAYER_STOP,
+};
+
+#endif
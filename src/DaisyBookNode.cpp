@@ -19,6 +19,9 @@
 
 #include "DaisyBookNode.h"
 #include "DaisyNavi.h"
+#include "TitleExtractor.h"
+#include "LibraryIndex.h"
+#include "Commands/InternalCommands.h"
 #include "Defines.h"
 #include "Utils.h"
 
@@ -36,7 +39,7 @@ using namespace naviengine;
 DaisyBookNode::DaisyBookNode()
 {
     LOG4CXX_TRACE(daisyBookNodeLog, "Constructor");
-    pDaisyNavi = new DaisyNavi;
+    pDaisyNavi = NULL;
     daisyNaviActive = false;
     daisyUri_ = "";
     title = "";
@@ -46,7 +49,7 @@ DaisyBookNode::DaisyBookNode()
 DaisyBookNode::DaisyBookNode(std::string uri)
 {
     LOG4CXX_TRACE(daisyBookNodeLog, "Constructor");
-    pDaisyNavi = new DaisyNavi;
+    pDaisyNavi = NULL;
     daisyNaviActive = false;
     daisyUri_ = uri;
     title = "";
@@ -54,19 +57,31 @@ DaisyBookNode::DaisyBookNode(std::string uri)
     initialize();
 }
 
+DaisyBookNode::DaisyBookNode(std::string uri, const BookTitle &bookTitle)
+{
+    LOG4CXX_TRACE(daisyBookNodeLog, "Constructor");
+    pDaisyNavi = NULL;
+    daisyNaviActive = false;
+    daisyUri_ = uri;
+    title = bookTitle.title;
+    titleSrc = bookTitle.titleSrc;
+    if (not bookTitle.found)
+        initialize();
+}
+
 DaisyBookNode::~DaisyBookNode()
 {
     LOG4CXX_TRACE(daisyBookNodeLog, "Destructor");
-    delete pDaisyNavi;
+    DaisyNavi::detach(this);
 }
 
 bool DaisyBookNode::up(NaviEngine& navi)
 {
-    if (not pDaisyNavi->up(navi))
+    if (not attached() || not pDaisyNavi->up(navi))
     {
         // DaisyNavi has moved beyond TOPLEVEL
         daisyNaviActive = false;
-        if (pDaisyNavi->isOpen())
+        if (attached() && pDaisyNavi->isOpen())
         {
             pDaisyNavi->closeBook();
         }
@@ -84,39 +99,49 @@ bool DaisyBookNode::up(NaviEngine& navi)
 
 bool DaisyBookNode::prev(NaviEngine& navi)
 {
-    return pDaisyNavi->prev(navi);
+    return leaveIfClosed(navi, attached() && pDaisyNavi->prev(navi));
 }
 
 bool DaisyBookNode::next(NaviEngine& navi)
 {
-    return pDaisyNavi->next(navi);
+    return leaveIfClosed(navi, attached() && pDaisyNavi->next(navi));
 }
 
 bool DaisyBookNode::select(NaviEngine& navi)
 {
-    return pDaisyNavi->select(navi);
+    return leaveIfClosed(navi, attached() && pDaisyNavi->select(navi));
 }
 
 bool DaisyBookNode::selectByUri(naviengine::NaviEngine& navi, std::string uri)
 {
-    return pDaisyNavi->selectByUri(navi, uri);
+    return leaveIfClosed(navi, attached() && pDaisyNavi->selectByUri(navi, uri));
 }
 
 bool DaisyBookNode::menu(NaviEngine& navi)
 {
+    if (not attached())
+        return leaveIfClosed(navi, false);
+
+    if (pDaisyNavi->isOpening())
+        return leaveIfClosed(navi, pDaisyNavi->process(navi, COMMAND_OPEN_CONTEXTMENU));
+
     return pDaisyNavi->menu(navi);
 }
 
 bool DaisyBookNode::onOpen(NaviEngine& navi)
 {
-    if (daisyNaviActive)
+    if (daisyNaviActive && attached())
     {
         return pDaisyNavi->onOpen(navi);
     }
 
+    // the navigator is shared by all book nodes, a book opened by another
+    // node is closed
+    pDaisyNavi = DaisyNavi::attach(this);
     if (not daisyUri_.empty() && pDaisyNavi->open(daisyUri_) && pDaisyNavi->onOpen(navi))
     {
         LOG4CXX_INFO(daisyBookNodeLog, "Opening Daisy book with uri '" << daisyUri_ << "'");
+        LibraryIndex::Instance()->opened(daisyUri_);
         daisyNaviActive = true;
         return daisyNaviActive;
     }
@@ -133,12 +158,17 @@ void DaisyBookNode::beforeOnOpen()
 
 bool DaisyBookNode::process(NaviEngine& navi, int command, void* data)
 {
-    bool result = pDaisyNavi->process(navi, command, data);
+    return leaveIfClosed(navi, attached() && pDaisyNavi->process(navi, command, data));
+}
 
-    // If the book is no longer opened then swap node to parent
-    if (daisyNaviActive && !pDaisyNavi->isOpen())
+// If the book is no longer opened, at the end of the book, when opening was
+// cancelled or when another book node has taken over the navigator, then swap
+// node to parent
+bool DaisyBookNode::leaveIfClosed(NaviEngine& navi, bool result)
+{
+    if (daisyNaviActive && (!attached() || (!pDaisyNavi->isOpen() && !pDaisyNavi->isOpening())))
     {
-        LOG4CXX_INFO(daisyBookNodeLog, "Closing at the end of book");
+        LOG4CXX_INFO(daisyBookNodeLog, "Closing book node");
         daisyNaviActive = false;
         return VirtualMenuNode::up(navi);
     }
@@ -183,9 +213,25 @@ bool DaisyBookNode::narrateName()
     return false;
 }
 
+// The shared navigator is used by this node, see DaisyNavi::attach
+bool DaisyBookNode::attached()
+{
+    return pDaisyNavi != NULL && pDaisyNavi->owner() == this;
+}
+
 void DaisyBookNode::initialize()
 {
     LOG4CXX_INFO(daisyBookNodeLog, "Initializing book node");
+
+    // reading the title is enough for listing the book
+    BookTitle bookTitle;
+    if (TitleExtractor::extract(daisyUri_, bookTitle))
+    {
+        title = bookTitle.title;
+        titleSrc = bookTitle.titleSrc;
+        return;
+    }
+
     amis::DaisyHandler *dh = amis::DaisyHandler::Instance();
     if (not dh->openBook(daisyUri_))
     {
@@ -194,7 +240,7 @@ void DaisyBookNode::initialize()
     }
     while (dh->getState() == amis::DaisyHandler::HANDLER_OPENING)
     {
-        usleep(100000);
+        usleep(10000);
     }
     bool withBookmarks = false;
     if (not dh->setupBook(withBookmarks))
@@ -25,12 +25,14 @@
 #include <string>
 
 class DaisyNavi;
+struct BookTitle;
 
 class DaisyBookNode: public naviengine::VirtualMenuNode
 {
 public:
     DaisyBookNode();
     DaisyBookNode(std::string);
+    DaisyBookNode(std::string, const BookTitle&);
     ~DaisyBookNode();
 
     bool up(naviengine::NaviEngine&);
@@ -49,7 +51,9 @@ public:
 
 protected:
     void initialize();
-    DaisyNavi *pDaisyNavi;
+    bool leaveIfClosed(naviengine::NaviEngine&, bool);
+    bool attached();
+    DaisyNavi *pDaisyNavi; // shared, NULL until the book is opened
     bool daisyNaviActive;
     std::string daisyUri_;
     std::string title;
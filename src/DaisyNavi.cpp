@@ -28,7 +28,14 @@
 #include "Commands/InternalCommands.h"
 #include "Commands/JumpCommand.h"
 #include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Atomic.h"
+#include "CommandQueue2/WorkerPool.h"
+#include "CommandQueue2/ScopeLock.h"
 #include "ClientCore.h"
+#include "InteractionTrace.h"
+#include "NavCache.h"
+#include "PositionScanner.h"
+#include "NarratorCompletion.h"
 #include "Defines.h"
 #include "config.h"
 
@@ -36,12 +43,22 @@
 #include <Nodes/MenuNode.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <libintl.h>
 #include <log4cxx/logger.h>
 
 // create logger which will become a child to logger kolibre.clientcore
 log4cxx::LoggerPtr daisyNaviLog(log4cxx::Logger::getLogger("kolibre.clientcore.daisynavi"));
 
+// Time in microseconds after which a wait jingle is played while a book opens
+#define OPEN_JINGLE_INTERVAL 3000000LL
+// Interval in milliseconds for checking if DaisyHandler has opened the book
+#define OPEN_POLL_INTERVAL 50
+// Largest distance in milliseconds between a jump target and the section or
+// page start the jump lands on instead of searching the SMIL files for the
+// phrase at the target
+#define POSITION_JUMP_TOLERANCE 3000
+
 using namespace amis;
 using namespace naviengine;
 
@@ -49,6 +66,180 @@ static long lastsecond = -1;
 static int lastpage = -1;
 static int lastsection = -1;
 
+// The DaisyNavi whose book is open, DaisyHandler handles one book at a time
+static DaisyNavi* openNavi = NULL;
+
+// The DaisyNavi whose book is being opened, checked by the open timer
+static DaisyNavi* openingNavi = NULL;
+
+// The DaisyNavi shared by the book nodes, see DaisyNavi::attach
+static DaisyNavi* sharedNavi = NULL;
+
+// Books opened since the start, see ClientCore::getBookOpenTimes
+static pthread_mutex_t openTimesMutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ClientCore::BookOpenTime> openTimes;
+
+// Sent by the open timer while a book is being opened
+struct OpenCheck
+{
+};
+
+// Handles the checks of the open timer on the clientcore thread
+class Handle_OpenCheck: public cq2::Handler<OpenCheck>
+{
+public:
+    static Handle_OpenCheck& instance()
+    {
+        static Handle_OpenCheck inst;
+        return inst;
+    }
+
+private:
+    Handle_OpenCheck()
+    {
+        listen();
+    }
+
+    void handle(OpenCheck)
+    {
+        if (openingNavi != NULL)
+            openingNavi->checkOpening();
+    }
+};
+
+// Sent when the narrator has told that a book could not be opened
+struct LeaveFailedBook
+{
+    LeaveFailedBook() : openId(0), node(NULL), navi(NULL) {}
+    long openId;
+    VirtualMenuNode* node;
+    NaviEngine* navi;
+};
+
+// Leaves the book node of a failed open on the clientcore thread
+class Handle_LeaveFailedBook: public cq2::Handler<LeaveFailedBook>
+{
+public:
+    static Handle_LeaveFailedBook& instance()
+    {
+        static Handle_LeaveFailedBook inst;
+        return inst;
+    }
+
+private:
+    Handle_LeaveFailedBook()
+    {
+        listen();
+    }
+
+    void handle(LeaveFailedBook leave)
+    {
+        if (sharedNavi != NULL)
+            sharedNavi->leaveFailedBook(leave.openId, leave.node, leave.navi);
+    }
+};
+
+// A navigation model to write to the NavCache
+struct NavCacheJob
+{
+    std::string uri;
+    boost::shared_ptr<const NavModel> model;
+};
+
+// Runs on a worker thread
+static void storeNavModel(NavCacheJob job)
+{
+    NavCache::Instance()->store(job.uri, *job.model);
+}
+
+// Never deleted, a job may still be running when the application exits
+static cq2::WorkerHandler<NavCacheJob>* navCacheWriter = new cq2::WorkerHandler<NavCacheJob>(&storeNavModel);
+
+// The section and page starts of a book, read from its SMIL files
+struct PositionScan
+{
+    PositionScan() : openId(0) {}
+    long openId;
+    std::string uri;
+    std::vector<PositionIndex::Entry> entries;
+};
+
+// Runs on a worker thread, sends the starts to the clientcore thread
+static void scanPositions(PositionScan scan)
+{
+    if (not PositionScanner::scan(scan.uri, scan.entries))
+        return;
+    cq2::Command<PositionScan> scanned(scan);
+    scanned();
+}
+
+// Never deleted, a job may still be running when the application exits
+static cq2::WorkerHandler<PositionScan>* positionScanner = new cq2::WorkerHandler<PositionScan>(&scanPositions);
+
+// Hands the scanned starts to the DaisyNavi on the clientcore thread
+class Handle_PositionScan: public cq2::Handler<PositionScan>
+{
+public:
+    static Handle_PositionScan& instance()
+    {
+        static Handle_PositionScan inst;
+        return inst;
+    }
+
+private:
+    Handle_PositionScan()
+    {
+        listen();
+    }
+
+    void handle(PositionScan scan)
+    {
+        if (openNavi != NULL)
+            openNavi->positionsScanned(scan.openId, scan.uri, scan.entries);
+    }
+};
+
+// Build the book data posted to the application from a navigation model
+static ClientCore::BookDataPtr bookDataFromModel(const NavModel &model)
+{
+    boost::shared_ptr<ClientCore::BookData> data(new ClientCore::BookData);
+
+    for (size_t i = 0; i < model.pages.size(); i++)
+    {
+        const NavModel::Point &point = model.pages[i];
+        std::string text = point.text.empty() ? _("no page label") : point.text;
+        data->pages.push_back(ClientCore::BookData::Page(point.ref, text, point.playOrder));
+    }
+
+    for (size_t i = 0; i < model.sections.size(); i++)
+    {
+        const NavModel::Point &point = model.sections[i];
+        std::string text = point.text.empty() ? _("no section label") : point.text;
+        data->sections.push_back(ClientCore::BookData::Section(point.ref, text, point.playOrder, point.level));
+    }
+
+    return data;
+}
+
+// Runs on a worker thread, asks the kernel to read a local audio file into
+// the page cache before the player opens it
+static void warmAudio(std::string uri)
+{
+    if (uri.compare(0, 7, "file://") == 0)
+        uri.erase(0, 7);
+    else if (uri.find("://") != std::string::npos)
+        return; // remote audio is fetched by the player itself
+
+    int fd = ::open(uri.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+// Never deleted, a job may still be running when the application exits
+static cq2::WorkerHandler<std::string>* audioWarmer = new cq2::WorkerHandler<std::string>(&warmAudio);
+
 bool DaisyNavi::select(NaviEngine& navi)
 {
     return process(navi, COMMAND_DOWN);
@@ -407,8 +598,15 @@ static bool PlayAudio_static(string uri, long long startms, long long stopms, vo
     return dn->playAudio(uri, startms, stopms);
 }
 
-bool DaisyNavi::onOpen(NaviEngine&)
+bool DaisyNavi::onOpen(NaviEngine& navi)
 {
+    // the book is still opening, continue when it is open
+    if (bOpening)
+    {
+        pendingNavi = &navi;
+        return true;
+    }
+
     // connect to player slots
     if (not playerMsgCon.connected())
     {
@@ -437,6 +635,7 @@ bool DaisyNavi::onOpen(NaviEngine&)
         return true;
     }
 
+    reportOpen(BookOpenProgress::OPEN_SETUP);
     if (not dh->setupBook())
     {
         dh->closeBook();
@@ -447,6 +646,20 @@ bool DaisyNavi::onOpen(NaviEngine&)
     DaisyHandler::PosInfo *posInfo = dh->getPosInfo();
     postBookData();
 
+    // index where the sections and pages start, unless the NavCache has it
+    if (not bPositionsScanned)
+    {
+        Handle_PositionScan::instance();
+        PositionScan scan;
+        scan.openId = openId;
+        scan.uri = mUri;
+        positionScanner->post(scan);
+    }
+
+    bookTotalms = -1;
+    if (bookInfo->hasTime)
+        bookTotalms = (bookInfo->mTotalTime.tm_hour * 60 * 60 + bookInfo->mTotalTime.tm_min * 60 + bookInfo->mTotalTime.tm_sec) * 1000L;
+
     // Always enable section highlighting as it doesn't decrease performance significantly
     sectionIdxReportingEnabled = true;
     /*
@@ -457,6 +670,8 @@ bool DaisyNavi::onOpen(NaviEngine&)
      sectionIdxReportingEnabled = ((bookInfo->mTocItems + pageCount) < 1000);
      */
 
+    if (not bReopeningBook)
+        reportOpen(BookOpenProgress::OPEN_LASTMARK);
     if (not bReopeningBook && dh->continueFromLastmark())
     {
         narrator->play(_N("continuing from last known position"));
@@ -487,6 +702,7 @@ bool DaisyNavi::onOpen(NaviEngine&)
             player->resume();
     }
     bReopeningBook = false;
+    reportOpen(BookOpenProgress::OPEN_DONE);
 
     // We are now ready to handle NARRATORFINISHED COMMANDS
     Narrator::Instance()->setPushCommandFinished(true);
@@ -500,10 +716,27 @@ bool DaisyNavi::onOpen(NaviEngine&)
 
 bool DaisyNavi::playerTimeSlot(Player::timeData td)
 {
+    long traceId = cq2::atomic::exchange(&audioTraceId, 0L);
+    if (traceId != 0)
+        InteractionTrace::Instance()->audio(traceId, "Player::playing");
+
+    if (readAhead.due(td.current))
+    {
+        cq2::Command<INTERNAL_COMMAND> c(COMMAND_READ_AHEAD);
+        c();
+    }
+
+    // DaisyHandler may already be at the phrases read ahead
+    const DaisyHandler::PosInfo playing = playingPosInfo();
     const DaisyHandler::PosInfo *pi;
     const DaisyHandler::BookInfo *bi;
-    pi = dh->getPosInfo();
+    pi = &playing;
     bi = dh->getBookInfo();
+
+    // learn where sections and pages start, costs a comparison when nothing changed
+    if (td.current != -1 && pi->currentSmilms != -1)
+        positions.record(td.current + pi->currentSmilms, pi->currentSmilms, pi->currentSectionIdx, pi->currentPageIdx);
+
     if (td.current / 1000 != lastsecond)
     {
 
@@ -516,9 +749,6 @@ bool DaisyNavi::playerTimeSlot(Player::timeData td)
             {
 
                 long bookCurrentms = td.current + pi->currentSmilms;
-                long bookTotalms = bi->mTotalTime.tm_hour * 60 * 60 * 1000;
-                bookTotalms += bi->mTotalTime.tm_min * 60 * 1000;
-                bookTotalms += bi->mTotalTime.tm_sec * 1000;
 
                 BookPositionInfo position(bookCurrentms, bookTotalms);
                 cq2::Command<BookPositionInfo> info(position);
@@ -588,15 +818,24 @@ private:
             return;
         }
 
-        // perform the jump
-        if (not DaisyHandler::Instance()->jumpToSecond(jump.target_))
+        // land on a section or page start close to the target, or let
+        // DaisyHandler search the SMIL files for the phrase at the target
+        long targetms = dn_->jumpToStart(jump.target_ * 1000L);
+        if (targetms < 0)
         {
-            LOG4CXX_ERROR(daisyNaviLog, "Jump to second '" << jump.target_ << "' failed");
-            Narrator::Instance()->play(_N("jump to position failed"));
-            Player::Instance()->reopen();
-            return;
+            if (not DaisyHandler::Instance()->jumpToSecond(jump.target_))
+            {
+                LOG4CXX_ERROR(daisyNaviLog, "Jump to second '" << jump.target_ << "' failed");
+                Narrator::Instance()->play(_N("jump to position failed"));
+                Player::Instance()->reopen();
+                return;
+            }
+            targetms = jump.target_ * 1000L;
         }
 
+        // move the application to the target before the player reports it
+        dn_->postPositionAt(targetms);
+
         // jump was successful, resume playback
         // we could call Player::Instance()->resume() from here but the playback will resume
         // automatically when Narrator signals that it is done
@@ -619,12 +858,27 @@ DaisyNavi::DaisyNavi()
     bContextMenuIsOpen = false;
     bBookIsOpen = false;
     bReopeningBook = false;
+    bOpening = false;
+    openId = 0;
+    bPlayingJingle = false;
+    openStarted = 0;
+    lastJingle = 0;
+    openTimer = 0;
+    pendingNavi = NULL;
+    positionsSaved = positions.revision();
+    bPositionsScanned = false;
+    bookTotalms = -1;
     bookmarkState = BOOKMARK_DEFAULT;
+    audioTraceId = 0;
+    owner_ = NULL;
 
     // Setup mutex variable
     playerCallbackMutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(playerCallbackMutex, NULL);
     bOpeningNext = false;
+    bReadingAhead = false;
+    bRewinding = false;
+    phrasesAhead = 0;
 
     DaisyNaviLevel level("TOPLEVEL");
     cq2::Command<DaisyNaviLevel> daisyLevel(level);
@@ -637,6 +891,11 @@ DaisyNavi::DaisyNavi()
 
 DaisyNavi::~DaisyNavi()
 {
+    if (bOpening)
+        cancelOpening();
+    if (openNavi == this)
+        openNavi = NULL;
+
     // disconnect from player slots
     if (playerMsgCon.connected())
     {
@@ -646,6 +905,12 @@ DaisyNavi::~DaisyNavi()
     {
         playerTimeCon.disconnect();
     }
+
+    delete jumpHandler1;
+    pthread_mutex_destroy(playerCallbackMutex);
+    free(playerCallbackMutex);
+    if (sharedNavi == this)
+        sharedNavi = NULL;
 }
 
 bool DaisyNavi::playAudio(string filename, long long startms, long long stopms)
@@ -655,10 +920,126 @@ bool DaisyNavi::playAudio(string filename, long long startms, long long stopms)
         LOG4CXX_ERROR(daisyNaviLog, "Cannot play audio when book is closed");
         return false;
     }
-    player->open(filename, startms, stopms);
+
+    if (bRewinding)
+        return true;
+
+    PhraseReadAhead::Clip clip(filename, startms, stopms);
+    if (bReadingAhead)
+    {
+        // start reading the next audio file while the current clip is playing
+        if (filename != lastWarmedAudio)
+            audioWarmer->post(filename);
+        lastWarmedAudio = filename;
+        readAhead.push(clip);
+        return true;
+    }
+
+    // a position resolved by navigation replaces the phrases read ahead
+    readAhead.clear();
+    pthread_mutex_lock(playerCallbackMutex);
+    phrasesAhead = 0;
+    queuedPos.clear();
+    pthread_mutex_unlock(playerCallbackMutex);
+    openClip(clip);
     return true;
 }
 
+void DaisyNavi::openClip(const PhraseReadAhead::Clip &clip)
+{
+    // the first time update from the player ends the interaction
+    InteractionTrace::Instance()->point("Player::open");
+    cq2::atomic::store(&audioTraceId, cq2::currentTraceId());
+    readAhead.opened(clip);
+    player->open(clip.uri, clip.startms, clip.stopms);
+}
+
+/**
+ * Resolve the phrases after the playing clip, requested by the player thread
+ * when the clip is about to end. DaisyHandler is moved to the last phrase
+ * read ahead, the phrases are played when the player reaches the end of the
+ * current clip. Until then the position of the playing clip is kept in
+ * playingPos and reported instead of the position of DaisyHandler.
+ */
+void DaisyNavi::readAheadPhrases()
+{
+    if (not bBookIsOpen || bPlaybackIsPaused || bContextMenuIsOpen || bookmarkState != BOOKMARK_DEFAULT)
+        return;
+
+    bool moved = true;
+    bReadingAhead = true;
+    while (readAhead.wanted())
+    {
+        size_t queued = readAhead.size();
+        DaisyHandler::PosInfo current = *dh->getPosInfo();
+        // at the end of the book COMMAND_NEXT fails again and reports it
+        if (not dh->nextPhrase())
+        {
+            LOG4CXX_DEBUG(daisyNaviLog, "No phrase to read ahead");
+            break;
+        }
+
+        pthread_mutex_lock(playerCallbackMutex);
+        if (phrasesAhead == 0)
+            playingPos = current;
+        phrasesAhead++;
+        if (readAhead.size() != queued)
+            queuedPos.push_back(*dh->getPosInfo());
+        pthread_mutex_unlock(playerCallbackMutex);
+
+        if (readAhead.size() == queued)
+        {
+            moved = false;
+            break;
+        }
+    }
+    bReadingAhead = false;
+
+    // DaisyHandler moved without a clip to queue, COMMAND_NEXT must start from the playing clip
+    if (not moved)
+        rewindReadAhead();
+    LOG4CXX_DEBUG(daisyNaviLog, readAhead.size() << " phrases read ahead");
+}
+
+/**
+ * Move DaisyHandler back to the playing clip and forget the phrases read
+ * ahead, so that commands act on the phrase that is heard
+ */
+void DaisyNavi::rewindReadAhead()
+{
+    readAhead.clear();
+
+    pthread_mutex_lock(playerCallbackMutex);
+    int steps = phrasesAhead;
+    pthread_mutex_unlock(playerCallbackMutex);
+    if (steps == 0)
+        return;
+
+    LOG4CXX_DEBUG(daisyNaviLog, "Rewinding " << steps << " phrases read ahead");
+    bRewinding = true;
+    for (int i = 0; i < steps; i++)
+        if (not dh->previousPhrase())
+            break;
+    bRewinding = false;
+
+    pthread_mutex_lock(playerCallbackMutex);
+    phrasesAhead = 0;
+    queuedPos.clear();
+    pthread_mutex_unlock(playerCallbackMutex);
+}
+
+/**
+ * Position of the clip that is playing, which is not the position of
+ * DaisyHandler while phrases are read ahead
+ */
+DaisyHandler::PosInfo DaisyNavi::playingPosInfo()
+{
+    pthread_mutex_lock(playerCallbackMutex);
+    DaisyHandler::PosInfo pos = phrasesAhead > 0 ? playingPos : *dh->getPosInfo();
+    pthread_mutex_unlock(playerCallbackMutex);
+    return pos;
+}
+
 void DaisyNavi::setOpeningNext(bool setting)
 {
     pthread_mutex_lock(playerCallbackMutex);
@@ -752,48 +1133,57 @@ bool DaisyNavi::isOpen()
 bool DaisyNavi::open()
 {
     bUserAtEndOfBook = false;
+    openId++;
 
     if (dh->openBook(mUri) == true)
     {
-        bool bPlayingJingle = false;
-        int waitCounter = 0;
-        while (dh->getState() == DaisyHandler::HANDLER_OPENING)
-        {
-            LOG4CXX_DEBUG(daisyNaviLog, "state == DaisyHandler::HANDLER_OPENING");
-            usleep(100000);
-            // when 3 seconds has passed, play wait jingle
-            if (!narrator->isSpeaking() && waitCounter++ == 30)
+        // DaisyHandler parses the navigation file on its own thread. Instead
+        // of waiting for it the open timer checks the state, so that keys
+        // are handled meanwhile and can cancel opening.
+        LOG4CXX_DEBUG(daisyNaviLog, "state == DaisyHandler::HANDLER_OPENING");
+        bOpening = true;
+        bPlayingJingle = false;
+        openStarted = lastJingle = cq2::nowMicroseconds();
+        pendingNavi = NULL;
+        openingNavi = this;
+        reportOpen(BookOpenProgress::OPEN_NAVIGATION);
+
+        // a book opened before has its sections and pages in the cache, the
+        // application gets them while DaisyHandler parses the navigation file
+        bookData.reset();
+        navModel.reset(new NavModel);
+        bPositionsScanned = false;
+        if (NavCache::Instance()->load(mUri, *navModel))
+        {
+            LOG4CXX_DEBUG(daisyNaviLog, "Navigation model of " << mUri << " loaded from cache");
+            bookData = bookDataFromModel(*navModel);
+            cq2::Command<ClientCore::BookDataPtr> bookDataCommand(bookData);
+            bookDataCommand();
+
+            std::vector<PositionIndex::Entry> entries;
+            for (size_t i = 0; i < navModel->times.size(); i++)
             {
-                Narrator::Instance()->playWait();
-                waitCounter = 0;
-                bPlayingJingle = true;
+                const NavModel::Time &time = navModel->times[i];
+                entries.push_back(PositionIndex::Entry(time.startms, time.smilms, time.section, time.page, time.ref));
+                if (not time.ref.empty())
+                    bPositionsScanned = true;
             }
-
+            positions.assign(entries);
         }
-
-        //Dont wait for jingle to finish
-        if(bPlayingJingle)
-            narrator->stop();
-
-        if (dh->getState() != DaisyHandler::HANDLER_OPEN)
+        else
         {
-            LOG4CXX_DEBUG(daisyNaviLog, "state != DaisyHandler::HANDLER_OPEN");
-            narrator->play(_N("content error"));
-            amis::AmisError err = dh->getLastError();
-            ErrorMessage error(NETWORK, err.getMessage());
-            cq2::Command<ErrorMessage> message(error);
-            message();
-            usleep(100000);
-            while (narrator->isSpeaking())
-                usleep(20000);
-            return false;
+            navModel.reset();
+            positions.clear();
         }
+        positionsSaved = positions.revision();
 
-        LOG4CXX_DEBUG(daisyNaviLog, "state == DaisyHandler::HANDLER_OPEN");
-
-        bBookIsOpen = true;
+        Handle_OpenCheck::instance();
+        cq2::Command<OpenCheck> check = OpenCheck();
+        openTimer = cq2::Dispatcher::instance().schedule(check, OPEN_POLL_INTERVAL, OPEN_POLL_INTERVAL);
 
-        return true;
+        // a small book may already be open
+        checkOpening();
+        return bOpening || bBookIsOpen;
     }
     else
     {
@@ -803,15 +1193,169 @@ bool DaisyNavi::open()
         ErrorMessage error(NETWORK, err.getMessage());
         cq2::Command<ErrorMessage> message(error);
         message();
-        usleep(100000);
-        while (narrator->isSpeaking())
-            usleep(20000);
+        NarratorCompletion done(narrator);
+        done.wait();
         return false;
     }
 
     return true;
 }
 
+bool DaisyNavi::isOpening()
+{
+    return bOpening;
+}
+
+/**
+ * Check if DaisyHandler has finished opening the book, called by the open
+ * timer on the clientcore thread. When the book is open the onOpen that was
+ * called meanwhile is continued, when opening failed the book node is left.
+ */
+void DaisyNavi::checkOpening()
+{
+    if (not bOpening)
+        return;
+
+    if (dh->getState() == DaisyHandler::HANDLER_OPENING)
+    {
+        // play the wait jingle every few seconds
+        long long now = cq2::nowMicroseconds();
+        if (not narrator->isSpeaking() && now - lastJingle > OPEN_JINGLE_INTERVAL)
+        {
+            Narrator::Instance()->playWait();
+            lastJingle = now;
+            bPlayingJingle = true;
+        }
+        return;
+    }
+
+    bOpening = false;
+    if (openingNavi == this)
+        openingNavi = NULL;
+    cq2::Dispatcher::instance().cancel(openTimer);
+    openTimer = 0;
+    NaviEngine* navi = pendingNavi;
+    pendingNavi = NULL;
+
+    //Dont wait for jingle to finish
+    if (bPlayingJingle)
+        narrator->stop();
+
+    if (dh->getState() != DaisyHandler::HANDLER_OPEN)
+    {
+        LOG4CXX_DEBUG(daisyNaviLog, "state != DaisyHandler::HANDLER_OPEN");
+        reportOpen(BookOpenProgress::OPEN_FAILED);
+        narrator->play(_N("content error"));
+        amis::AmisError err = dh->getLastError();
+        ErrorMessage error(NETWORK, err.getMessage());
+        cq2::Command<ErrorMessage> message(error);
+        message();
+
+        // leave the book node when the narrator has finished speaking
+        if (navi != NULL)
+            leaveWhenNarrated(navi);
+        return;
+    }
+
+    LOG4CXX_DEBUG(daisyNaviLog, "state == DaisyHandler::HANDLER_OPEN");
+
+    bBookIsOpen = true;
+    openNavi = this;
+
+    // continue the onOpen that was called while the book was opening
+    if (navi != NULL && not onOpen(*navi))
+    {
+        LOG4CXX_WARN(daisyNaviLog, "failed to set up book");
+        bBookIsOpen = false;
+        openNavi = NULL;
+        reportOpen(BookOpenProgress::OPEN_FAILED);
+        narrator->play(_N("content error"));
+        leaveWhenNarrated(navi);
+    }
+}
+
+/**
+ * Leave the book node when the narrator has finished telling that opening
+ * failed. The command is tagged with the open and the book node, so that it
+ * is dropped if the user has moved on or opened another book meanwhile.
+ */
+void DaisyNavi::leaveWhenNarrated(NaviEngine* navi)
+{
+    LeaveFailedBook leave;
+    leave.openId = openId;
+    leave.node = owner_;
+    leave.navi = navi;
+
+    Handle_LeaveFailedBook::instance();
+    NarratorCompletion done(narrator);
+    done.whenDone(cq2::Command<LeaveFailedBook>(leave));
+}
+
+/**
+ * Move up from the book node of a failed open, called on the clientcore
+ * thread when the narrator has finished
+ *
+ * @param id The open that failed
+ * @param node The book node that opened the book
+ * @param navi The NaviEngine the book node was opened in
+ */
+void DaisyNavi::leaveFailedBook(long id, VirtualMenuNode* node, NaviEngine* navi)
+{
+    if (id != openId || node == NULL || node != owner_ || bOpening || bBookIsOpen)
+        return;
+    if (navi->getCurrentNode() != node)
+        return;
+
+    LOG4CXX_DEBUG(daisyNaviLog, "Leaving book node after failed open");
+    cq2::Command<INTERNAL_COMMAND> c(COMMAND_UP);
+    c();
+}
+
+// Stop waiting for DaisyHandler and close the book it is opening
+void DaisyNavi::cancelOpening()
+{
+    LOG4CXX_INFO(daisyNaviLog, "Opening book cancelled after " << (cq2::nowMicroseconds() - openStarted) / 1000 << " ms");
+    bOpening = false;
+    pendingNavi = NULL;
+    if (openingNavi == this)
+        openingNavi = NULL;
+    cq2::Dispatcher::instance().cancel(openTimer);
+    openTimer = 0;
+    if (bPlayingJingle)
+        narrator->stop();
+    reportOpen(BookOpenProgress::OPEN_CANCELLED);
+    dh->closeBook();
+}
+
+// Send the progress of opening the book, and record the time when it is open
+void DaisyNavi::reportOpen(BookOpenProgress::Phase phase)
+{
+    long milliseconds = (long) ((cq2::nowMicroseconds() - openStarted) / 1000);
+    if (phase == BookOpenProgress::OPEN_DONE)
+    {
+        LOG4CXX_INFO(daisyNaviLog, "Opened book in " << milliseconds << " ms");
+        ClientCore::BookOpenTime time;
+        time.uri = mUri;
+        time.milliseconds = milliseconds;
+        ScopeLock lock(openTimesMutex);
+        openTimes.push_back(time);
+    }
+
+    cq2::Command<BookOpenProgress> progress(BookOpenProgress(mUri, phase, milliseconds));
+    progress();
+}
+
+/**
+ * Get the time it took to open each book
+ *
+ * @return The books in the order they were opened
+ */
+std::vector<ClientCore::BookOpenTime> DaisyNavi::getOpenTimes()
+{
+    ScopeLock lock(openTimesMutex);
+    return openTimes;
+}
+
 bool DaisyNavi::open(const string &uri)
 {
 
@@ -848,8 +1392,13 @@ bool DaisyNavi::open(const string &uri)
 
 bool DaisyNavi::closeBook()
 {
+    if (openNavi == this)
+        openNavi = NULL;
     bBookIsOpen = false;
     bReopeningBook = false;
+    // the lastmark is saved at the playing clip
+    rewindReadAhead();
+    saveNavModel();
     LOG4CXX_DEBUG(daisyNaviLog, "closing book");
     player->stop();
     dh->closeBook();
@@ -859,12 +1408,80 @@ bool DaisyNavi::closeBook()
     return true;
 }
 
+/**
+ * Close the book that is open, if any, so that its last position is stored
+ * before the application exits. Must be called on the clientcore thread.
+ *
+ * @return true if a book was closed
+ */
+bool DaisyNavi::closeOpenBook()
+{
+    if (openingNavi != NULL)
+        openingNavi->cancelOpening();
+
+    if (openNavi == NULL)
+        return false;
+
+    LOG4CXX_INFO(daisyNaviLog, "Closing open book");
+    // the worker pool stops before a background write would run
+    openNavi->saveNavModel(false);
+    return openNavi->closeBook();
+}
+
+/**
+ * Get the navigator for a book node that is about to open its book. There is
+ * one navigator for all book nodes, it is created on first use. A book opened
+ * by another node is closed first. Must be called on the clientcore thread.
+ *
+ * @param owner The book node
+ * @return The shared navigator, owned by the book node until it is detached
+ */
+DaisyNavi* DaisyNavi::attach(VirtualMenuNode* owner)
+{
+    if (sharedNavi == NULL)
+        sharedNavi = new DaisyNavi;
+
+    if (sharedNavi->owner_ != owner)
+    {
+        detach(sharedNavi->owner_);
+        sharedNavi->owner_ = owner;
+    }
+    return sharedNavi;
+}
+
+/**
+ * Release the shared navigator if it is owned by the book node, a book the
+ * node has opened is closed. Must be called on the clientcore thread.
+ *
+ * @param owner The book node
+ */
+void DaisyNavi::detach(VirtualMenuNode* owner)
+{
+    if (sharedNavi == NULL || owner == NULL || sharedNavi->owner_ != owner)
+        return;
+
+    if (sharedNavi->bOpening)
+        sharedNavi->cancelOpening();
+    if (sharedNavi->bBookIsOpen)
+        sharedNavi->closeBook();
+    sharedNavi->owner_ = NULL;
+}
+
+/**
+ * Book node that has attached the navigator, NULL if none
+ */
+VirtualMenuNode* DaisyNavi::owner()
+{
+    return owner_;
+}
+
 void DaisyNavi::sayLevel(DaisyHandler::NaviLevel level, bool verbose)
 {
     if (player->isPlaying())
     {
         player->pause();
     }
+    InteractionTrace::Instance()->audio("Narrator::play");
 
     if (verbose)
     {
@@ -920,7 +1537,28 @@ void DaisyNavi::sayLevel(DaisyHandler::NaviLevel level, bool verbose)
 
 bool DaisyNavi::process(NaviEngine& navi, int command, void* data)
 {
+    // not a key press, must not resume a paused book or end a bookmark dialog
+    if (command == COMMAND_READ_AHEAD)
+    {
+        readAheadPhrases();
+        return true;
+    }
+
+    // a navigation key cancels opening the book, the book node is then left
+    if (bOpening)
+    {
+        if (command == COMMAND_NARRATORFINISHED || command == COMMAND_INFO)
+            return true;
+        cancelOpening();
+        return false;
+    }
+
+    // commands act on the phrase that is heard, not on the phrases read ahead
+    if (command != COMMAND_NEXT && command != COMMAND_NARRATORFINISHED && command != COMMAND_INFO)
+        rewindReadAhead();
+
     LOG4CXX_DEBUG(daisyNaviLog, "Processing command: " << command);
+    InteractionTrace::Instance()->point("DaisyNavi::process");
     bool amisSuccess = true;
     unsigned int totalTime;
 
@@ -1316,7 +1954,20 @@ bool DaisyNavi::process(NaviEngine& navi, int command, void* data)
         LOG4CXX_INFO(daisyNaviLog, "COMMAND_NEXT received");
         LOG4CXX_INFO(daisyNaviLog, "Going to next phrase");
         setOpeningNext(true);
-        amisSuccess = dh->nextPhrase();
+        {
+            PhraseReadAhead::Clip clip;
+            if (readAhead.pop(clip))
+            {
+                pthread_mutex_lock(playerCallbackMutex);
+                phrasesAhead--;
+                playingPos = queuedPos.front();
+                queuedPos.pop_front();
+                pthread_mutex_unlock(playerCallbackMutex);
+                openClip(clip);
+            }
+            else
+                amisSuccess = dh->nextPhrase();
+        }
         LOG4CXX_INFO(daisyNaviLog, "operation" << (amisSuccess == true ? " was successful" : " failed"));
         if (amisSuccess && !player->isPlaying() && !narrator->isSpeaking())
             player->resume();
@@ -1573,14 +2224,20 @@ bool DaisyNavi::process(NaviEngine& navi, int command, void* data)
             LOG4CXX_ERROR(daisyNaviLog, "Jump failed with error PERMISSION_ERROR" << details);
             closeBook();
             narrator->play(_N("error loading data"));
-            while(narrator->isSpeaking());
+            {
+                NarratorCompletion done(narrator);
+                done.wait();
+            }
             return up(navi); // return to parent node
 
         case IO_ERROR:
             LOG4CXX_ERROR(daisyNaviLog, "Jump failed with error IO_ERROR" << details);
             closeBook();
             narrator->play(_N("error loading data"));
-            while(narrator->isSpeaking());
+            {
+                NarratorCompletion done(narrator);
+                done.wait();
+            }
             bReopeningBook = true;
             if (open() && onOpen(navi))
                 return true; // Re-open publication
@@ -1641,7 +2298,19 @@ bool DaisyNavi::process(NaviEngine& navi, int command, void* data)
 
 void DaisyNavi::postBookData()
 {
-    ClientCore::BookData data;
+    // the data is immutable once posted, build it only once per opened book
+    if (bookData)
+    {
+        cq2::Command<ClientCore::BookDataPtr> bookDataCommand(bookData);
+        bookDataCommand();
+        return;
+    }
+
+    boost::shared_ptr<NavModel> model(new NavModel);
+    DaisyHandler::BookInfo *bookInfo = dh->getBookInfo();
+    model->title = bookInfo->mTitle;
+    if (bookInfo->hasTime)
+        model->totalms = (bookInfo->mTotalTime.tm_hour * 60 * 60 + bookInfo->mTotalTime.tm_min * 60 + bookInfo->mTotalTime.tm_sec) * 1000L;
 
     // navigation points
     DaisyHandler::NavPoints* navPoints = dh->getNavPoints();
@@ -1649,32 +2318,130 @@ void DaisyNavi::postBookData()
     // pages
     for (int i = 0; i < navPoints->pages.size(); i++)
     {
-        if (navPoints->pages[i].text.empty())
-        {
-            navPoints->pages[i].text = _("no page label");
-        }
-        ClientCore::BookData::Page page(navPoints->pages[i].id,
+        model->pages.push_back(NavModel::Point(navPoints->pages[i].id,
                 navPoints->pages[i].text,
-                navPoints->pages[i].playOrder);
-        data.pages.push_back(page);
+                navPoints->pages[i].playOrder));
     }
 
     // sections
     for (int i = 0; i < navPoints->sections.size(); i++)
     {
-        if (navPoints->sections[i].text.empty())
-        {
-            navPoints->sections[i].text = _("no section label");
-        }
-        ClientCore::BookData::Section section(navPoints->sections[i].id,
+        model->sections.push_back(NavModel::Point(navPoints->sections[i].id,
                 navPoints->sections[i].text,
                 navPoints->sections[i].playOrder,
-                navPoints->sections[i].level);
-        data.sections.push_back(section);
+                navPoints->sections[i].level));
     }
 
-    cq2::Command<ClientCore::BookData> bookData(data);
-    bookData();
+    bookData = bookDataFromModel(*model);
+    cq2::Command<ClientCore::BookDataPtr> bookDataCommand(bookData);
+    bookDataCommand();
+
+    // write the model to the cache in the background
+    navModel = model;
+    positionsSaved = -1;
+    saveNavModel();
+}
+
+// Write the navigation model and the learned positions to the NavCache, if
+// they changed since they were read or written
+void DaisyNavi::saveNavModel(bool background)
+{
+    if (not navModel || positions.revision() == positionsSaved)
+        return;
+
+    boost::shared_ptr<NavModel> model(new NavModel(*navModel));
+    model->times.clear();
+    std::vector<PositionIndex::Entry> entries = positions.entries();
+    for (size_t i = 0; i < entries.size(); i++)
+        model->times.push_back(NavModel::Time(entries[i].startms, entries[i].smilms, entries[i].section, entries[i].page, entries[i].ref));
+    positionsSaved = positions.revision();
+
+    if (not background)
+    {
+        NavCache::Instance()->store(mUri, *model);
+        return;
+    }
+
+    NavCacheJob job;
+    job.uri = mUri;
+    job.model = model;
+    navCacheWriter->post(job);
+}
+
+/**
+ * Send the section, page and time at a book position from the PositionIndex,
+ * e.g. right after a jump
+ *
+ * @param ms Offset from the start of the book in milliseconds
+ * @return false if the position is not indexed yet
+ */
+bool DaisyNavi::postPositionAt(long ms)
+{
+    PositionIndex::Entry entry;
+    if (not positions.seek(ms, entry))
+        return false;
+
+    if (bookTotalms >= 0)
+    {
+        cq2::Command<BookPositionInfo> position(BookPositionInfo(ms, bookTotalms));
+        position();
+    }
+
+    if (sectionIdxReportingEnabled)
+    {
+        if (entry.page != lastpage && dh->getBookInfo()->hasPages)
+        {
+            cq2::Command<BookPageInfo> page(BookPageInfo(entry.page));
+            page();
+            lastpage = entry.page;
+        }
+        if (entry.section >= 0 && entry.section != lastsection)
+        {
+            cq2::Command<BookSectionInfo> section(BookSectionInfo(entry.section - 1));
+            section();
+            lastsection = entry.section;
+        }
+    }
+    return true;
+}
+
+/**
+ * Jump to the section or page start read from the SMIL files right before a
+ * book position, if it is close enough to stand for the position
+ *
+ * @param ms Offset from the start of the book in milliseconds
+ * @return the offset of the start jumped to, -1 if there was none
+ */
+long DaisyNavi::jumpToStart(long ms)
+{
+    PositionIndex::Entry entry;
+    if (not positions.seekStart(ms, entry) || ms - entry.startms > POSITION_JUMP_TOLERANCE)
+        return -1;
+
+    if (not dh->goToId(entry.ref))
+    {
+        LOG4CXX_WARN(daisyNaviLog, "Jump to '" << entry.ref << "' at " << entry.startms << " ms failed");
+        return -1;
+    }
+    return entry.startms;
+}
+
+/**
+ * Take the section and page starts read from the SMIL files of the open book
+ *
+ * @param id The open the scan was started for
+ * @param uri The book scanned
+ * @param entries The starts, see PositionScanner
+ */
+void DaisyNavi::positionsScanned(long id, const std::string &uri, const std::vector<PositionIndex::Entry> &entries)
+{
+    if (id != openId || uri != mUri || not bBookIsOpen)
+        return;
+
+    LOG4CXX_DEBUG(daisyNaviLog, entries.size() << " section and page starts read from " << uri);
+    positions.assign(entries);
+    bPositionsScanned = true;
+    saveNavModel();
 }
 
 string DaisyNavi::getPageId(int pageNumber)
@@ -1704,17 +2471,13 @@ int DaisyNavi::getCurrentTime()
 int DaisyNavi::getCurrentPageIdx()
 {
     if (dh->getBookInfo()->hasPages)
-        return dh->getPosInfo()->currentPageIdx;
+        return playingPosInfo().currentPageIdx;
     return 0;
 }
 
 int DaisyNavi::getCurrentPercent()
 {
-    DaisyHandler::BookInfo *bookInfo = dh->getBookInfo();
-    if (bookInfo->hasTime)
-    {
-        int totalTime = bookInfo->mTotalTime.tm_hour * 3600 + bookInfo->mTotalTime.tm_min * 60 + bookInfo->mTotalTime.tm_sec;
-        return getCurrentTime() * 100 / totalTime;
-    }
+    if (bookTotalms > 0)
+        return getCurrentTime() * 100000L / bookTotalms;
     return 0;
 }
@@ -20,18 +20,26 @@
 #ifndef _DAISYNAVI_H
 #define _DAISYNAVI_H
 
+#include "ClientCore.h"
+#include "PhraseReadAhead.h"
+#include "PositionIndex.h"
+
 #include <DaisyHandler.h>
 #include <Player.h>
 #include <Narrator.h>
 #include <Nodes/VirtualMenuNode.h>
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <pthread.h>
 #include <boost/signals2.hpp>
+#include <boost/shared_ptr.hpp>
 
 // forward declare data types
 class BookInfoNode;
 class Handle_JumpToSecond;
+struct NavModel;
 
 /**
  * DaisyNavi implements the VirtualMenuNode, making a book function like a menu.
@@ -83,6 +91,14 @@ public:
     bool open(const std::string &uri);
     bool closeBook();
     bool isOpen();
+    bool isOpening();
+    void checkOpening();
+    void leaveFailedBook(long id, naviengine::VirtualMenuNode* node, naviengine::NaviEngine* navi);
+    static bool closeOpenBook();
+    static DaisyNavi* attach(naviengine::VirtualMenuNode* owner);
+    static void detach(naviengine::VirtualMenuNode* owner);
+    naviengine::VirtualMenuNode* owner();
+    static std::vector<ClientCore::BookOpenTime> getOpenTimes();
     void sayLevel(amis::DaisyHandler::NaviLevel level, bool verbose = false);
 
     bool process(naviengine::NaviEngine&, int command, void* data = 0);
@@ -104,6 +120,9 @@ public:
     int getCurrentTime();
     int getCurrentPageIdx();
     int getCurrentPercent();
+    bool postPositionAt(long ms);
+    long jumpToStart(long ms);
+    void positionsScanned(long id, const std::string &uri, const std::vector<PositionIndex::Entry> &entries);
     bool bPlaybackIsPaused;
 
 private:
@@ -114,8 +133,15 @@ private:
     boost::signals2::connection playerTimeCon;
     // signals and slots end
     bool open();
+    void cancelOpening();
+    void leaveWhenNarrated(naviengine::NaviEngine* navi);
+    void reportOpen(BookOpenProgress::Phase);
     void setOpeningNext(bool);
     bool isOpeningNext();
+    void openClip(const PhraseReadAhead::Clip&);
+    void readAheadPhrases();
+    void rewindReadAhead();
+    amis::DaisyHandler::PosInfo playingPosInfo();
     void buildInfoNode(BookInfoNode* info);
     amis::DaisyHandler *dh;
     Narrator *narrator;
@@ -123,16 +149,39 @@ private:
     std::string mUri;
     bool bBookIsOpen;
     bool bReopeningBook;
+    bool bOpening; // DaisyHandler is parsing the navigation file
+    bool bPlayingJingle;
+    long openId; // increases with every open, tags the commands sent for it
+    long long openStarted; // cq2 clock, microseconds
+    long long lastJingle; // cq2 clock, microseconds
+    unsigned long openTimer;
+    naviengine::NaviEngine* pendingNavi; // onOpen waits for the book to open
     bool bUserAtEndOfBook;
     bool bContextMenuIsOpen;
     int lastReportedPlayerPosition;
     bool sectionIdxReportingEnabled;
+    volatile long audioTraceId; // interaction waiting for the player to start, see InteractionTrace
 
     pthread_mutex_t *playerCallbackMutex;
     bool bOpeningNext;
+    PhraseReadAhead readAhead;
+    bool bReadingAhead; // playAudio queues the phrase instead of opening it
+    bool bRewinding; // playAudio ignores the phrases passed by rewindReadAhead
+    std::string lastWarmedAudio;
+    int phrasesAhead; // DaisyHandler is this many phrases after the playing clip, protected by playerCallbackMutex
+    amis::DaisyHandler::PosInfo playingPos; // position of the playing clip while phrasesAhead > 0
+    std::deque<amis::DaisyHandler::PosInfo> queuedPos; // positions of the queued clips
 
     void postBookData();
+    void saveNavModel(bool background = true);
+    ClientCore::BookDataPtr bookData;
+    boost::shared_ptr<NavModel> navModel; // as read from the navigation file or the NavCache
+    PositionIndex positions;
+    long positionsSaved; // revision of the positions in the NavCache
+    bool bPositionsScanned; // the positions hold the section and page starts of the SMIL files
+    long bookTotalms; // -1 if the book has no total time
     Handle_JumpToSecond* jumpHandler1;
+    naviengine::VirtualMenuNode* owner_; // book node using the shared navigator
 
 };
 
@@ -18,15 +18,16 @@
  */
 
 #include "DaisyOnlineBookNode.h"
+#include "DaisyOnlineNode.h"
 #include "Commands/InternalCommands.h"
 #include "CommandQueue2/CommandQueue.h"
 #include "DaisyNavi.h"
+#include "NarratorCompletion.h"
 #include "Defines.h"
 #include "Utils.h"
 
 #include <Narrator.h>
 #include <NaviEngine.h>
-#include <DaisyOnlineHandler.h>
 
 #include <cstring>
 #include <log4cxx/logger.h>
@@ -36,120 +37,105 @@ log4cxx::LoggerPtr bookNodeLog(log4cxx::Logger::getLogger("kolibre.clientcore.da
 
 using namespace naviengine;
 
-DaisyOnlineBookNode::DaisyOnlineBookNode(std::string book_id, DaisyOnlineHandler *DOHandler) : DaisyBookNode()
+// Counts the opens of all online books, a failed open is only left if no
+// book has been opened since
+static long lastOpenId = 0;
+
+// Sent when the narrator has told that an online book could not be opened
+struct LeaveFailedOnlineBook
+{
+    LeaveFailedOnlineBook() : openId(0), node(NULL), navi(NULL) {}
+    long openId;
+    AnyNode* node;
+    NaviEngine* navi;
+};
+
+// Returns to the very beginning from a failed open on the clientcore thread,
+// unless the user has moved on meanwhile
+class Handle_LeaveFailedOnlineBook: public cq2::Handler<LeaveFailedOnlineBook>
+{
+public:
+    static Handle_LeaveFailedOnlineBook& instance()
+    {
+        static Handle_LeaveFailedOnlineBook inst;
+        return inst;
+    }
+
+private:
+    Handle_LeaveFailedOnlineBook()
+    {
+        listen();
+    }
+
+    void handle(LeaveFailedOnlineBook leave)
+    {
+        if (leave.openId != lastOpenId || leave.navi->getCurrentNode() != leave.node)
+            return;
+
+        LOG4CXX_DEBUG(bookNodeLog, "Returning home after failed open");
+        cq2::Command<INTERNAL_COMMAND> c(COMMAND_HOME);
+        c();
+    }
+};
+
+DaisyOnlineBookNode::DaisyOnlineBookNode(std::string book_id, DaisyOnlineNode *service) : DaisyBookNode()
 {
     LOG4CXX_TRACE(bookNodeLog, "Constructor");
     book_id_ = book_id;
-    pDOHandler = DOHandler;
+    pService = service;
+    openId = 0;
     lastError = (errorType) -1;
 }
 
 bool DaisyOnlineBookNode::onOpen(NaviEngine& navi)
 {
-    if (daisyNaviActive)
+    if (daisyNaviActive && attached())
     {
         return pDaisyNavi->onOpen(navi);
     }
 
-    time_t starttime, timenow;
-    time(&starttime);
-
+    // getContentResources blocks on the network, it is invoked on the worker
+    // of the DaisyOnlineNode which calls openResolved when it replies
     daisyUri_ = "";
-    pDaisyNavi->parent_ = this;
+    DaisyNavi::detach(this);
+    openId = ++lastOpenId;
+    pService->requestContentResources(navi, this, book_id_);
+    return true;
+}
 
-    // invoke getContentResouces
-    kdo::ContentResources *contentResources = pDOHandler->getContentResources(book_id_);
+bool DaisyOnlineBookNode::up(NaviEngine& navi)
+{
+    // a reply that arrives after leaving the node is dropped
+    pService->cancelContentResources(this);
+    return DaisyBookNode::up(navi);
+}
 
-    if (!pDOHandler->good())
+/**
+ * Open the book with the content resources handed over by the worker
+ */
+bool DaisyOnlineBookNode::openResolved(NaviEngine& navi, const DaisyOnlineNode::ContentResources &resources)
+{
+    if (!resources.invokeOk)
     {
-        lastError = DO_INVOKE_ERROR;
         LOG4CXX_ERROR(bookNodeLog, "getContentResources failed for contentID " << book_id_);
-        Narrator::Instance()->play(_N("error loading data"));
-        // wait for narrator to finish speaking
-        while (Narrator::Instance()->isSpeaking())
-        {
-            usleep(20000);
-        };
-        //ErrorMessage error(NETWORK, pDOHandler->getErrorMessage());
-        //cq2::Command<ErrorMessage> message(error);
-        //error();
-        cq2::Command<INTERNAL_COMMAND> c(COMMAND_HOME);
-        c();
-        daisyNaviActive = false;
-        delete contentResources;
-        return daisyNaviActive;
+        return openFailed(navi, DO_INVOKE_ERROR, _N("error loading data"));
     }
 
-    if (contentResources == NULL)
+    if (!resources.found)
     {
-        lastError = CONTENTRESOURCES_NULL_ERROR;
         LOG4CXX_ERROR(bookNodeLog, "getContentResources is NULL for contentID " << book_id_);
-        Narrator::Instance()->play(_N("error loading data"));
-        // wait for narrator to finish speaking
-        while (Narrator::Instance()->isSpeaking())
-        {
-            usleep(20000);
-        };
-        //ErrorMessage error(SERVICE, pDOHandler->getErrorMessage());
-        //cq2::Command<ErrorMessage> message(error);
-        //error();
-        cq2::Command<INTERNAL_COMMAND> c(COMMAND_HOME);
-        c();
-        daisyNaviActive = false;
-        delete contentResources;
-        return daisyNaviActive;
-    }
-
-    // loop through each resource and try locating ncc.html
-
-    std::vector<kdo::Resource> resources = contentResources->getResouces();
-    int resource_count = resources.size();
-    for (int i = 0; i < resource_count; i++)
-    {
-        time(&timenow);
-        // when 3 seconds has passed and more than 1 item is left, play wait jingle
-        if ((i == resource_count - 1) && (timenow - starttime > 3))
-        {
-            Narrator::Instance()->playWait();
-        }
-
-        // is this ncc.html file
-        std::string filename = Utils::toLower(resources[i].getLocalUri());
-        if (filename == "ncc.html")
-        {
-            LOG4CXX_INFO(bookNodeLog, "Found uri to ncc: " << daisyUri_);
-            daisyUri_ = std::string(resources[i].getUri());
-            break;
-        }
-        else if (Utils::fileExtension(filename) == "opf")
-        {
-            LOG4CXX_INFO(bookNodeLog, "Found uri to opf: " << daisyUri_);
-            daisyUri_ = std::string(resources[i].getUri());
-            break;
-        }
+        return openFailed(navi, CONTENTRESOURCES_NULL_ERROR, _N("error loading data"));
     }
 
-    delete contentResources;
-
+    daisyUri_ = resources.uri;
     if (daisyUri_.empty())
     {
-        lastError = NAVIGATION_CONTROL_FILE_ERROR;
         LOG4CXX_ERROR(bookNodeLog, "url to ncc was not found in resources for contentID " << book_id_);
-        Narrator::Instance()->play(_N("content error"));
-        // wait for narrator to finish speaking
-        while (Narrator::Instance()->isSpeaking())
-        {
-            usleep(20000);
-        };
-        //ErrorMessage error(CONTENT, "ncc.html not found in content resources");
-        //cq2::Command<ErrorMessage> message(error);
-        //error();
-        cq2::Command<INTERNAL_COMMAND> c(COMMAND_HOME);
-        c();
-        daisyNaviActive = false;
-        return daisyNaviActive;
+        return openFailed(navi, NAVIGATION_CONTROL_FILE_ERROR, _N("content error"));
     }
 
+    pDaisyNavi = DaisyNavi::attach(this);
+    pDaisyNavi->parent_ = this;
     if (pDaisyNavi->open(daisyUri_) && pDaisyNavi->onOpen(navi))
     {
         LOG4CXX_INFO(bookNodeLog, "opening contentID " << book_id_);
@@ -157,20 +143,24 @@ bool DaisyOnlineBookNode::onOpen(NaviEngine& navi)
         return daisyNaviActive;
     }
 
-    lastError = OPEN_CONTENT_ERROR;
     LOG4CXX_ERROR(bookNodeLog, "not able to open contentID " << book_id_);
-    Narrator::Instance()->play(_N("content error"));
-    // wait for narrator to finish speaking
-    while (Narrator::Instance()->isSpeaking())
-    {
-        usleep(20000);
-    };
-    //ErrorMessage error(CONTENT, "not able to open publication");
-    //cq2::Command<ErrorMessage> message(error);
-    //error();
-    cq2::Command<INTERNAL_COMMAND> c(COMMAND_HOME);
-    c();
+    return openFailed(navi, OPEN_CONTENT_ERROR, _N("content error"));
+}
 
+bool DaisyOnlineBookNode::openFailed(NaviEngine& navi, errorType error, const char *message)
+{
+    lastError = error;
+    Narrator::Instance()->play(message);
+
+    // return to the very beginning when the narrator has finished speaking
+    LeaveFailedOnlineBook leave;
+    leave.openId = openId;
+    leave.node = this;
+    leave.navi = &navi;
+
+    Handle_LeaveFailedOnlineBook::instance();
+    NarratorCompletion done(Narrator::Instance());
+    done.whenDone(cq2::Command<LeaveFailedOnlineBook>(leave));
     daisyNaviActive = false;
     return daisyNaviActive;
 }
@@ -21,17 +21,17 @@
 #define DAISYONLINEBOOK_NODE
 
 #include "DaisyBookNode.h"
+#include "DaisyOnlineNode.h"
 
 #include <string>
 
-class DaisyOnlineHandler;
-
 class DaisyOnlineBookNode: public DaisyBookNode
 {
 public:
-    DaisyOnlineBookNode(std::string book_id, DaisyOnlineHandler *DOHandler);
+    DaisyOnlineBookNode(std::string book_id, DaisyOnlineNode *service);
 
     bool onOpen(naviengine::NaviEngine&);
+    bool up(naviengine::NaviEngine&);
 
     enum errorType
     {
@@ -45,8 +45,12 @@ public:
 private:
     std::string book_id_;
     std::string last_modified_;
-    DaisyOnlineHandler *pDOHandler;
+    DaisyOnlineNode *pService; // the parent, its worker fetches the content resources
+    long openId; // the latest open of this book
 
+    friend class DaisyOnlineNode;
+    bool openResolved(naviengine::NaviEngine&, const DaisyOnlineNode::ContentResources&);
+    bool openFailed(naviengine::NaviEngine&, errorType, const char *message);
     errorType lastError;
 };
 
@@ -26,8 +26,10 @@
 #include "Commands/NotifyCommands.h"
 #include "Commands/InternalCommands.h"
 #include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Clock.h"
 #include "Settings/Settings.h"
 #include "MediaSourceManager.h"
+#include "NarratorCompletion.h"
 #include "Utils.h"
 
 #include <DataStreamHandler.h>
@@ -36,6 +38,7 @@
 
 #include <time.h>
 #include <iostream>
+#include <boost/bind.hpp>
 #include <libintl.h>
 #include <log4cxx/logger.h>
 #include <XmlError.h>
@@ -43,83 +46,198 @@
 // create logger which will become a child to logger kolibre.clientcore
 log4cxx::LoggerPtr onlineNodeLog(log4cxx::Logger::getLogger("kolibre.clientcore.daisyonlinenode"));
 
+// Time in microseconds after which a wait jingle is played during long operations
+#define WAIT_JINGLE_INTERVAL 3000000LL
+// Minimum time in microseconds between issuing two content items
+#define ISSUE_INTERVAL 1000000LL
+// Interval in milliseconds for checking for shutdown while the worker waits for the narrator
+#define SHUTDOWN_CHECK_INTERVAL 100
+
 using namespace naviengine;
 
+// A request for the worker of a node
+struct DaisyOnlineNode::Request
+{
+    Request() : type(REQUEST_SESSION_INIT), id(0) {}
+    requestType type;
+    long id;
+    std::string bookId; // REQUEST_CONTENT_RESOURCES
+    ReadingSystem readingSystem; // REQUEST_SESSION_INIT and REQUEST_SESSION_INIT_FORCED
+    boost::shared_ptr<Service> service;
+};
+
+// The result of a request, sent from the worker to the clientcore thread
+struct DaisyOnlineNode::Reply
+{
+    enum replyType
+    {
+        REPLY_LOGIN,
+        REPLY_ISSUE_FAILED,
+        REPLY_CONTENT_LIST,
+        REPLY_CONTENT_RESOURCES,
+    };
+
+    Reply() : type(REPLY_LOGIN), id(0), result(OK), attempted(false), loggedIn(false), announce(false) {}
+    replyType type;
+    long id; // the request that produced the reply
+    errorType result;
+    std::string message; // error to announce
+    std::string status; // status message of the DaisyOnlineHandler
+    bool attempted; // REPLY_LOGIN, logOn was invoked
+    bool loggedIn;
+    bool announce; // tell the user about the result
+    std::vector<kdo::ContentItem> contentItems; // REPLY_CONTENT_LIST
+    ContentResources resources; // REPLY_CONTENT_RESOURCES
+    boost::shared_ptr<Service> service;
+};
+
+// The DaisyOnline calls of a node and the state they need. Only used on the
+// worker, except for node which the clientcore thread clears when the node
+// is destroyed.
+class DaisyOnlineNode::Service
+{
+public:
+    Service(const std::string &name, const std::string &serviceName, const std::string &uri, const std::string &username, const std::string &password, const std::string &useragent);
+    ~Service();
+
+    DaisyOnlineNode *node; // clientcore thread only, NULL when the node is gone
+    DaisyOnlineHandler *pDOHandler;
+
+    static void run(Request request);
+
+private:
+    std::string name_;
+    std::string serviceName_;
+    std::string username_;
+    std::string password_;
+    std::string previousUsername_;
+    std::string previousPassword_;
+    bool loggedIn_;
+    time_t lastUpdate_;
+    errorType lastError_;
+    errorType lastLogOnAttempt_;
+    std::string errorstring_;
+
+    void onSessionInit(const Request &request);
+    void onContentList(const Request &request);
+    void onContentResources(const Request &request);
+    void sendReply(const Request &request, Reply &reply);
+    bool cancelled();
+
+    DaisyOnlineNode::errorType sessionInit(const ReadingSystem &readingSystem);
+    DaisyOnlineNode::errorType autoIssueContentList();
+    DaisyOnlineNode::errorType issueContentList(kdo::ContentList* contentList, int& numIssued);
+    DaisyOnlineNode::errorType fetchContentList(std::vector<kdo::ContentItem>& contentItems);
+    DaisyOnlineNode::errorType faultHandler(DaisyOnlineHandler::status status);
+
+    // functions for inserting label audio into messages.db
+    bool insertLabelInMessageDb(std::string, kdo::Label);
+    bool insertServiceLabel(kdo::ServiceAttributes*);
+    bool insertContentLabel(kdo::ContentItem);
+    size_t downloadData(std::string uri, char **destinationbuffer);
+};
+
+// Hands the replies of all services to their nodes on the clientcore thread
+class DaisyOnlineNode::ReplyHandler: public cq2::Handler<Reply>
+{
+public:
+    static ReplyHandler& instance()
+    {
+        static ReplyHandler inst;
+        return inst;
+    }
+
+private:
+    ReplyHandler()
+    {
+        listen();
+    }
+
+    void handle(Reply reply)
+    {
+        DaisyOnlineNode *node = reply.service->node;
+        if (node == NULL)
+        {
+            LOG4CXX_DEBUG(onlineNodeLog, "Dropping reply to request " << reply.id << ", the node is gone");
+            return;
+        }
+        node->onReply(reply);
+    }
+};
+
 DaisyOnlineNode::DaisyOnlineNode(const std::string name, const std::string uri, const std::string username, const std::string password, std::string useragent, bool openFirstChild) :
-        good_(true), currentChild_(0)
+        serviceWorker(NULL), lastRequestId_(0), sessionRequestId_(0), resourcesRequestId_(0), resolvingBook_(NULL), navi_(NULL),
+        good_(true), lastError_((errorType) -1), currentChild_(0)
 {
     LOG4CXX_TRACE(onlineNodeLog, "Constructor");
     openFirstChild_ = openFirstChild;
     name_ = "DaisyOnline_" + name;
     serviceName_ = name;
-    serviceUri_ = uri;
-    username_ = username;
-    password_ = password;
-    previousUsername_ = "";
-    previousPassword_ = "";
-    lastUpdate_ = -1;
-    lastError_ = (DaisyOnlineNode::errorType)-1;
-    lastLogOnAttempt_ = (DaisyOnlineNode::errorType)-1;
-    loggedIn_ = false;
+    navilist.reset(new NaviList);
+    sessionReady_ = false;
     serviceUpdated_ = false;
 
     if (useragent.length() == 0)
         useragent = string(VERSION_PACKAGE_NAME) + "/" + VERSION_PACKAGE_VERSION;
 
-    NaviList navilist;
-    navilist.name_ = _("Logging in");
-    navilist.info_ = _("Connecting to content provider, please wait");
-    cq2::Command<NaviList> naviList(navilist);
+    boost::shared_ptr<NaviList> loginList(new NaviList);
+    loginList->name_ = _("Logging in");
+    loginList->info_ = _("Connecting to content provider, please wait");
+    cq2::Command<NaviListPtr> naviList(loginList);
     naviList();
 
-    pDOHandler = new DaisyOnlineHandler(uri, useragent);
+    service_.reset(new Service(name_, name, uri, username, password, useragent));
+    service_->node = this;
+    serviceWorker = new cq2::WorkerHandler<Request>(&Service::run);
+    ReplyHandler::instance();
+
     // Check if initialization failed
-    if (not pDOHandler->good())
+    if (not service_->pDOHandler->good())
     {
         good_ = false;
+        errorMessage_ = service_->pDOHandler->getStatusMessage();
         return;
     }
 
-    language_ = "i-unknown";
-    manufacturer_ = "Kolibre";
-    model_ = string(VERSION_PACKAGE_NAME);
-    version_ = string(VERSION_PACKAGE_VERSION);
-    serialNumber_ = "";
-
-    // connect slots to signals
-    sessionInit_signal.connect(boost::bind(&DaisyOnlineNode::onSessionInit, this));
-    issueContent_signal.connect(boost::bind(&DaisyOnlineNode::onIssueContent, this));
+    readingSystem_.language = "i-unknown";
+    readingSystem_.manufacturer = "Kolibre";
+    readingSystem_.model = string(VERSION_PACKAGE_NAME);
+    readingSystem_.version = string(VERSION_PACKAGE_VERSION);
+    readingSystem_.serialNumber = "";
 }
 
 DaisyOnlineNode::~DaisyOnlineNode()
 {
     LOG4CXX_TRACE(onlineNodeLog, "Destructor");
-    delete pDOHandler;
+    // don't wait for a running DaisyOnline call, the service is deleted
+    // when the call has returned and its reply is dropped
+    service_->node = NULL;
+    serviceWorker->release();
 }
 
 void DaisyOnlineNode::setManufacturer(const std::string &manufacturer)
 {
-    manufacturer_ = manufacturer;
+    readingSystem_.manufacturer = manufacturer;
 }
 
 void DaisyOnlineNode::setModel(const std::string &model)
 {
-    model_ = model;
+    readingSystem_.model = model;
 }
 
 void DaisyOnlineNode::setSerialNumber(const std::string &serialNumber)
 {
-    serialNumber_ = serialNumber;
+    readingSystem_.serialNumber = serialNumber;
 }
 
 void DaisyOnlineNode::setVersion(const std::string &version)
 {
-    version_ = version;
+    readingSystem_.version = version;
 }
 
 void DaisyOnlineNode::setLanguage(const std::string &language)
 {
-    language_ = language;
+    readingSystem_.language = language;
 }
 
 // NaviEngine functions
@@ -147,7 +265,7 @@ bool DaisyOnlineNode::menu(NaviEngine& navi)
 
 bool DaisyOnlineNode::up(NaviEngine& navi)
 {
-    loggedIn_ = false;
+    sessionReady_ = false;
     serviceUpdated_ = false;
     bool ret = MenuNode::up(navi);
     return ret;
@@ -197,7 +315,7 @@ DaisyOnlineNode::errorType DaisyOnlineNode::getLastError()
 
 std::string DaisyOnlineNode::getErrorMessage()
 {
-    return pDOHandler->getStatusMessage();
+    return errorMessage_;
 }
 
 bool DaisyOnlineNode::good()
@@ -205,9 +323,221 @@ bool DaisyOnlineNode::good()
     return good_;
 }
 
-void DaisyOnlineNode::onSessionInit()
+/**
+ * Post a request to the worker, called on the clientcore thread
+ *
+ * @param type The request
+ * @param requestId Set to the id of the request, replies to older requests are dropped
+ * @param bookId The book of a REQUEST_CONTENT_RESOURCES
+ */
+void DaisyOnlineNode::postRequest(requestType type, long &requestId, const std::string &bookId)
+{
+    Request request;
+    request.type = type;
+    request.id = requestId = ++lastRequestId_;
+    request.bookId = bookId;
+    request.readingSystem = readingSystem_;
+    request.service = service_;
+    serviceWorker->post(request);
+}
+
+/**
+ * Fetch the content resources of a book on the worker, called on the
+ * clientcore thread. The book is opened with them when the reply arrives,
+ * unless it has been left or another book has been requested meanwhile.
+ */
+void DaisyOnlineNode::requestContentResources(NaviEngine &navi, DaisyOnlineBookNode *book, const std::string &bookId)
+{
+    navi_ = &navi;
+    resolvingBook_ = book;
+    postRequest(REQUEST_CONTENT_RESOURCES, resourcesRequestId_, bookId);
+}
+
+/**
+ * Drop the reply to a content resources request of a book, called on the
+ * clientcore thread when the book is left
+ */
+void DaisyOnlineNode::cancelContentResources(DaisyOnlineBookNode *book)
+{
+    if (resolvingBook_ != book)
+        return;
+    resolvingBook_ = NULL;
+    resourcesRequestId_ = 0;
+}
+
+void DaisyOnlineNode::onReply(const Reply &reply)
+{
+    switch (reply.type)
+    {
+    case Reply::REPLY_LOGIN:
+        if (reply.id != sessionRequestId_)
+            break;
+        lastError_ = reply.result;
+        errorMessage_ = reply.status;
+        if (reply.attempted)
+            good_ = reply.loggedIn;
+        if (reply.announce)
+            announceResult(reply.result, reply.message, reply.loggedIn);
+        break;
+    case Reply::REPLY_ISSUE_FAILED:
+        if (reply.id != sessionRequestId_)
+            break;
+        lastError_ = reply.result;
+        errorMessage_ = reply.status;
+
+        // announce result for auto issue attempt
+        announceResult(reply.result, reply.message, reply.loggedIn);
+
+        // push COMMAND_HOME to command queue and return to the very beginning,
+        // unless the user has already left this node
+        if (navi_ != NULL && navi_->getCurrentNode() == this)
+        {
+            cq2::Command<ClientCore::COMMAND> c(ClientCore::HOME);
+            c();
+        }
+        break;
+    case Reply::REPLY_CONTENT_LIST:
+        if (reply.id != sessionRequestId_)
+            break;
+        onContentList(reply);
+        break;
+    case Reply::REPLY_CONTENT_RESOURCES:
+        if (reply.id != resourcesRequestId_ || resolvingBook_ == NULL)
+        {
+            LOG4CXX_DEBUG(onlineNodeLog, "Dropping content resources of request " << reply.id << ", the book has been left");
+            break;
+        }
+        onContentResources(reply);
+        break;
+    }
+}
+
+// Create book nodes from the content list fetched by the worker
+void DaisyOnlineNode::onContentList(const Reply &reply)
 {
-    LOG4CXX_DEBUG(onlineNodeLog, "sessionInit signal triggered");
+    lastError_ = reply.result;
+    errorMessage_ = reply.status;
+
+    // the book nodes are children of this node, don't replace them while
+    // the user is somewhere else, the list is fetched again on next open
+    if (navi_ == NULL || navi_->getCurrentNode() != this)
+    {
+        LOG4CXX_INFO(onlineNodeLog, "Dropping content list, the node is no longer open");
+        return;
+    }
+
+    errorType autoResult = reply.result;
+    std::string listMessage = reply.message;
+    if (autoResult == OK)
+    {
+        autoResult = createBookNodes(reply.contentItems);
+        if (autoResult != OK)
+            listMessage = "could not create all book nodes";
+    }
+    sessionReady_ = (autoResult == OK);
+    if (autoResult != OK)
+    {
+        // announce result for auto create attempt
+        announceResult(autoResult, listMessage, reply.loggedIn);
+
+        // push COMMAND_HOME to command queue and return to the very beginning
+        cq2::Command<ClientCore::COMMAND> c(ClientCore::HOME);
+        c();
+    }
+
+    navi_->setCurrentChoice(firstChild());
+    currentChild_ = firstChild();
+    announce();
+
+    bool autoPlay = Settings::Instance()->read<bool>("autoplay", true);
+    if(autoPlay && openFirstChild_){
+        narratorDoneConnection = Narrator::Instance()->connectAudioFinished(boost::bind(&DaisyOnlineNode::onNarratorDone, this));
+        Narrator::Instance()->setPushCommandFinished(true);
+    }
+}
+
+// Open the book that requested the content resources
+void DaisyOnlineNode::onContentResources(const Reply &reply)
+{
+    DaisyOnlineBookNode *book = resolvingBook_;
+    resolvingBook_ = NULL;
+    resourcesRequestId_ = 0;
+    if (navi_ == NULL || navi_->getCurrentNode() != book)
+    {
+        LOG4CXX_DEBUG(onlineNodeLog, "Dropping content resources, the book is not open");
+        return;
+    }
+    book->openResolved(*navi_, reply.resources);
+}
+
+DaisyOnlineNode::Service::Service(const std::string &name, const std::string &serviceName, const std::string &uri, const std::string &username, const std::string &password, const std::string &useragent) :
+        node(NULL), name_(name), serviceName_(serviceName), username_(username), password_(password), loggedIn_(false), lastUpdate_(-1)
+{
+    lastError_ = (DaisyOnlineNode::errorType)-1;
+    lastLogOnAttempt_ = (DaisyOnlineNode::errorType)-1;
+    pDOHandler = new DaisyOnlineHandler(uri, useragent);
+}
+
+DaisyOnlineNode::Service::~Service()
+{
+    delete pDOHandler;
+}
+
+// Runs a request on the worker
+void DaisyOnlineNode::Service::run(Request request)
+{
+    Service *service = request.service.get();
+    switch (request.type)
+    {
+    case REQUEST_SESSION_INIT_FORCED:
+        // by setting lastLogOnAttempt_ to -1, session initialization will be forced
+        service->lastLogOnAttempt_ = (DaisyOnlineNode::errorType)-1;
+        service->onSessionInit(request);
+        break;
+    case REQUEST_SESSION_INIT:
+        service->onSessionInit(request);
+        break;
+    case REQUEST_CONTENT_LIST:
+        service->onContentList(request);
+        break;
+    case REQUEST_CONTENT_RESOURCES:
+        service->onContentResources(request);
+        break;
+    }
+}
+
+/**
+ * Check if the request has to be given up because the application is
+ * shutting down, called between DaisyOnline calls
+ */
+bool DaisyOnlineNode::Service::cancelled()
+{
+    if (not cq2::WorkerPool::instance().isClosed())
+        return false;
+
+    LOG4CXX_INFO(onlineNodeLog, "Giving up request, shutting down");
+    errorstring_ = "shutting down";
+    lastError_ = NETWORK_ERROR;
+    return true;
+}
+
+// Send a reply to the clientcore thread, tagged with the request
+void DaisyOnlineNode::Service::sendReply(const Request &request, Reply &reply)
+{
+    reply.id = request.id;
+    reply.status = pDOHandler->getStatusMessage();
+    reply.service = request.service;
+    cq2::Command<Reply> c(reply);
+    c();
+}
+
+void DaisyOnlineNode::Service::onSessionInit(const Request &request)
+{
+    LOG4CXX_DEBUG(onlineNodeLog, "session initialization requested");
+
+    Reply login;
+    login.type = Reply::REPLY_LOGIN;
+    login.result = lastError_;
 
     // last logon attempt failed due to incorrect username or password
     if (lastLogOnAttempt_ == USERNAME_PASSWORD_ERROR)
@@ -227,6 +557,7 @@ void DaisyOnlineNode::onSessionInit()
         if (previousUsername_ == username_ && previousPassword_ == password_)
         {
             LOG4CXX_WARN(onlineNodeLog, "aborting session initialization since nothing has changed since last attempt");
+            sendReply(request, login);
             return;
         }
     }
@@ -237,58 +568,117 @@ void DaisyOnlineNode::onSessionInit()
         LOG4CXX_WARN(onlineNodeLog, "User name is empty. Sending login fail");
         cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_LOGIN_FAIL);
         notify();
+        sendReply(request, login);
         return;
     }
 
     previousUsername_ = username_;
     previousPassword_ = password_;
-    lastLogOnAttempt_ = sessionInit();
+    lastLogOnAttempt_ = sessionInit(request.readingSystem);
+
+    login.result = lastLogOnAttempt_;
+    login.attempted = true;
+    login.loggedIn = loggedIn_;
 
     // Log and inform user if session initialization failed
     if (lastLogOnAttempt_ != OK)
     {
-        announceResult(lastLogOnAttempt_);
+        login.message = errorstring_;
+        login.announce = true;
+        sendReply(request, login);
         LOG4CXX_ERROR(onlineNodeLog, "Session initialization failed");
         return;
     }
 
+    sendReply(request, login);
     cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_LOGIN_OK);
     notify();
 
-    // wait for narrator to finish speaking
-    usleep(500000);
-    while (Narrator::Instance()->isSpeaking())
+    // wait for narrator to finish speaking, unless shutting down
+    NarratorCompletion done(Narrator::Instance());
+    for (long waited = 0; not done.wait(SHUTDOWN_CHECK_INTERVAL) && waited < NARRATOR_COMPLETION_TIMEOUT; waited += SHUTDOWN_CHECK_INTERVAL)
     {
-        usleep(20000);
-    };
+        if (cancelled())
+            return;
+    }
 
-    // emit signal to issue new content
-    issueContent_signal();
+    // automatically issue new content
+    errorType autoResult = autoIssueContentList();
+    if (autoResult != OK)
+    {
+        Reply issue;
+        issue.type = Reply::REPLY_ISSUE_FAILED;
+        issue.result = autoResult;
+        issue.message = errorstring_;
+        issue.loggedIn = loggedIn_;
+        sendReply(request, issue);
+        return;
+    }
+
+    // get the content list
+    onContentList(request);
 }
 
-void DaisyOnlineNode::onIssueContent()
+void DaisyOnlineNode::Service::onContentList(const Request &request)
 {
-    // automatically issue new content
-    errorType autoResult = OK;
-    autoResult = autoIssueContentList();
-    if (autoResult != OK)
+    // get the content list and the label audio on this thread, the book
+    // nodes are created when the clientcore thread handles the reply
+    Reply list;
+    list.type = Reply::REPLY_CONTENT_LIST;
+    list.result = fetchContentList(list.contentItems);
+    list.message = errorstring_;
+    list.loggedIn = loggedIn_;
+    lastUpdate_ = time(NULL);
+    sendReply(request, list);
+}
+
+void DaisyOnlineNode::Service::onContentResources(const Request &request)
+{
+    long long starttime = cq2::nowMicroseconds();
+
+    Reply reply;
+    reply.type = Reply::REPLY_CONTENT_RESOURCES;
+    ContentResources &resources = reply.resources;
+    kdo::ContentResources *contentResources = pDOHandler->getContentResources(request.bookId);
+    resources.invokeOk = pDOHandler->good();
+    resources.found = (contentResources != NULL);
+
+    if (resources.invokeOk && contentResources != NULL)
     {
-        // announce result for auto issue attempt
-        announceResult(autoResult);
+        // loop through each resource and try locating ncc.html
+        std::vector<kdo::Resource> items = contentResources->getResouces();
+        int resource_count = items.size();
+        for (int i = 0; i < resource_count; i++)
+        {
+            // when 3 seconds has passed and more than 1 item is left, play wait jingle
+            if ((i == resource_count - 1) && (cq2::nowMicroseconds() - starttime > WAIT_JINGLE_INTERVAL))
+            {
+                Narrator::Instance()->playWait();
+            }
 
-        // push COMMAND_HOME to command queue and return to the very beginning
-        cq2::Command<ClientCore::COMMAND> c(ClientCore::HOME);
-        c();
+            // is this ncc.html file
+            std::string filename = Utils::toLower(items[i].getLocalUri());
+            if (filename == "ncc.html")
+            {
+                resources.uri = std::string(items[i].getUri());
+                LOG4CXX_INFO(onlineNodeLog, "Found uri to ncc: " << resources.uri);
+                break;
+            }
+            else if (Utils::fileExtension(filename) == "opf")
+            {
+                resources.uri = std::string(items[i].getUri());
+                LOG4CXX_INFO(onlineNodeLog, "Found uri to opf: " << resources.uri);
+                break;
+            }
+        }
     }
+    delete contentResources;
 
-    // send command to get content list
-    cq2::Command<INTERNAL_COMMAND> c(COMMAND_DO_GETCONTENTLIST);
-    c();
+    sendReply(request, reply);
 }
 
-DaisyOnlineNode::errorType DaisyOnlineNode::sessionInit()
+DaisyOnlineNode::errorType DaisyOnlineNode::Service::sessionInit(const ReadingSystem &readingSystem)
 {
-    good_ = false;
     loggedIn_ = false;
     // we must set lastUpdate_ here to block queued update requests
     lastUpdate_ = time(NULL);
@@ -312,6 +702,8 @@ DaisyOnlineNode::errorType DaisyOnlineNode::sessionInit()
         lastUpdate_ = -1;
         return lastError_;
     }
+    if (cancelled())
+        return lastError_;
 
     // getServiceAttributes
     kdo::ServiceAttributes* serviceAttributes;
@@ -329,14 +721,16 @@ DaisyOnlineNode::errorType DaisyOnlineNode::sessionInit()
         return lastError_;
     }
     insertServiceLabel(serviceAttributes);
+    if (cancelled())
+        return lastError_;
 
     // build readingSystemAttributes object
     kdo::ReadingSystemAttributes readingSystemAttributes;
-    readingSystemAttributes.setManufacturer(manufacturer_);
-    readingSystemAttributes.setModel(model_);
-    readingSystemAttributes.setSerialNumber(serialNumber_);
-    readingSystemAttributes.setVersion(version_);
-    readingSystemAttributes.setPreferredUILanguage(language_);
+    readingSystemAttributes.setManufacturer(readingSystem.manufacturer);
+    readingSystemAttributes.setModel(readingSystem.model);
+    readingSystemAttributes.setSerialNumber(readingSystem.serialNumber);
+    readingSystemAttributes.setVersion(readingSystem.version);
+    readingSystemAttributes.setPreferredUILanguage(readingSystem.language);
     readingSystemAttributes.addContentFormat("Daisy 2.02");
     readingSystemAttributes.addContentFormat("ANSI/NISO Z39.86-2005");
     readingSystemAttributes.addMimeType("audio/ogg");
@@ -359,12 +753,11 @@ DaisyOnlineNode::errorType DaisyOnlineNode::sessionInit()
     // Session initialized
     LOG4CXX_INFO(onlineNodeLog, "Session to Daisy Online service established");
     loggedIn_ = true;
-    good_ = true;
     lastError_ = OK;
     return lastError_;
 }
 
-DaisyOnlineNode::errorType DaisyOnlineNode::autoIssueContentList()
+DaisyOnlineNode::errorType DaisyOnlineNode::Service::autoIssueContentList()
 {
     LOG4CXX_INFO(onlineNodeLog, "get content list with new items");
 
@@ -413,14 +806,13 @@ DaisyOnlineNode::errorType DaisyOnlineNode::autoIssueContentList()
     return lastError_;
 }
 
-DaisyOnlineNode::errorType DaisyOnlineNode::issueContentList(kdo::ContentList* contentList, int& numIssued)
+DaisyOnlineNode::errorType DaisyOnlineNode::Service::issueContentList(kdo::ContentList* contentList, int& numIssued)
 {
     numIssued = 0;
     errorstring_ = "";
 
-    clock_t timeUntilNextIssue;
-    time_t starttime, timenow;
-    time(&starttime);
+    long long nextIssue = 0;
+    long long lastJingle = cq2::nowMicroseconds();
 
     std::vector<kdo::ContentItem> contentItems = contentList->getContentItems();
     const int numberOfContentItems = contentItems.size();
@@ -432,20 +824,17 @@ DaisyOnlineNode::errorType DaisyOnlineNode::issueContentList(kdo::ContentList* c
         LOG4CXX_INFO(onlineNodeLog, "processing item #" << i << " with id " << contentItems[i].getId());
 
         // when 3 seconds has passed and more than 1 item is left, play wait jingle
-        time(&timenow);
-        if ((i > 1) && (timenow - starttime > 3))
+        if ((i > 1) && (cq2::nowMicroseconds() - lastJingle > WAIT_JINGLE_INTERVAL))
         {
             Narrator::Instance()->playWait();
-            time(&starttime);
+            lastJingle = cq2::nowMicroseconds();
         }
 
         // wait until we can issue this item unless it's the first item in contentList
         if (i < numberOfContentItems - 1)
-        {
-            while (clock() < timeUntilNextIssue)
-            {
-            }
-        }
+            cq2::sleepMicroseconds(nextIssue - cq2::nowMicroseconds());
+        if (cancelled())
+            return lastError_;
 
         // getContentMetadata for the content item, this operation is part of the issue process
         kdo::ContentMetadata *contentMetadata = pDOHandler->getContentMetadata(contentItems[i].getId());
@@ -477,8 +866,8 @@ DaisyOnlineNode::errorType DaisyOnlineNode::issueContentList(kdo::ContentList* c
             return lastError_;
         }
 
-        // set a clock time when next item can be issued
-        timeUntilNextIssue = clock() + CLOCKS_PER_SEC;
+        // set the time when next item can be issued
+        nextIssue = cq2::nowMicroseconds() + ISSUE_INTERVAL;
 
         numIssued++;
     }
@@ -492,7 +881,7 @@ DaisyOnlineNode::errorType DaisyOnlineNode::issueContentList(kdo::ContentList* c
     return lastError_;
 }
 
-DaisyOnlineNode::errorType DaisyOnlineNode::autoCreateBookNodes()
+DaisyOnlineNode::errorType DaisyOnlineNode::Service::fetchContentList(std::vector<kdo::ContentItem>& contentItems)
 {
     LOG4CXX_INFO(onlineNodeLog, "get content list with issued items");
 
@@ -513,23 +902,43 @@ DaisyOnlineNode::errorType DaisyOnlineNode::autoCreateBookNodes()
         return lastError_;
     }
 
-    return createBookNodes(content_list_issued);
+    contentItems = content_list_issued->getContentItems();
+    const int numberOfContentItems = contentItems.size();
+
+    long long lastJingle = cq2::nowMicroseconds();
+
+    // insert label audio in database, this may download one file per item
+    for (int i = 0; i < numberOfContentItems; i++)
+    {
+        // when 3 seconds has passed and more than 1 item is left, play wait jingle
+        if ((i + 1 < numberOfContentItems) && (cq2::nowMicroseconds() - lastJingle > WAIT_JINGLE_INTERVAL))
+        {
+            Narrator::Instance()->playWait();
+            lastJingle = cq2::nowMicroseconds();
+        }
+
+        if (cancelled())
+            return lastError_;
+        insertContentLabel(contentItems[i]);
+    }
+
+    lastError_ = OK;
+    return lastError_;
 }
 
-DaisyOnlineNode::errorType DaisyOnlineNode::createBookNodes(kdo::ContentList* contentList)
+DaisyOnlineNode::errorType DaisyOnlineNode::createBookNodes(const std::vector<kdo::ContentItem>& contentItems)
 {
     int fail = 0;
     int added = 0;
 
+    // the book nodes are deleted, drop the reply of a book being resolved
     clearNodes();
-    navilist.items.clear();
+    resolvingBook_ = NULL;
+    resourcesRequestId_ = 0;
 
-    errorstring_ = "";
-
-    time_t starttime, timenow;
-    time(&starttime);
+    // build a new list, the previous one may still be shared with listeners
+    boost::shared_ptr<NaviList> list(new NaviList);
 
-    std::vector<kdo::ContentItem> contentItems = contentList->getContentItems();
     const int numberOfContentItems = contentItems.size();
     LOG4CXX_INFO(onlineNodeLog, "Creating book nodes for all items in content list");
     LOG4CXX_DEBUG(onlineNodeLog, "Content list contains " << numberOfContentItems << " items");
@@ -538,14 +947,6 @@ DaisyOnlineNode::errorType DaisyOnlineNode::createBookNodes(kdo::ContentList* co
     {
         LOG4CXX_INFO(onlineNodeLog, "processing item #" << i << " with id " << contentItems[i].getId());
 
-        // when 3 seconds has passed and more than 1 item is left, play wait jingle
-        time(&timenow);
-        if ((i + 1 < numberOfContentItems) && (timenow - starttime > 3))
-        {
-            Narrator::Instance()->playWait();
-            time(&starttime);
-        }
-
         // join id and text string to avoid duplicates in database
         std::string name = contentItems[i].getId() + "_" + contentItems[i].getLabel().getText();
 
@@ -556,7 +957,7 @@ DaisyOnlineNode::errorType DaisyOnlineNode::createBookNodes(kdo::ContentList* co
 
         // create node
         LOG4CXX_DEBUG(onlineNodeLog, "Creating book node: '" << name << "'");
-        DaisyOnlineBookNode* node = new DaisyOnlineBookNode(contentItems[i].getId(), pDOHandler);
+        DaisyOnlineBookNode* node = new DaisyOnlineBookNode(contentItems[i].getId(), this);
         node->name_ = name;
         node->uri_ = uri_from_anything.str(); // There is nothing that works like an uri so I used the address;
 
@@ -564,29 +965,25 @@ DaisyOnlineNode::errorType DaisyOnlineNode::createBookNodes(kdo::ContentList* co
         addNode(node);
         added++;
 
-        // insert label audio in database
-        insertContentLabel(contentItems[i]);
-
         // create a NaviListItem and store it in list for the NaviList signal
         NaviListItem item(uri_from_anything.str(), contentItems[i].getLabel().getText());
-        navilist.items.push_back(item);
+        list->items.push_back(item);
     }
+    navilist = list;
 
     if (fail > 0)
     {
         LOG4CXX_WARN(onlineNodeLog, "Could not create " << fail << " book nodes of " << numberOfContentItems << " items in content list");
-        lastError_ = SERVICE_ERROR;
-        return lastError_;
+        return SERVICE_ERROR;
     }
 
     LOG4CXX_DEBUG(onlineNodeLog, added << " book nodes added");
 
     serviceUpdated_ = true;
-    lastError_ = OK;
-    return lastError_;
+    return OK;
 }
 
-DaisyOnlineNode::errorType DaisyOnlineNode::faultHandler(DaisyOnlineHandler::status status)
+DaisyOnlineNode::errorType DaisyOnlineNode::Service::faultHandler(DaisyOnlineHandler::status status)
 {
     switch (status)
     {
@@ -627,16 +1024,17 @@ DaisyOnlineNode::errorType DaisyOnlineNode::faultHandler(DaisyOnlineHandler::sta
 
 bool DaisyOnlineNode::onOpen(NaviEngine& navi)
 {
-    if (loggedIn_ && serviceUpdated_ && navi.good())
+    navi_ = &navi;
+    if (sessionReady_ && serviceUpdated_ && navi.good())
     {
         currentChild_ = navi.getCurrentChoice();
         announce();
         return true;
     }
 
-    // start chain of commands, this action will try to establish a session, issue
+    // start chain of requests, this action will try to establish a session, issue
     // new content, and retrieve the content list
-    sessionInit_signal();
+    postRequest(REQUEST_SESSION_INIT, sessionRequestId_);
 
     good_ = true;
     return true;
@@ -651,6 +1049,7 @@ void DaisyOnlineNode::beforeOnOpen()
 bool DaisyOnlineNode::process(NaviEngine& navi, int command, void* data)
 {
     LOG4CXX_INFO(onlineNodeLog, "Processing command: " << command);
+    navi_ = &navi;
 
     switch (command)
     {
@@ -658,37 +1057,14 @@ bool DaisyOnlineNode::process(NaviEngine& navi, int command, void* data)
         LOG4CXX_INFO(onlineNodeLog, "COMMAND_BACK received");
         return onOpen(navi);
     case COMMAND_RETRY_LOGIN_FORCED:
-        // by setting lastLogOnAttempt_ to -1, session initialization will be forced
-        lastLogOnAttempt_ = (DaisyOnlineNode::errorType)-1;
+        postRequest(REQUEST_SESSION_INIT_FORCED, sessionRequestId_);
+        break;
     case COMMAND_RETRY_LOGIN:
-        sessionInit_signal();
+        postRequest(REQUEST_SESSION_INIT, sessionRequestId_);
         break;
     case COMMAND_DO_GETCONTENTLIST:
-    {
-        // get content list and create book nodes
-        errorType autoResult = OK;
-        autoResult = autoCreateBookNodes();
-        if (autoResult != OK)
-        {
-            // announce result for auto create attempt
-            announceResult(autoResult);
-
-            // push COMMAND_HOME to command queue and return to the very beginning
-            cq2::Command<ClientCore::COMMAND> c(ClientCore::HOME);
-            c();
-        }
-
-        lastUpdate_ = time(NULL);
-        navi.setCurrentChoice(firstChild());
-        currentChild_ = firstChild();
-        announce();
-
-        bool autoPlay = Settings::Instance()->read<bool>("autoplay", true);
-        if(autoPlay && openFirstChild_){
-            narratorDoneConnection = Narrator::Instance()->connectAudioFinished(boost::bind(&DaisyOnlineNode::onNarratorDone, this));
-            Narrator::Instance()->setPushCommandFinished(true);
-        }
-    }
+        // get content list on the worker, the book nodes are created when it replies
+        postRequest(REQUEST_CONTENT_LIST, sessionRequestId_);
         break;
 
     default:
@@ -722,7 +1098,7 @@ void DaisyOnlineNode::onNarratorDone(){
         c();
     }
 }
-bool DaisyOnlineNode::insertLabelInMessageDb(std::string identifier, kdo::Label label)
+bool DaisyOnlineNode::Service::insertLabelInMessageDb(std::string identifier, kdo::Label label)
 {
     // if we get here, the label object contains audio
 
@@ -790,7 +1166,7 @@ bool DaisyOnlineNode::insertLabelInMessageDb(std::string identifier, kdo::Label
     return true;
 }
 
-bool DaisyOnlineNode::insertServiceLabel(kdo::ServiceAttributes* serviceAttributes)
+bool DaisyOnlineNode::Service::insertServiceLabel(kdo::ServiceAttributes* serviceAttributes)
 {
     std::string service = serviceAttributes->getServiceId();
     if (service.empty()) return true;
@@ -811,7 +1187,7 @@ bool DaisyOnlineNode::insertServiceLabel(kdo::ServiceAttributes* serviceAttribut
     return insertLabelInMessageDb(name_, serviceAttributes->getService());
 }
 
-bool DaisyOnlineNode::insertContentLabel(kdo::ContentItem contentItem)
+bool DaisyOnlineNode::Service::insertContentLabel(kdo::ContentItem contentItem)
 {
     LOG4CXX_INFO(onlineNodeLog, "Download and insert audio label for content '" << contentItem.getLabel().getText() << "' with id " << contentItem.getId());
 
@@ -827,7 +1203,7 @@ bool DaisyOnlineNode::insertContentLabel(kdo::ContentItem contentItem)
     return insertLabelInMessageDb(identifier, contentItem.getLabel());
 }
 
-size_t DaisyOnlineNode::downloadData(string uri, char **destinationbuffer)
+size_t DaisyOnlineNode::Service::downloadData(string uri, char **destinationbuffer)
 {
 
     size_t bytes_read = 0;
@@ -898,7 +1274,7 @@ std::string DaisyOnlineNode::getLangCode(std::string language)
 
 void DaisyOnlineNode::announce()
 {
-    cq2::Command<NaviList> naviList(navilist);
+    cq2::Command<NaviListPtr> naviList(navilist);
     naviList();
 
     int numItems = numberOfChildren();
@@ -939,7 +1315,7 @@ void DaisyOnlineNode::announceSelection()
         Narrator::Instance()->play(_N("publication no. {1}"));
         Narrator::Instance()->play(currentChild_->name_.c_str());
 
-        NaviListItem item = navilist.items[currentChoice];
+        NaviListItem item = navilist->items[currentChoice];
         cq2::Command<NaviListItem> naviItem(item);
         naviItem();
     }
@@ -952,7 +1328,7 @@ void DaisyOnlineNode::announceSelection()
     }
 }
 
-void DaisyOnlineNode::announceResult(DaisyOnlineNode::errorType error)
+void DaisyOnlineNode::announceResult(DaisyOnlineNode::errorType error, const std::string &message, bool loggedIn)
 {
     switch (error)
     {
@@ -962,9 +1338,9 @@ void DaisyOnlineNode::announceResult(DaisyOnlineNode::errorType error)
         Narrator::Instance()->play(_N("error loading data"));
         Narrator::Instance()->playLongpause();
         Narrator::Instance()->play(_N("retrying shortly"));
-        ErrorMessage error(NETWORK, errorstring_);
-        cq2::Command<ErrorMessage> message(error);
-        message();
+        ErrorMessage errorMessage(NETWORK, message);
+        cq2::Command<ErrorMessage> errorCommand(errorMessage);
+        errorCommand();
     }
         break;
 
@@ -974,9 +1350,9 @@ void DaisyOnlineNode::announceResult(DaisyOnlineNode::errorType error)
         Narrator::Instance()->play(_N("service error"));
         Narrator::Instance()->playLongpause();
         Narrator::Instance()->play(_N("retrying shortly"));
-        ErrorMessage error(SERVICE, errorstring_);
-        cq2::Command<ErrorMessage> message(error);
-        message();
+        ErrorMessage errorMessage(SERVICE, message);
+        cq2::Command<ErrorMessage> errorCommand(errorMessage);
+        errorCommand();
     }
         break;
 
@@ -995,7 +1371,7 @@ void DaisyOnlineNode::announceResult(DaisyOnlineNode::errorType error)
     }
 
     //If error occurred during login then send notification
-    if(!loggedIn_){
+    if(!loggedIn){
         cq2::Command<NOTIFY_COMMAND> notify(NOTIFY_LOGIN_FAIL);
         notify();
     }
@@ -21,13 +21,18 @@
 #define _DAISYONLINENODE_H
 
 #include "NaviList.h"
+#include "CommandQueue2/WorkerPool.h"
 
 #include <DaisyOnlineHandler.h>
 #include <Nodes/MenuNode.h>
 
 #include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2.hpp>
 
+class DaisyOnlineBookNode;
+
 /**
  * DaisyOnlineNode implements the MenuNode, making a publication list
  * (library) function like a menu.
@@ -72,58 +77,77 @@ public:
     std::string getErrorMessage();
     bool good();
 
+    // Content resources of a book, fetched on the worker for DaisyOnlineBookNode
+    struct ContentResources
+    {
+        ContentResources() : invokeOk(false), found(false) {}
+        bool invokeOk; // getContentResources succeeded
+        bool found; // the service returned the resources of the book
+        std::string uri; // uri of the navigation file, empty if there is none
+    };
+    void requestContentResources(naviengine::NaviEngine &navi, DaisyOnlineBookNode *book, const std::string &bookId);
+    void cancelContentResources(DaisyOnlineBookNode *book);
+
 private:
+    // DaisyOnline calls block on the network. They are made by a Service on
+    // a worker, one request at a time. The Service outlives the node while
+    // a call is running, the node releases it without waiting. Each reply
+    // is sent back as a command tagged with the id of its request and is
+    // dropped on the clientcore thread if the node is gone or has sent a
+    // newer request since.
+    enum requestType
+    {
+        REQUEST_SESSION_INIT,
+        REQUEST_SESSION_INIT_FORCED,
+        REQUEST_CONTENT_LIST,
+        REQUEST_CONTENT_RESOURCES,
+    };
+    struct ReadingSystem
+    {
+        std::string manufacturer;
+        std::string model;
+        std::string serialNumber;
+        std::string version;
+        std::string language;
+    };
+    class Service;
+    class ReplyHandler;
+    struct Request;
+    struct Reply;
+    boost::shared_ptr<Service> service_;
+    cq2::WorkerHandler<Request> *serviceWorker;
+    long lastRequestId_;
+    long sessionRequestId_; // the latest login or content list request
+    long resourcesRequestId_; // the latest content resources request, 0 when cancelled
+    DaisyOnlineBookNode *resolvingBook_; // the book waiting for its content resources
+    naviengine::NaviEngine *navi_; // the engine the node was opened in
+
+    void postRequest(requestType type, long &requestId, const std::string &bookId = "");
+    void onReply(const Reply &reply);
+    void onContentList(const Reply &reply);
+    void onContentResources(const Reply &reply);
+
+    // clientcore thread only
     bool good_; // if false, call getErrorMessage, resets on every invoke
-    DaisyOnlineHandler *pDOHandler;
+    errorType lastError_;
+    std::string errorMessage_;
     std::string serviceName_;
-    std::string serviceUri_;
-    std::string username_;
-    std::string password_;
-    std::string previousUsername_;
-    std::string previousPassword_;
-    std::string useragent_;
-    std::string manufacturer_;
-    std::string model_;
-    std::string serialNumber_;
-    std::string version_;
-    std::string language_;
+    ReadingSystem readingSystem_;
 
     bool openFirstChild_;
-    bool loggedIn_;
+    bool sessionReady_; // a content list has been received
     bool serviceUpdated_;
-    NaviList navilist;
+    NaviListPtr navilist;
     AnyNode* currentChild_;
 
-    time_t lastUpdate_;
-    errorType lastError_;
-    errorType lastLogOnAttempt_;
-    std::string errorstring_;
-
-    // signals and slots to control invocation of DaisyOnline calls
-    boost::signals2::signal<void()> sessionInit_signal;
-    boost::signals2::signal<void()> issueContent_signal;
     boost::signals2::connection narratorDoneConnection;
-    void onSessionInit();
-    void onIssueContent();
-    // signals and slots to control invocation of DaisyOnline calls end
-
-    DaisyOnlineNode::errorType sessionInit();
-    DaisyOnlineNode::errorType autoIssueContentList();
-    DaisyOnlineNode::errorType issueContentList(kdo::ContentList* contentList, int& numIssued);
-    DaisyOnlineNode::errorType autoCreateBookNodes();
-    DaisyOnlineNode::errorType createBookNodes(kdo::ContentList* contentList);
-    DaisyOnlineNode::errorType faultHandler(DaisyOnlineHandler::status status);
-
-    // functions for inserting label audio into messages.db
-    bool insertLabelInMessageDb(std::string, kdo::Label);
-    bool insertServiceLabel(kdo::ServiceAttributes*);
-    bool insertContentLabel(kdo::ContentItem);
-    size_t downloadData(std::string uri, char **destinationbuffer);
+
+    DaisyOnlineNode::errorType createBookNodes(const std::vector<kdo::ContentItem>& contentItems);
 
     std::string getLangCode(std::string language);
     void announce();
     void announceSelection();
-    void announceResult(DaisyOnlineNode::errorType error);
+    void announceResult(DaisyOnlineNode::errorType error, const std::string &message, bool loggedIn);
 };
 
 #endif
@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DIRECTORYWALKER_H
+#define _DIRECTORYWALKER_H
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <boost/function.hpp>
+
+#include "CommandQueue2/ScopeLock.h"
+
+// Number of threads reading directories, including the calling thread
+#define DIRECTORY_WALKER_THREADS 4
+// Number of directories waiting to be read before another thread is started
+#define DIRECTORY_WALKER_SPAWN_DIRS 8
+
+/**
+ * DirectoryWalker searches a directory tree for files matching any of
+ * several file names or extensions in a single traversal.
+ *
+ * The file type is taken from the directory entry, files are only stat'ed
+ * when the file system does not report the type or for symbolic links.
+ * Symbolic links to directories are not followed. Matches are passed to a
+ * callback as soon as their directory has been read. A walk starts on the
+ * calling thread, more threads are started only when enough directories are
+ * waiting to be read, so small trees are walked without starting threads.
+ *
+ * With pruning enabled a directory that has a matching file is taken to be
+ * the root of a book and its subdirectories are not searched.
+ *
+ * With a Cache the listings of directories are kept between walks, and a
+ * directory whose modification time has not changed is not read again.
+ */
+class DirectoryWalker
+{
+public:
+    /**
+     * Called for each match with the path of the file and the index of the
+     * pattern it matched. Calls are serialized, but may come from any of the
+     * walking threads.
+     */
+    typedef boost::function<void(const std::string&, int)> Callback;
+
+    /**
+     * The matching files and the subdirectories of a directory
+     */
+    struct Listing
+    {
+        std::vector<std::pair<std::string, int> > files; /**< Path and pattern index */
+        std::vector<std::string> subdirs; /**< Paths */
+    };
+
+    /**
+     * Keeps directory listings between walks. Calls are serialized, but may
+     * come from any of the walking threads.
+     */
+    class Cache
+    {
+    public:
+        virtual ~Cache() {}
+
+        /**
+         * Get the listing of dir if it is known to be unchanged, without
+         * looking at the directory
+         */
+        virtual bool known(const std::string&, Listing&)
+        {
+            return false;
+        }
+
+        /**
+         * Get the listing of dir if it is known for this modification time
+         */
+        virtual bool lookup(const std::string &dir, time_t mtime, Listing &listing) = 0;
+
+        /**
+         * Remember the listing of dir, read at this modification time
+         */
+        virtual void store(const std::string &dir, time_t mtime, const Listing &listing) = 0;
+    };
+
+    DirectoryWalker() : pruning(false), threads(DIRECTORY_WALKER_THREADS), cache(NULL) {}
+
+    /**
+     * Match files with this name
+     *
+     * @return Index of the pattern
+     */
+    int addFilename(const std::string &name)
+    {
+        patterns.push_back(Pattern(name, false));
+        return patterns.size() - 1;
+    }
+
+    /**
+     * Match files with this extension, including the dot, e.g. ".opf"
+     *
+     * @return Index of the pattern
+     */
+    int addExtension(const std::string &extension)
+    {
+        patterns.push_back(Pattern(extension, true));
+        return patterns.size() - 1;
+    }
+
+    /**
+     * Do not search the subdirectories of a directory that has a match
+     */
+    void setPruning(bool enable)
+    {
+        pruning = enable;
+    }
+
+    /**
+     * Set the maximum number of threads reading directories, 1 walks the
+     * tree on the calling thread only
+     */
+    void setThreads(int count)
+    {
+        threads = count > 0 ? count : 1;
+    }
+
+    /**
+     * Use listings from the cache and store the directories that are read in
+     * it, NULL reads every directory
+     */
+    void setCache(Cache *c)
+    {
+        cache = c;
+    }
+
+    /**
+     * Walk the tree below root and return when it has been searched
+     *
+     * @param root Directory to search
+     * @param found Called for each match
+     * @return Number of matches
+     */
+    long walk(const std::string &root, Callback found)
+    {
+        Walk w(*this, found);
+        w.dirs.push_back(root);
+
+        // the threads started by the walk have left run() when it returns here
+        w.run();
+        for (size_t i = 0; i < w.started.size(); i++)
+            pthread_join(w.started[i], NULL);
+        return w.matches;
+    }
+
+    /**
+     * Walk the tree below root and collect the matches
+     *
+     * @param root Directory to search
+     * @return The sorted paths of the files matching each pattern, by pattern index
+     */
+    std::vector<std::vector<std::string> > search(const std::string &root)
+    {
+        std::vector<std::vector<std::string> > matches(patterns.size());
+        walk(root, Collector(matches));
+        for (size_t i = 0; i < matches.size(); i++)
+            std::sort(matches[i].begin(), matches[i].end());
+        return matches;
+    }
+
+private:
+    struct Pattern
+    {
+        Pattern(const std::string &t, bool ext) : text(t), extension(ext) {}
+        std::string text;
+        bool extension;
+    };
+
+    struct Collector
+    {
+        Collector(std::vector<std::vector<std::string> > &m) : matches(&m) {}
+        void operator()(const std::string &path, int pattern)
+        {
+            (*matches)[pattern].push_back(path);
+        }
+        std::vector<std::vector<std::string> > *matches;
+    };
+
+    // Index of the first pattern the file name matches, -1 if none
+    int match(const char *name) const
+    {
+        size_t length = strlen(name);
+        for (size_t i = 0; i < patterns.size(); i++)
+        {
+            const std::string &text = patterns[i].text;
+            if (patterns[i].extension)
+            {
+                if (length > text.size() && text.compare(0, std::string::npos, name + length - text.size()) == 0)
+                    return i;
+            }
+            else if (text == name)
+                return i;
+        }
+        return -1;
+    }
+
+    // State of one walk, shared by its threads
+    struct Walk
+    {
+        Walk(const DirectoryWalker &w, Callback f) : walker(w), found(f), busy(0), matches(0)
+        {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+        }
+
+        ~Walk()
+        {
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        void run()
+        {
+            Listing listing;
+
+            ScopeLock lock(mutex);
+            for (;;)
+            {
+                while (dirs.empty() && busy > 0)
+                    pthread_cond_wait(&cond, &mutex);
+                if (dirs.empty())
+                    break;
+
+                std::string dir = dirs.front();
+                dirs.pop_front();
+                busy++;
+
+                listing.files.clear();
+                listing.subdirs.clear();
+                bool cached = walker.cache != NULL && walker.cache->known(dir, listing);
+                if (walker.cache != NULL && not cached)
+                {
+                    pthread_mutex_unlock(&mutex);
+                    struct stat st;
+                    bool exists = stat(dir.c_str(), &st) == 0;
+                    pthread_mutex_lock(&mutex);
+                    if (not exists)
+                    {
+                        busy--;
+                        pthread_cond_broadcast(&cond);
+                        continue;
+                    }
+
+                    cached = walker.cache->lookup(dir, st.st_mtime, listing);
+                    if (not cached)
+                    {
+                        pthread_mutex_unlock(&mutex);
+                        read(dir, listing);
+                        pthread_mutex_lock(&mutex);
+                        walker.cache->store(dir, st.st_mtime, listing);
+                    }
+                }
+                else if (walker.cache == NULL)
+                {
+                    pthread_mutex_unlock(&mutex);
+                    read(dir, listing);
+                    pthread_mutex_lock(&mutex);
+                }
+
+                for (size_t i = 0; i < listing.files.size(); i++)
+                    found(listing.files[i].first, listing.files[i].second);
+                matches += listing.files.size();
+                if (not (walker.pruning && not listing.files.empty()))
+                    dirs.insert(dirs.end(), listing.subdirs.begin(), listing.subdirs.end());
+                busy--;
+
+                // the tree is large, read it in parallel
+                if (dirs.size() >= DIRECTORY_WALKER_SPAWN_DIRS && (int) started.size() + 1 < walker.threads)
+                {
+                    pthread_t thread;
+                    if (pthread_create(&thread, NULL, walkThread, this) == 0)
+                        started.push_back(thread);
+                }
+                pthread_cond_broadcast(&cond);
+            }
+        }
+
+        // List the matching files and the subdirectories of dir
+        void read(const std::string &dir, Listing &listing)
+        {
+            DIR *d = opendir(dir.c_str());
+            if (d == NULL)
+                return;
+
+            std::string prefix = dir;
+            if (prefix.empty() || prefix[prefix.size() - 1] != '/')
+                prefix += '/';
+
+            struct dirent *entry;
+            while ((entry = readdir(d)) != NULL)
+            {
+                const char *name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                    continue;
+
+                bool isDir = entry->d_type == DT_DIR;
+                bool isFile = entry->d_type == DT_REG;
+                if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+                {
+                    struct stat st;
+                    if (stat((prefix + name).c_str(), &st) != 0)
+                        continue;
+                    isFile = S_ISREG(st.st_mode);
+                    isDir = S_ISDIR(st.st_mode) && entry->d_type == DT_UNKNOWN;
+                }
+
+                if (isDir)
+                    listing.subdirs.push_back(prefix + name);
+                else if (isFile)
+                {
+                    int pattern = walker.match(name);
+                    if (pattern >= 0)
+                        listing.files.push_back(std::make_pair(prefix + name, pattern));
+                }
+            }
+            closedir(d);
+        }
+
+        const DirectoryWalker &walker;
+        Callback found;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        std::deque<std::string> dirs;
+        std::vector<pthread_t> started; // threads started besides the calling thread
+        int busy; // threads reading a directory
+        long matches;
+    };
+
+    static void* walkThread(void *ctx)
+    {
+        static_cast<Walk*>(ctx)->run();
+        return NULL;
+    }
+
+    std::vector<Pattern> patterns;
+    bool pruning;
+    int threads;
+    Cache *cache;
+};
+
+#endif
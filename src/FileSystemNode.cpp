@@ -19,9 +19,14 @@
 
 #include "FileSystemNode.h"
 #include "DaisyBookNode.h"
+#include "TitleExtractor.h"
+#include "LibraryIndex.h"
+#include "LibraryWatcher.h"
 #include "Defines.h"
 #include "config.h"
 #include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/WorkerPool.h"
+#include "CommandQueue2/Clock.h"
 #include "Commands/InternalCommands.h"
 #include "Utils.h"
 #include "Settings/Settings.h"
@@ -29,7 +34,9 @@
 #include <Narrator.h>
 #include <NaviEngine.h>
 
+#include <set>
 #include <sstream>
+#include <algorithm>
 #include <log4cxx/logger.h>
 
 // create logger which will become a child to logger kolibre.clientcore
@@ -37,25 +44,61 @@ log4cxx::LoggerPtr fsNodeLog(log4cxx::Logger::getLogger("kolibre.clientcore.file
 
 using namespace naviengine;
 
+// Runs on a worker thread
+static void rescanPath(std::string path)
+{
+    LibraryIndex::Instance()->rescan(path);
+}
+
+// Never deleted, a rescan may still be running when the application exits
+static cq2::WorkerHandler<std::string>* rescanWorker = new cq2::WorkerHandler<std::string>(&rescanPath);
+
+// The nodes that exist, used on the clientcore thread
+static std::set<FileSystemNode*> fileSystemNodes;
+
+void FileSystemNode::libraryChanged(NaviEngine& navi, const std::string &path)
+{
+    for (std::set<FileSystemNode*>::iterator it = fileSystemNodes.begin(); it != fileSystemNodes.end(); ++it)
+    {
+        FileSystemNode* node = *it;
+        if (node->fsPath_ != path || not node->pathUpdated_)
+            continue;
+
+        // the children are only replaced while the list is shown, a book
+        // that is being read keeps its node
+        LOG4CXX_INFO(fsNodeLog, "Library index of path '" << path << "' changed");
+        if (navi.getCurrentNode() == node)
+            node->refresh(navi, true);
+        else
+            node->pendingRefresh_ = true;
+    }
+}
+
 FileSystemNode::FileSystemNode(const std::string name, const std::string path, bool openFirstChild)
 {
     LOG4CXX_TRACE(fsNodeLog, "Constructor");
     name_ = "FileSystem_" + name;
     fsName_ = name;
     fsPath_ = path;
+    navilist_.reset(new NaviList);
     pathUpdated_ = false;
     openFirstChild_ = openFirstChild;
+    pendingRefresh_ = false;
+    fileSystemNodes.insert(this);
 }
 
 FileSystemNode::~FileSystemNode()
 {
     LOG4CXX_TRACE(fsNodeLog, "Destructor");
+    fileSystemNodes.erase(this);
 }
 
 // NaviEngine functions
 
 bool FileSystemNode::next(NaviEngine& navi)
 {
+    if (pendingRefresh_)
+        refresh(navi, false);
     bool ret = MenuNode::next(navi);
     currentChild_ = navi.getCurrentChoice();
     announceSelection();
@@ -64,6 +107,8 @@ bool FileSystemNode::next(NaviEngine& navi)
 
 bool FileSystemNode::prev(NaviEngine& navi)
 {
+    if (pendingRefresh_)
+        refresh(navi, false);
     bool ret = MenuNode::prev(navi);
     currentChild_ = navi.getCurrentChoice();
     announceSelection();
@@ -87,59 +132,31 @@ bool FileSystemNode::onOpen(NaviEngine& navi)
     if (not pathUpdated_)
     {
         navi.setCurrentChoice(NULL);
-        clearNodes();
-        navilist_.items.clear();
 
         // Create sources defined in MediaSourceManager
         LOG4CXX_INFO(fsNodeLog, "Searching for supported content in path '" << fsPath_ << "'");
 
-        // Recursively search for Daisy2.02 publications
-        std::vector<std::string> uris = Utils::recursiveSearchByFilename(fsPath_, "ncc.html");
-        LOG4CXX_INFO(fsNodeLog, "Found " << uris.size() << " matches by file name");
-        for (int i = 0; i < uris.size(); i++)
+        // List the Daisy2.02 and Daisy3 publications in the library index.
+        // The index is kept up to date by the LibraryWatcher, or verified in
+        // the background if the path is not watched. A path that has never
+        // been indexed is scanned first, waiting for a running scan of it.
+        long long start = cq2::monotonicMicroseconds();
+        LibraryIndex *index = LibraryIndex::Instance();
+        std::vector<LibraryIndex::Book> books;
+        bool warm = false;
+        if (Utils::isDir(fsPath_))
         {
-            // create book node
-            LOG4CXX_DEBUG(fsNodeLog, "Creating book node: '" <<  uris[i] << "'");
-            DaisyBookNode* node = new DaisyBookNode(uris[i]);
-            std::string title = node->getBookTitle();
-
-            // invent a name for it
-            ostringstream oss;
-            oss << (i+1);
-            node->name_ = "title_" + oss.str() + "_" + title;
-
-            // add node
-            addNode(node);
-
-            // create a NaviListItem and store it in list for the NaviList signal
-            NaviListItem item(node->uri_, node->name_);
-            navilist_.items.push_back(item);
-
+            warm = index->books(fsPath_, books);
+            if (warm && not LibraryWatcher::Instance()->watching(fsPath_))
+                rescanWorker->post(fsPath_);
+            else if (not warm && index->rescan(fsPath_) >= 0)
+                index->books(fsPath_, books);
         }
 
-        // Recursively search for Daisy3 publications
-        uris = Utils::recursiveSearchByExtension(fsPath_, ".opf");
-        LOG4CXX_INFO(fsNodeLog, "Found " << uris.size() << " matches by file extension");
-        for (int i = 0; i < uris.size(); i++)
-        {
-            // create book node
-            LOG4CXX_DEBUG(fsNodeLog, "Creating book node: '" <<  uris[i] << "'");
-            DaisyBookNode* node = new DaisyBookNode(uris[i]);
-            std::string title = node->getBookTitle();
-
-            // invent a name for it
-            ostringstream oss;
-            oss << (i+1);
-            node->name_ = "title_" + oss.str() + "_" + title;
-
-            // add node
-            addNode(node);
-
-            // create a NaviListItem and store it in list for the NaviList signal
-            NaviListItem item(node->uri_, node->name_);
-            navilist_.items.push_back(item);
+        LOG4CXX_INFO(fsNodeLog, "Found " << books.size() << " publications in " << (cq2::monotonicMicroseconds() - start) / 1000
+                << " ms using a " << (warm ? "warm" : "cold") << " library index");
 
-        }
+        createBookNodes(books);
 
         if (navi.getCurrentChoice() == NULL && numberOfChildren() > 0)
         {
@@ -149,6 +166,10 @@ bool FileSystemNode::onOpen(NaviEngine& navi)
 
         pathUpdated_ = true;
     }
+    else if (pendingRefresh_)
+    {
+        refresh(navi, false);
+    }
 
     currentChild_ = navi.getCurrentChoice();
     announce();
@@ -163,6 +184,101 @@ bool FileSystemNode::onOpen(NaviEngine& navi)
     return true;
 }
 
+// Replace the children with nodes for books
+void FileSystemNode::createBookNodes(const std::vector<LibraryIndex::Book> &books)
+{
+    clearNodes();
+    uris_.clear();
+    pendingRefresh_ = false;
+
+    // build a new list, the previous one may still be shared with listeners
+    boost::shared_ptr<NaviList> navilist(new NaviList);
+
+    int number[] = { 0, 0 };
+    for (int i = 0; i < books.size(); i++)
+    {
+        // create book node, books without a title in the index read it
+        // themselves
+        LOG4CXX_DEBUG(fsNodeLog, "Creating book node: '" <<  books[i].uri << "'");
+        BookTitle bookTitle;
+        bookTitle.title = books[i].title;
+        bookTitle.titleSrc = books[i].titleSrc;
+        bookTitle.found = not books[i].title.empty();
+        DaisyBookNode* node = new DaisyBookNode(books[i].uri, bookTitle);
+        std::string title = node->getBookTitle();
+
+        // invent a name for it, books found by extension are numbered
+        // separately
+        ostringstream oss;
+        oss << ++number[books[i].format];
+        node->name_ = "title_" + oss.str() + "_" + title;
+
+        // add node
+        addNode(node);
+        uris_.push_back(books[i].uri);
+
+        // create a NaviListItem and store it in list for the NaviList signal
+        NaviListItem item(node->uri_, node->name_);
+        navilist->items.push_back(item);
+
+    }
+
+    navilist_ = navilist;
+}
+
+// Rebuild the children from the library index, keeping the selected book
+// selected. The naviengine has no way to remove a single child, but the nodes
+// are built from the index without reading the books.
+void FileSystemNode::refresh(NaviEngine& navi, bool narrate)
+{
+    std::vector<LibraryIndex::Book> books;
+    if (Utils::isDir(fsPath_))
+        LibraryIndex::Instance()->books(fsPath_, books);
+
+    // the position of the selected book
+    int position = -1;
+    AnyNode* current = navi.getCurrentChoice();
+    AnyNode* child = firstChild();
+    for (int i = 0; current != NULL && child != NULL && i < numberOfChildren(); i++, child = child->next_)
+    {
+        if (child == current)
+        {
+            position = i;
+            break;
+        }
+    }
+    std::string selected = position >= 0 && position < uris_.size() ? uris_[position] : "";
+
+    navi.setCurrentChoice(NULL);
+    createBookNodes(books);
+    LOG4CXX_INFO(fsNodeLog, "Refreshed path '" << fsPath_ << "', " << books.size() << " publications");
+
+    // select the same book, or the one in its place if it was removed
+    int selection = std::find(uris_.begin(), uris_.end(), selected) - uris_.begin();
+    bool moved = selection == uris_.size();
+    if (moved)
+        selection = position < 0 ? 0 : std::min(position, (int) uris_.size() - 1);
+
+    AnyNode* choice = firstChild();
+    for (int i = 0; choice != NULL && i < selection; i++)
+        choice = choice->next_;
+    navi.setCurrentChoice(choice);
+    currentChild_ = choice;
+
+    cq2::Command<NaviListPtr> naviList(navilist_);
+    naviList();
+
+    if (narrate && numberOfChildren() == 0)
+        Narrator::Instance()->play(_N("device contains no publications"));
+    else if (narrate && moved)
+        announceSelection();
+    else if (currentChild_ != NULL)
+    {
+        cq2::Command<NaviListItem> naviItem(navilist_->items[selection]);
+        naviItem();
+    }
+}
+
 void FileSystemNode::beforeOnOpen()
 {
     if (not pathUpdated_)
@@ -241,7 +357,7 @@ void FileSystemNode::onNarratorDone()
 
 void FileSystemNode::announce()
 {
-    cq2::Command<NaviList> naviList(navilist_);
+    cq2::Command<NaviListPtr> naviList(navilist_);
     naviList();
 
     int numItems = numberOfChildren();
@@ -283,7 +399,7 @@ void FileSystemNode::announceSelection()
 
         currentChild_->narrateName();
 
-        NaviListItem item = navilist_.items[currentChoice];
+        NaviListItem item = navilist_->items[currentChoice];
         cq2::Command<NaviListItem> naviItem(item);
         naviItem();
     }
@@ -21,10 +21,12 @@
 #define _FILESYSTEM_H
 
 #include "NaviList.h"
+#include "LibraryIndex.h"
 
 #include <Nodes/MenuNode.h>
 
 #include <string>
+#include <vector>
 #include <boost/signals2.hpp>
 
 /**
@@ -52,11 +54,17 @@ public:
     bool onRender();
     void onNarratorDone();
 
+    // Show a change of the library index of a path in the nodes listing it,
+    // called on the clientcore thread
+    static void libraryChanged(naviengine::NaviEngine&, const std::string &path);
+
 private:
-    NaviList navilist_;
+    NaviListPtr navilist_;
     AnyNode* currentChild_;
     bool pathUpdated_;
     bool openFirstChild_;
+    bool pendingRefresh_; // the index changed while another node was current
+    std::vector<std::string> uris_; // of the children, in order
     boost::signals2::connection narratorDoneConnection;
 
     std::string fsName_;
@@ -64,6 +72,8 @@ private:
 
     void announce();
     void announceSelection();
+    void createBookNodes(const std::vector<LibraryIndex::Book> &books);
+    void refresh(naviengine::NaviEngine&, bool narrate);
 };
 
 #endif
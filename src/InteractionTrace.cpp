@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "InteractionTrace.h"
+#include "CommandQueue2/Atomic.h"
+#include "CommandQueue2/Clock.h"
+#include "CommandQueue2/Trace.h"
+#include "CommandQueue2/ScopeLock.h"
+
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <log4cxx/logger.h>
+
+// create logger which will become a child to logger kolibre.clientcore
+log4cxx::LoggerPtr traceLog(log4cxx::Logger::getLogger("kolibre.clientcore.interactiontrace"));
+
+// Number of events kept, older events are overwritten
+#define TRACE_CAPACITY 65536
+
+// Kinds of events
+#define TRACE_BEGIN 'B'
+#define TRACE_POINT 'P'
+#define TRACE_AUDIO 'A'
+
+InteractionTrace * InteractionTrace::pinstance = 0;
+
+InteractionTrace * InteractionTrace::Instance()
+{
+    if (pinstance == 0)
+    {
+        pinstance = new InteractionTrace;
+    }
+
+    return pinstance;
+}
+
+InteractionTrace::InteractionTrace() :
+        enabled(0), lastId(0), next(0), size(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+InteractionTrace::~InteractionTrace()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Enable or disable tracing, the recorded events are kept
+ */
+void InteractionTrace::setEnabled(bool enable)
+{
+    if (enable)
+    {
+        ScopeLock lock(mutex);
+        if (ring.empty())
+            ring.resize(TRACE_CAPACITY);
+    }
+    cq2::atomic::store(&enabled, enable ? 1L : 0L);
+    LOG4CXX_INFO(traceLog, "Interaction tracing " << (enable ? "enabled" : "disabled"));
+}
+
+bool InteractionTrace::isEnabled()
+{
+    return cq2::atomic::load(&enabled) != 0;
+}
+
+/**
+ * Forget the recorded events
+ */
+void InteractionTrace::clear()
+{
+    ScopeLock lock(mutex);
+    next = 0;
+    size = 0;
+}
+
+/**
+ * Start an interaction and make it the current interaction of the calling
+ * thread. Commands sent by the thread carry it to the dispatching thread.
+ *
+ * @param name Name of the interaction, must be a string literal
+ * @return The trace id, 0 if tracing is disabled
+ */
+long InteractionTrace::begin(const char *name)
+{
+    if (not isEnabled())
+        return 0;
+
+    long id;
+    { // LOCK
+        ScopeLock lock(mutex);
+        id = ++lastId;
+    } // UNLOCK
+
+    cq2::setCurrentTraceId(id);
+    record(id, name, TRACE_BEGIN);
+    return id;
+}
+
+/**
+ * Record a trace point for the current interaction of the calling thread
+ *
+ * @param name Name of the trace point, must be a string literal
+ */
+void InteractionTrace::point(const char *name)
+{
+    if (not isEnabled())
+        return;
+
+    long id = cq2::currentTraceId();
+    if (id != 0)
+        record(id, name, TRACE_POINT);
+}
+
+/**
+ * Record that audio was requested or started for the current interaction
+ * of the calling thread. The first audio event ends the latency of the
+ * interaction.
+ *
+ * @param name Name of the trace point, must be a string literal
+ */
+void InteractionTrace::audio(const char *name)
+{
+    if (not isEnabled())
+        return;
+
+    audio(cq2::currentTraceId(), name);
+}
+
+/**
+ * Record that audio started for an interaction, e.g. from a player thread
+ * that does not know the current interaction
+ *
+ * @param id The trace id of the interaction
+ * @param name Name of the trace point, must be a string literal
+ */
+void InteractionTrace::audio(long id, const char *name)
+{
+    if (not isEnabled() || id == 0)
+        return;
+
+    record(id, name, TRACE_AUDIO);
+}
+
+void InteractionTrace::record(long id, const char *name, char kind)
+{
+    Event event;
+    event.id = id;
+    event.name = name;
+    event.time = cq2::monotonicMicroseconds();
+    event.thread = (unsigned long) pthread_self();
+    event.kind = kind;
+
+    ScopeLock lock(mutex);
+    if (ring.empty())
+        return;
+    ring[next] = event;
+    next = (next + 1) % ring.size();
+    if (size < ring.size())
+        size++;
+}
+
+// Copy the recorded events, oldest first
+void InteractionTrace::snapshot(std::vector<Event> &events)
+{
+    ScopeLock lock(mutex);
+    events.clear();
+    events.reserve(size);
+    size_t first = (next + ring.size() - size) % (ring.empty() ? 1 : ring.size());
+    for (size_t i = 0; i < size; i++)
+        events.push_back(ring[(first + i) % ring.size()]);
+}
+
+/**
+ * Get the latency from the start of each interaction until its first audio
+ * event, grouped by the name of the interaction
+ *
+ * @return One entry per interaction name, sorted by name
+ */
+std::vector<InteractionTrace::Latency> InteractionTrace::latencies()
+{
+    std::vector<Event> events;
+    snapshot(events);
+
+    // start of each interaction that has not reached audio yet
+    std::map<long, const Event*> started;
+    std::map<std::string, std::vector<long long> > samples;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const Event &event = events[i];
+        if (event.kind == TRACE_BEGIN)
+        {
+            started[event.id] = &event;
+        }
+        else if (event.kind == TRACE_AUDIO)
+        {
+            std::map<long, const Event*>::iterator it = started.find(event.id);
+            if (it == started.end())
+                continue;
+            samples[it->second->name].push_back(event.time - it->second->time);
+            started.erase(it);
+        }
+    }
+
+    std::vector<Latency> result;
+    std::map<std::string, std::vector<long long> >::iterator it;
+    for (it = samples.begin(); it != samples.end(); ++it)
+    {
+        std::vector<long long> &values = it->second;
+        std::sort(values.begin(), values.end());
+
+        Latency latency;
+        latency.name = it->first;
+        latency.count = values.size();
+        latency.p50 = values[(values.size() - 1) * 50 / 100];
+        latency.p99 = values[(values.size() - 1) * 99 / 100];
+        latency.max = values.back();
+        result.push_back(latency);
+    }
+    return result;
+}
+
+/**
+ * Get the recorded events in the Chrome trace event format, e.g. for
+ * chrome://tracing or Perfetto. Each trace point is an instant event with
+ * the trace id in its arguments, and each interaction that reached audio
+ * is an async span from its start to its first audio.
+ */
+std::string InteractionTrace::chromeTrace()
+{
+    std::vector<Event> events;
+    snapshot(events);
+
+    std::ostringstream json;
+    json << "{\"traceEvents\":[";
+
+    std::map<long, const Event*> started;
+    bool first = true;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const Event &event = events[i];
+        if (not first)
+            json << ",";
+        first = false;
+        json << "\n{\"name\":\"" << event.name << "\",\"cat\":\"interaction\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << event.time
+                << ",\"pid\":1,\"tid\":" << event.thread << ",\"args\":{\"id\":" << event.id << "}}";
+
+        if (event.kind == TRACE_BEGIN)
+        {
+            started[event.id] = &event;
+        }
+        else if (event.kind == TRACE_AUDIO)
+        {
+            std::map<long, const Event*>::iterator it = started.find(event.id);
+            if (it == started.end())
+                continue;
+            const Event &begin = *it->second;
+            json << ",\n{\"name\":\"" << begin.name << "\",\"cat\":\"latency\",\"ph\":\"b\",\"id\":" << begin.id << ",\"ts\":"
+                    << begin.time << ",\"pid\":1,\"tid\":" << begin.thread << "}";
+            json << ",\n{\"name\":\"" << begin.name << "\",\"cat\":\"latency\",\"ph\":\"e\",\"id\":" << begin.id << ",\"ts\":"
+                    << event.time << ",\"pid\":1,\"tid\":" << begin.thread << ",\"args\":{\"audio\":\"" << event.name << "\"}}";
+            started.erase(it);
+        }
+    }
+
+    json << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return json.str();
+}
+
+/**
+ * Write the recorded events to a file in the Chrome trace event format
+ *
+ * @param path The file to write
+ * @return true on success
+ */
+bool InteractionTrace::writeChromeTrace(const std::string &path)
+{
+    std::ofstream file(path.c_str());
+    if (not file)
+    {
+        LOG4CXX_ERROR(traceLog, "Could not open trace file '" << path << "'");
+        return false;
+    }
+
+    file << chromeTrace();
+    return file.good();
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INTERACTIONTRACE_H
+#define _INTERACTIONTRACE_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * InteractionTrace records trace points for user interactions, e.g. from
+ * ClientCore::pushCommand() until the audio for the command starts.
+ * Trace points are correlated by the cq2 trace id, see
+ * CommandQueue2/Trace.h. They are kept in a ring buffer that holds the
+ * most recent events.
+ *
+ * Tracing is disabled by default. A disabled trace point costs one check of
+ * a flag.
+ */
+class InteractionTrace
+{
+public:
+    static InteractionTrace *Instance();
+
+    /**
+     * Latency from the start of an interaction until its first audio
+     */
+    struct Latency
+    {
+        std::string name; /**< Name of the interaction, e.g. "RIGHT" */
+        long count; /**< Number of interactions that reached audio */
+        long long p50; /**< Median latency in microseconds */
+        long long p99; /**< 99th percentile latency in microseconds */
+        long long max; /**< Longest latency in microseconds */
+    };
+
+    void setEnabled(bool enable);
+    bool isEnabled();
+    void clear();
+
+    long begin(const char *name);
+    void point(const char *name);
+    void audio(const char *name);
+    void audio(long id, const char *name);
+
+    std::vector<Latency> latencies();
+    std::string chromeTrace();
+    bool writeChromeTrace(const std::string &path);
+
+private:
+    InteractionTrace();
+    ~InteractionTrace();
+
+    // One trace point, names must be string literals
+    struct Event
+    {
+        long id;
+        const char *name;
+        long long time;
+        unsigned long thread;
+        char kind;
+    };
+
+    void record(long id, const char *name, char kind);
+    void snapshot(std::vector<Event> &events);
+
+    static InteractionTrace *pinstance;
+    pthread_mutex_t mutex;
+    volatile long enabled;
+    long lastId;
+    std::vector<Event> ring;
+    size_t next;
+    size_t size;
+};
+
+#endif
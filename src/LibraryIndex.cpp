@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LibraryIndex.h"
+#include "DirectoryWalker.h"
+#include "TitleExtractor.h"
+#include "CommandQueue2/ScopeLock.h"
+#include "CommandQueue2/Clock.h"
+#include "Settings/Db.h"
+#include "Utils.h"
+
+#include <ctime>
+#include <sys/stat.h>
+#include <log4cxx/logger.h>
+
+// create logger which will become a child to logger kolibre.clientcore
+log4cxx::LoggerPtr libraryIndexLog(log4cxx::Logger::getLogger("kolibre.clientcore.libraryindex"));
+
+namespace
+{
+
+// Names joined by NUL characters, as stored in the database
+std::string joinNames(const std::vector<std::string> &names)
+{
+    std::string joined;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        joined += names[i];
+        joined += '\0';
+    }
+    return joined;
+}
+
+std::vector<std::string> splitNames(const void *data, long size)
+{
+    std::vector<std::string> names;
+    const char *p = static_cast<const char*>(data);
+    for (long start = 0, i = 0; data != NULL && i < size; i++)
+    {
+        if (p[i] == '\0')
+        {
+            names.push_back(std::string(p + start, i - start));
+            start = i + 1;
+        }
+    }
+    return names;
+}
+
+std::string baseName(const std::string &path)
+{
+    return path.substr(path.rfind('/') + 1);
+}
+
+std::string text(settings::DBResult &result, long column)
+{
+    const char *value = result.getText(column);
+    return value == NULL ? "" : value;
+}
+
+bool sameBook(const LibraryIndex::Book &a, const LibraryIndex::Book &b)
+{
+    return a.uri == b.uri && a.title == b.title && a.titleSrc == b.titleSrc && a.format == b.format && a.mtime == b.mtime && a.size == b.size;
+}
+
+}
+
+/**
+ * The directory cache of one rescan. Listings are taken from the index when
+ * the modification time of a directory is unchanged, or without looking at
+ * the directory when an update is limited to other directories. The
+ * directories that are visited make up the new index.
+ */
+class LibraryIndex::Scan: public DirectoryWalker::Cache
+{
+public:
+    Scan(const std::map<std::string, Directory> &previous, const std::set<std::string> *dirty) :
+            read(0), previous_(previous), dirty_(dirty)
+    {
+    }
+
+    bool known(const std::string &dir, DirectoryWalker::Listing &listing)
+    {
+        if (dirty_ == NULL || dirty_->count(dir) > 0)
+            return false;
+        return lookup(dir, -1, listing);
+    }
+
+    bool lookup(const std::string &dir, time_t mtime, DirectoryWalker::Listing &listing)
+    {
+        // a modification time of -1 takes any listing in the index
+        std::map<std::string, Directory>::const_iterator it = previous_.find(dir);
+        if (it == previous_.end() || (mtime != -1 && (it->second.mtime < 0 || it->second.mtime != (long long) mtime)))
+            return false;
+
+        std::string prefix = dir[dir.size() - 1] == '/' ? dir : dir + "/";
+        const Directory &d = it->second;
+        for (size_t i = 0; i < d.subdirs.size(); i++)
+            listing.subdirs.push_back(prefix + d.subdirs[i]);
+        for (size_t i = 0; i < d.files.size(); i++)
+            listing.files.push_back(std::make_pair(prefix + d.files[i].first, d.files[i].second));
+        directories[dir] = d;
+        return true;
+    }
+
+    void store(const std::string &dir, time_t mtime, const DirectoryWalker::Listing &listing)
+    {
+        // a directory changed in the second it was read may change again
+        // without changing its modification time, it is read again next time
+        Directory &d = directories[dir];
+        d.mtime = mtime >= time(NULL) - 1 ? -1 : (long long) mtime;
+        for (size_t i = 0; i < listing.subdirs.size(); i++)
+            d.subdirs.push_back(baseName(listing.subdirs[i]));
+        for (size_t i = 0; i < listing.files.size(); i++)
+            d.files.push_back(std::make_pair(baseName(listing.files[i].first), listing.files[i].second));
+        read++;
+    }
+
+    std::map<std::string, Directory> directories;
+    long read;
+
+private:
+    const std::map<std::string, Directory> &previous_;
+    const std::set<std::string> *dirty_;
+};
+
+LibraryIndex * LibraryIndex::pinstance = 0;
+
+LibraryIndex * LibraryIndex::Instance()
+{
+    if (pinstance == 0)
+    {
+        pinstance = new LibraryIndex(Utils::getDatapath() + "library.db");
+    }
+    return pinstance;
+}
+
+/**
+ * @param database Path of the database file, created if it does not exist
+ */
+LibraryIndex::LibraryIndex(const std::string &database) :
+        database_(database), db(NULL), directoriesRead_(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&rescanMutex, NULL);
+    if (not open())
+        LOG4CXX_ERROR(libraryIndexLog, "Library index '" << database_ << "' not available, books are not remembered between runs");
+}
+
+LibraryIndex::~LibraryIndex()
+{
+    delete db;
+    pthread_mutex_destroy(&rescanMutex);
+    pthread_mutex_destroy(&mutex);
+}
+
+// Open the database and create the tables, called from the constructor
+bool LibraryIndex::open()
+{
+    db = new settings::DB(database_);
+    if (not db->connect())
+    {
+        LOG4CXX_ERROR(libraryIndexLog, "Could not open " << database_ << ": " << db->getLasterror());
+        delete db;
+        db = NULL;
+        return false;
+    }
+
+    long version = -1;
+    settings::DBResult result;
+    if (db->prepare("create table if not exists version (number INT)") && db->perform()
+            && db->prepare("select number from version") && db->perform(&result))
+    {
+        while (result.loadRow())
+            version = result.getInt(0);
+    }
+
+    if (version != LIBRARY_INDEX_VERSION)
+    {
+        LOG4CXX_INFO(libraryIndexLog, "Creating library index version " << LIBRARY_INDEX_VERSION << " in " << database_);
+        const char *statements[] = {
+            "drop table if exists directory",
+            "drop table if exists book",
+            "delete from version",
+            "create table directory (media TEXT, path TEXT, mtime INT, subdirs BLOB, files BLOB, UNIQUE(media, path))",
+            "create table book (media TEXT, uri TEXT, title TEXT, titlesrc TEXT, format INT, mtime INT, size INT, opened INT, UNIQUE(media, uri))",
+            "create index book_uri on book (uri)"
+        };
+        for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++)
+        {
+            if (not db->prepare(statements[i]) || not db->perform())
+            {
+                LOG4CXX_ERROR(libraryIndexLog, "Could not create library index: " << db->getLasterror());
+                delete db;
+                db = NULL;
+                return false;
+            }
+        }
+        db->prepare("insert into version values(?)");
+        db->bind(1, (int) LIBRARY_INDEX_VERSION);
+        db->perform();
+    }
+    return true;
+}
+
+// The state of a media path, loaded from the database the first time,
+// called with the mutex locked
+LibraryIndex::Media &LibraryIndex::media(const std::string &path)
+{
+    Media &m = medias[path];
+    if (not m.loaded)
+    {
+        m.loaded = true;
+        load(path, m);
+    }
+    return m;
+}
+
+void LibraryIndex::load(const std::string &path, Media &m)
+{
+    if (db == NULL)
+        return;
+
+    settings::DBResult dirs;
+    if (db->prepare("select path, mtime, subdirs, files from directory where media=?")
+            && db->bind(1, path.c_str()) && db->perform(&dirs))
+    {
+        while (dirs.loadRow())
+        {
+            Directory &d = m.directories[text(dirs, 0)];
+            d.mtime = dirs.getInt64(1);
+            d.subdirs = splitNames(dirs.getData(2), dirs.getDataSize(2));
+            std::vector<std::string> files = splitNames(dirs.getData(3), dirs.getDataSize(3));
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                if (not files[i].empty())
+                    d.files.push_back(std::make_pair(files[i].substr(1), files[i][0] - '0'));
+            }
+        }
+    }
+
+    settings::DBResult books;
+    if (db->prepare("select uri, title, titlesrc, format, mtime, size, opened from book where media=? order by format, uri")
+            && db->bind(1, path.c_str()) && db->perform(&books))
+    {
+        while (books.loadRow())
+        {
+            Book book;
+            book.uri = text(books, 0);
+            book.title = text(books, 1);
+            book.titleSrc = text(books, 2);
+            book.format = books.getInt(3) == FORMAT_DAISY3 ? FORMAT_DAISY3 : FORMAT_DAISY202;
+            book.mtime = books.getInt64(4);
+            book.size = books.getInt64(5);
+            book.opened = books.getInt64(6);
+            m.books.push_back(book);
+        }
+    }
+
+    m.indexed = not m.directories.empty();
+    LOG4CXX_DEBUG(libraryIndexLog, "Loaded " << m.books.size() << " books and " << m.directories.size() << " directories of " << path);
+}
+
+// Replace the rows of a media path, called with the mutex locked
+bool LibraryIndex::save(const std::string &path, const Media &m)
+{
+    if (db == NULL)
+        return false;
+
+    bool ok = db->prepare("begin") && db->perform();
+    ok = ok && db->prepare("delete from directory where media=?") && db->bind(1, path.c_str()) && db->perform();
+    for (std::map<std::string, Directory>::const_iterator it = m.directories.begin(); ok && it != m.directories.end(); ++it)
+    {
+        std::vector<std::string> files;
+        for (size_t i = 0; i < it->second.files.size(); i++)
+            files.push_back(std::string(1, '0' + it->second.files[i].second) + it->second.files[i].first);
+        std::string subdirs = joinNames(it->second.subdirs);
+        std::string joinedFiles = joinNames(files);
+
+        ok = db->prepare("insert into directory values (?,?,?,?,?)")
+                && db->bind(1, path.c_str()) && db->bind(2, it->first.c_str()) && db->bind(3, it->second.mtime)
+                && db->bind(4, (const void*) subdirs.data(), subdirs.size(), NULL)
+                && db->bind(5, (const void*) joinedFiles.data(), joinedFiles.size(), NULL)
+                && db->perform();
+    }
+
+    ok = ok && db->prepare("delete from book where media=?") && db->bind(1, path.c_str()) && db->perform();
+    for (size_t i = 0; ok && i < m.books.size(); i++)
+    {
+        const Book &book = m.books[i];
+        ok = db->prepare("insert into book values (?,?,?,?,?,?,?,?)")
+                && db->bind(1, path.c_str()) && db->bind(2, book.uri.c_str()) && db->bind(3, book.title.c_str())
+                && db->bind(4, book.titleSrc.c_str()) && db->bind(5, (int) book.format) && db->bind(6, book.mtime)
+                && db->bind(7, book.size) && db->bind(8, book.opened) && db->perform();
+    }
+
+    if (ok)
+        ok = db->prepare("commit") && db->perform();
+    if (not ok)
+    {
+        LOG4CXX_ERROR(libraryIndexLog, "Could not save the library index of " << path << ": " << db->getLasterror());
+        if (db->prepare("rollback"))
+            db->perform();
+    }
+    return ok;
+}
+
+/**
+ * Get the books found on a media path by the last rescan, also in an earlier
+ * run. Does not touch the file system.
+ *
+ * @param media The media path
+ * @param books Receives the books, Daisy 2.02 books first, sorted by uri
+ * @return false if the media path has never been scanned
+ */
+bool LibraryIndex::books(const std::string &media, std::vector<Book> &books)
+{
+    ScopeLock lock(mutex);
+    Media &m = this->media(media);
+    books = m.books;
+    return m.indexed;
+}
+
+/**
+ * Bring the index of a media path up to date. Only directories whose
+ * modification time has changed are read, and titles are only extracted for
+ * new or changed books. Blocks while another rescan is running.
+ *
+ * @param media The media path
+ * @return Number of books found, -1 if the media path is not a directory
+ */
+long LibraryIndex::rescan(const std::string &media)
+{
+    return scan(media, NULL);
+}
+
+/**
+ * Bring the index of a media path up to date after changes in some of its
+ * directories, e.g. reported by a LibraryWatcher. The other directories and
+ * their books are taken from the index without looking at them, new
+ * directories below a changed one are read. Does a rescan if the media path
+ * has never been scanned.
+ *
+ * @param media The media path
+ * @param dirs The directories that changed
+ * @return Number of books found, -1 if the media path is not a directory
+ */
+long LibraryIndex::update(const std::string &media, const std::set<std::string> &dirs)
+{
+    return scan(media, &dirs);
+}
+
+// Rescan, or update the directories in dirty if it is not NULL
+long LibraryIndex::scan(const std::string &media, const std::set<std::string> *dirty)
+{
+    ScopeLock scanLock(rescanMutex);
+
+    struct stat st;
+    if (stat(media.c_str(), &st) != 0 || not S_ISDIR(st.st_mode))
+        return -1;
+
+    long long start = cq2::monotonicMicroseconds();
+    std::map<std::string, Directory> previous;
+    std::vector<Book> previousBooks;
+    bool indexed;
+    { // LOCK
+        ScopeLock lock(mutex);
+        Media &m = this->media(media);
+        previous = m.directories;
+        previousBooks = m.books;
+        indexed = m.indexed;
+    } // UNLOCK
+    if (not indexed)
+        dirty = NULL;
+
+    Scan scan(previous, dirty);
+    DirectoryWalker walker;
+    walker.addFilename("ncc.html"); // FORMAT_DAISY202
+    walker.addExtension(".opf"); // FORMAT_DAISY3
+    walker.setPruning(true);
+    walker.setCache(&scan);
+    std::vector<std::vector<std::string> > found = walker.search(media);
+
+    std::map<std::string, const Book*> known;
+    for (size_t i = 0; i < previousBooks.size(); i++)
+        known[previousBooks[i].uri] = &previousBooks[i];
+
+    // books whose navigation file is unchanged keep their title
+    std::vector<Book> books;
+    std::vector<std::string> uris;
+    std::vector<size_t> extract;
+    for (size_t format = 0; format < found.size(); format++)
+    {
+        for (size_t i = 0; i < found[format].size(); i++)
+        {
+            // books outside the changed directories of an update are taken
+            // as they are
+            const std::string &uri = found[format][i];
+            std::map<std::string, const Book*>::iterator it = known.find(uri);
+            std::string::size_type slash = uri.rfind('/');
+            if (it != known.end() && dirty != NULL && dirty->count(uri.substr(0, slash)) == 0 && dirty->count(uri.substr(0, slash + 1)) == 0)
+            {
+                books.push_back(*it->second);
+                continue;
+            }
+
+            Book book;
+            book.uri = uri;
+            book.format = (Format) format;
+            struct stat file;
+            if (stat(book.uri.c_str(), &file) != 0)
+                continue;
+            book.mtime = file.st_mtime;
+            book.size = file.st_size;
+
+            if (it != known.end())
+                book.opened = it->second->opened;
+            if (it != known.end() && it->second->mtime == book.mtime && it->second->size == book.size)
+            {
+                book.title = it->second->title;
+                book.titleSrc = it->second->titleSrc;
+            }
+            else
+            {
+                extract.push_back(books.size());
+                uris.push_back(book.uri);
+            }
+            books.push_back(book);
+        }
+    }
+
+    std::vector<BookTitle> titles = TitleExtractor::extractAll(uris);
+    for (size_t i = 0; i < extract.size(); i++)
+    {
+        books[extract[i]].title = titles[i].title;
+        books[extract[i]].titleSrc = titles[i].titleSrc;
+    }
+
+    // the revision only changes with the books, changed directories are
+    // saved as well
+    bool booksChanged = not indexed || books.size() != previousBooks.size();
+    for (size_t i = 0; not booksChanged && i < books.size(); i++)
+        booksChanged = not sameBook(books[i], previousBooks[i]);
+    bool changed = booksChanged || not (scan.directories == previous);
+
+    { // LOCK
+        ScopeLock lock(mutex);
+        Media &m = this->media(media);
+        m.directories.swap(scan.directories);
+        m.books.swap(books);
+        m.indexed = true;
+        directoriesRead_ += scan.read;
+        if (booksChanged)
+            m.revision++;
+        if (changed)
+            save(media, m);
+
+        LOG4CXX_INFO(libraryIndexLog, "Rescanned " << media << " in " << (cq2::monotonicMicroseconds() - start) / 1000 << " ms: "
+                << m.books.size() << " books, read " << scan.read << " of " << m.directories.size() << " directories, extracted "
+                << uris.size() << " titles" << (changed ? "" : ", no changes") << (dirty != NULL ? ", updated" : ""));
+        return m.books.size();
+    } // UNLOCK
+}
+
+/**
+ * Get the directories of a media path that were visited by the last rescan,
+ * the directories that may have books below them
+ *
+ * @param media The media path
+ * @param dirs Receives the paths of the directories
+ * @return false if the media path has never been scanned
+ */
+bool LibraryIndex::directories(const std::string &media, std::vector<std::string> &dirs)
+{
+    ScopeLock lock(mutex);
+    Media &m = this->media(media);
+    dirs.clear();
+    for (std::map<std::string, Directory>::const_iterator it = m.directories.begin(); it != m.directories.end(); ++it)
+        dirs.push_back(it->first);
+    return m.indexed;
+}
+
+/**
+ * Number of rescans of a media path that changed its books in this run
+ */
+long LibraryIndex::revision(const std::string &media)
+{
+    ScopeLock lock(mutex);
+    return this->media(media).revision;
+}
+
+/**
+ * Record that a book was opened
+ *
+ * @param uri The path of the navigation file
+ */
+void LibraryIndex::opened(const std::string &uri)
+{
+    ScopeLock lock(mutex);
+    long long now = time(NULL);
+    for (std::map<std::string, Media>::iterator it = medias.begin(); it != medias.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.books.size(); i++)
+        {
+            if (it->second.books[i].uri == uri)
+                it->second.books[i].opened = now;
+        }
+    }
+
+    if (db != NULL && db->prepare("update book set opened=? where uri=?") && db->bind(1, now) && db->bind(2, uri.c_str()))
+        db->perform();
+}
+
+/**
+ * Number of directories read by rescans since the index was created
+ */
+long LibraryIndex::directoriesRead()
+{
+    ScopeLock lock(mutex);
+    return directoriesRead_;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBRARYINDEX_H
+#define _LIBRARYINDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <pthread.h>
+
+// Version of the database schema, tables of other versions are recreated
+#define LIBRARY_INDEX_VERSION 2
+
+namespace settings
+{
+class DB;
+}
+
+/**
+ * LibraryIndex remembers the publications found on each media path between
+ * runs, in library.db next to settings.db.
+ *
+ * A rescan walks the media path with a DirectoryWalker that uses the
+ * directory listings in the index, so only directories whose modification
+ * time has changed are read again. The navigation file of every book is
+ * stat'ed, and titles are only extracted for new or changed books.
+ *
+ * The index is used from the clientcore thread and from a worker thread, it
+ * must be created on the clientcore thread.
+ */
+class LibraryIndex
+{
+public:
+    enum Format
+    {
+        FORMAT_DAISY202, /**< ncc.html */
+        FORMAT_DAISY3 /**< .opf */
+    };
+
+    /**
+     * A publication on a media path
+     */
+    struct Book
+    {
+        Book() : format(FORMAT_DAISY202), mtime(-1), size(-1), opened(0) {}
+        std::string uri; /**< Path of the navigation file */
+        std::string title; /**< Empty if no title could be extracted */
+        std::string titleSrc;
+        Format format;
+        long long mtime; /**< Of the navigation file */
+        long long size; /**< Of the navigation file */
+        long long opened; /**< Time the book was last opened, 0 if never */
+    };
+
+    static LibraryIndex *Instance();
+
+    LibraryIndex(const std::string &database);
+    ~LibraryIndex();
+
+    bool books(const std::string &media, std::vector<Book> &books);
+    long rescan(const std::string &media);
+    long update(const std::string &media, const std::set<std::string> &dirs);
+    bool directories(const std::string &media, std::vector<std::string> &dirs);
+    long revision(const std::string &media);
+    void opened(const std::string &uri);
+    long directoriesRead();
+
+private:
+    struct Directory
+    {
+        Directory() : mtime(-1) {}
+        bool operator==(const Directory &other) const
+        {
+            return mtime == other.mtime && subdirs == other.subdirs && files == other.files;
+        }
+        long long mtime; /**< -1 if the directory must be read again */
+        std::vector<std::string> subdirs; /**< Names */
+        std::vector<std::pair<std::string, int> > files; /**< Names and formats */
+    };
+
+    // Everything known about one media path
+    struct Media
+    {
+        Media() : loaded(false), indexed(false), revision(0) {}
+        bool loaded;
+        bool indexed; /**< Scanned at least once */
+        long revision; /**< Changed by every rescan that finds changed books */
+        std::map<std::string, Directory> directories; /**< By path */
+        std::vector<Book> books; /**< Daisy 2.02 books first, sorted by uri */
+    };
+
+    class Scan;
+    friend class Scan;
+
+    bool open();
+    long scan(const std::string &media, const std::set<std::string> *dirty);
+    Media &media(const std::string &path);
+    void load(const std::string &path, Media &m);
+    bool save(const std::string &path, const Media &m);
+
+    // Not copyable
+    LibraryIndex(const LibraryIndex&);
+    LibraryIndex& operator=(const LibraryIndex&);
+
+    static LibraryIndex *pinstance;
+    std::string database_;
+    settings::DB *db;
+    std::map<std::string, Media> medias;
+    long directoriesRead_;
+    pthread_mutex_t mutex; // protects the members and the database
+    pthread_mutex_t rescanMutex; // one rescan at a time
+};
+
+#endif
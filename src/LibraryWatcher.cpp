@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LibraryWatcher.h"
+#include "LibraryIndex.h"
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/ScopeLock.h"
+#include "CommandQueue2/Clock.h"
+#include "Commands/LibraryCommand.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <log4cxx/logger.h>
+
+// create logger which will become a child to logger kolibre.clientcore
+log4cxx::LoggerPtr libraryWatcherLog(log4cxx::Logger::getLogger("kolibre.clientcore.librarywatcher"));
+
+// Events that change the books found in a directory
+#define LIBRARY_WATCHER_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// Tell the clientcore thread, called on the watcher thread
+static void postLibraryCommand(const std::string &media)
+{
+    LibraryCommand command(media);
+    cq2::Command<LibraryCommand> c(command);
+    c();
+}
+
+LibraryWatcher * LibraryWatcher::pinstance = 0;
+
+LibraryWatcher * LibraryWatcher::Instance()
+{
+    if (pinstance == 0)
+    {
+        pinstance = new LibraryWatcher(LibraryIndex::Instance(), &postLibraryCommand);
+    }
+    return pinstance;
+}
+
+/**
+ * @param index The index to keep up to date
+ * @param changed Called on the watcher thread with a media path whose books have changed
+ */
+LibraryWatcher::LibraryWatcher(LibraryIndex *index, Callback changed) :
+        index(index), changed_(changed), threadStarted(false), debounce_(LIBRARY_WATCHER_DEBOUNCE),
+        maxDelay_(LIBRARY_WATCHER_MAX_DELAY), rescanInterval_(LIBRARY_WATCHER_RESCAN_INTERVAL), maxWatches_(-1), watchCount(0),
+        updateCount(0), stopping(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0)
+        LOG4CXX_WARN(libraryWatcherLog, "inotify not available (" << strerror(errno) << "), media paths are rescanned every "
+                << rescanInterval_ / 1000 << " s");
+
+    if (pipe(wakeupFds) == 0)
+    {
+        fcntl(wakeupFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeupFds[1], F_SETFL, O_NONBLOCK);
+        threadStarted = pthread_create(&thread, NULL, watcherThread, this) == 0;
+    }
+    else
+    {
+        wakeupFds[0] = wakeupFds[1] = -1;
+    }
+
+    if (not threadStarted)
+        LOG4CXX_ERROR(libraryWatcherLog, "Could not start the library watcher, media paths are not watched");
+}
+
+LibraryWatcher::~LibraryWatcher()
+{
+    if (threadStarted)
+    {
+        { // LOCK
+            ScopeLock lock(mutex);
+            stopping = true;
+        } // UNLOCK
+        if (write(wakeupFds[1], "s", 1) < 0)
+            LOG4CXX_WARN(libraryWatcherLog, "Could not wake up the library watcher: " << strerror(errno));
+        pthread_join(thread, NULL);
+    }
+
+    if (wakeupFds[0] >= 0)
+    {
+        close(wakeupFds[0]);
+        close(wakeupFds[1]);
+    }
+    if (inotifyFd >= 0)
+        close(inotifyFd);
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Set how long to wait for a burst of events to end before the index is updated
+ *
+ * @param debounce Milliseconds without events
+ * @param maxDelay Longest time to wait after the first event, in milliseconds
+ */
+void LibraryWatcher::setDebounce(long debounce, long maxDelay)
+{
+    ScopeLock lock(mutex);
+    debounce_ = debounce;
+    maxDelay_ = maxDelay;
+}
+
+/**
+ * Set the time between rescans of media paths that are not watched completely
+ *
+ * @param interval Milliseconds
+ */
+void LibraryWatcher::setRescanInterval(long interval)
+{
+    ScopeLock lock(mutex);
+    rescanInterval_ = interval;
+}
+
+/**
+ * Limit the number of watched directories, below the inotify limit of the
+ * system. Media paths that need more are rescanned periodically.
+ *
+ * @param watches Maximum number of watches, -1 for no limit but the system's
+ */
+void LibraryWatcher::setMaxWatches(long watches)
+{
+    ScopeLock lock(mutex);
+    maxWatches_ = watches;
+}
+
+/**
+ * Start watching a media path. The index is brought up to date with a rescan
+ * on the watcher thread.
+ *
+ * @param media The media path
+ */
+void LibraryWatcher::watch(const std::string &media)
+{
+    { // LOCK
+        ScopeLock lock(mutex);
+        if (not threadStarted || mediaPaths.count(media) > 0)
+            return;
+        mediaPaths.insert(media);
+        requests.push_back(media);
+    } // UNLOCK
+
+    LOG4CXX_INFO(libraryWatcherLog, "Watching media path '" << media << "'");
+    if (write(wakeupFds[1], "w", 1) < 0 && errno != EAGAIN)
+        LOG4CXX_WARN(libraryWatcherLog, "Could not wake up the library watcher: " << strerror(errno));
+}
+
+/**
+ * True if the index of a media path is kept up to date by the watcher
+ */
+bool LibraryWatcher::watching(const std::string &media)
+{
+    ScopeLock lock(mutex);
+    return mediaPaths.count(media) > 0;
+}
+
+/**
+ * False if some directories of a media path could not be watched and the
+ * path is rescanned periodically instead
+ */
+bool LibraryWatcher::complete(const std::string &media)
+{
+    ScopeLock lock(mutex);
+    return mediaPaths.count(media) > 0 && incomplete.count(media) == 0;
+}
+
+/**
+ * Number of watched directories
+ */
+long LibraryWatcher::watches()
+{
+    ScopeLock lock(mutex);
+    return watchCount;
+}
+
+/**
+ * Number of updates and rescans of the index done by the watcher
+ */
+long LibraryWatcher::updates()
+{
+    ScopeLock lock(mutex);
+    return updateCount;
+}
+
+void *LibraryWatcher::watcherThread(void *ctx)
+{
+    static_cast<LibraryWatcher*>(ctx)->run();
+    return NULL;
+}
+
+void LibraryWatcher::run()
+{
+    for (;;)
+    {
+        long long now = cq2::monotonicMicroseconds();
+        long long next = -1;
+        for (std::map<std::string, Media>::iterator it = medias.begin(); it != medias.end(); ++it)
+        {
+            long long due = deadline(it->second);
+            if (due >= 0 && (next < 0 || due < next))
+                next = due;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = wakeupFds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = inotifyFd;
+        fds[1].events = POLLIN;
+        int timeout = next < 0 ? -1 : next > now ? (int) ((next - now + 999) / 1000) : 0;
+        if (poll(fds, inotifyFd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR)
+        {
+            LOG4CXX_ERROR(libraryWatcherLog, "poll failed: " << strerror(errno));
+            return;
+        }
+
+        char buffer[64];
+        while (read(wakeupFds[0], buffer, sizeof(buffer)) > 0)
+        {
+        }
+
+        std::deque<std::string> started;
+        { // LOCK
+            ScopeLock lock(mutex);
+            if (stopping)
+                return;
+            started.swap(requests);
+        } // UNLOCK
+
+        if (inotifyFd >= 0)
+            readEvents();
+        for (size_t i = 0; i < started.size(); i++)
+            start(started[i]);
+
+        now = cq2::monotonicMicroseconds();
+        for (std::map<std::string, Media>::iterator it = medias.begin(); it != medias.end(); ++it)
+        {
+            long long due = deadline(it->second);
+            if (due >= 0 && due <= now)
+                apply(it->first, it->second, now);
+        }
+    }
+}
+
+// Time of the next update or rescan of a media path, -1 if none is due
+long long LibraryWatcher::deadline(const Media &m)
+{
+    ScopeLock lock(mutex);
+    long long due = -1;
+    if (m.rescan || not m.dirty.empty())
+    {
+        due = m.lastEvent + debounce_ * 1000LL;
+        if (m.firstEvent + maxDelay_ * 1000LL < due)
+            due = m.firstEvent + maxDelay_ * 1000LL;
+    }
+    if (not m.complete)
+    {
+        long long rescan = m.lastRescan + rescanInterval_ * 1000LL;
+        if (due < 0 || rescan < due)
+            due = rescan;
+    }
+    return due;
+}
+
+// Watch the directories in the index and rescan the media path
+void LibraryWatcher::start(const std::string &media)
+{
+    Media &m = medias[media];
+    m.complete = inotifyFd >= 0;
+
+    // the directories of the last run are watched before the rescan, so that
+    // no changes are missed while it runs
+    long revision = index->revision(media);
+    sync(media, m, false);
+    index->rescan(media);
+    sync(media, m, false);
+    m.lastRescan = cq2::monotonicMicroseconds();
+
+    if (index->revision(media) != revision && not changed_.empty())
+        changed_(media);
+}
+
+// Read the queued inotify events
+void LibraryWatcher::readEvents()
+{
+    char buffer[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    long long now = cq2::monotonicMicroseconds();
+    for (;;)
+    {
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0)
+            break;
+
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len)
+        {
+            const struct inotify_event *event = (const struct inotify_event*) p;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                LOG4CXX_WARN(libraryWatcherLog, "inotify events were lost, rescanning all media paths");
+                for (std::map<std::string, Media>::iterator it = medias.begin(); it != medias.end(); ++it)
+                {
+                    it->second.rescan = true;
+                    changed(it->second, now);
+                }
+                continue;
+            }
+
+            std::map<int, Watch>::iterator it = paths.find(event->wd);
+            if (it == paths.end())
+                continue;
+
+            Media &m = medias[it->second.media];
+            if (event->mask & IN_IGNORED)
+            {
+                // the directory was removed or unmounted, its parent has an
+                // event of its own
+                unwatch(event->wd);
+                continue;
+            }
+            if (event->mask & IN_UNMOUNT)
+                m.rescan = true;
+            else
+                m.dirty.insert(it->second.dir);
+            changed(m, now);
+        }
+    }
+}
+
+// Note an event of a media path, the first event starts a burst
+void LibraryWatcher::changed(Media &m, long long now)
+{
+    if (m.firstEvent == 0)
+        m.firstEvent = now;
+    m.lastEvent = now;
+}
+
+// Update the index with the pending changes of a media path
+void LibraryWatcher::apply(const std::string &media, Media &m, long long now)
+{
+    std::set<std::string> dirty;
+    dirty.swap(m.dirty);
+    bool rescan;
+    { // LOCK
+        ScopeLock lock(mutex);
+        rescan = m.rescan || (not m.complete && now >= m.lastRescan + rescanInterval_ * 1000LL);
+    } // UNLOCK
+    m.rescan = false;
+    m.firstEvent = m.lastEvent = 0;
+
+    long revision = index->revision(media);
+    if (rescan)
+    {
+        // try to watch every directory again, the limit may have been raised
+        m.complete = inotifyFd >= 0;
+        index->rescan(media);
+        m.lastRescan = cq2::monotonicMicroseconds();
+    }
+    else
+    {
+        LOG4CXX_DEBUG(libraryWatcherLog, "Updating " << dirty.size() << " changed directories of " << media);
+        index->update(media, dirty);
+    }
+
+    // directories found by the update are read again once they are watched,
+    // books may have been added to them before that
+    sync(media, m, not rescan);
+
+    { // LOCK
+        ScopeLock lock(mutex);
+        updateCount++;
+    } // UNLOCK
+
+    if (index->revision(media) != revision && not changed_.empty())
+        changed_(media);
+}
+
+// Watch the directories of a media path that are in the index and stop
+// watching the others
+void LibraryWatcher::sync(const std::string &media, Media &m, bool markNew)
+{
+    std::vector<std::string> dirs;
+    index->directories(media, dirs);
+    std::set<std::string> indexed(dirs.begin(), dirs.end());
+
+    std::vector<int> removed;
+    for (std::map<int, Watch>::iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        if (it->second.media == media && indexed.count(it->second.dir) == 0)
+            removed.push_back(it->first);
+    }
+    for (size_t i = 0; i < removed.size(); i++)
+    {
+        inotify_rm_watch(inotifyFd, removed[i]);
+        unwatch(removed[i]);
+    }
+
+    long maxWatches;
+    { // LOCK
+        ScopeLock lock(mutex);
+        maxWatches = maxWatches_;
+    } // UNLOCK
+
+    long long now = cq2::monotonicMicroseconds();
+    for (size_t i = 0; i < dirs.size() && m.complete; i++)
+    {
+        if (m.watched.count(dirs[i]) > 0)
+            continue;
+
+        if (maxWatches >= 0 && (long) paths.size() >= maxWatches)
+        {
+            m.complete = false;
+            break;
+        }
+
+        int wd = inotify_add_watch(inotifyFd, dirs[i].c_str(), LIBRARY_WATCHER_EVENTS);
+        if (wd < 0)
+        {
+            // a directory may have been removed since the update
+            if (errno == ENOSPC)
+                m.complete = false;
+            continue;
+        }
+
+        // a directory that was moved keeps its watch
+        if (paths.count(wd) > 0)
+            unwatch(wd);
+        paths[wd].media = media;
+        paths[wd].dir = dirs[i];
+        m.watched.insert(dirs[i]);
+        if (markNew)
+        {
+            m.dirty.insert(dirs[i]);
+            changed(m, now);
+        }
+    }
+
+    if (inotifyFd < 0)
+        m.complete = false;
+
+    ScopeLock lock(mutex);
+    bool wasComplete = incomplete.count(media) == 0;
+    if (m.complete)
+        incomplete.erase(media);
+    else
+        incomplete.insert(media);
+    watchCount = paths.size();
+
+    if (wasComplete && not m.complete)
+        LOG4CXX_WARN(libraryWatcherLog, "Could not watch all directories of " << media << ", watching " << m.watched.size() << " of "
+                << dirs.size() << " and rescanning every " << rescanInterval_ / 1000 << " s");
+}
+
+// Forget a watch, called when inotify has removed it or after removing it
+void LibraryWatcher::unwatch(int wd)
+{
+    std::map<int, Watch>::iterator it = paths.find(wd);
+    if (it == paths.end())
+        return;
+    medias[it->second.media].watched.erase(it->second.dir);
+    paths.erase(it);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBRARYWATCHER_H
+#define _LIBRARYWATCHER_H
+
+#include <string>
+#include <set>
+#include <map>
+#include <deque>
+#include <pthread.h>
+#include <boost/function.hpp>
+
+// Milliseconds without events before the index of a media path is updated
+#define LIBRARY_WATCHER_DEBOUNCE 2000
+
+// Longest time in milliseconds an update waits for a burst of events to end
+#define LIBRARY_WATCHER_MAX_DELAY 10000
+
+// Milliseconds between rescans of media paths that are not watched completely
+#define LIBRARY_WATCHER_RESCAN_INTERVAL 300000
+
+class LibraryIndex;
+
+/**
+ * LibraryWatcher keeps the LibraryIndex of the file system paths up to date
+ * while they are mounted, so that new books show up without rescanning the
+ * whole media.
+ *
+ * The directories in the index of a media path are watched with inotify.
+ * Events mark their directory as changed, and when no events have arrived
+ * for a while the index is updated by reading only the changed directories.
+ * Directories found by an update are watched as well. A media path is
+ * rescanned instead when events were lost, and periodically when its
+ * directories could not all be watched, e.g. when the inotify watch limit
+ * has been reached.
+ *
+ * The callback is called on the watcher thread when the books of a media
+ * path have changed.
+ */
+class LibraryWatcher
+{
+public:
+    typedef boost::function<void(const std::string&)> Callback;
+
+    static LibraryWatcher *Instance();
+
+    LibraryWatcher(LibraryIndex *index, Callback changed);
+    ~LibraryWatcher();
+
+    void setDebounce(long debounce, long maxDelay);
+    void setRescanInterval(long interval);
+    void setMaxWatches(long watches);
+
+    void watch(const std::string &media);
+    bool watching(const std::string &media);
+    bool complete(const std::string &media);
+    long watches();
+    long updates();
+
+private:
+    // State of a watched media path, used on the watcher thread
+    struct Media
+    {
+        Media() : complete(false), rescan(false), firstEvent(0), lastEvent(0), lastRescan(0) {}
+        bool complete; /**< Every directory in the index is watched */
+        bool rescan; /**< Events were lost */
+        std::set<std::string> dirty; /**< Directories with events */
+        std::set<std::string> watched;
+        long long firstEvent; /**< Of the pending changes, cq2 clock */
+        long long lastEvent;
+        long long lastRescan;
+    };
+
+    struct Watch
+    {
+        std::string media;
+        std::string dir;
+    };
+
+    static void *watcherThread(void *ctx);
+    void run();
+    void start(const std::string &media);
+    void readEvents();
+    void changed(Media &m, long long now);
+    void apply(const std::string &media, Media &m, long long now);
+    void sync(const std::string &media, Media &m, bool markNew);
+    void unwatch(int wd);
+    long long deadline(const Media &m);
+
+    // Not copyable
+    LibraryWatcher(const LibraryWatcher&);
+    LibraryWatcher& operator=(const LibraryWatcher&);
+
+    static LibraryWatcher *pinstance;
+    LibraryIndex *index;
+    Callback changed_;
+    int inotifyFd; // -1 if inotify is not available
+    int wakeupFds[2];
+    pthread_t thread;
+    bool threadStarted;
+
+    // set on other threads, protected by the mutex
+    pthread_mutex_t mutex;
+    std::deque<std::string> requests;
+    std::set<std::string> mediaPaths;
+    std::set<std::string> incomplete;
+    long debounce_;
+    long maxDelay_;
+    long rescanInterval_;
+    long maxWatches_;
+    long watchCount;
+    long updateCount;
+    bool stopping;
+
+    // used on the watcher thread only
+    std::map<std::string, Media> medias;
+    std::map<int, Watch> paths;
+};
+
+#endif
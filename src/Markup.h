@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MARKUP_H
+#define _MARKUP_H
+
+#include <string>
+#include <cctype>
+#include <cstdlib>
+
+/**
+ * Helpers for reading the navigation and SMIL files of a book as text,
+ * without building a document tree. Used where only a few tags are needed,
+ * see TitleExtractor and PositionScanner.
+ */
+class Markup
+{
+public:
+    /**
+     * ASCII lower case, tag and attribute names of NCC files may be upper
+     * case
+     */
+    static std::string toLower(std::string s)
+    {
+        for (size_t i = 0; i < s.size(); i++)
+            if (s[i] >= 'A' && s[i] <= 'Z')
+                s[i] += 'a' - 'A';
+        return s;
+    }
+
+    /**
+     * Value of the attribute name in tag, empty if the tag does not have it
+     */
+    static std::string attribute(const std::string &tag, const std::string &name)
+    {
+        std::string lowerTag = toLower(tag);
+        size_t pos = 0;
+        while ((pos = lowerTag.find(name, pos)) != std::string::npos)
+        {
+            size_t after = pos + name.size();
+            bool startsName = pos > 0 && isspace((unsigned char) lowerTag[pos - 1]);
+            pos = after;
+            if (not startsName)
+                continue;
+
+            while (after < tag.size() && isspace((unsigned char) tag[after]))
+                after++;
+            if (after >= tag.size() || tag[after] != '=')
+                continue;
+            after++;
+            while (after < tag.size() && isspace((unsigned char) tag[after]))
+                after++;
+            if (after >= tag.size())
+                break;
+
+            char quote = tag[after];
+            if (quote != '"' && quote != '\'')
+            {
+                size_t end = tag.find_first_of(" \t\r\n/>", after);
+                return tag.substr(after, end - after);
+            }
+            size_t end = tag.find(quote, after + 1);
+            if (end == std::string::npos)
+                break;
+            return tag.substr(after + 1, end - after - 1);
+        }
+        return "";
+    }
+
+    /**
+     * Path of a file referred to by href from the file at base, without the
+     * fragment
+     */
+    static std::string resolve(const std::string &base, std::string href)
+    {
+        size_t fragment = href.find('#');
+        if (fragment != std::string::npos)
+            href.erase(fragment);
+
+        // decode %XX escapes
+        std::string path;
+        for (size_t i = 0; i < href.size(); i++)
+        {
+            if (href[i] == '%' && i + 2 < href.size() && isxdigit((unsigned char) href[i + 1]) && isxdigit((unsigned char) href[i + 2]))
+            {
+                path += (char) strtol(href.substr(i + 1, 2).c_str(), NULL, 16);
+                i += 2;
+            }
+            else
+                path += href[i];
+        }
+
+        if (path.empty() || path[0] == '/')
+            return path;
+        size_t slash = base.rfind('/');
+        if (slash == std::string::npos)
+            return path;
+        return base.substr(0, slash + 1) + path;
+    }
+};
+
+#endif
@@ -164,17 +164,17 @@ bool GotoPageNode::onNarrate()
 
 void GotoPageNode::render()
 {
-    NaviList list;
-    list.name_ = name_;
-    list.info_ = info_;
+    boost::shared_ptr<NaviList> list(new NaviList);
+    list->name_ = name_;
+    list->info_ = info_;
 
     for (int i = 0; i < children.size(); i++)
     {
         NaviListItem item(children[i].uri_, children[i].name_);
-        list.items.push_back(item);
+        list->items.push_back(item);
     }
 
-    cq2::Command<NaviList> naviList(list);
+    cq2::Command<NaviListPtr> naviList(list);
     naviList();
 }
 
@@ -298,18 +298,18 @@ void GotoTimeNode::render()
         unit = _(mapNarrations[NARRATE_SECONDS].c_str());
         break;
     }
-    NaviList list;
-    list.name_ = name_ + " : " + specify + " " + unit;
-    list.info_ = info_;
+    boost::shared_ptr<NaviList> list(new NaviList);
+    list->name_ = name_ + " : " + specify + " " + unit;
+    list->info_ = info_;
     time.clear();
     for (int i = 0; i < levelMax; i++)
     {
         time[i] = i;
         NaviListItem_GotoTimeNode item(time.find(i), iCurrentSelectedHours, iCurrentSelectedMinutes, iCurrentSelectedSeconds, iTimeUnit);
-        list.items.push_back(item);
+        list->items.push_back(item);
     }
 
-    cq2::Command<NaviList> naviList(list);
+    cq2::Command<NaviListPtr> naviList(list);
     naviList();
 }
 
@@ -175,21 +175,21 @@ bool TempoNode::onNarrate()
 
 void TempoNode::render()
 {
-    NaviList list;
-    list.name_ = name_;
-    list.info_ = info_;
+    boost::shared_ptr<NaviList> list(new NaviList);
+    list->name_ = name_;
+    list->info_ = info_;
 
     for (int i = 0; i < children.size(); i++)
     {
         NaviListItem item(children[i].uri_, children[i].name_);
-        list.items.push_back(item);
+        list->items.push_back(item);
     }
 
-    cq2::Command<NaviList> naviList(list);
+    cq2::Command<NaviListPtr> naviList(list);
     naviList();
 
     Narrator::Instance()->play(name_.c_str());
-    Narrator::Instance()->setParameter("2", list.items.size());
+    Narrator::Instance()->setParameter("2", list->items.size());
     Narrator::Instance()->play(_N("contains {2} options"));
 
     Narrator::Instance()->playShortpause();
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NARRATORCOMPLETION_H
+#define _NARRATORCOMPLETION_H
+
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Clock.h"
+#include "CommandQueue2/ScopeLock.h"
+
+#include <pthread.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/signals2.hpp>
+
+// Time in milliseconds after which narration is taken to be done if the
+// narrator never reports that it has finished, e.g. when nothing was queued
+#define NARRATOR_COMPLETION_TIMEOUT 10000
+
+/**
+ * NarratorCompletion is a handle for narration that has just been queued,
+ * e.g. with Narrator::play(). It is done when the narrator signals that it
+ * has finished speaking, see Narrator::connectAudioFinished(). If the signal
+ * never comes the handle gives up after a timeout.
+ *
+ * The caller either blocks with wait() or lets the dispatching thread send a
+ * command when the narration is done with whenDone(). This replaces fixed
+ * delays followed by a loop on Narrator::isSpeaking().
+ *
+ * Copies of a handle share its state, it stops listening to the narrator
+ * when the last copy is destroyed.
+ */
+class NarratorCompletion
+{
+public:
+    /**
+     * Create a handle for narration queued just before this call
+     *
+     * @param narrator The narrator, normally Narrator::Instance(), or any
+     * object with a compatible connectAudioFinished()
+     */
+    template<typename NarratorT>
+    explicit NarratorCompletion(NarratorT *narrator) :
+            state_(new State)
+    {
+        boost::weak_ptr<State> weak(state_);
+        state_->connection = narrator->connectAudioFinished(boost::bind(&NarratorCompletion::audioFinished, weak));
+    }
+
+    /**
+     * Check without blocking if the narration is done
+     */
+    bool done() const
+    {
+        ScopeLock lock(state_->mutex);
+        return state_->finished;
+    }
+
+    /**
+     * Block until the narration is done
+     *
+     * @param timeout Maximum time to wait in milliseconds on the monotonic
+     * clock, a negative value waits forever
+     * @return true if the narration is done, false on timeout
+     */
+    bool wait(long timeout = NARRATOR_COMPLETION_TIMEOUT)
+    {
+        long long deadline = cq2::monotonicMicroseconds() + timeout * 1000LL;
+        ScopeLock lock(state_->mutex);
+        while (not state_->finished)
+        {
+            if (timeout < 0)
+            {
+                pthread_cond_wait(&state_->cond, &state_->mutex);
+                continue;
+            }
+
+            if (cq2::monotonicMicroseconds() >= deadline)
+                return false;
+            struct timespec ts = cq2::monotonicTimespec(deadline);
+            pthread_cond_timedwait(&state_->cond, &state_->mutex, &ts);
+        }
+        return true;
+    }
+
+    /**
+     * Send a command from the dispatching thread when the narration is done,
+     * without blocking. Must be called on the dispatching thread.
+     *
+     * @param command The command to send
+     * @param timeout Send the command anyway after this many milliseconds, a negative value waits forever
+     */
+    template<typename DataT>
+    void whenDone(const cq2::Command<DataT>& command, long timeout = NARRATOR_COMPLETION_TIMEOUT);
+
+private:
+    struct Pending;
+    struct Check;
+    class CheckHandler;
+
+    // Shared by the copies of a handle, finished is set on the narrator thread
+    struct State
+    {
+        State() :
+                finished(false)
+        {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&cond, &attr);
+            pthread_condattr_destroy(&attr);
+        }
+
+        ~State()
+        {
+            connection.disconnect();
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool finished;
+        boost::signals2::connection connection;
+        boost::function<void()> onFinished; // set by whenDone()
+    };
+
+    // Slot for the audio finished signal, called on the narrator thread
+    static void audioFinished(boost::weak_ptr<State> weak)
+    {
+        boost::shared_ptr<State> state = weak.lock();
+        if (not state)
+            return;
+
+        boost::function<void()> onFinished;
+        {
+            ScopeLock lock(state->mutex);
+            if (state->finished)
+                return;
+            state->finished = true;
+            onFinished.swap(state->onFinished);
+            pthread_cond_broadcast(&state->cond);
+        }
+        state->connection.disconnect();
+        if (onFinished)
+            onFinished();
+    }
+
+    boost::shared_ptr<State> state_;
+};
+
+// State of a whenDone() request, shared with the timeout timer and the commands
+struct NarratorCompletion::Pending
+{
+    Pending(const NarratorCompletion& c) :
+            completion(c), timer(0), sent(false)
+    {
+    }
+    NarratorCompletion completion;
+    boost::shared_ptr<cq2::IScheduled> command;
+    cq2::TimerId timer;
+    bool sent;
+};
+
+struct NarratorCompletion::Check
+{
+    Check() {}
+    Check(boost::shared_ptr<Pending> p) : pending(p) {}
+    boost::shared_ptr<Pending> pending;
+};
+
+// Sends the command of a whenDone() request on the dispatching thread, when
+// the narrator has finished or the timeout timer has fired, whichever is first
+class NarratorCompletion::CheckHandler: public cq2::Handler<Check>
+{
+public:
+    static CheckHandler& instance()
+    {
+        static CheckHandler inst;
+        return inst;
+    }
+
+    static void post(boost::shared_ptr<Pending> pending)
+    {
+        cq2::Command<Check> check = Check(pending);
+        check();
+    }
+
+private:
+    CheckHandler()
+    {
+        listen();
+    }
+
+    void handle(Check check)
+    {
+        Pending* pending = check.pending.get();
+        if (pending == NULL || pending->sent)
+            return;
+
+        pending->sent = true;
+        {
+            // the narrator no longer needs to post a check
+            State* state = pending->completion.state_.get();
+            ScopeLock lock(state->mutex);
+            state->onFinished.clear();
+        }
+        if (pending->timer != 0)
+            cq2::Dispatcher::instance().cancel(pending->timer);
+        pending->command->send();
+    }
+};
+
+template<typename DataT>
+void NarratorCompletion::whenDone(const cq2::Command<DataT>& command, long timeout)
+{
+    boost::shared_ptr<Pending> pending(new Pending(*this));
+    pending->command.reset(new cq2::ScheduledCommand<DataT>(command));
+
+    CheckHandler::instance();
+    if (timeout >= 0)
+        pending->timer = cq2::Dispatcher::instance().schedule(cq2::Command<Check>(Check(pending)), timeout);
+
+    bool finished;
+    {
+        ScopeLock lock(state_->mutex);
+        finished = state_->finished;
+        if (not finished)
+            state_->onFinished = boost::bind(&CheckHandler::post, pending);
+    }
+    if (finished)
+        CheckHandler::post(pending);
+}
+
+#endif
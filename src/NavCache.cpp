@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "NavCache.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <log4cxx/logger.h>
+
+// create logger which will become a child to logger kolibre.clientcore
+log4cxx::LoggerPtr navCacheLog(log4cxx::Logger::getLogger("kolibre.clientcore.navcache"));
+
+// First bytes of a cache file
+static const char NAV_CACHE_MAGIC[4] = { 'K', 'N', 'A', 'V' };
+static const char NAV_CACHE_SUFFIX[] = ".nav";
+
+/*
+ * File layout, integers in host byte order:
+ *
+ *   magic        4 bytes, "KNAV"
+ *   version      uint32
+ *   mtime        int64, of the navigation file
+ *   size         int64, of the navigation file
+ *   uri          string
+ *   title        string
+ *   totalms      int64
+ *   sections     uint32 count, then per section: ref, text, playOrder, level
+ *   pages        uint32 count, then per page: ref, text, playOrder, level
+ *   times        uint32 count, then per time: int64 startms, int64 smilms,
+ *                int32 section, int32 page, ref
+ *
+ * A string is a uint32 length followed by the bytes, playOrder and level
+ * are int32.
+ */
+
+namespace
+{
+
+// Appends the fields of a cache file to a buffer
+class Writer
+{
+public:
+    void bytes(const void *data, size_t length)
+    {
+        buffer.append(static_cast<const char *>(data), length);
+    }
+
+    void u32(uint32_t value)
+    {
+        bytes(&value, sizeof(value));
+    }
+
+    void i32(int32_t value)
+    {
+        bytes(&value, sizeof(value));
+    }
+
+    void i64(int64_t value)
+    {
+        bytes(&value, sizeof(value));
+    }
+
+    void str(const std::string &value)
+    {
+        u32(value.size());
+        bytes(value.data(), value.size());
+    }
+
+    void points(const std::vector<NavModel::Point> &points)
+    {
+        u32(points.size());
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            str(points[i].ref);
+            str(points[i].text);
+            i32(points[i].playOrder);
+            i32(points[i].level);
+        }
+    }
+
+    void times(const std::vector<NavModel::Time> &times)
+    {
+        u32(times.size());
+        for (size_t i = 0; i < times.size(); i++)
+        {
+            i64(times[i].startms);
+            i64(times[i].smilms);
+            i32(times[i].section);
+            i32(times[i].page);
+            str(times[i].ref);
+        }
+    }
+
+    std::string buffer;
+};
+
+// Reads the fields of a mapped cache file, every read is checked against the end
+class Reader
+{
+public:
+    Reader(const char *data, size_t length) : pos(data), end(data + length), ok(true) {}
+
+    bool bytes(void *out, size_t length)
+    {
+        if (not ok || (size_t) (end - pos) < length)
+            return ok = false;
+        memcpy(out, pos, length);
+        pos += length;
+        return true;
+    }
+
+    uint32_t u32()
+    {
+        uint32_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    int32_t i32()
+    {
+        int32_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    int64_t i64()
+    {
+        int64_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    std::string str()
+    {
+        uint32_t length = u32();
+        if (not ok || (size_t) (end - pos) < length)
+        {
+            ok = false;
+            return "";
+        }
+        std::string value(pos, length);
+        pos += length;
+        return value;
+    }
+
+    bool points(std::vector<NavModel::Point> &points)
+    {
+        uint32_t count = u32();
+        // every point takes at least 16 bytes, reject counts that cannot fit
+        if (not ok || count > (size_t) (end - pos) / 16)
+            return ok = false;
+
+        points.resize(count);
+        for (uint32_t i = 0; i < count && ok; i++)
+        {
+            points[i].ref = str();
+            points[i].text = str();
+            points[i].playOrder = i32();
+            points[i].level = i32();
+        }
+        return ok;
+    }
+
+    bool times(std::vector<NavModel::Time> &times)
+    {
+        uint32_t count = u32();
+        // every time takes at least 28 bytes, reject counts that cannot fit
+        if (not ok || count > (size_t) (end - pos) / 28)
+            return ok = false;
+
+        times.resize(count);
+        for (uint32_t i = 0; i < count && ok; i++)
+        {
+            times[i].startms = (long) i64();
+            times[i].smilms = (long) i64();
+            times[i].section = i32();
+            times[i].page = i32();
+            times[i].ref = str();
+        }
+        return ok;
+    }
+
+    const char *pos;
+    const char *end;
+    bool ok;
+};
+
+// FNV-1a, names the cache file of a uri
+uint64_t hashUri(const std::string &uri)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < uri.size(); i++)
+    {
+        hash ^= (unsigned char) uri[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+}
+
+NavCache * NavCache::pinstance = 0;
+
+NavCache * NavCache::Instance()
+{
+    if (pinstance == 0)
+    {
+        pinstance = new NavCache(Utils::getDatapath() + "navcache");
+    }
+
+    return pinstance;
+}
+
+/**
+ * @param directory Directory of the cache files, created when the first entry is stored
+ * @param maxEntries Number of books kept
+ */
+NavCache::NavCache(const std::string &directory, size_t maxEntries) :
+        directory_(directory), maxEntries_(maxEntries > 0 ? maxEntries : 1)
+{
+}
+
+std::string NavCache::directory() const
+{
+    return directory_;
+}
+
+/**
+ * The path of the cache file for a navigation file
+ */
+std::string NavCache::fileFor(const std::string &uri) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) hashUri(uri));
+    return directory_ + PATH_SEPARATOR_STR + name + NAV_CACHE_SUFFIX;
+}
+
+// The modification time and size of a local navigation file, false for remote uris
+bool NavCache::sourceStamp(const std::string &uri, long long &mtime, long long &size)
+{
+    std::string path = uri;
+    if (path.compare(0, 7, "file://") == 0)
+        path.erase(0, 7);
+    else if (path.find("://") != std::string::npos)
+        return false;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+
+    mtime = st.st_mtime;
+    size = st.st_size;
+    return true;
+}
+
+/**
+ * Load the navigation model of a book
+ *
+ * @param uri The uri of the navigation file, as given to DaisyHandler::openBook
+ * @param model Set to the cached model
+ * @return false if the book is not cached or its navigation file has changed
+ */
+bool NavCache::load(const std::string &uri, NavModel &model)
+{
+    long long mtime, size;
+    if (not sourceStamp(uri, mtime, size))
+        return false;
+
+    std::string file = fileFor(uri);
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    Reader in(static_cast<const char *>(map), st.st_size);
+    char magic[sizeof(NAV_CACHE_MAGIC)];
+    bool valid = in.bytes(magic, sizeof(magic)) && memcmp(magic, NAV_CACHE_MAGIC, sizeof(magic)) == 0;
+    valid = valid && in.u32() == NAV_CACHE_VERSION;
+    valid = valid && in.i64() == mtime && in.i64() == size;
+    valid = valid && in.str() == uri;
+
+    NavModel result;
+    if (valid)
+    {
+        result.title = in.str();
+        result.totalms = (long) in.i64();
+        valid = in.points(result.sections) && in.points(result.pages) && in.times(result.times) && in.pos == in.end;
+    }
+    munmap(map, st.st_size);
+
+    if (not valid)
+    {
+        LOG4CXX_DEBUG(navCacheLog, "Cache entry for '" << uri << "' is stale or invalid");
+        unlink(file.c_str());
+        return false;
+    }
+
+    // mark the entry as recently used
+    utime(file.c_str(), NULL);
+
+    model = result;
+    return true;
+}
+
+/**
+ * Store the navigation model of a book
+ *
+ * @param uri The uri of the navigation file
+ * @param model The model read from the navigation file
+ * @return false if the book cannot be cached, e.g. because it is remote
+ */
+bool NavCache::store(const std::string &uri, const NavModel &model)
+{
+    long long mtime, size;
+    if (not sourceStamp(uri, mtime, size))
+        return false;
+
+    mkdir(directory_.c_str(), 0755);
+
+    Writer out;
+    out.bytes(NAV_CACHE_MAGIC, sizeof(NAV_CACHE_MAGIC));
+    out.u32(NAV_CACHE_VERSION);
+    out.i64(mtime);
+    out.i64(size);
+    out.str(uri);
+    out.str(model.title);
+    out.i64(model.totalms);
+    out.points(model.sections);
+    out.points(model.pages);
+    out.times(model.times);
+
+    std::string file = fileFor(uri);
+    std::ostringstream tmp;
+    tmp << file << ".tmp" << getpid();
+
+    int fd = open(tmp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        LOG4CXX_WARN(navCacheLog, "Failed to create cache file " << tmp.str());
+        return false;
+    }
+
+    const char *data = out.buffer.data();
+    size_t left = out.buffer.size();
+    while (left > 0)
+    {
+        ssize_t written = write(fd, data, left);
+        if (written <= 0)
+            break;
+        data += written;
+        left -= written;
+    }
+    close(fd);
+
+    if (left > 0 || rename(tmp.str().c_str(), file.c_str()) != 0)
+    {
+        LOG4CXX_WARN(navCacheLog, "Failed to write cache file " << file);
+        unlink(tmp.str().c_str());
+        return false;
+    }
+
+    LOG4CXX_DEBUG(navCacheLog, "Cached " << model.sections.size() << " sections and " << model.pages.size() << " pages of '" << uri << "'");
+    prune();
+    return true;
+}
+
+/**
+ * Forget the cached model of a book
+ */
+void NavCache::remove(const std::string &uri)
+{
+    unlink(fileFor(uri).c_str());
+}
+
+// Remove the least recently used entries above the maximum
+void NavCache::prune()
+{
+    DIR *dir = opendir(directory_.c_str());
+    if (dir == NULL)
+        return;
+
+    std::vector<std::pair<time_t, std::string> > entries;
+    const size_t suffixLength = strlen(NAV_CACHE_SUFFIX);
+    while (struct dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.size() <= suffixLength || name.compare(name.size() - suffixLength, suffixLength, NAV_CACHE_SUFFIX) != 0)
+            continue;
+
+        std::string path = directory_ + PATH_SEPARATOR_STR + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+            entries.push_back(std::make_pair(st.st_mtime, path));
+    }
+    closedir(dir);
+
+    if (entries.size() <= maxEntries_)
+        return;
+
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() - maxEntries_; i++)
+        unlink(entries[i].second.c_str());
+}
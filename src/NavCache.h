@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NAVCACHE_H
+#define _NAVCACHE_H
+
+#include <string>
+#include <vector>
+
+// Version of the cache file format, files of other versions are ignored
+#define NAV_CACHE_VERSION 3
+// Maximum number of books kept in the cache, the least recently used are removed
+#define NAV_CACHE_MAX_ENTRIES 256
+
+/**
+ * The navigation model of a book, as read from its NCC or NCX
+ */
+struct NavModel
+{
+    /**
+     * A section or a page
+     */
+    struct Point
+    {
+        Point() : playOrder(-1), level(0) {}
+        Point(const std::string &r, const std::string &t, int order, int lvl = 0) : ref(r), text(t), playOrder(order), level(lvl) {}
+        std::string ref;
+        std::string text;
+        int playOrder;
+        int level;
+    };
+
+    /**
+     * A book time where the section or page changes, see PositionIndex
+     */
+    struct Time
+    {
+        Time() : startms(-1), smilms(-1), section(-1), page(-1) {}
+        Time(long start, long smil, int sect, int pg, const std::string &r = "") :
+                startms(start), smilms(smil), section(sect), page(pg), ref(r)
+        {
+        }
+        long startms;
+        long smilms;
+        int section;
+        int page;
+        std::string ref;
+    };
+
+    NavModel() : totalms(-1) {}
+
+    std::string title;
+    long totalms; /**< Duration of the book, -1 if unknown */
+    std::vector<Point> sections;
+    std::vector<Point> pages;
+    std::vector<Time> times; /**< Sorted by startms */
+};
+
+/**
+ * NavCache keeps the navigation models of opened books on disk, so that a
+ * book that is opened again has its sections and pages before DaisyHandler
+ * has parsed the navigation file. DaisyHandler still parses it on every
+ * open, it cannot be given a model, so the cache saves the time until the
+ * application gets the book data, not the time until the book is open.
+ *
+ * There is one file per book, named after a hash of the uri of the
+ * navigation file. An entry is valid while the modification time and size
+ * of the navigation file are unchanged, so only local books are cached. The
+ * files are read with mmap and written to a temporary file that is renamed,
+ * so a reader never sees a partly written entry.
+ */
+class NavCache
+{
+public:
+    static NavCache *Instance();
+
+    NavCache(const std::string &directory, size_t maxEntries = NAV_CACHE_MAX_ENTRIES);
+
+    bool load(const std::string &uri, NavModel &model);
+    bool store(const std::string &uri, const NavModel &model);
+    void remove(const std::string &uri);
+
+    std::string directory() const;
+    std::string fileFor(const std::string &uri) const;
+
+private:
+    static bool sourceStamp(const std::string &uri, long long &mtime, long long &size);
+    void prune();
+
+    // Not copyable
+    NavCache(const NavCache&);
+    NavCache& operator=(const NavCache&);
+
+    static NavCache *pinstance;
+    std::string directory_;
+    size_t maxEntries_;
+};
+
+#endif
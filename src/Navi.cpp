@@ -29,6 +29,7 @@
 #include "Menu/AutoPlayNode.h"
 #include "Commands/InternalCommands.h"
 #include "CommandQueue2/CommandQueue.h"
+#include "InteractionTrace.h"
 
 #include <Narrator.h>
 #include <log4cxx/logger.h>
@@ -49,6 +50,8 @@ Navi::~Navi()
 
 bool Navi::process(int command, void* data)
 {
+    InteractionTrace::Instance()->point("Navi::process");
+
     std::string commandName;
     switch(command)
     {
@@ -97,6 +100,9 @@ bool Navi::process(int command, void* data)
     case COMMAND_NEXT:
         commandName = "COMMAND_NEXT";
         break;
+    case COMMAND_READ_AHEAD:
+        commandName = "COMMAND_READ_AHEAD";
+        break;
     case COMMAND_LAST:
         commandName = "COMMAND_LAST";
         break;
@@ -253,8 +259,8 @@ void Navi::narrateChange(const MenuState& before, const MenuState& after)
     { // Narrate both node and choice change
         if (NULL != after.state.currentNode and renderNode(after.state.currentNode))
         {
-            naviengine::NaviListImpl navilist(after.state.currentNode);
-            cq2::Command<NaviList> naviList(navilist);
+            NaviListPtr navilist(new naviengine::NaviListImpl(after.state.currentNode));
+            cq2::Command<NaviListPtr> naviList(navilist);
             naviList();
 
             if (NULL != after.state.currentChoice)
@@ -301,11 +307,13 @@ void Navi::narrateChange(const MenuState& before, const MenuState& after)
 
 void Navi::narrate(const std::string text)
 {
+    InteractionTrace::Instance()->audio("Narrator::play");
     Narrator::Instance()->play(text.c_str());
 }
 
 void Navi::narrate(const int value)
 {
+    InteractionTrace::Instance()->audio("Narrator::play");
     Narrator::Instance()->play(value);
 }
 
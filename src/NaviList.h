@@ -24,6 +24,7 @@
 
 #include <string>
 #include <vector>
+#include <boost/shared_ptr.hpp>
 
 /**
  * A data type to hold information about a navigation list
@@ -60,4 +61,9 @@ struct NaviList
 
     virtual ~NaviList() {};
 };
+
+/**
+ * An immutable, reference counted navigation list
+ */
+typedef boost::shared_ptr<const NaviList> NaviListPtr;
 #endif
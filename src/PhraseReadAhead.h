@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PHRASEREADAHEAD_H
+#define _PHRASEREADAHEAD_H
+
+#include "CommandQueue2/ScopeLock.h"
+
+#include <deque>
+#include <string>
+#include <pthread.h>
+
+// Number of phrases resolved before the current one has finished
+#define READ_AHEAD_PHRASES 1
+// Time in milliseconds before the end of a clip at which the next phrases are resolved
+#define READ_AHEAD_WINDOW 750
+
+/**
+ * PhraseReadAhead is the queue of phrases that have been resolved before the
+ * playing clip has finished. The player thread asks due() on every time
+ * update, and when the end of the clip is near the phrases after it are
+ * resolved on the clientcore thread and queued with push(). At the end of the
+ * clip the next one is taken with pop() and opened directly, so the next SMIL
+ * is not parsed or fetched while the player is silent.
+ *
+ * The end of a clip is found by comparing the position reported by the
+ * player with the stop time of the clip, so the tempo and pauses are taken
+ * into account. A clip without a stop time never reads ahead. All methods may
+ * be called from any thread.
+ */
+class PhraseReadAhead
+{
+public:
+    struct Clip
+    {
+        Clip() : startms(-1), stopms(-1) {}
+        Clip(const std::string &u, long long start, long long stop) : uri(u), startms(start), stopms(stop) {}
+        std::string uri;
+        long long startms;
+        long long stopms;
+    };
+
+    /**
+     * @param depth Maximum number of queued phrases
+     * @param window Milliseconds of the clip before its end at which due() becomes true
+     */
+    PhraseReadAhead(size_t depth = READ_AHEAD_PHRASES, long window = READ_AHEAD_WINDOW) :
+            depth_(depth), window_(window), requested_(false)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+    }
+
+    ~PhraseReadAhead()
+    {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    /**
+     * A clip has been opened on the player
+     */
+    void opened(const Clip &clip)
+    {
+        ScopeLock lock(mutex_);
+        current_ = clip;
+        requested_ = false;
+    }
+
+    /**
+     * Called on player time updates, returns true once per clip when the
+     * next phrases should be resolved
+     *
+     * @param currentms Position of the player in the audio file, -1 if unknown
+     */
+    bool due(long long currentms)
+    {
+        ScopeLock lock(mutex_);
+        if (requested_ || queue_.size() >= depth_)
+            return false;
+        if (currentms < 0 || current_.stopms < 0 || current_.stopms <= current_.startms)
+            return false;
+        if (currentms < current_.stopms - window_)
+            return false;
+
+        requested_ = true;
+        return true;
+    }
+
+    /**
+     * True while the phrases asked for by due() have not been resolved
+     */
+    bool wanted()
+    {
+        ScopeLock lock(mutex_);
+        return requested_ && queue_.size() < depth_;
+    }
+
+    /**
+     * Queue a phrase that was resolved ahead
+     */
+    void push(const Clip &clip)
+    {
+        ScopeLock lock(mutex_);
+        queue_.push_back(clip);
+    }
+
+    /**
+     * Take the oldest queued phrase
+     *
+     * @return false if no phrase is queued
+     */
+    bool pop(Clip &clip)
+    {
+        ScopeLock lock(mutex_);
+        if (queue_.empty())
+            return false;
+        clip = queue_.front();
+        queue_.pop_front();
+        return true;
+    }
+
+    /**
+     * Forget the queued phrases, e.g. when the user changes position
+     */
+    void clear()
+    {
+        ScopeLock lock(mutex_);
+        queue_.clear();
+        requested_ = false;
+    }
+
+    size_t size()
+    {
+        ScopeLock lock(mutex_);
+        return queue_.size();
+    }
+
+    size_t depth() const
+    {
+        return depth_;
+    }
+
+private:
+    // Not copyable
+    PhraseReadAhead(const PhraseReadAhead&);
+    PhraseReadAhead& operator=(const PhraseReadAhead&);
+
+    pthread_mutex_t mutex_;
+    std::deque<Clip> queue_;
+    Clip current_;
+    size_t depth_;
+    long long window_;
+    bool requested_;
+};
+
+#endif
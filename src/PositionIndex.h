@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POSITIONINDEX_H
+#define _POSITIONINDEX_H
+
+#include "CommandQueue2/ScopeLock.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+
+/**
+ * PositionIndex maps book time to the SMIL, section and page playing at
+ * that time. It holds the positions where the section or page changes,
+ * sorted by their offset from the start of the book.
+ *
+ * DaisyHandler does not expose the times of its navigation points, so the
+ * entries are read from the SMIL files when a book opens, see
+ * PositionScanner, and each section and page start keeps the id to jump to
+ * it. Playback corrects the index: every player time update records the
+ * current position, which adds an entry only when the section or page
+ * differs from the one the index already has for that time. The entries of
+ * a book are kept in the NavCache, so a book that was read before is
+ * indexed when it opens.
+ *
+ * seek() finds the entry for any time with a binary search. at() remembers
+ * the last entry it returned, so consecutive lookups while the book plays
+ * cost a comparison or two regardless of the size of the book. All methods
+ * may be called from any thread.
+ */
+class PositionIndex
+{
+public:
+    struct Entry
+    {
+        Entry() : startms(-1), smilms(-1), section(-1), page(-1) {}
+        Entry(long start, long smil, int sect, int pg, const std::string &r = "") :
+                startms(start), smilms(smil), section(sect), page(pg), ref(r)
+        {
+        }
+        long startms; /**< Offset from the start of the book in milliseconds */
+        long smilms; /**< Offset of the SMIL containing the position */
+        int section; /**< Section index, -1 if unknown */
+        int page; /**< Page index, -1 if unknown */
+        std::string ref; /**< Id of the section or page starting here, empty if learned from playback */
+
+        bool operator<(const Entry &other) const
+        {
+            return startms < other.startms;
+        }
+    };
+
+    PositionIndex() : cursor_(0), revision_(0)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+    }
+
+    ~PositionIndex()
+    {
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    /**
+     * Record the position playing at a time
+     *
+     * @return true if the index changed
+     */
+    bool record(long ms, long smilms, int section, int page)
+    {
+        ScopeLock lock(mutex_);
+        long found = locate(ms);
+        if (found >= 0 && entries_[found].section == section && entries_[found].page == page)
+            return false;
+
+        Entry entry(ms, smilms, section, page);
+        if (found >= 0 && entries_[found].startms == ms)
+        {
+            entry.ref = entries_[found].ref;
+            entries_[found] = entry;
+        }
+        else
+        {
+            cursor_ = found + 1;
+            entries_.insert(entries_.begin() + cursor_, entry);
+        }
+        revision_++;
+        return true;
+    }
+
+    /**
+     * Find the position at a time with a binary search
+     *
+     * @return false if the time is before the first entry
+     */
+    bool seek(long ms, Entry &entry)
+    {
+        ScopeLock lock(mutex_);
+        std::vector<Entry>::iterator it = std::upper_bound(entries_.begin(), entries_.end(), Entry(ms, -1, -1, -1));
+        if (it == entries_.begin())
+            return false;
+        entry = *(it - 1);
+        return true;
+    }
+
+    /**
+     * Find the last section or page start read from the SMIL files at or
+     * before a time, skipping the entries learned from playback
+     *
+     * @return false if no such start precedes the time
+     */
+    bool seekStart(long ms, Entry &entry)
+    {
+        ScopeLock lock(mutex_);
+        std::vector<Entry>::iterator it = std::upper_bound(entries_.begin(), entries_.end(), Entry(ms, -1, -1, -1));
+        while (it != entries_.begin())
+        {
+            --it;
+            if (not it->ref.empty())
+            {
+                entry = *it;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Find the position at a time, fast when the time follows the one of
+     * the previous call, e.g. on player time updates
+     *
+     * @return false if the time is before the first entry
+     */
+    bool at(long ms, Entry &entry)
+    {
+        ScopeLock lock(mutex_);
+        long found = locate(ms);
+        if (found < 0)
+            return false;
+        entry = entries_[found];
+        return true;
+    }
+
+    /**
+     * Replace the entries, e.g. with the ones from the NavCache
+     */
+    void assign(const std::vector<Entry> &entries)
+    {
+        ScopeLock lock(mutex_);
+        entries_ = entries;
+        std::sort(entries_.begin(), entries_.end());
+        cursor_ = 0;
+        revision_++;
+    }
+
+    std::vector<Entry> entries()
+    {
+        ScopeLock lock(mutex_);
+        return entries_;
+    }
+
+    void clear()
+    {
+        ScopeLock lock(mutex_);
+        entries_.clear();
+        cursor_ = 0;
+        revision_++;
+    }
+
+    size_t size()
+    {
+        ScopeLock lock(mutex_);
+        return entries_.size();
+    }
+
+    /**
+     * Incremented on every change, to find out if the index must be saved
+     */
+    long revision()
+    {
+        ScopeLock lock(mutex_);
+        return revision_;
+    }
+
+private:
+    // Index of the last entry starting at or before ms, -1 if there is none.
+    // Tries the entry of the previous lookup and the one after it before
+    // searching. Called with the mutex locked.
+    long locate(long ms)
+    {
+        size_t n = entries_.size();
+        for (size_t c = cursor_; c < n && c < cursor_ + 2; c++)
+        {
+            if (entries_[c].startms <= ms && (c + 1 == n || ms < entries_[c + 1].startms))
+            {
+                cursor_ = c;
+                return c;
+            }
+        }
+
+        std::vector<Entry>::iterator it = std::upper_bound(entries_.begin(), entries_.end(), Entry(ms, -1, -1, -1));
+        if (it == entries_.begin())
+            return -1;
+        cursor_ = (it - entries_.begin()) - 1;
+        return cursor_;
+    }
+
+    // Not copyable
+    PositionIndex(const PositionIndex&);
+    PositionIndex& operator=(const PositionIndex&);
+
+    pthread_mutex_t mutex_;
+    std::vector<Entry> entries_;
+    size_t cursor_;
+    long revision_;
+};
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PositionScanner.h"
+#include "Markup.h"
+
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <log4cxx/logger.h>
+
+// create logger which will become a child to logger kolibre.clientcore
+log4cxx::LoggerPtr positionScannerLog(log4cxx::Logger::getLogger("kolibre.clientcore.positionscanner"));
+
+namespace
+{
+
+// A heading or page of the navigation file
+struct NavRef
+{
+    NavRef(bool s, const std::string &i, const std::string &h) : section(s), id(i), href(h) {}
+    bool section;
+    std::string id;
+    std::string href;
+};
+
+// Times read from a SMIL file
+struct SmilTimes
+{
+    SmilTimes() : startms(-1), durationms(0) {}
+    long startms; /**< Elapsed time at the start of the SMIL, -1 if it has none */
+    long durationms; /**< Sum of the audio clips */
+    std::map<std::string, long> offsets; /**< Audio before each element with an id */
+};
+
+// A section or page start in book time
+struct Start
+{
+    Start(long t, long s, const NavRef *r, int n) : startms(t), smilms(s), ref(r), number(n) {}
+    long startms;
+    long smilms;
+    const NavRef *ref;
+    int number;
+
+    bool operator<(const Start &other) const
+    {
+        return startms < other.startms;
+    }
+};
+
+bool readFile(const std::string &path, std::string &data)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+        return false;
+
+    char buffer[16384];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.append(buffer, count);
+    fclose(file);
+    return true;
+}
+
+// Calls visit(tag, lowerName) for every start tag of a markup file in order
+template<typename Visitor>
+void forEachTag(const std::string &data, Visitor &visit)
+{
+    size_t pos = 0;
+    while ((pos = data.find('<', pos)) != std::string::npos)
+    {
+        size_t end = data.find('>', pos);
+        if (end == std::string::npos)
+            break;
+
+        size_t nameEnd = data.find_first_of(" \t\r\n/>", pos + 1);
+        std::string name = Markup::toLower(data.substr(pos + 1, nameEnd - pos - 1));
+        if (not name.empty() && name[0] != '/' && name[0] != '!' && name[0] != '?')
+            visit(data.substr(pos, end - pos + 1), name);
+        pos = end + 1;
+    }
+}
+
+// Collects the headings and pages of an NCC or the navPoints and pageTargets
+// of an NCX, with the href of the first link after each
+struct NavCollector
+{
+    NavCollector(bool n) : ncx(n), pending(-1) {}
+
+    void operator()(const std::string &tag, const std::string &name)
+    {
+        bool heading = name.size() == 2 && name[0] == 'h' && name[1] >= '1' && name[1] <= '6';
+        bool page = Markup::toLower(Markup::attribute(tag, "class")).compare(0, 5, "page-") == 0;
+        if (ncx)
+        {
+            heading = name == "navpoint";
+            page = name == "pagetarget";
+        }
+
+        if (heading || page)
+        {
+            refs.push_back(NavRef(heading, Markup::attribute(tag, "id"), ""));
+            pending = refs.size() - 1;
+        }
+        else if (pending >= 0 && name == (ncx ? "content" : "a"))
+        {
+            refs[pending].href = Markup::attribute(tag, ncx ? "src" : "href");
+            pending = -1;
+        }
+    }
+
+    bool ncx;
+    long pending;
+    std::vector<NavRef> refs;
+};
+
+// Reads the elapsed time meta and the audio clips of a SMIL file
+struct SmilCollector
+{
+    SmilCollector(SmilTimes &t) : times(t) {}
+
+    void operator()(const std::string &tag, const std::string &name)
+    {
+        if (name == "meta")
+        {
+            // ncc:totalElapsedTime in Daisy 2.02, dtb:totalElapsedTime in Daisy 3
+            std::string meta = Markup::toLower(Markup::attribute(tag, "name"));
+            if (meta.size() > 16 && meta.compare(meta.size() - 16, 16, "totalelapsedtime") == 0)
+                times.startms = PositionScanner::parseClock(Markup::attribute(tag, "content"));
+            return;
+        }
+
+        std::string id = Markup::attribute(tag, "id");
+        if (not id.empty())
+            times.offsets.insert(std::make_pair(id, times.durationms));
+
+        if (name == "audio")
+        {
+            std::string begin = Markup::attribute(tag, "clip-begin");
+            std::string end = Markup::attribute(tag, "clip-end");
+            if (begin.empty() && end.empty())
+            {
+                begin = Markup::attribute(tag, "clipbegin");
+                end = Markup::attribute(tag, "clipend");
+            }
+            long beginms = begin.empty() ? 0 : PositionScanner::parseClock(begin);
+            long endms = PositionScanner::parseClock(end);
+            if (beginms >= 0 && endms > beginms)
+                times.durationms += endms - beginms;
+        }
+    }
+
+    SmilTimes &times;
+};
+
+// Path of the NCX of a Daisy 3 book, from the manifest of its OPF
+std::string ncxPath(const std::string &opf)
+{
+    std::string data;
+    if (not readFile(opf, data))
+        return "";
+
+    std::string lower = Markup::toLower(data);
+    size_t pos = 0;
+    while ((pos = lower.find("<item", pos)) != std::string::npos)
+    {
+        std::string item = data.substr(pos, data.find('>', pos) - pos + 1);
+        if (Markup::toLower(Markup::attribute(item, "media-type")) == "application/x-dtbncx+xml")
+            return Markup::resolve(opf, Markup::attribute(item, "href"));
+        pos++;
+    }
+    return "";
+}
+
+}
+
+/**
+ * Parse a SMIL clock value, e.g. "npt=12.5s", "0:01:02.5", "500ms" or "2min"
+ *
+ * @return the value in milliseconds, -1 if it can't be parsed
+ */
+long PositionScanner::parseClock(const std::string &value)
+{
+    std::string v = value;
+    if (v.compare(0, 4, "npt=") == 0)
+        v.erase(0, 4);
+    if (v.empty())
+        return -1;
+
+    if (v.find(':') != std::string::npos)
+    {
+        // full or partial clock value, [hh:]mm:ss[.fraction]
+        double total = 0;
+        size_t start = 0;
+        for (;;)
+        {
+            size_t colon = v.find(':', start);
+            std::string part = v.substr(start, colon == std::string::npos ? std::string::npos : colon - start);
+            char *end;
+            double number = strtod(part.c_str(), &end);
+            if (part.empty() || *end != '\0')
+                return -1;
+            total = total * 60 + number;
+            if (colon == std::string::npos)
+                break;
+            start = colon + 1;
+        }
+        return (long) (total * 1000 + 0.5);
+    }
+
+    // timecount value with an optional metric, seconds by default
+    char *end;
+    double number = strtod(v.c_str(), &end);
+    if (end == v.c_str())
+        return -1;
+    std::string metric = end;
+    double scale;
+    if (metric.empty() || metric == "s")
+        scale = 1000;
+    else if (metric == "ms")
+        scale = 1;
+    else if (metric == "min")
+        scale = 60 * 1000;
+    else if (metric == "h")
+        scale = 60 * 60 * 1000;
+    else
+        return -1;
+    return (long) (number * scale + 0.5);
+}
+
+/**
+ * Find the start times of the sections and pages of a book
+ *
+ * @param uri Path of the NCC or OPF
+ * @param entries Set to one entry per start time, sorted by time
+ * @return false if the book is not local or has no timed sections or pages
+ */
+bool PositionScanner::scan(const std::string &uri, std::vector<PositionIndex::Entry> &entries)
+{
+    entries.clear();
+    std::string path = uri;
+    if (path.compare(0, 7, "file://") == 0)
+        path.erase(0, 7);
+    else if (path.find("://") != std::string::npos)
+        return false;
+
+    std::string name = Markup::toLower(path.substr(path.rfind('/') + 1));
+    bool daisy3 = name.size() > 4 && name.compare(name.size() - 4, 4, ".opf") == 0;
+    std::string navPath = daisy3 ? ncxPath(path) : path;
+
+    std::string nav;
+    if (navPath.empty() || not readFile(navPath, nav))
+    {
+        LOG4CXX_WARN(positionScannerLog, "Could not read the navigation file of " << uri);
+        return false;
+    }
+
+    NavCollector collector(daisy3);
+    forEachTag(nav, collector);
+
+    // the start of every referenced element, a SMIL without elapsed time
+    // starts where the previously referenced one ended
+    std::map<std::string, SmilTimes> smils;
+    std::vector<Start> starts;
+    long nextStart = 0;
+    int sections = 0;
+    int pages = 0;
+    for (size_t i = 0; i < collector.refs.size(); i++)
+    {
+        const NavRef &ref = collector.refs[i];
+        int number = ref.section ? ++sections : pages++;
+
+        std::string smil = Markup::resolve(navPath, ref.href);
+        if (smil.empty())
+            continue;
+
+        std::map<std::string, SmilTimes>::iterator it = smils.find(smil);
+        if (it == smils.end())
+        {
+            it = smils.insert(std::make_pair(smil, SmilTimes())).first;
+            std::string data;
+            if (readFile(smil, data))
+            {
+                SmilCollector times(it->second);
+                forEachTag(data, times);
+            }
+            if (it->second.startms < 0)
+                it->second.startms = nextStart;
+            nextStart = it->second.startms + it->second.durationms;
+        }
+
+        size_t hash = ref.href.find('#');
+        std::string fragment = hash == std::string::npos ? "" : ref.href.substr(hash + 1);
+        std::map<std::string, long>::const_iterator offset = it->second.offsets.find(fragment);
+        long startms = it->second.startms + (offset == it->second.offsets.end() ? 0 : offset->second);
+        starts.push_back(Start(startms, it->second.startms, &ref, number));
+    }
+
+    std::stable_sort(starts.begin(), starts.end());
+    int section = -1;
+    int page = -1;
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        const Start &start = starts[i];
+        if (start.ref->section)
+            section = start.number;
+        else
+            page = start.number;
+
+        // one entry per time, the first heading or page there keeps its ref
+        if (not entries.empty() && entries.back().startms == start.startms)
+        {
+            entries.back().section = section;
+            entries.back().page = page;
+            continue;
+        }
+        entries.push_back(PositionIndex::Entry(start.startms, start.smilms, section, page, start.ref->id));
+    }
+
+    LOG4CXX_DEBUG(positionScannerLog, "Found " << entries.size() << " positions in " << smils.size() << " SMIL files of " << uri);
+    return not entries.empty();
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POSITIONSCANNER_H
+#define _POSITIONSCANNER_H
+
+#include "PositionIndex.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * PositionScanner finds where the sections and pages of a book start in
+ * time, without the DaisyHandler. It reads the NCC of a Daisy 2.02 book or
+ * the NCX of a Daisy 3 book for the references of the headings and pages,
+ * and the SMIL files they refer to for the elapsed time at the start of the
+ * SMIL and the audio clips before the referenced element.
+ *
+ * The result is one PositionIndex entry per time where a section or page
+ * starts, with the id of the heading or page in the navigation file as its
+ * ref. Sections are numbered from 1 and pages from 0, like the positions
+ * DaisyHandler reports. Each SMIL file is read once, only local books are
+ * scanned.
+ */
+class PositionScanner
+{
+public:
+    static bool scan(const std::string &uri, std::vector<PositionIndex::Entry> &entries);
+    static long parseClock(const std::string &value);
+};
+
+#endif
@@ -43,7 +43,9 @@ RootNode::RootNode(const std::string useragent)
     LOG4CXX_TRACE(rootNodeLog, "Constructor");
     userAgent_ = useragent;
     name_ = "Root";
+    navilist_.reset(new NaviList);
     openFirstChild_ = true;
+    prepared_ = false;
 }
 
 RootNode::~RootNode()
@@ -83,8 +85,37 @@ bool RootNode::up(NaviEngine& navi)
 bool RootNode::onOpen(NaviEngine& navi)
 {
     navi.setCurrentChoice(NULL);
+
+    // use the children created by prepare() once, recreate them on later opens
+    if (not prepared_)
+        prepare();
+    prepared_ = false;
+
+    if (navi.getCurrentChoice() == NULL && numberOfChildren() > 0)
+    {
+        navi.setCurrentChoice(firstChild());
+        currentChild_ = firstChild();
+    }
+
+    currentChild_ = navi.getCurrentChoice();
+    announce();
+
+    bool autoPlay = Settings::Instance()->read<bool>("autoplay", true);
+    if (autoPlay && openFirstChild_)
+    {
+        narratorDoneConnection = Narrator::Instance()->connectAudioFinished(boost::bind(&RootNode::onNarratorDone, this));
+        Narrator::Instance()->setPushCommandFinished(true);
+    }
+
+    return true;
+}
+
+void RootNode::prepare()
+{
     clearNodes();
-    navilist_.items.clear();
+
+    // build a new list, the previous one may still be shared with listeners
+    boost::shared_ptr<NaviList> navilist(new NaviList);
 
     // Create sources defined in MediaSourceManager
     LOG4CXX_INFO(rootNodeLog, "Creating children for root");
@@ -123,7 +154,7 @@ bool RootNode::onOpen(NaviEngine& navi)
 
             // create a NaviListItem and store it in list for the NaviList signal
             NaviListItem item(daisyOnlineNode->uri_, name);
-            navilist_.items.push_back(item);
+            navilist->items.push_back(item);
         }
         else
         {
@@ -145,27 +176,11 @@ bool RootNode::onOpen(NaviEngine& navi)
 
             // create a NaviListItem and store it in list for the NaviList signal
             NaviListItem item(fileSystemNode->uri_, name);
-            navilist_.items.push_back(item);
+            navilist->items.push_back(item);
         }
     }
-
-    if (navi.getCurrentChoice() == NULL && numberOfChildren() > 0)
-    {
-        navi.setCurrentChoice(firstChild());
-        currentChild_ = firstChild();
-    }
-
-    currentChild_ = navi.getCurrentChoice();
-    announce();
-
-    bool autoPlay = Settings::Instance()->read<bool>("autoplay", true);
-    if (autoPlay && openFirstChild_)
-    {
-        narratorDoneConnection = Narrator::Instance()->connectAudioFinished(boost::bind(&RootNode::onNarratorDone, this));
-        Narrator::Instance()->setPushCommandFinished(true);
-    }
-
-    return true;
+    navilist_ = navilist;
+    prepared_ = true;
 }
 
 bool RootNode::process(NaviEngine& navi, int command, void* data)
@@ -233,7 +248,7 @@ void RootNode::onNarratorDone()
 
 void RootNode::announce()
 {
-    cq2::Command<NaviList> naviList(navilist_);
+    cq2::Command<NaviListPtr> naviList(navilist_);
     naviList();
 
     int numItems = numberOfChildren();
@@ -274,7 +289,7 @@ void RootNode::announceSelection()
         Narrator::Instance()->play(_N("source no. {1}"));
         currentChild_->narrateName();
 
-        NaviListItem item = navilist_.items[currentChoice];
+        NaviListItem item = navilist_->items[currentChoice];
         cq2::Command<NaviListItem> naviItem(item);
         naviItem();
     }
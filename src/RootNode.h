@@ -50,9 +50,13 @@ public:
     bool onRender();
     void onNarratorDone();
 
+    // Create the children before the node is opened, e.g. during startup
+    void prepare();
+
 private:
-    NaviList navilist_;
+    NaviListPtr navilist_;
     AnyNode* currentChild_;
+    bool prepared_;
 
     std::string userAgent_;
     bool openFirstChild_;
@@ -161,6 +161,26 @@ bool DB::bind(const char *key, const long value)
     return bind(sqlite3_bind_parameter_index(pStatement, key), value);
 }
 
+bool DB::bind(const int idx, const long long value)
+{
+    if (!pStatement)
+        prepare(NULL);
+    if (idx == 0)
+        return false;
+    rc = sqlite3_bind_int64(pStatement, idx, value);
+    if (rc != SQLITE_OK)
+    {
+        mLasterror.assign(sqlite3_errmsg(pDBHandle));
+        return false;
+    }
+    return true;
+}
+
+bool DB::bind(const char *key, const long long value)
+{
+    return bind(sqlite3_bind_parameter_index(pStatement, key), value);
+}
+
 bool DB::bind(const int idx, const double value)
 {
     if (!pStatement)
@@ -398,6 +418,14 @@ long DBResult::getInt(const long column)
     return 0;
 }
 
+long long DBResult::getInt64(const long column)
+{
+    if (sqlite3_column_type(pStatement, column) == SQLITE_INTEGER)
+        return sqlite3_column_int64(pStatement, column);
+
+    return 0;
+}
+
 double DBResult::getDouble(const long column)
 {
     if (sqlite3_column_type(pStatement, column) == SQLITE_FLOAT)
@@ -70,6 +70,10 @@ public:
     bool bind(const int idx, const long value);
     bool bind(const char *key, const long value);
 
+    // 64-bit on all platforms, e.g. for times and file sizes
+    bool bind(const int idx, const long long value);
+    bool bind(const char *key, const long long value);
+
     bool bind(const int idx, const double value);
     bool bind(const char *key, const double value);
 
@@ -112,6 +116,7 @@ public:
     bool isDone();
 
     long getInt(long column);
+    long long getInt64(long column);
     double getDouble(long column);
     const char *getText(long column);
     const void *getData(long column);
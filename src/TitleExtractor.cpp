@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TitleExtractor.h"
+#include "Markup.h"
+#include "CommandQueue2/Atomic.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <log4cxx/logger.h>
+
+// create logger which will become a child to logger kolibre.clientcore
+log4cxx::LoggerPtr titleExtractorLog(log4cxx::Logger::getLogger("kolibre.clientcore.titleextractor"));
+
+// Bytes read from a file at a time
+#define TITLE_EXTRACTOR_CHUNK 16384
+
+namespace
+{
+
+/**
+ * Reads a markup file in chunks, only as far as a search needs. Searches are
+ * case insensitive, NCC files are HTML and may have upper case tags.
+ */
+class MarkupReader
+{
+public:
+    MarkupReader(const std::string &path) : eof(false)
+    {
+        file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+            eof = true;
+    }
+
+    ~MarkupReader()
+    {
+        if (file != NULL)
+            fclose(file);
+    }
+
+    bool good()
+    {
+        return file != NULL;
+    }
+
+    // Position of needle, which must be lower case, at or after from
+    size_t find(const std::string &needle, size_t from)
+    {
+        size_t searched = from;
+        for (;;)
+        {
+            size_t pos = lower.find(needle, searched);
+            if (pos != std::string::npos)
+                return pos;
+            if (lower.size() >= needle.size())
+                searched = std::max(from, lower.size() - needle.size() + 1);
+            if (not read())
+                return std::string::npos;
+        }
+    }
+
+    // Position of the first of two needles at or after from
+    size_t findFirst(const std::string &needle, const std::string &other, size_t from)
+    {
+        return std::min(find(needle, from), find(other, from));
+    }
+
+    // The tag starting at pos, up to and including its '>'
+    std::string tag(size_t pos)
+    {
+        size_t end = find(">", pos);
+        if (end == std::string::npos)
+            return "";
+        return data.substr(pos, end - pos + 1);
+    }
+
+    std::string substr(size_t from, size_t to)
+    {
+        return data.substr(from, to - from);
+    }
+
+private:
+    bool read()
+    {
+        if (eof || data.size() >= TITLE_EXTRACTOR_MAX_BYTES)
+            return false;
+
+        char buffer[TITLE_EXTRACTOR_CHUNK];
+        size_t count = fread(buffer, 1, sizeof(buffer), file);
+        if (count < sizeof(buffer))
+            eof = true;
+        if (count == 0)
+            return false;
+
+        data.append(buffer, count);
+        lower.reserve(data.size());
+        for (size_t i = 0; i < count; i++)
+        {
+            char c = buffer[i];
+            lower += (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+        return true;
+    }
+
+    FILE *file;
+    bool eof;
+    std::string data;
+    std::string lower;
+};
+
+// Append a code point as UTF-8
+void appendUtf8(std::string &out, unsigned long c)
+{
+    if (c < 0x80)
+        out += (char) c;
+    else if (c < 0x800)
+    {
+        out += (char) (0xC0 | (c >> 6));
+        out += (char) (0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+        out += (char) (0xE0 | (c >> 12));
+        out += (char) (0x80 | ((c >> 6) & 0x3F));
+        out += (char) (0x80 | (c & 0x3F));
+    }
+    else if (c < 0x110000)
+    {
+        out += (char) (0xF0 | (c >> 18));
+        out += (char) (0x80 | ((c >> 12) & 0x3F));
+        out += (char) (0x80 | ((c >> 6) & 0x3F));
+        out += (char) (0x80 | (c & 0x3F));
+    }
+}
+
+// Text content of markup: tags removed, entities decoded and white space
+// collapsed
+std::string textContent(const std::string &markup)
+{
+    std::string text;
+    bool space = false;
+    for (size_t i = 0; i < markup.size(); i++)
+    {
+        char c = markup[i];
+        if (c == '<')
+        {
+            size_t end = markup.find('>', i);
+            if (end == std::string::npos)
+                break;
+            i = end;
+            continue;
+        }
+
+        if (isspace((unsigned char) c))
+        {
+            space = not text.empty();
+            continue;
+        }
+        if (space)
+            text += ' ';
+        space = false;
+
+        size_t end = c == '&' ? markup.find(';', i) : std::string::npos;
+        if (end == std::string::npos || end - i > 10)
+        {
+            text += c;
+            continue;
+        }
+
+        std::string entity = markup.substr(i + 1, end - i - 1);
+        if (entity == "amp")
+            text += '&';
+        else if (entity == "lt")
+            text += '<';
+        else if (entity == "gt")
+            text += '>';
+        else if (entity == "quot")
+            text += '"';
+        else if (entity == "apos")
+            text += '\'';
+        else if (entity == "nbsp")
+            appendUtf8(text, 0xA0);
+        else if (entity.size() > 1 && entity[0] == '#')
+        {
+            bool hex = entity[1] == 'x' || entity[1] == 'X';
+            appendUtf8(text, strtoul(entity.c_str() + (hex ? 2 : 1), NULL, hex ? 16 : 10));
+        }
+        else
+        {
+            text += c;
+            continue;
+        }
+        i = end;
+    }
+    return text;
+}
+
+// Source of the first audio at or after the element with the id, or of the
+// first audio in the file if the id is not found
+std::string audioSource(const std::string &path, const std::string &id)
+{
+    MarkupReader reader(path);
+    if (not reader.good())
+        return "";
+
+    size_t pos = std::string::npos;
+    if (not id.empty())
+    {
+        std::string lowerId = Markup::toLower(id);
+        pos = reader.findFirst("id=\"" + lowerId + "\"", "id='" + lowerId + "'", 0);
+    }
+    if (pos == std::string::npos)
+        pos = 0;
+
+    pos = reader.find("<audio", pos);
+    if (pos == std::string::npos)
+        return "";
+    std::string src = Markup::attribute(reader.tag(pos), "src");
+    if (src.empty())
+        return "";
+    return Markup::resolve(path, src);
+}
+
+// Title of a Daisy 2.02 book, the text of the first heading in the NCC and
+// the audio of its SMIL reference
+bool extractNcc(const std::string &path, BookTitle &title)
+{
+    MarkupReader ncc(path);
+    if (not ncc.good())
+        return false;
+
+    std::string href;
+    size_t pos = ncc.find("<h1", 0);
+    if (pos != std::string::npos)
+    {
+        size_t start = ncc.find(">", pos);
+        size_t end = start == std::string::npos ? start : ncc.find("</h1", start);
+        if (end != std::string::npos)
+        {
+            std::string heading = ncc.substr(start + 1, end);
+            title.title = textContent(heading);
+
+            std::string lowerHeading = Markup::toLower(heading);
+            size_t anchor = lowerHeading.find("<a");
+            if (anchor != std::string::npos)
+            {
+                size_t anchorEnd = heading.find('>', anchor);
+                href = Markup::attribute(heading.substr(anchor, anchorEnd - anchor + 1), "href");
+            }
+        }
+    }
+
+    // books without headings are listed by their dc:title
+    for (pos = ncc.find("<meta", 0); title.title.empty() && pos != std::string::npos; pos = ncc.find("<meta", pos + 1))
+    {
+        std::string meta = ncc.tag(pos);
+        if (Markup::toLower(Markup::attribute(meta, "name")) == "dc:title")
+            title.title = textContent(Markup::attribute(meta, "content"));
+    }
+
+    if (title.title.empty())
+        return false;
+
+    if (not href.empty())
+    {
+        size_t fragment = href.find('#');
+        std::string id = fragment == std::string::npos ? "" : href.substr(fragment + 1);
+        title.titleSrc = audioSource(Markup::resolve(path, href), id);
+    }
+    return true;
+}
+
+// Title of a Daisy 3 book, the dc:title of the OPF and the audio of the
+// docTitle in the NCX
+bool extractOpf(const std::string &path, BookTitle &title)
+{
+    MarkupReader opf(path);
+    if (not opf.good())
+        return false;
+
+    size_t pos = opf.find("<dc:title", 0);
+    if (pos != std::string::npos)
+    {
+        size_t start = opf.find(">", pos);
+        size_t end = start == std::string::npos ? start : opf.find("</dc:title", start);
+        if (end != std::string::npos)
+            title.title = textContent(opf.substr(start + 1, end));
+    }
+
+    std::string ncxPath;
+    for (pos = opf.find("<item", 0); pos != std::string::npos; pos = opf.find("<item", pos + 1))
+    {
+        std::string item = opf.tag(pos);
+        if (Markup::toLower(Markup::attribute(item, "media-type")) == "application/x-dtbncx+xml")
+        {
+            ncxPath = Markup::resolve(path, Markup::attribute(item, "href"));
+            break;
+        }
+    }
+
+    if (not ncxPath.empty())
+    {
+        MarkupReader ncx(ncxPath);
+        size_t docTitle = ncx.find("<doctitle", 0);
+        size_t end = docTitle == std::string::npos ? docTitle : ncx.find("</doctitle", docTitle);
+        if (end != std::string::npos)
+        {
+            std::string markup = ncx.substr(docTitle, end);
+            if (title.title.empty())
+            {
+                size_t text = Markup::toLower(markup).find("<text");
+                size_t textEnd = Markup::toLower(markup).find("</text", text);
+                if (text != std::string::npos && textEnd != std::string::npos)
+                    title.title = textContent(markup.substr(text, textEnd - text));
+            }
+
+            size_t audio = Markup::toLower(markup).find("<audio");
+            if (audio != std::string::npos)
+            {
+                std::string src = Markup::attribute(markup.substr(audio, markup.find('>', audio) - audio + 1), "src");
+                if (not src.empty())
+                    title.titleSrc = Markup::resolve(ncxPath, src);
+            }
+        }
+    }
+
+    return not title.title.empty();
+}
+
+// Work shared by the threads of extractAll
+struct Batch
+{
+    const std::vector<std::string> *uris;
+    std::vector<BookTitle> *titles;
+    volatile long next;
+};
+
+void *extractThread(void *ctx)
+{
+    Batch *batch = static_cast<Batch*>(ctx);
+    long count = batch->uris->size();
+    for (;;)
+    {
+        long i = cq2::atomic::add(&batch->next, 1L) - 1;
+        if (i >= count)
+            break;
+        TitleExtractor::extract((*batch->uris)[i], (*batch->titles)[i]);
+    }
+    return NULL;
+}
+
+}
+
+/**
+ * Extract the title of a book
+ *
+ * @param uri Path of an ncc.html or .opf file, or a file:// uri
+ * @param title Receives the title, found is set if one was found
+ * @return true if a title was found
+ */
+bool TitleExtractor::extract(const std::string &uri, BookTitle &title)
+{
+    title = BookTitle();
+
+    std::string path = uri;
+    if (path.compare(0, 7, "file://") == 0)
+        path.erase(0, 7);
+    else if (path.find("://") != std::string::npos)
+        return false;
+
+    std::string name = Markup::toLower(path.substr(path.rfind('/') + 1));
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".opf") == 0)
+        title.found = extractOpf(path, title);
+    else
+        title.found = extractNcc(path, title);
+
+    if (not title.found)
+    {
+        LOG4CXX_WARN(titleExtractorLog, "No title found in " << uri);
+        title = BookTitle();
+    }
+    return title.found;
+}
+
+/**
+ * Extract the titles of books on parallel threads, the calling thread is one
+ * of them
+ *
+ * @param uris Paths of ncc.html or .opf files
+ * @param threads Maximum number of threads
+ * @return The titles, in the order of the uris
+ */
+std::vector<BookTitle> TitleExtractor::extractAll(const std::vector<std::string> &uris, int threads)
+{
+    std::vector<BookTitle> titles(uris.size());
+    Batch batch;
+    batch.uris = &uris;
+    batch.titles = &titles;
+    batch.next = 0;
+
+    if (threads > (int) uris.size())
+        threads = uris.size();
+
+    std::vector<pthread_t> started;
+    for (int i = 1; i < threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, extractThread, &batch) == 0)
+            started.push_back(thread);
+    }
+
+    extractThread(&batch);
+    for (size_t i = 0; i < started.size(); i++)
+        pthread_join(started[i], NULL);
+
+    return titles;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TITLEEXTRACTOR_H
+#define _TITLEEXTRACTOR_H
+
+#include <string>
+#include <vector>
+
+// Number of threads used by TitleExtractor::extractAll
+#define TITLE_EXTRACTOR_THREADS 4
+// Bytes read from a file before giving up on finding the title in it
+#define TITLE_EXTRACTOR_MAX_BYTES (1024 * 1024)
+
+/**
+ * The title of a book as listed in a bookshelf
+ */
+struct BookTitle
+{
+    BookTitle() : found(false) {}
+    std::string title;
+    std::string titleSrc; /**< Audio file with the spoken title, empty if none */
+    bool found;
+};
+
+/**
+ * TitleExtractor reads the title of a book without opening it in the
+ * DaisyHandler. Only the beginning of the navigation file is read, up to the
+ * title heading of an NCC or the dc:title of an OPF, and the SMIL or NCX file
+ * that has the audio of the title. No navigation state is built, so titles
+ * of many books can be extracted in parallel.
+ *
+ * The title is the same as DaisyHandler gives after setting up a book: the
+ * first heading of an NCC, or the dc:title of an OPF. Only local files are
+ * read.
+ */
+class TitleExtractor
+{
+public:
+    static bool extract(const std::string &uri, BookTitle &title);
+    static std::vector<BookTitle> extractAll(const std::vector<std::string> &uris, int threads = TITLE_EXTRACTOR_THREADS);
+};
+
+#endif
@@ -27,6 +27,8 @@
 #include <log4cxx/logger.h>
 #include <boost/filesystem.hpp>
 
+#include "DirectoryWalker.h"
+
 #ifdef WIN32
 #define DEFAULT_DATAPATH "./"
 #define ENVIRONMENT_PATH "KOLIBRE_DATA_PATH_UTF8"
@@ -137,15 +139,9 @@ public:
         std::vector<std::string> matches;
         if (isDir(path))
         {
-            for (boost::filesystem::recursive_directory_iterator end, dir(path); dir != end; ++dir)
-            {
-                boost::filesystem::path p(*dir);
-                if (isFile(p))
-                {
-                    if (p.filename() == pattern)
-                        matches.push_back(p.string());
-                }
-            }
+            DirectoryWalker walker;
+            walker.addFilename(pattern);
+            matches = walker.search(path)[0];
         }
         return matches;
     }
@@ -160,15 +156,9 @@ public:
         std::vector<std::string> matches;
         if (isDir(path))
         {
-            for (boost::filesystem::recursive_directory_iterator end, dir(path); dir != end; ++dir)
-            {
-                boost::filesystem::path p(*dir);
-                if (isFile(p))
-                {
-                    if (p.extension() == pattern)
-                        matches.push_back(p.string());
-                }
-            }
+            DirectoryWalker walker;
+            walker.addExtension(pattern);
+            matches = walker.search(path)[0];
         }
         return matches;
     }
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+struct Position
+{
+    long second;
+    Position(long s = -1) : second(s) {}
+};
+
+static vector<long> positions;
+static vector<int> order;
+
+void handle_position(Position data)
+{
+    positions.push_back(data.second);
+    order.push_back(-1);
+}
+
+void handle_int(int data)
+{
+    order.push_back(data);
+}
+
+bool is_odd(const Position& data)
+{
+    return data.second % 2 != 0;
+}
+
+static volatile bool producing = true;
+
+void* position_producer(void* count)
+{
+    long total = *(long*) count;
+    for (long i = 1; i <= total; i++)
+    {
+        cq2::Command<Position> position(i);
+        position();
+    }
+    producing = false;
+
+    pthread_exit(NULL);
+}
+
+int main()
+{
+    cq2::Handler<Position> positionHandler(&handle_position);
+    positionHandler.listen();
+    cq2::Handler<int> intHandler(&handle_int);
+    intHandler.listen();
+
+    cq2::CommandQueue<Position>::instance().setCoalescing(true);
+
+    // a burst of updates is dispatched once with the latest value
+    for (long i = 1; i <= 100; i++)
+    {
+        cq2::Command<Position> position(i);
+        position();
+    }
+    assert(cq2::Dispatcher::instance().pending() == 1);
+    assert(cq2::Dispatcher::instance().dispatchCommand());
+    assert(not cq2::Dispatcher::instance().dispatchCommand());
+    assert(positions.size() == 1 && positions[0] == 100);
+    assert(cq2::CommandQueue<Position>::instance().coalesced() == 99);
+
+    // a coalesced command keeps its position in the queue
+    positions.clear();
+    order.clear();
+    cq2::Command<int> one(1);
+    one();
+    cq2::Command<Position> first(1);
+    first();
+    cq2::Command<int> two(2);
+    two();
+    cq2::Command<Position> second(2);
+    second();
+    while (cq2::Dispatcher::instance().dispatchCommand())
+        ;
+    assert(order.size() == 3);
+    assert(order[0] == 1 && order[1] == -1 && order[2] == 2);
+    assert(positions.size() == 1 && positions[0] == 2);
+
+    // a flushed command is not updated any more
+    cq2::Command<Position> flushed(3);
+    flushed();
+    cq2::Dispatcher::instance().flushQueue();
+    cq2::Command<Position> queued(4);
+    queued();
+    assert(cq2::Dispatcher::instance().dispatchCommand());
+    assert(positions.back() == 4);
+
+    // concurrent updates are seen in order and the last one is never lost
+    positions.clear();
+    long total = 1000000;
+    pthread_t thread;
+    pthread_create(&thread, NULL, position_producer, &total);
+    while (producing or cq2::Dispatcher::instance().pending() > 0)
+        cq2::Dispatcher::instance().waitAndDispatch(10);
+    pthread_join(thread, NULL);
+    while (cq2::Dispatcher::instance().dispatchCommand())
+        ;
+
+    for (size_t i = 1; i < positions.size(); i++)
+        assert(positions[i] > positions[i - 1]);
+    assert(positions.back() == total);
+
+    // flushing concurrent updates by value never drops a value that was
+    // coalesced into the command after the predicate was evaluated
+    positions.clear();
+    producing = true;
+    pthread_create(&thread, NULL, position_producer, &total);
+    while (producing or cq2::Dispatcher::instance().pending() > 0)
+    {
+        cq2::Dispatcher::instance().flush<Position>(&is_odd);
+        cq2::Dispatcher::instance().waitAndDispatch(1);
+    }
+    pthread_join(thread, NULL);
+    cq2::Dispatcher::instance().flush<Position>(&is_odd);
+    while (cq2::Dispatcher::instance().dispatchCommand())
+        ;
+
+    for (size_t i = 1; i < positions.size(); i++)
+        assert(positions[i] > positions[i - 1]);
+    assert(positions.back() == total);
+
+    cout << total << " updates sent, " << positions.size() << " dispatched, "
+         << cq2::CommandQueue<Position>::instance().coalesced() << " coalesced in total" << endl;
+
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Clock.h"
+
+using namespace std;
+
+// Verifies that the dispatcher can be driven by an external poll() loop that
+// also watches its own file descriptor, the way ClientCore drives it from a
+// GMainContext together with the D-Bus connection.
+
+static int wakeupPipe[2];
+static int eventPipe[2];
+static long wakeups = 0;
+
+static vector<string> order;
+static vector<long long> latencies;
+static long long timerDue = 0;
+static long long timerLate = -1;
+
+struct Stamp
+{
+    Stamp() : sent(0) {}
+    Stamp(long long s) : sent(s) {}
+    long long sent;
+};
+
+// Runs on any thread, must not block
+void wakeup_loop(void*)
+{
+    char c = 0;
+    if (write(wakeupPipe[1], &c, 1) < 0)
+    {
+        // the pipe is full, the loop wakes up anyway
+    }
+}
+
+void handle_name(string name)
+{
+    order.push_back(name);
+}
+
+void handle_stamp(Stamp stamp)
+{
+    latencies.push_back(cq2::monotonicMicroseconds() - stamp.sent);
+}
+
+void handle_timer(int)
+{
+    timerLate = cq2::monotonicMicroseconds() - timerDue;
+}
+
+// One iteration of the loop, returns false when it timed out without events
+bool iterate(long maxTimeout)
+{
+    cq2::Dispatcher& dispatcher = cq2::Dispatcher::instance();
+
+    long timeout = dispatcher.prepareWait();
+    if (maxTimeout >= 0 && (timeout < 0 || timeout > maxTimeout))
+        timeout = maxTimeout;
+
+    struct pollfd fds[2];
+    fds[0].fd = wakeupPipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = eventPipe[0];
+    fds[1].events = POLLIN;
+    int ready = poll(fds, 2, timeout);
+    dispatcher.finishWait();
+
+    if (fds[0].revents & POLLIN)
+    {
+        char buffer[64];
+        while (read(wakeupPipe[0], buffer, sizeof(buffer)) > 0)
+        {
+        }
+        wakeups++;
+    }
+
+    // events on the loop's own descriptor become ordinary commands, so they
+    // are ordered with the commands of the loop thread
+    if (fds[1].revents & POLLIN)
+    {
+        char event;
+        if (read(eventPipe[0], &event, 1) == 1)
+        {
+            cq2::Command<string> mounted(string("mount ") + event);
+            mounted();
+        }
+    }
+
+    while (dispatcher.dispatchCommand())
+    {
+    }
+
+    return ready > 0;
+}
+
+void* producer_thread(void*)
+{
+    for (int i = 0; i < 200; i++)
+    {
+        cq2::Command<Stamp> stamp(Stamp(cq2::monotonicMicroseconds()));
+        stamp();
+        usleep(2000);
+    }
+    pthread_exit(NULL);
+}
+
+int main()
+{
+    assert(pipe(wakeupPipe) == 0);
+    assert(pipe(eventPipe) == 0);
+    fcntl(wakeupPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeupPipe[1], F_SETFL, O_NONBLOCK);
+
+    cq2::Dispatcher::instance().setWakeupFunction(&wakeup_loop, NULL);
+
+    cq2::Handler<string> nameHandler(&handle_name);
+    nameHandler.listen();
+    cq2::Handler<Stamp> stampHandler(&handle_stamp);
+    stampHandler.listen();
+    cq2::Handler<int> timerHandler(&handle_timer);
+    timerHandler.listen();
+
+    // nothing to do, the loop sleeps for the whole timeout without wakeups
+    long long start = cq2::monotonicMicroseconds();
+    assert(not iterate(200));
+    long long idle = cq2::monotonicMicroseconds() - start;
+    cout << "idle iteration took " << idle / 1000 << " ms, wakeups " << wakeups << endl;
+    assert(idle >= 200000);
+    assert(wakeups == 0);
+
+    // commands sent from another thread wake up the poll
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer_thread, NULL);
+    while (latencies.size() < 200)
+        iterate(-1);
+    pthread_join(thread, NULL);
+
+    sort(latencies.begin(), latencies.end());
+    cout << "command latency through poll: median " << latencies[latencies.size() / 2]
+         << " us, max " << latencies.back() << " us, wakeups " << wakeups << endl;
+    assert(wakeups > 0);
+
+    // the poll timeout follows the next timer
+    timerDue = cq2::monotonicMicroseconds() + 50000;
+    cq2::Dispatcher::instance().schedule<int>(cq2::Command<int>(1), 50);
+    while (timerLate < 0)
+        iterate(-1);
+    cout << "timer fired " << timerLate << " us late" << endl;
+    assert(timerLate >= 0);
+
+    // events on the loop's descriptor and commands sent in between keep
+    // their order
+    order.clear();
+    for (int i = 0; i < 3; i++)
+    {
+        char event = '0' + i;
+        assert(write(eventPipe[1], &event, 1) == 1);
+        while (order.size() < (size_t) (2 * i + 1))
+            iterate(-1);
+        cq2::Command<string> navigate("navigate");
+        navigate();
+        while (order.size() < (size_t) (2 * i + 2))
+            iterate(-1);
+    }
+    assert(order.size() == 6);
+    assert(order[0] == "mount 0" && order[1] == "navigate");
+    assert(order[2] == "mount 1" && order[3] == "navigate");
+    assert(order[4] == "mount 2" && order[5] == "navigate");
+
+    // wakeup() makes a waiting loop return without a command
+    cq2::Dispatcher::instance().wakeup();
+    start = cq2::monotonicMicroseconds();
+    assert(iterate(1000));
+    assert(cq2::monotonicMicroseconds() - start < 100000);
+
+    cq2::Dispatcher::instance().setWakeupFunction(NULL, NULL);
+
+    return 0;
+}
@@ -18,6 +18,7 @@
  */
 
 #include <iostream>
+#include <vector>
 #include <assert.h>
 #include <stdlib.h>
 
@@ -25,9 +26,12 @@
 
 using namespace std;
 
+static vector<int> ints;
+
 void handle_int(int data)
 {
     cout << __PRETTY_FUNCTION__ << " " << data << endl;
+    ints.push_back(data);
 }
 
 void handle_string(string data)
@@ -35,6 +39,11 @@ void handle_string(string data)
     cout << __PRETTY_FUNCTION__ << " " << data << endl;
 }
 
+bool is_odd(const int& data)
+{
+    return data % 2 != 0;
+}
+
 int main()
 {
     // one handler for each command type
@@ -62,5 +71,37 @@ int main()
     assert(not cq2::Dispatcher::instance().dispatchCommand());
     assert(not cq2::Dispatcher::instance().dispatchCommand());
 
+    // flushing one type keeps the commands of other types
+    digit();
+    word();
+    digit();
+    assert(cq2::Dispatcher::instance().flush<string>() == 1);
+    assert(cq2::Dispatcher::instance().pending() == 2);
+    ints.clear();
+    assert(cq2::Dispatcher::instance().dispatchCommand());
+    assert(cq2::Dispatcher::instance().dispatchCommand());
+    assert(not cq2::Dispatcher::instance().dispatchCommand());
+    assert(ints.size() == 2);
+
+    // flushing with a predicate keeps the other commands in order, also
+    // commands in other lanes and commands sent after the flush
+    ints.clear();
+    for (int i = 0; i < 10; i++)
+    {
+        cq2::Command<int> number(i);
+        number();
+    }
+    cq2::CommandQueue<string>::instance().setLane(cq2::LANE_LOW);
+    word();
+    assert(cq2::Dispatcher::instance().flush<int>(is_odd) == 5);
+    cq2::Command<int> last(10);
+    last();
+    assert(cq2::Dispatcher::instance().pending() == 7);
+    while (cq2::Dispatcher::instance().dispatchCommand())
+        ;
+    assert(ints.size() == 6);
+    for (int i = 0; i < 6; i++)
+        assert(ints[i] == i * 2);
+
     return 0;
 }
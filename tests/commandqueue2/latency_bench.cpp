@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <unistd.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Measures how fast a thread blocked in Dispatcher::waitAndDispatch picks up
+// a command sent from another thread, run it with make bench.
+
+static volatile bool running = true;
+static volatile long handled = 0;
+static vector<long long> latencies;
+
+void handle_timestamp(long long enqueued)
+{
+    latencies.push_back(cq2::monotonicMicroseconds() - enqueued);
+    handled++;
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+
+    pthread_exit(NULL);
+}
+
+int main()
+{
+    cq2::Handler<long long> handler(&handle_timestamp);
+    handler.listen();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, dispatch_thread, NULL);
+
+    // send commands with a pause in between so that each one has to wake up
+    // the dispatching thread
+    const long count = 1000;
+    for (long i = 0; i < count; i++)
+    {
+        cq2::Command<long long> stamp(cq2::monotonicMicroseconds());
+        stamp();
+        usleep(1000);
+    }
+
+    // wait for the last command to be handled
+    while (handled < count)
+        usleep(1000);
+
+    sort(latencies.begin(), latencies.end());
+    long long median = latencies[count / 2];
+    long long p99 = latencies[count * 99 / 100];
+    cout << "enqueue to handle latency: median " << median << " us, p99 " << p99 << " us, max " << latencies.back() << " us" << endl;
+    assert(median < 1000);
+
+    // stop the dispatching thread
+    running = false;
+    cq2::Dispatcher::instance().wakeup();
+    pthread_join(thread, NULL);
+
+    return 0;
+}
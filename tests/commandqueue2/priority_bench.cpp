@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Measures key press to handler latency while the queue is flooded with
+// position updates, with and without priority lanes, run it with make bench.
+
+struct Key
+{
+    long long sent;
+    Key(long long s = 0) : sent(s) {}
+};
+
+struct Position
+{
+    long second;
+    Position(long s = 0) : second(s) {}
+};
+
+static const int keyCount = 300;
+static vector<long long> keyLatencies;
+static long positionCount = 0;
+static volatile bool flooding = true;
+
+static void busy(long long microseconds)
+{
+    long long end = cq2::monotonicMicroseconds() + microseconds;
+    while (cq2::monotonicMicroseconds() < end)
+        ;
+}
+
+void handle_key(Key key)
+{
+    keyLatencies.push_back(cq2::monotonicMicroseconds() - key.sent);
+}
+
+void handle_position(Position)
+{
+    // pretend to update a user interface
+    busy(20);
+    positionCount++;
+}
+
+void* position_flood(void*)
+{
+    long second = 0;
+    while (flooding)
+    {
+        // a burst of updates, e.g. after the core thread has been stalled
+        for (int i = 0; i < 200; i++)
+        {
+            cq2::Command<Position> position(second++);
+            position();
+        }
+        usleep(5000);
+    }
+
+    pthread_exit(NULL);
+}
+
+void* key_presses(void*)
+{
+    for (int i = 0; i < keyCount; i++)
+    {
+        cq2::Command<Key> key(cq2::monotonicMicroseconds());
+        key();
+        usleep(3000);
+    }
+
+    flooding = false;
+    pthread_exit(NULL);
+}
+
+long long run_flood(const char* description)
+{
+    keyLatencies.clear();
+    positionCount = 0;
+    flooding = true;
+
+    pthread_t flood, keys;
+    pthread_create(&flood, NULL, position_flood, NULL);
+    pthread_create(&keys, NULL, key_presses, NULL);
+
+    while (flooding or cq2::Dispatcher::instance().pending() > 0)
+        cq2::Dispatcher::instance().waitAndDispatch(10);
+
+    pthread_join(flood, NULL);
+    pthread_join(keys, NULL);
+    while (cq2::Dispatcher::instance().dispatchCommand())
+        ;
+
+    assert(keyLatencies.size() == (size_t) keyCount);
+    sort(keyLatencies.begin(), keyLatencies.end());
+    long long p99 = keyLatencies[keyCount * 99 / 100];
+    cout << description << ": " << positionCount << " position updates, key latency p50 "
+         << keyLatencies[keyCount / 2] << " us, p99 " << p99 << " us" << endl;
+    return p99;
+}
+
+int main()
+{
+    cq2::Handler<Key> keyHandler(&handle_key);
+    keyHandler.listen();
+    cq2::Handler<Position> positionHandler(&handle_position);
+    positionHandler.listen();
+
+    // everything in one lane, keys wait behind the queued updates
+    long long fifo = run_flood("single lane");
+
+    // keys in the high lane, updates in the low lane
+    cq2::CommandQueue<Key>::instance().setLane(cq2::LANE_HIGH);
+    cq2::CommandQueue<Position>::instance().setLane(cq2::LANE_LOW);
+    long long lanes = run_flood("priority lanes");
+    assert(lanes < fifo);
+
+    cq2::LaneStats high = cq2::Dispatcher::instance().laneStats(cq2::LANE_HIGH);
+    cq2::LaneStats low = cq2::Dispatcher::instance().laneStats(cq2::LANE_LOW);
+    cout << "high lane: " << high.dispatched << " dispatched, max depth " << high.maxDepth
+         << ", average wait " << high.totalWait / high.dispatched << " us" << endl;
+    cout << "low lane: " << low.dispatched << " dispatched, max depth " << low.maxDepth
+         << ", average wait " << low.totalWait / low.dispatched << " us" << endl;
+    assert(high.depth == 0 && low.depth == 0);
+    assert(high.dispatched == keyCount);
+
+    return 0;
+}
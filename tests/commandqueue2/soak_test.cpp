@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <new>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Flushes the queue a million times with commands of several types waiting,
+// and verifies that no memory is leaked by counting live heap allocations.
+// Also verifies that sending and dispatching commands does not allocate.
+
+#if __cplusplus >= 201103L
+#define THROWS_BAD_ALLOC
+#define THROWS_NOTHING noexcept
+#else
+#define THROWS_BAD_ALLOC throw (std::bad_alloc)
+#define THROWS_NOTHING throw ()
+#endif
+
+static long liveAllocations = 0;
+static long totalAllocations = 0;
+
+void* operator new(size_t size) THROWS_BAD_ALLOC
+{
+    void* p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    __sync_add_and_fetch(&liveAllocations, 1);
+    __sync_add_and_fetch(&totalAllocations, 1);
+    return p;
+}
+
+void operator delete(void* p) THROWS_NOTHING
+{
+    if (p == NULL)
+        return;
+    __sync_sub_and_fetch(&liveAllocations, 1);
+    free(p);
+}
+
+#if __cplusplus >= 201402L
+void operator delete(void* p, size_t) THROWS_NOTHING
+{
+    operator delete(p);
+}
+#endif
+
+struct Position
+{
+    long ms;
+    Position(long m = 0) : ms(m) {}
+};
+
+static long handled = 0;
+
+void handle_int(int)
+{
+    handled++;
+}
+
+void handle_string(string)
+{
+    handled++;
+}
+
+void handle_position(Position)
+{
+    handled++;
+}
+
+bool is_odd(const int& data)
+{
+    return data % 2 != 0;
+}
+
+static long residentPages()
+{
+    long size = 0, resident = 0;
+    ifstream statm("/proc/self/statm");
+    statm >> size >> resident;
+    return resident;
+}
+
+void cycle(long i)
+{
+    cq2::Dispatcher& dispatcher = cq2::Dispatcher::instance();
+
+    for (int j = 0; j < 4; j++)
+    {
+        cq2::Command<int> number(j);
+        number();
+        cq2::Command<string> word("a string long enough to be allocated on the heap");
+        word();
+        cq2::Command<Position> position(j);
+        position();
+    }
+
+    // alternate between the kinds of flushing, dispatch what is left
+    switch (i % 4)
+    {
+    case 0:
+        dispatcher.flushQueue();
+        break;
+    case 1:
+        assert(dispatcher.flush<string>() == 4);
+        break;
+    case 2:
+        assert(dispatcher.flush<int>(is_odd) == 2);
+        break;
+    case 3:
+        dispatcher.flush<Position>();
+        dispatcher.flush<int>();
+        break;
+    }
+    while (dispatcher.dispatchCommand())
+        ;
+    assert(dispatcher.pending() == 0);
+}
+
+int main()
+{
+    cq2::Handler<int> handler1(&handle_int);
+    handler1.listen();
+    cq2::Handler<string> handler2(&handle_string);
+    handler2.listen();
+    cq2::Handler<Position> handler3(&handle_position);
+    handler3.listen();
+
+    cq2::CommandQueue<Position>::instance().setCoalescing(true);
+    cq2::CommandQueue<string>::instance().setLane(cq2::LANE_LOW);
+
+    // warm up the node pools
+    const long warmup = 1000;
+    for (long i = 0; i < warmup; i++)
+        cycle(i);
+
+    long allocations = liveAllocations;
+    long pages = residentPages();
+    handled = 0;
+
+    const long flushes = 1000000;
+    for (long i = 0; i < flushes; i++)
+        cycle(i);
+
+    cout << flushes << " flushes, " << handled << " commands handled" << endl;
+    cout << "live allocations: " << allocations << " before, " << liveAllocations << " after" << endl;
+    cout << "resident pages: " << pages << " before, " << residentPages() << " after" << endl;
+
+    // positions are coalesced into one command, per four cycles 6 ints,
+    // 8 strings and 2 positions are left
+    assert(handled == flushes / 4 * (0 + 5 + 7 + 4));
+    assert(liveAllocations == allocations);
+
+    // once the node pool is warm, sending and dispatching allocates nothing
+    long before = totalAllocations;
+    for (int i = 0; i < 100000; i++)
+    {
+        cq2::Command<int> number(i);
+        number();
+        cq2::Command<Position> position(i);
+        position();
+        while (cq2::Dispatcher::instance().dispatchCommand())
+            ;
+    }
+    cout << "allocations while dispatching: " << totalAllocations - before << endl;
+    assert(totalAllocations == before);
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Verifies the statistics collected when cq2 is built with CQ2_STATS.
+
+#ifndef CQ2_STATS
+#error "stats_test must be built with CQ2_STATS defined"
+#endif
+
+enum TEST_COMMAND
+{
+    TEST_FAST,
+    TEST_SLOW,
+};
+
+struct Position
+{
+    long ms;
+    Position(long m = 0) : ms(m) {}
+};
+
+void handle_command(TEST_COMMAND command)
+{
+    if (command == TEST_SLOW)
+        usleep(2000);
+}
+
+void handle_position(Position)
+{
+}
+
+long histogramTotal(const cq2::Histogram& histogram)
+{
+    long total = 0;
+    for (int i = 0; i < cq2::Histogram::BUCKETS; i++)
+        total += histogram.counts[i];
+    return total;
+}
+
+const cq2::CommandStats* find(const vector<cq2::CommandStats>& stats, const string& type, long value)
+{
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        if (stats[i].type == type && stats[i].value == value)
+            return &stats[i];
+    }
+    return NULL;
+}
+
+int main()
+{
+    cq2::Dispatcher& dispatcher = cq2::Dispatcher::instance();
+
+    cq2::Handler<TEST_COMMAND> commandHandler(&handle_command);
+    commandHandler.listen();
+    cq2::Handler<Position> positionHandler(&handle_position);
+    positionHandler.listen();
+    cq2::CommandQueue<Position>::instance().setCoalescing(true);
+
+    // nothing has been sent yet
+    assert(dispatcher.stats().empty());
+
+    for (int i = 0; i < 3; i++)
+    {
+        cq2::Command<TEST_COMMAND> fast(TEST_FAST);
+        fast();
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        cq2::Command<TEST_COMMAND> slow(TEST_SLOW);
+        slow();
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        cq2::Command<Position> position(i);
+        position();
+    }
+
+    // depths are counted per enum value while the commands are waiting
+    vector<cq2::CommandStats> stats = dispatcher.stats();
+    assert(stats.size() == 3);
+    const cq2::CommandStats* fast = find(stats, "TEST_COMMAND", TEST_FAST);
+    const cq2::CommandStats* slow = find(stats, "TEST_COMMAND", TEST_SLOW);
+    const cq2::CommandStats* position = find(stats, "Position", -1);
+    assert(fast != NULL && slow != NULL && position != NULL);
+    assert(fast->enqueued == 3 && fast->depth == 3 && fast->maxDepth == 3);
+    assert(slow->enqueued == 2 && slow->depth == 2);
+    assert(position->enqueued == 10 && position->depth == 1);
+
+    usleep(5000);
+    while (dispatcher.dispatchCommand())
+        ;
+
+    stats = dispatcher.stats();
+    fast = find(stats, "TEST_COMMAND", TEST_FAST);
+    slow = find(stats, "TEST_COMMAND", TEST_SLOW);
+    position = find(stats, "Position", -1);
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        cout << stats[i].type << " " << stats[i].value << ": " << stats[i].enqueued << " enqueued, "
+                << stats[i].dispatched << " dispatched, max depth " << stats[i].maxDepth
+                << ", wait p50 " << stats[i].wait.percentile(0.5) << " us max " << stats[i].wait.max
+                << " us, handling p50 " << stats[i].handling.percentile(0.5) << " us max "
+                << stats[i].handling.max << " us" << endl;
+    }
+
+    assert(fast->depth == 0 && fast->dispatched == 3);
+    assert(slow->depth == 0 && slow->dispatched == 2);
+    assert(position->depth == 0 && position->dispatched == 1);
+    assert(histogramTotal(fast->wait) == 3 && histogramTotal(fast->handling) == 3);
+    assert(histogramTotal(slow->handling) == 2);
+
+    // the commands waited at least 5 ms, the slow ones took 2 ms to handle
+    assert(fast->wait.max >= 5000);
+    assert(slow->handling.max >= 2000);
+    assert(fast->handling.max < 2000);
+
+    // flushed commands are not counted as dispatched
+    cq2::Command<TEST_COMMAND> flushed(TEST_FAST);
+    flushed();
+    dispatcher.flushQueue();
+    stats = dispatcher.stats();
+    fast = find(stats, "TEST_COMMAND", TEST_FAST);
+    assert(fast->enqueued == 4 && fast->dispatched == 3 && fast->depth == 0);
+
+    // overhead of the instrumentation
+    const long count = 1000000;
+    long long start = cq2::monotonicMicroseconds();
+    for (long i = 0; i < count; i++)
+    {
+        cq2::Command<TEST_COMMAND> command(TEST_FAST);
+        command();
+        dispatcher.dispatchCommand();
+    }
+    long long elapsed = cq2::monotonicMicroseconds() - start;
+    cout << "send and dispatch with statistics: " << elapsed * 1000 / count << " ns per command" << endl;
+
+    return 0;
+}
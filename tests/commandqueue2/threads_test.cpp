@@ -105,6 +105,43 @@ void handle_string(string data)
 
 }
 
+// ORDER UNDER CONTENTION
+
+struct Stamp
+{
+    int producer;
+    long sequence;
+};
+
+static const int orderProducers = 8;
+static const long orderCommands = 80000;
+static long lastSequence[orderProducers];
+static long stampCount = 0;
+
+void handle_stamp(Stamp stamp)
+{
+    // commands from one producer must arrive in the order they were sent
+    assert(stamp.sequence == lastSequence[stamp.producer] + 1);
+    lastSequence[stamp.producer] = stamp.sequence;
+    stampCount++;
+}
+
+void* stamp_producer(void* arg)
+{
+    int producer = *(int*) arg;
+
+    for (long i = 1; i <= orderCommands / orderProducers; i++)
+    {
+        Stamp stamp;
+        stamp.producer = producer;
+        stamp.sequence = i;
+        cq2::Command<Stamp> command(stamp);
+        command();
+    }
+
+    pthread_exit(NULL);
+}
+
 int main()
 {
     // One handler for each command type
@@ -181,5 +218,20 @@ int main()
         assert(false);
     }
 
+    cq2::Handler<Stamp> stampHandler(&handle_stamp);
+    stampHandler.listen();
+    pthread_t producers[orderProducers];
+    int ids[orderProducers];
+    for (int i = 0; i < orderProducers; i++)
+    {
+        ids[i] = i;
+        pthread_create(&producers[i], NULL, stamp_producer, &ids[i]);
+    }
+    while (stampCount < orderCommands)
+        cq2::Dispatcher::instance().waitAndDispatch(100);
+    for (int i = 0; i < orderProducers; i++)
+        pthread_join(producers[i], NULL);
+    assert(not cq2::Dispatcher::instance().dispatchCommand());
+
     cout << "The end, alles OK!" << endl;
 }
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Measures throughput and enqueue to handle latency with contending
+// producers, run it with make bench.
+
+struct Stamp
+{
+    int producer;
+    long sequence;
+    long enqueued;
+};
+
+static const int maxProducers = 16;
+static const long benchmarkCommands = 320000;
+static long lastSequence[maxProducers];
+static long stampCount = 0;
+static vector<long> stampLatencies;
+
+static long nowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void handle_stamp(Stamp stamp)
+{
+    // commands from one producer must arrive in the order they were sent
+    assert(stamp.sequence == lastSequence[stamp.producer] + 1);
+    lastSequence[stamp.producer] = stamp.sequence;
+
+    stampLatencies.push_back(nowMicroseconds() - stamp.enqueued);
+    stampCount++;
+}
+
+struct ProducerArgs
+{
+    int producer;
+    long count;
+};
+
+void* stamp_producer(void* arg)
+{
+    ProducerArgs* args = (ProducerArgs*) arg;
+
+    for (long i = 1; i <= args->count; i++)
+    {
+        Stamp stamp;
+        stamp.producer = args->producer;
+        stamp.sequence = i;
+        stamp.enqueued = nowMicroseconds();
+        cq2::Command<Stamp> command(stamp);
+        command();
+    }
+
+    pthread_exit(NULL);
+}
+
+// Send benchmarkCommands commands from a number of threads and dispatch them
+// from this thread, report throughput and enqueue to handle latency
+void contention_benchmark(int producers)
+{
+    cq2::Handler<Stamp> handler(&handle_stamp);
+    handler.listen();
+
+    stampCount = 0;
+    stampLatencies.clear();
+    stampLatencies.reserve(benchmarkCommands);
+    for (int i = 0; i < maxProducers; i++)
+        lastSequence[i] = 0;
+
+    pthread_t threads[maxProducers];
+    ProducerArgs args[maxProducers];
+    long start = nowMicroseconds();
+    for (int i = 0; i < producers; i++)
+    {
+        args[i].producer = i;
+        args[i].count = benchmarkCommands / producers;
+        pthread_create(&threads[i], NULL, stamp_producer, &args[i]);
+    }
+
+    while (stampCount < benchmarkCommands)
+        cq2::Dispatcher::instance().waitAndDispatch(100);
+
+    long elapsed = nowMicroseconds() - start;
+
+    for (int i = 0; i < producers; i++)
+        pthread_join(threads[i], NULL);
+
+    assert(stampCount == benchmarkCommands);
+    assert(not cq2::Dispatcher::instance().dispatchCommand());
+
+    sort(stampLatencies.begin(), stampLatencies.end());
+    cout << producers << " producer(s): "
+         << (long long) benchmarkCommands * 1000000 / elapsed << " commands/s, latency"
+         << " p50 " << stampLatencies[benchmarkCommands / 2] << " us"
+         << " p99 " << stampLatencies[benchmarkCommands * 99 / 100] << " us" << endl;
+}
+
+int main()
+{
+    contention_benchmark(1);
+    contention_benchmark(4);
+    contention_benchmark(16);
+
+    return 0;
+}
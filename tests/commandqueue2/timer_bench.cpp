@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <vector>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Measures how late scheduled commands are sent on an idle and on a busy
+// queue and how well a repeating timer keeps its period, run it with make
+// bench.
+
+struct Tick
+{
+    int id;
+    long long due;
+    Tick(int i = 0, long long d = 0) : id(i), due(d) {}
+};
+
+static volatile bool running = true;
+static volatile long handled = 0;
+static vector<int> order;
+static vector<long long> lateness;
+
+void handle_tick(Tick tick)
+{
+    order.push_back(tick.id);
+    lateness.push_back(cq2::monotonicMicroseconds() - tick.due);
+    handled++;
+}
+
+void handle_flood(int)
+{
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+
+    pthread_exit(NULL);
+}
+
+cq2::TimerId scheduleTick(int id, long delay, long interval = 0)
+{
+    cq2::Command<Tick> tick(Tick(id, cq2::monotonicMicroseconds() + delay * 1000LL));
+    return cq2::Dispatcher::instance().schedule(tick, delay, interval);
+}
+
+void waitHandled(long count)
+{
+    while (handled < count)
+        usleep(1000);
+}
+
+void reset()
+{
+    waitHandled(handled);
+    order.clear();
+    lateness.clear();
+    handled = 0;
+}
+
+int main()
+{
+    cq2::Dispatcher& dispatcher = cq2::Dispatcher::instance();
+
+    cq2::Handler<Tick> tickHandler(&handle_tick);
+    tickHandler.listen();
+    cq2::Handler<int> floodHandler(&handle_flood);
+    floodHandler.listen();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, dispatch_thread, NULL);
+
+    // timers expire on time on an idle queue
+    scheduleTick(3, 150);
+    scheduleTick(1, 50);
+    scheduleTick(2, 100);
+    waitHandled(3);
+    for (size_t i = 0; i < lateness.size(); i++)
+    {
+        cout << "timer " << order[i] << " expired " << lateness[i] << " us late" << endl;
+        assert(lateness[i] >= 0);
+        assert(lateness[i] < 20000);
+    }
+    reset();
+
+    // a repeating timer keeps its period until it is cancelled
+    cq2::TimerId repeating = scheduleTick(5, 20, 20);
+    usleep(210000);
+    assert(dispatcher.cancel(repeating));
+    long repetitions = handled;
+    cout << "repeating timer expired " << repetitions << " times in 210 ms" << endl;
+    assert(repetitions >= 9 && repetitions <= 11);
+    reset();
+
+    // timers expire on time while the queue is busy, the tick is put in the
+    // high lane so that it does not wait behind the flood once it is sent
+    cq2::CommandQueue<Tick>::instance().setLane(cq2::LANE_HIGH);
+    scheduleTick(7, 50);
+    long long stop = cq2::monotonicMicroseconds() + 150000;
+    while (cq2::monotonicMicroseconds() < stop)
+    {
+        cq2::Command<int> flood(0);
+        flood();
+    }
+    waitHandled(1);
+    cout << "timer expired " << lateness[0] << " us late on a busy queue" << endl;
+    assert(lateness[0] < 20000);
+    reset();
+
+    // stop the dispatching thread
+    running = false;
+    dispatcher.wakeup();
+    pthread_join(thread, NULL);
+
+    return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/VirtualClock.h"
+#include "NarratorCompletion.h"
+
+#include <boost/signals2.hpp>
+
+using namespace std;
+
+// Microbenchmark of cq2 commands, timers and NarratorCompletion on a
+// VirtualClock. It replays the command and timer pattern of a listening
+// session: welcome message, login, browsing the menu, opening a book,
+// playing it phrase by phrase with bookmarks and a 30 minute sleep timer.
+// ClientCore, Navi, the narrator and the player are not used, the handlers
+// below only post the commands they would have caused. The session covers
+// more than half an hour of timers and is expected to run in a fraction of
+// a second, the benchmark reports how many commands per second are
+// dispatched. Run it with make bench.
+
+enum SessionEvent
+{
+    WELCOME_DONE,
+    LOGGED_IN,
+    BROWSE_KEY,
+    BOOK_OPENED,
+    PHRASE_END,
+    POSITION_TICK,
+    ADD_BOOKMARK,
+    BOOKMARK_DONE,
+    SLEEP_NEAR_TIMEOUT,
+    SLEEP_TIMEOUT,
+    NARRATOR_FINISHED
+};
+
+struct Position
+{
+    Position(int p = 0, long long t = 0) : phrase(p), time(t) {}
+    int phrase;
+    long long time;
+};
+
+static const int browseKeys = 20;
+static const long keyInterval = 400;
+static const long loginDelay = 800;
+static const long sleepMinutes = 30;
+static const long bookmarkInterval = 10 * 60 * 1000;
+
+static cq2::VirtualClock virtualClock;
+
+// Narrator that speaks one prompt at a time, a new prompt interrupts. It
+// signals that its audio has finished like the real narrator.
+struct SimNarrator
+{
+    SimNarrator() : prompts(0), finishTimer(0) {}
+
+    void play(long duration)
+    {
+        cq2::Dispatcher::instance().cancel(finishTimer);
+        cq2::Command<SessionEvent> finished(NARRATOR_FINISHED);
+        finishTimer = cq2::Dispatcher::instance().schedule(finished, duration);
+        prompts++;
+    }
+
+    boost::signals2::connection connectAudioFinished(const boost::function<void()>& slot)
+    {
+        return audioFinished.connect(slot);
+    }
+
+    long prompts;
+    cq2::TimerId finishTimer;
+    boost::signals2::signal<void()> audioFinished;
+};
+
+// Player for a book made of phrases of 2 to 6 seconds
+struct SimPlayer
+{
+    SimPlayer() : phrase(0), playing(false), phraseTimer(0), tickTimer(0) {}
+
+    long phraseDuration(int index)
+    {
+        return 2000 + (index * 7919) % 4000;
+    }
+
+    void play()
+    {
+        playing = true;
+        cq2::Command<SessionEvent> end(PHRASE_END);
+        phraseTimer = cq2::Dispatcher::instance().schedule(end, phraseDuration(phrase));
+        cq2::Command<SessionEvent> tick(POSITION_TICK);
+        tickTimer = cq2::Dispatcher::instance().schedule(tick, 1000, 1000);
+    }
+
+    void stop()
+    {
+        playing = false;
+        cq2::Dispatcher::instance().cancel(phraseTimer);
+        cq2::Dispatcher::instance().cancel(tickTimer);
+    }
+
+    void nextPhrase()
+    {
+        phrase++;
+        cq2::Command<SessionEvent> end(PHRASE_END);
+        phraseTimer = cq2::Dispatcher::instance().schedule(end, phraseDuration(phrase));
+    }
+
+    int phrase;
+    bool playing;
+    cq2::TimerId phraseTimer;
+    cq2::TimerId tickTimer;
+};
+
+static SimNarrator narrator;
+static SimPlayer player;
+static bool finished = false;
+static long keys = 0;
+static long bookmarks = 0;
+static long positions = 0;
+static long long dispatched = 0;
+static long long sleepTimerSet = 0;
+static long long nearTimeoutAt = 0;
+static long long timeoutAt = 0;
+static cq2::TimerId bookmarkTimer = 0;
+
+void handle_position(Position position)
+{
+    assert(position.phrase <= player.phrase);
+    positions++;
+    dispatched++;
+}
+
+void handle_event(SessionEvent event)
+{
+    dispatched++;
+    switch (event)
+    {
+    case WELCOME_DONE:
+        {
+            // log in to the service, the request takes a while
+            cq2::Command<SessionEvent> loggedIn(LOGGED_IN);
+            cq2::Dispatcher::instance().schedule(loggedIn, loginDelay);
+        }
+        break;
+    case LOGGED_IN:
+        {
+            // browse the menu, each key press announces the next item
+            cq2::Command<SessionEvent> key(BROWSE_KEY);
+            cq2::Dispatcher::instance().schedule(key, keyInterval);
+        }
+        break;
+    case BROWSE_KEY:
+        narrator.play(600);
+        if (++keys < browseKeys)
+        {
+            cq2::Command<SessionEvent> key(BROWSE_KEY);
+            cq2::Dispatcher::instance().schedule(key, keyInterval);
+        }
+        else
+        {
+            // open the selected book when its name has been announced
+            NarratorCompletion announced(&narrator);
+            announced.whenDone(cq2::Command<SessionEvent>(BOOK_OPENED));
+        }
+        break;
+    case BOOK_OPENED:
+        {
+            sleepTimerSet = cq2::nowMicroseconds();
+            cq2::Command<SessionEvent> near(SLEEP_NEAR_TIMEOUT);
+            cq2::Dispatcher::instance().schedule(near, sleepMinutes * 60 * 1000 - 30 * 1000);
+            cq2::Command<SessionEvent> timeout(SLEEP_TIMEOUT);
+            cq2::Dispatcher::instance().schedule(timeout, sleepMinutes * 60 * 1000);
+            cq2::Command<SessionEvent> bookmark(ADD_BOOKMARK);
+            bookmarkTimer = cq2::Dispatcher::instance().schedule(bookmark, bookmarkInterval, bookmarkInterval);
+            player.play();
+        }
+        break;
+    case PHRASE_END:
+        player.nextPhrase();
+        break;
+    case POSITION_TICK:
+        {
+            cq2::Command<Position> position(Position(player.phrase, cq2::nowMicroseconds()));
+            position();
+        }
+        break;
+    case ADD_BOOKMARK:
+        {
+            // pause while the narrator confirms the bookmark
+            player.stop();
+            narrator.play(1500);
+            NarratorCompletion confirmed(&narrator);
+            confirmed.whenDone(cq2::Command<SessionEvent>(BOOKMARK_DONE));
+        }
+        break;
+    case BOOKMARK_DONE:
+        bookmarks++;
+        if (not finished)
+            player.play();
+        break;
+    case SLEEP_NEAR_TIMEOUT:
+        nearTimeoutAt = cq2::nowMicroseconds();
+        narrator.play(2000);
+        break;
+    case SLEEP_TIMEOUT:
+        timeoutAt = cq2::nowMicroseconds();
+        player.stop();
+        cq2::Dispatcher::instance().cancel(bookmarkTimer);
+        finished = true;
+        break;
+    case NARRATOR_FINISHED:
+        narrator.finishTimer = 0;
+        narrator.audioFinished();
+        break;
+    }
+}
+
+int main()
+{
+    cq2::setClockSource(&virtualClock);
+    cq2::CommandQueue<Position>::instance().setCoalescing(true);
+
+    cq2::Handler<SessionEvent> eventHandler(&handle_event);
+    eventHandler.listen();
+    cq2::Handler<Position> positionHandler(&handle_position);
+    positionHandler.listen();
+
+    long long realStart = cq2::monotonicMicroseconds();
+    long long virtualStart = cq2::nowMicroseconds();
+
+    // say welcome and start the session when it has been spoken
+    narrator.play(2500);
+    NarratorCompletion welcome(&narrator);
+    welcome.whenDone(cq2::Command<SessionEvent>(WELCOME_DONE));
+
+    while (not finished)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+
+    long long realElapsed = cq2::monotonicMicroseconds() - realStart;
+    long long virtualElapsed = cq2::nowMicroseconds() - virtualStart;
+    if (realElapsed <= 0)
+        realElapsed = 1;
+
+    cout << "simulated " << virtualElapsed / 1000000 << " s in " << realElapsed << " us real time, speedup "
+         << virtualElapsed / realElapsed << "x" << endl;
+    cout << "phrases played: " << player.phrase << ", positions: " << positions << ", bookmarks: " << bookmarks
+         << ", prompts: " << narrator.prompts << endl;
+    cout << "dispatched " << dispatched << " cq2 commands, " << dispatched * 1000000LL / realElapsed
+         << " commands per second" << endl;
+
+    // the session ran to the sleep timeout, timers fired on virtual time
+    assert(keys == browseKeys);
+    assert(timeoutAt - sleepTimerSet == sleepMinutes * 60 * 1000000LL);
+    assert(timeoutAt - nearTimeoutAt == 30 * 1000000LL);
+    assert(bookmarks == sleepMinutes * 60 * 1000 / bookmarkInterval - 1);
+    assert(player.phrase > sleepMinutes * 60 / 6);
+    assert(positions > 0);
+
+    // more than half an hour of session in well under a minute
+    assert(virtualElapsed > sleepMinutes * 60 * 1000000LL);
+    assert(realElapsed < 60 * 1000000LL);
+
+    cq2::setClockSource(NULL);
+    return 0;
+}
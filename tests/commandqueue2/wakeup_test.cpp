@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "CommandQueue2/CommandQueue.h"
+
+using namespace std;
+
+// Verifies that a thread blocked in Dispatcher::waitAndDispatch does not wake
+// up while the queue is idle and that each new command wakes it up. How fast
+// it picks them up is measured by latency_bench.
+
+static volatile bool running = true;
+static long wakeups = 0;
+static long handled = 0;
+
+static long nowMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void handle_timestamp(long)
+{
+    handled++;
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+    {
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+        wakeups++;
+    }
+
+    pthread_exit(NULL);
+}
+
+int main()
+{
+    cq2::Handler<long> handler(&handle_timestamp);
+    handler.listen();
+
+    // a timed wait on an empty queue returns without dispatching
+    long start = nowMicroseconds();
+    assert(not cq2::Dispatcher::instance().waitAndDispatch(50));
+    long waited = nowMicroseconds() - start;
+    cout << "timed wait returned after " << waited << " us" << endl;
+    assert(waited >= 50000);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, dispatch_thread, NULL);
+
+    // idle for a second, the dispatching thread should not wake up at all
+    sleep(1);
+    cout << "wakeups while idle: " << wakeups << endl;
+    assert(wakeups == 0);
+
+    // send commands with a pause in between so that each one has to wake up
+    // the dispatching thread
+    const long count = 1000;
+    for (long i = 0; i < count; i++)
+    {
+        cq2::Command<long> stamp(nowMicroseconds());
+        stamp();
+        usleep(1000);
+    }
+
+    // wait for the last command to be handled
+    while (handled < count)
+        usleep(1000);
+
+    // stop the dispatching thread
+    running = false;
+    cq2::Dispatcher::instance().wakeup();
+    pthread_join(thread, NULL);
+
+    // one wakeup per command plus the final wakeup
+    cout << "wakeups while active: " << wakeups - 1 << endl;
+    assert(wakeups == count + 1);
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <unistd.h>
+
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/WorkerPool.h"
+#include "CommandQueue2/Atomic.h"
+#include "CommandQueue2/Clock.h"
+
+using namespace std;
+
+// Verifies that blocking work in a WorkerHandler keeps the dispatching thread
+// responsive, that jobs of one handler run in order while different handlers
+// run concurrently, that results are posted back as commands and that a
+// handler can be released without waiting for its running job.
+
+struct Job
+{
+    Job() : lane(0), seq(0) {}
+    Job(int l, int s) : lane(l), seq(s) {}
+    int lane;
+    int seq;
+};
+
+struct Result
+{
+    Result() : lane(0), seq(0) {}
+    Result(int l, int s) : lane(l), seq(s) {}
+    int lane;
+    int seq;
+};
+
+static const int lanes = 3;
+static const long blockMicroseconds = 20000;
+
+static volatile bool running = true;
+static pthread_t dispatcher;
+static long active = 0;
+static long maxActive = 0;
+static vector<int> started[lanes];
+static vector<int> results[lanes];
+static vector<long long> latencies;
+static long handledResults = 0;
+
+// Runs on a worker thread and blocks like a network call
+void blocking_work(Job job)
+{
+    assert(not pthread_equal(pthread_self(), dispatcher));
+
+    long now = cq2::atomic::add(&active, 1L);
+    long seen = cq2::atomic::load(&maxActive);
+    while (now > seen && not cq2::atomic::compareAndSwap(&maxActive, seen, now))
+        seen = cq2::atomic::load(&maxActive);
+
+    started[job.lane].push_back(job.seq);
+    usleep(blockMicroseconds);
+    cq2::atomic::add(&active, -1L);
+
+    cq2::Command<Result> result(Result(job.lane, job.seq));
+    result();
+}
+
+static volatile int gateOpen = 0;
+static long gatedStarted = 0;
+static long destroyedWorkers = 0;
+
+// Runs on a worker thread and blocks until the gate is opened
+void gated_work(Job)
+{
+    cq2::atomic::add(&gatedStarted, 1L);
+    while (not cq2::atomic::load(&gateOpen))
+        usleep(1000);
+}
+
+// Counts the handlers that have been deleted
+struct CountedWorker: public cq2::WorkerHandler<Job>
+{
+    CountedWorker() : cq2::WorkerHandler<Job>(&gated_work) {}
+    ~CountedWorker()
+    {
+        cq2::atomic::add(&destroyedWorkers, 1L);
+    }
+};
+
+// Runs on the dispatching thread
+void handle_result(Result result)
+{
+    assert(pthread_equal(pthread_self(), dispatcher));
+    results[result.lane].push_back(result.seq);
+    handledResults++;
+}
+
+void handle_timestamp(long long enqueued)
+{
+    latencies.push_back(cq2::monotonicMicroseconds() - enqueued);
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+
+    pthread_exit(NULL);
+}
+
+int main()
+{
+    cq2::WorkerPool::instance().setMaxThreads(2);
+
+    cq2::Handler<Result> resultHandler(&handle_result);
+    resultHandler.listen();
+    cq2::Handler<long long> stampHandler(&handle_timestamp);
+    stampHandler.listen();
+
+    // one worker handler per lane, the first two receive commands through the
+    // dispatcher and the third one is posted to directly
+    cq2::WorkerHandler<Job>* workers[lanes];
+    for (int i = 0; i < lanes; i++)
+        workers[i] = new cq2::WorkerHandler<Job>(&blocking_work);
+    workers[0]->listen();
+
+    pthread_create(&dispatcher, NULL, dispatch_thread, NULL);
+
+    const int jobs = 10;
+    for (int seq = 0; seq < jobs; seq++)
+    {
+        cq2::Command<Job> job(Job(0, seq));
+        job();
+        workers[1]->post(Job(1, seq));
+        workers[2]->post(Job(2, seq));
+    }
+
+    // while the workers block the dispatching thread keeps handling commands
+    long long start = cq2::monotonicMicroseconds();
+    while (cq2::WorkerPool::instance().pending() > 0)
+    {
+        cq2::Command<long long> stamp(cq2::monotonicMicroseconds());
+        stamp();
+        usleep(1000);
+    }
+    long long elapsed = cq2::monotonicMicroseconds() - start;
+
+    // wait for the last results to be dispatched
+    while (handledResults < jobs * lanes)
+        usleep(1000);
+
+    sort(latencies.begin(), latencies.end());
+    cout << "dispatch latency while workers block: median " << latencies[latencies.size() / 2]
+         << " us, max " << latencies.back() << " us" << endl;
+    assert(latencies.back() < blockMicroseconds);
+
+    // bounded concurrency, the three handlers share two threads
+    cout << "max concurrent jobs: " << maxActive << ", elapsed " << elapsed / 1000 << " ms" << endl;
+    assert(maxActive == 2);
+    assert(elapsed >= jobs * lanes * blockMicroseconds / 2);
+
+    // FIFO per handler, both for the jobs and for the results they posted
+    for (int i = 0; i < lanes; i++)
+    {
+        assert(started[i].size() == (size_t)jobs);
+        assert(results[i].size() == (size_t)jobs);
+        for (int seq = 0; seq < jobs; seq++)
+        {
+            assert(started[i][seq] == seq);
+            assert(results[i][seq] == seq);
+        }
+    }
+
+    // cancel drops queued jobs and waits for the running one
+    for (int seq = 0; seq < jobs; seq++)
+        workers[2]->post(Job(2, jobs + seq));
+    usleep(blockMicroseconds / 2);
+    workers[2]->cancel();
+    assert(cq2::atomic::load(&active) <= 1);
+    size_t ran = started[2].size() - jobs;
+    cout << "jobs run before cancel: " << ran << endl;
+    assert(ran >= 1 && ran < (size_t)jobs);
+    assert(cq2::WorkerPool::instance().pending() == 0);
+
+    // release drops queued jobs and returns while a job is still running,
+    // the worker deletes the handler when the job is done
+    CountedWorker* released = new CountedWorker();
+    for (int seq = 0; seq < jobs; seq++)
+        released->post(Job(2, seq));
+    while (cq2::atomic::load(&gatedStarted) == 0)
+        usleep(1000);
+    released->release();
+    assert(cq2::atomic::load(&destroyedWorkers) == 0);
+    cq2::atomic::store(&gateOpen, 1);
+    while (cq2::atomic::load(&destroyedWorkers) == 0)
+        usleep(1000);
+    assert(cq2::atomic::load(&gatedStarted) == 1);
+    assert(cq2::WorkerPool::instance().pending() == 0);
+
+    // a destroyed handler no longer receives commands
+    delete workers[0];
+    cq2::Command<Job> late(Job(0, jobs));
+    late();
+    usleep(blockMicroseconds * 2);
+    assert(started[0].size() == (size_t)jobs);
+    assert(cq2::WorkerPool::instance().pending() == 0);
+
+    // close drops queued jobs, ignores new ones and waitIdle is bounded by
+    // the running job
+    size_t before = started[1].size();
+    for (int seq = 0; seq < jobs; seq++)
+        workers[1]->post(Job(1, jobs + seq));
+    usleep(blockMicroseconds / 2);
+    assert(not cq2::WorkerPool::instance().isClosed());
+    long dropped = cq2::WorkerPool::instance().close();
+    assert(cq2::WorkerPool::instance().isClosed());
+    cout << "jobs dropped by close: " << dropped << endl;
+    assert(dropped >= jobs - 2 && dropped < jobs);
+    workers[1]->post(Job(1, 2 * jobs));
+    assert(not cq2::WorkerPool::instance().waitIdle(1));
+    assert(cq2::WorkerPool::instance().waitIdle(blockMicroseconds * 5 / 1000));
+    assert(cq2::WorkerPool::instance().pending() == 0);
+    assert(started[1].size() - before == (size_t)(jobs - dropped));
+
+    delete workers[1];
+    delete workers[2];
+
+    running = false;
+    cq2::Dispatcher::instance().wakeup();
+    pthread_join(dispatcher, NULL);
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ClientCore.h"
+#include "../setup_logging.h"
+
+#include <assert.h>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+bool rootMenuOpen(ClientCore& clientcore)
+{
+    std::vector<ClientCore::StartupPhase> timeline = clientcore.getStartupTimeline();
+    for (size_t i = 0; i < timeline.size(); i++)
+        if (timeline[i].name == "root menu open")
+            return true;
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    // setup logging
+    setup_logging();
+    log4cxx::LoggerPtr narratorLogger(log4cxx::Logger::getLogger("kolibre.narrator"));
+    narratorLogger->setLevel(log4cxx::Level::getFatal());
+    log4cxx::LoggerPtr playerLogger(log4cxx::Logger::getLogger("kolibre.player"));
+    playerLogger->setLevel(log4cxx::Level::getFatal());
+    log4cxx::LoggerPtr naviLogger(log4cxx::Logger::getLogger("kolibre.clientcore.navi"));
+    naviLogger->setLevel(log4cxx::Level::getFatal());
+
+    // an empty directory to search for publications
+    char path[] = "/tmp/kolibre-shutdown-XXXXXX";
+    assert(mkdtemp(path) != NULL);
+
+    ClientCore clientcore("");
+    clientcore.addFileSystemPath("temp", path);
+    clientcore.start();
+
+    // wait for the root menu
+    int maxWait = 300;
+    while (not rootMenuOpen(clientcore) && maxWait > 0)
+    {
+        usleep(100000);
+        maxWait--;
+    }
+    assert(rootMenuOpen(clientcore));
+
+    // nothing blocks, every step finishes before the deadline
+    const long deadline = 5000;
+    ClientCore::ShutdownReport report = clientcore.shutdown(deadline);
+    cout << "shutdown took " << report.milliseconds << " ms" << endl;
+    for (size_t i = 0; i < report.unfinished.size(); i++)
+        cout << "unfinished: " << report.unfinished[i] << endl;
+    assert(report.completed);
+    assert(report.unfinished.empty());
+    assert(not report.overrun);
+    assert(report.milliseconds <= deadline);
+    assert(clientcore.isRunning() == false);
+
+    rmdir(path);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ClientCore.h"
+#include "../setup_logging.h"
+
+#include <assert.h>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+// Index of a phase in the timeline, or -1 if it has not been reached
+int phaseIndex(const std::vector<ClientCore::StartupPhase>& timeline, const std::string& name)
+{
+    for (size_t i = 0; i < timeline.size(); i++)
+        if (timeline[i].name == name)
+            return i;
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    // setup logging
+    setup_logging();
+    log4cxx::LoggerPtr narratorLogger(log4cxx::Logger::getLogger("kolibre.narrator"));
+    narratorLogger->setLevel(log4cxx::Level::getFatal());
+    log4cxx::LoggerPtr playerLogger(log4cxx::Logger::getLogger("kolibre.player"));
+    playerLogger->setLevel(log4cxx::Level::getFatal());
+    log4cxx::LoggerPtr naviLogger(log4cxx::Logger::getLogger("kolibre.clientcore.navi"));
+    naviLogger->setLevel(log4cxx::Level::getFatal());
+
+    // an empty directory to search for publications
+    char path[] = "/tmp/kolibre-startup-XXXXXX";
+    assert(mkdtemp(path) != NULL);
+
+    ClientCore clientcore("");
+    clientcore.addFileSystemPath("temp", path);
+
+    // the constructor phases are recorded before start
+    std::vector<ClientCore::StartupPhase> timeline = clientcore.getStartupTimeline();
+    assert(phaseIndex(timeline, "settings loaded") == 0);
+    assert(phaseIndex(timeline, "player ready") != -1);
+    assert(phaseIndex(timeline, "root menu open") == -1);
+
+    clientcore.start();
+
+    // wait for the root menu and the end of the welcome narration
+    int maxWait = 300;
+    while (phaseIndex(clientcore.getStartupTimeline(), "welcome finished") == -1 && maxWait > 0)
+    {
+        usleep(100000);
+        maxWait--;
+    }
+
+    timeline = clientcore.getStartupTimeline();
+    for (size_t i = 0; i < timeline.size(); i++)
+        cout << timeline[i].name << ": " << timeline[i].milliseconds << " ms" << endl;
+
+    // phases are reached in order
+    const char* phases[] = { "settings loaded", "narrator ready", "player ready", "clientcore thread started",
+            "file system scans started", "handlers ready", "root menu built", "root menu open", "welcome finished" };
+    const int phaseCount = sizeof(phases) / sizeof(phases[0]);
+    assert(timeline.size() == (size_t) phaseCount);
+    for (int i = 0; i < phaseCount; i++)
+    {
+        assert(timeline[i].name == phases[i]);
+        if (i > 0)
+            assert(timeline[i].milliseconds >= timeline[i - 1].milliseconds);
+    }
+
+    // the menu is built and opened while the welcome message plays
+    assert(phaseIndex(timeline, "root menu open") < phaseIndex(timeline, "welcome finished"));
+
+    clientcore.shutdown();
+    while (clientcore.isRunning())
+        usleep(100000);
+    rmdir(path);
+
+    return 0;
+}
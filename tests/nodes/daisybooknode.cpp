@@ -18,17 +18,37 @@
  */
 
 #include "DaisyBookNode.h"
+#include "TitleExtractor.h"
+#include "Commands/JumpCommand.h"
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Clock.h"
 #include "../setup_logging.h"
 
 #include <NaviEngine.h>
+#include <DaisyHandler.h>
 
 #include <assert.h>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <vector>
 #include <unistd.h>
 
 using namespace std;
 
+// Resident memory of the process in kilobytes
+long residentKilobytes()
+{
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 class Navi: public naviengine::NaviEngine
 {
     naviengine::MenuNode* buildContextMenu()
@@ -84,5 +104,55 @@ int main(int argc, char **argv)
     std::cout << "Src: " << src << std::endl;
     assert(src.find("01_Fire_Safety__by_Wendy_Blaxland.mp3") > 0);
 
+    // The title extracted for listing the book is the title DaisyHandler
+    // gives when the book is opened, compare the time both take
+    const int rounds = 10;
+    amis::DaisyHandler *dh = amis::DaisyHandler::Instance();
+    long long start = cq2::monotonicMicroseconds();
+    for (int i = 0; i < rounds; i++)
+    {
+        assert(dh->openBook(argv[1]));
+        while (dh->getState() == amis::DaisyHandler::HANDLER_OPENING)
+            usleep(1000);
+        assert(dh->setupBook(false));
+        assert(dh->getBookInfo()->mTitle == title);
+        dh->closeBook();
+    }
+    long long opening = (cq2::monotonicMicroseconds() - start) / rounds;
+
+    start = cq2::monotonicMicroseconds();
+    BookTitle extracted;
+    for (int i = 0; i < rounds; i++)
+        assert(TitleExtractor::extract(argv[1], extracted));
+    long long extracting = (cq2::monotonicMicroseconds() - start) / rounds;
+    assert(extracted.title == title && extracted.titleSrc == src);
+
+    std::cout << "Title by opening the book: " << opening << " us, by extracting it: " << extracting << " us" << std::endl;
+    assert(extracting < opening);
+
+    // A bookshelf creates a node per title, the nodes must not create
+    // navigators, jump handlers or commands until a book is opened
+    cq2::CommandQueue<JumpCommand<unsigned int> > &jumps = cq2::CommandQueue<JumpCommand<unsigned int> >::instance();
+    size_t handlers = jumps.handlerCount();
+    long pending = cq2::Dispatcher::instance().pending();
+    long resident = residentKilobytes();
+    start = cq2::monotonicMicroseconds();
+
+    const int titles = 2000;
+    std::vector<DaisyBookNode*> nodes;
+    for (int i = 0; i < titles; i++)
+        nodes.push_back(new DaisyBookNode());
+
+    long long elapsed = cq2::monotonicMicroseconds() - start;
+    std::cout << titles << " book nodes: " << elapsed / 1000 << " ms, "
+              << residentKilobytes() - resident << " kB, "
+              << jumps.handlerCount() - handlers << " jump handlers, "
+              << cq2::Dispatcher::instance().pending() - pending << " commands" << std::endl;
+    assert(jumps.handlerCount() == handlers);
+    assert(cq2::Dispatcher::instance().pending() == pending);
+
+    for (int i = 0; i < titles; i++)
+        delete nodes[i];
+
     return 0;
 }
@@ -95,10 +95,14 @@ int main(int argc, char **argv)
     Navi navi;
     DaisyNavi daisynavi;
 
-    // open daisy book
+    // open daisy book, it opens in the background
     assert(daisynavi.open(argv[1]));
     assert(daisynavi.onOpen(navi));
+    while (daisynavi.isOpening())
+        usleep(10000);
     assert(daisynavi.isOpen());
+    assert(DaisyNavi::getOpenTimes().size() == 1);
+    std::cout << "opened in " << DaisyNavi::getOpenTimes()[0].milliseconds << " ms" << std::endl;
 
     sleep(10);
     std::cout << "currentTime: " << daisynavi.getCurrentTime() << std::endl;
@@ -120,6 +124,20 @@ int main(int argc, char **argv)
     // close daisy book
     assert(daisynavi.closeBook());
 
+    // a key cancels opening the book
+    assert(daisynavi.open(argv[1]));
+    if (daisynavi.isOpening())
+    {
+        assert(not daisynavi.process(navi, COMMAND_RIGHT));
+        assert(not daisynavi.isOpening());
+        assert(not daisynavi.isOpen());
+        assert(DaisyNavi::getOpenTimes().size() == 1);
+    }
+    else
+    {
+        assert(daisynavi.closeBook());
+    }
+
     // test closing book by changing navi level
     // test going to next phrase
     // test jumping to sections
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DaisyNavi.h"
+#include "NavCache.h"
+#include "ClientCore.h"
+#include "CommandQueue2/CommandQueue.h"
+#include "../setup_logging.h"
+
+#include <NaviEngine.h>
+
+#include <assert.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// Measures DaisyNavi::open of a book without and with its navigation model
+// in the NavCache, run it with make bench. DaisyHandler parses the
+// navigation file in both cases, the cache only brings the sections and
+// pages to the application before parsing has finished.
+
+#define ROUNDS 5
+
+class Navi: public naviengine::NaviEngine
+{
+    naviengine::MenuNode* buildContextMenu()
+    {
+        return NULL;
+    }
+
+    void narrateChange(const naviengine::NaviEngine::MenuState& before, const naviengine::NaviEngine::MenuState& after)
+    {
+    }
+
+    void narrate(std::string message)
+    {
+    }
+
+    void narrate(int value)
+    {
+    }
+
+    void narrateStop()
+    {
+    }
+
+    void narrateShortPause()
+    {
+    }
+
+    void narrateLongPause()
+    {
+    }
+};
+
+static volatile bool running = true;
+static volatile long long bookDataAt = 0;
+
+void handle_bookdata(ClientCore::BookDataPtr)
+{
+    if (bookDataAt == 0)
+        bookDataAt = cq2::monotonicMicroseconds();
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+    pthread_exit(NULL);
+}
+
+struct Round
+{
+    long long bookData; // microseconds until the application had the sections and pages
+    long long open; // microseconds until the book was open
+};
+
+Round openBook(DaisyNavi &daisynavi, Navi &navi, const string &uri)
+{
+    Round round;
+    bookDataAt = 0;
+    long long start = cq2::monotonicMicroseconds();
+    assert(daisynavi.open(uri));
+    assert(daisynavi.onOpen(navi));
+    while (daisynavi.isOpening())
+        usleep(1000);
+    round.open = cq2::monotonicMicroseconds() - start;
+    assert(daisynavi.isOpen());
+    while (bookDataAt == 0)
+        usleep(1000);
+    round.bookData = bookDataAt - start;
+    assert(daisynavi.closeBook());
+    return round;
+}
+
+// Wait for the worker to write the navigation model of the first open
+void waitCached(const string &uri)
+{
+    NavModel model;
+    for (int i = 0; i < 5000 && not NavCache::Instance()->load(uri, model); i++)
+        usleep(1000);
+    assert(NavCache::Instance()->load(uri, model));
+}
+
+long long median(vector<long long> values)
+{
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cout << "Usage: " << argv[0] << " /path/to/navigation/file" << endl;
+        return -1;
+    }
+    string uri = argv[1];
+
+    setup_logging();
+
+    cq2::Handler<ClientCore::BookDataPtr> bookDataHandler(&handle_bookdata);
+    bookDataHandler.listen();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, dispatch_thread, NULL);
+
+    Player *player = Player::Instance();
+    player->enable(NULL, NULL);
+    player->setTempo(1.0);
+
+    Navi navi;
+    DaisyNavi daisynavi;
+
+    vector<long long> coldData, coldOpen, warmData, warmOpen;
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        NavCache::Instance()->remove(uri);
+        Round cold = openBook(daisynavi, navi, uri);
+        coldData.push_back(cold.bookData);
+        coldOpen.push_back(cold.open);
+        waitCached(uri);
+
+        Round warm = openBook(daisynavi, navi, uri);
+        warmData.push_back(warm.bookData);
+        warmOpen.push_back(warm.open);
+    }
+
+    cout << "cold open: book data after " << median(coldData) << " us, open after " << median(coldOpen) << " us" << endl;
+    cout << "warm open: book data after " << median(warmData) << " us, open after " << median(warmOpen) << " us" << endl;
+
+    running = false;
+    cq2::Dispatcher::instance().wakeup();
+    pthread_join(thread, NULL);
+
+    return 0;
+}
@@ -18,10 +18,12 @@
  */
 
 #include "DaisyOnlineBookNode.h"
+#include "DaisyOnlineNode.h"
+#include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Clock.h"
 #include "../setup_logging.h"
 
 #include <NaviEngine.h>
-#include <DaisyOnlineHandler.h>
 
 #include <assert.h>
 #include <cstdlib>
@@ -62,6 +64,18 @@ class Navi: public naviengine::NaviEngine
     }
 };
 
+// The content resources are fetched on the worker of the DaisyOnlineNode and
+// handed to the book on the dispatching thread, which is this one
+void dispatchFor(long milliseconds)
+{
+    long long until = cq2::nowMicroseconds() + milliseconds * 1000LL;
+    long long now;
+    while ((now = cq2::nowMicroseconds()) < until)
+    {
+        cq2::Dispatcher::instance().waitAndDispatch((until - now) / 1000 + 1);
+    }
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
@@ -82,29 +96,33 @@ int main(int argc, char **argv)
     Navi navi;
 
     DaisyOnlineBookNode::errorType error = (DaisyOnlineBookNode::errorType)-1;
-    DaisyOnlineHandler DOHandler(argv[1]);
-    DaisyOnlineBookNode node("any_id", &DOHandler);
+    DaisyOnlineNode service("localhost", argv[1], "any", "any");
+    DaisyOnlineBookNode node("any_id", &service);
+    navi.setCurrentNode(&node);
 
-    // Note: onOpen fails when no server is hosting the content resources. i.e. no file server
+    // Note: opening fails when no server is hosting the content resources. i.e. no file server
 
     /*
      * Test 1: ncc file is found in content resources
      */
-    assert(not node.onOpen(navi));
+    assert(node.onOpen(navi));
+    dispatchFor(1000);
     error = node.getLastError();
     assert(error == DaisyOnlineBookNode::OPEN_CONTENT_ERROR);
 
     /*
      * Test 2: ncc file is not found in content resources
      */
-    assert(not node.onOpen(navi));
+    assert(node.onOpen(navi));
+    dispatchFor(1000);
     error = node.getLastError();
     assert(error == DaisyOnlineBookNode::NAVIGATION_CONTROL_FILE_ERROR);
 
     /*
      * Test 3: content resources failed due to soap fault
      */
-    assert(not node.onOpen(navi));
+    assert(node.onOpen(navi));
+    dispatchFor(1000);
     error = node.getLastError();
     assert(error == DaisyOnlineBookNode::DO_INVOKE_ERROR);
 
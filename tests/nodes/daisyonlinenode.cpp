@@ -19,6 +19,7 @@
 
 #include "DaisyOnlineNode.h"
 #include "CommandQueue2/CommandQueue.h"
+#include "CommandQueue2/Clock.h"
 #include "Commands/NotifyCommands.h"
 #include "Commands/InternalCommands.h"
 #include "MediaSourceManager.h"
@@ -31,7 +32,6 @@
 #include <iostream>
 
 using namespace std;
-bool running = true;
 bool notifyLoginOkReceived = false;
 bool notifyLoginFailReceived = false;
 
@@ -67,13 +67,16 @@ class Navi: public naviengine::NaviEngine
     }
 };
 
-void* dispatchThread(void*)
+// The node runs DaisyOnline calls on a worker and handles their replies on
+// the dispatching thread, which is this one
+void dispatchFor(long milliseconds)
 {
-    while (running)
+    long long until = cq2::nowMicroseconds() + milliseconds * 1000LL;
+    long long now;
+    while ((now = cq2::nowMicroseconds()) < until)
     {
-        cq2::Dispatcher::instance().dispatchCommand();
+        cq2::Dispatcher::instance().waitAndDispatch((until - now) / 1000 + 1);
     }
-    pthread_exit(NULL);
 }
 
 struct Handle_NotifyCommands: public cq2::Handler<NOTIFY_COMMAND>
@@ -112,11 +115,9 @@ int main(int argc, char **argv)
     // setup logging
     setup_logging();
 
-    // setup command handlers and dispatch thread
+    // setup command handlers
     Handle_NotifyCommands notifyHandler;
     notifyHandler.listen();
-    pthread_t tdispatch;
-    pthread_create(&tdispatch, NULL, dispatchThread, NULL);
 
     // add DaisyOnliceService source with incorrect username and password
     MediaSourceManager::Instance()->addDaisyOnlineService("localhost", argv[1], "incorrect", "incorrect");
@@ -128,64 +129,61 @@ int main(int argc, char **argv)
 
     // open should fail with incorrect username and password
     assert(node->onOpen(navi));
+    dispatchFor(1000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::USERNAME_PASSWORD_ERROR);
-    sleep(1);
     assert(notifyLoginFailReceived == true);
 
     // a normal login retry without changing username or password should not trigger in invoke
     // of logOn nor the NOTIFY_LOGIN_FAIL command
     notifyLoginFailReceived = false;
     node->process(navi, COMMAND_RETRY_LOGIN);
+    dispatchFor(1000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::USERNAME_PASSWORD_ERROR);
-    sleep(1);
     assert(notifyLoginFailReceived == false);
 
     // a forced login retry should have the opposite effect as a normal login retry
     notifyLoginFailReceived = false;
     node->process(navi, COMMAND_RETRY_LOGIN_FORCED);
+    dispatchFor(1000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::USERNAME_PASSWORD_ERROR);
-    sleep(1);
     assert(notifyLoginFailReceived == true);
 
     // changing password should also have the opposite effect
     MediaSourceManager::Instance()->setDOSpassword(0, "correct");
     notifyLoginFailReceived = false;
     node->process(navi, COMMAND_RETRY_LOGIN);
+    dispatchFor(1000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::USERNAME_PASSWORD_ERROR);
-    sleep(1);
     assert(notifyLoginFailReceived == true);
 
     // changing username should also have the opposite effect, but session init fails
     // when invoking getServiceAttributes due to soap fault
     MediaSourceManager::Instance()->setDOSusername(0, "correct");
     node->process(navi, COMMAND_RETRY_LOGIN);
+    dispatchFor(1000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::SERVICE_ERROR);
 
     // next session init fails when invoking setReadingsSystem attributes due to soap fault
     node->process(navi, COMMAND_RETRY_LOGIN_FORCED);
+    dispatchFor(1000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::SERVICE_ERROR);
 
-    // next we establish a session and and issue new content
+    // next we establish a session and and issue new content, after which the
+    // worker retrieves a content list of issued content
     node->process(navi, COMMAND_RETRY_LOGIN_FORCED);
+    dispatchFor(3000);
     error = node->getLastError();
     assert(error == DaisyOnlineNode::OK);
-    sleep(1);
     assert(notifyLoginOkReceived == true);
-
-    // finally we retrieve a content list of issued content
-    node->process(navi, COMMAND_DO_GETCONTENTLIST);
-    error = node->getLastError();
-    assert(error == DaisyOnlineNode::OK);
+    assert(node->numberOfChildren() == 2);
 
     // a sleep here will prevent random segmentation faults in narrator thread
-    running = false;
-    pthread_join(tdispatch, NULL);
     sleep(1);
 
     return 0;
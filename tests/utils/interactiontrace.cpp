@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "InteractionTrace.h"
+#include "CommandQueue2/CommandQueue.h"
+
+#include <iostream>
+#include <string>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+using namespace std;
+
+// Follows key presses from the sending thread through the dispatching
+// thread to a player thread that reports when audio starts, and checks the
+// latencies and the Chrome trace built from the trace points.
+
+enum Key
+{
+    KEY_RIGHT,
+    KEY_LEFT
+};
+
+static const int presses = 20;
+static volatile long playerTraceId = 0;
+static volatile bool running = true;
+
+// Runs on the dispatching thread like Navi::process and DaisyNavi::playAudio
+void handle_key(Key key)
+{
+    InteractionTrace::Instance()->point("Navi::process");
+    if (key == KEY_RIGHT)
+    {
+        // the player starts later on its own thread
+        InteractionTrace::Instance()->point("Player::open");
+        cq2::atomic::store(&playerTraceId, cq2::currentTraceId());
+    }
+    else
+    {
+        InteractionTrace::Instance()->audio("Narrator::play");
+    }
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+    return NULL;
+}
+
+void* player_thread(void*)
+{
+    while (running)
+    {
+        long id = cq2::atomic::exchange(&playerTraceId, 0L);
+        if (id != 0)
+        {
+            usleep(2000);
+            InteractionTrace::Instance()->audio(id, "Player::playing");
+        }
+        usleep(500);
+    }
+    return NULL;
+}
+
+int main()
+{
+    InteractionTrace* trace = InteractionTrace::Instance();
+
+    // nothing is recorded while tracing is disabled
+    assert(trace->begin("RIGHT") == 0);
+    assert(cq2::currentTraceId() == 0);
+    assert(trace->latencies().empty());
+
+    trace->setEnabled(true);
+
+    cq2::Handler<Key> keyHandler(&handle_key);
+    keyHandler.listen();
+
+    pthread_t dispatcher, player;
+    pthread_create(&dispatcher, NULL, dispatch_thread, NULL);
+    pthread_create(&player, NULL, player_thread, NULL);
+
+    for (int i = 0; i < presses; i++)
+    {
+        Key key = (i % 2 == 0) ? KEY_RIGHT : KEY_LEFT;
+        long id = trace->begin(key == KEY_RIGHT ? "RIGHT" : "LEFT");
+        assert(id == i + 1);
+        assert(cq2::currentTraceId() == id);
+        cq2::Command<Key> command(key);
+        command();
+        cq2::setCurrentTraceId(0);
+        usleep(10000);
+    }
+
+    // a command sent without an interaction is not traced
+    cq2::Command<Key> untraced(KEY_LEFT);
+    untraced();
+    usleep(10000);
+
+    running = false;
+    cq2::Dispatcher::instance().wakeup();
+    pthread_join(dispatcher, NULL);
+    pthread_join(player, NULL);
+
+    // every interaction reached audio, the player ones after its delay
+    std::vector<InteractionTrace::Latency> latencies = trace->latencies();
+    assert(latencies.size() == 2);
+    for (size_t i = 0; i < latencies.size(); i++)
+    {
+        cout << latencies[i].name << ": " << latencies[i].count << " interactions, p50 " << latencies[i].p50 << " us, p99 "
+                << latencies[i].p99 << " us, max " << latencies[i].max << " us" << endl;
+        assert(latencies[i].count == presses / 2);
+        assert(latencies[i].p50 <= latencies[i].p99 && latencies[i].p99 <= latencies[i].max);
+    }
+    assert(latencies[0].name == "LEFT");
+    assert(latencies[1].name == "RIGHT");
+    assert(latencies[1].p50 >= 2000);
+
+    // the Chrome trace has the trace points and one span per interaction
+    std::string json = trace->chromeTrace();
+    assert(json.find("{\"traceEvents\":[") == 0);
+    assert(json.find("\"name\":\"Player::playing\"") != std::string::npos);
+    assert(json.find("\"args\":{\"id\":20}") != std::string::npos);
+    size_t spans = 0;
+    for (size_t pos = json.find("\"ph\":\"b\""); pos != std::string::npos; pos = json.find("\"ph\":\"b\"", pos + 1))
+        spans++;
+    assert(spans == (size_t) presses);
+
+    char path[] = "/tmp/kolibre-trace-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(trace->writeChromeTrace(path));
+    unlink(path);
+
+    trace->clear();
+    assert(trace->latencies().empty());
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LibraryIndex.h"
+#include "CommandQueue2/Clock.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <assert.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Checks that the library index lists the books of a media path from an
+// earlier run, that a rescan only reads changed directories and compares the
+// time to the first menu with a cold and a warm index.
+
+static string workdir;
+static vector<string> dirs;
+
+static void makeDir(const string &path)
+{
+    mkdir(path.c_str(), 0755);
+    dirs.push_back(path);
+}
+
+static void writeFile(const string &path, const string &content)
+{
+    ofstream out(path.c_str());
+    out << content;
+}
+
+static string writeBook(const string &dir, const string &title)
+{
+    makeDir(dir);
+    writeFile(dir + "/ncc.html", "<html><head><title>x</title></head><body>\n"
+            "<h1 class=\"title\" id=\"s0\"><a href=\"c0.smil#t0\">" + title + "</a></h1>\n</body></html>\n");
+    writeFile(dir + "/c0.smil", "<smil><body><par><text id=\"t0\"/><audio src=\"title.mp3\"/></par></body></smil>");
+    return dir + "/ncc.html";
+}
+
+// A rescan reads directories modified in the last second every time, move
+// recent modification times into the past like on a real media, a little
+// later every time
+static void age()
+{
+    static int generation = 0;
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - 1000 + generation++;
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        struct stat st;
+        if (stat(dirs[i].c_str(), &st) == 0 && st.st_mtime > time(NULL) - 10)
+            utime(dirs[i].c_str(), &times);
+    }
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/libraryindexXXXXXX";
+    assert(mkdtemp(tmpl) != NULL);
+    workdir = tmpl;
+    string media = workdir + "/media";
+    string database = workdir + "/library.db";
+    vector<LibraryIndex::Book> books;
+
+    // 20 shelves of 50 books and a Daisy 3 book
+    makeDir(media);
+    for (int shelf = 0; shelf < 20; shelf++)
+    {
+        ostringstream dir;
+        dir << media << "/shelf" << shelf;
+        makeDir(dir.str());
+        for (int i = 0; i < 50; i++)
+        {
+            ostringstream book, title;
+            book << dir.str() << "/book" << i;
+            title << "Book " << shelf << "-" << i;
+            writeBook(book.str(), title.str());
+        }
+    }
+    makeDir(media + "/daisy3");
+    writeFile(media + "/daisy3/book.opf", "<package><metadata><dc:Title>Daisy three</dc:Title></metadata></package>");
+    age();
+
+    // cold, nothing is known until the media has been scanned
+    long long start = cq2::monotonicMicroseconds();
+    LibraryIndex *index = new LibraryIndex(database);
+    assert(not index->books(media, books) && books.empty());
+    assert(index->rescan(media) == 1001);
+    assert(index->books(media, books));
+    long long cold = cq2::monotonicMicroseconds() - start;
+    assert(books.size() == 1001);
+    assert(books[0].uri == media + "/shelf0/book0/ncc.html" && books[0].title == "Book 0-0");
+    assert(books[0].titleSrc == media + "/shelf0/book0/title.mp3");
+    assert(books[0].format == LibraryIndex::FORMAT_DAISY202 && books[0].opened == 0);
+    assert(books[1000].format == LibraryIndex::FORMAT_DAISY3 && books[1000].title == "Daisy three");
+    long read = index->directoriesRead();
+    assert(read == 1022);
+    assert(index->revision(media) == 1);
+
+    // nothing changed, no directory is read again
+    assert(index->rescan(media) == 1001);
+    assert(index->directoriesRead() == read);
+    assert(index->revision(media) == 1);
+
+    // a new book and a changed title, only the changed directories are read
+    writeBook(media + "/shelf3/new", "New book");
+    writeFile(media + "/shelf5/book7/ncc.html", "<html><body><h1><a href=\"c0.smil#t0\">Changed title</a></h1></body></html>");
+    age();
+    assert(index->rescan(media) == 1002);
+    assert(index->directoriesRead() == read + 2);
+    assert(index->revision(media) == 2);
+    assert(index->books(media, books));
+    bool found = false;
+    for (size_t i = 0; i < books.size(); i++)
+    {
+        if (books[i].uri == media + "/shelf5/book7/ncc.html")
+            assert(books[i].title == "Changed title");
+        found = found || books[i].title == "New book";
+    }
+    assert(found);
+
+    // a removed book
+    string command = "rm -rf " + media + "/shelf9/book1";
+    assert(system(command.c_str()) == 0);
+    age();
+    assert(index->rescan(media) == 1001);
+    read = index->directoriesRead();
+
+    // a directory modified in the last second is read every time
+    writeBook(media + "/shelf0/recent", "Recent");
+    assert(index->rescan(media) == 1002);
+    assert(index->directoriesRead() > read + 1);
+    read = index->directoriesRead();
+    assert(index->rescan(media) == 1002);
+    assert(index->directoriesRead() > read);
+    age();
+
+    // times past 2038 are stored without being truncated
+    struct utimbuf future;
+    future.actime = future.modtime = (time_t) 2208988800LL; // 2040-01-01
+    assert(utime((media + "/shelf1/book1/ncc.html").c_str(), &future) == 0);
+    index->opened(media + "/shelf2/book4/ncc.html");
+    assert(index->rescan(media) == 1002);
+    delete index;
+
+    // warm, the books of the last run are listed without touching the media
+    start = cq2::monotonicMicroseconds();
+    index = new LibraryIndex(database);
+    assert(index->books(media, books));
+    long long warm = cq2::monotonicMicroseconds() - start;
+    assert(books.size() == 1002);
+    for (size_t i = 0; i < books.size(); i++)
+    {
+        assert(not books[i].title.empty());
+        assert((books[i].opened != 0) == (books[i].uri == media + "/shelf2/book4/ncc.html"));
+    }
+
+    // the verification after a warm start reads nothing
+    start = cq2::monotonicMicroseconds();
+    assert(index->rescan(media) == 1002);
+    long long verify = cq2::monotonicMicroseconds() - start;
+    assert(index->directoriesRead() == 0);
+    assert(index->revision(media) == 0);
+
+    // media paths that are not directories are not indexed
+    assert(index->rescan(workdir + "/missing") == -1);
+    assert(not index->books(workdir + "/missing", books));
+    delete index;
+
+    cout << "1002 books in 1023 directories, time to first menu:" << endl;
+    cout << "  cold index        " << cold / 1000 << " ms" << endl;
+    cout << "  warm index        " << warm / 1000 << " ms" << endl;
+    cout << "  verifying         " << verify / 1000 << " ms in the background" << endl;
+    assert(warm < cold);
+
+    command = "rm -rf " + workdir;
+    assert(system(command.c_str()) == 0);
+    return 0;
+}
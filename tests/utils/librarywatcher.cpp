@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LibraryWatcher.h"
+#include "LibraryIndex.h"
+#include "CommandQueue2/Clock.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <assert.h>
+#include <unistd.h>
+#include <utime.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Checks that the watcher updates the library index when books are copied,
+// removed and renamed, that a burst of events gives one update, and that a
+// media path that can't be watched completely is rescanned. Compares the
+// time to find one new book with a rescan of the whole media.
+
+static string workdir;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int changes = 0;
+static long long lastChange = 0;
+
+static void changed(const string &media)
+{
+    pthread_mutex_lock(&mutex);
+    changes++;
+    lastChange = cq2::monotonicMicroseconds();
+    pthread_mutex_unlock(&mutex);
+}
+
+static int changeCount()
+{
+    pthread_mutex_lock(&mutex);
+    int count = changes;
+    pthread_mutex_unlock(&mutex);
+    return count;
+}
+
+// Wait up to 5 seconds for the callback to be called count times
+static bool waitChanges(int count)
+{
+    for (int i = 0; i < 500 && changeCount() < count; i++)
+        usleep(10000);
+    return changeCount() >= count;
+}
+
+static void writeFile(const string &path, const string &content)
+{
+    ofstream out(path.c_str());
+    out << content;
+}
+
+static void writeBook(const string &dir, const string &title)
+{
+    mkdir(dir.c_str(), 0755);
+    mkdir((dir + "/audio").c_str(), 0755);
+    writeFile(dir + "/ncc.html", "<html><body><h1><a href=\"c0.smil#t0\">" + title + "</a></h1></body></html>\n");
+    writeFile(dir + "/audio/title.mp3", string(4096, 'x'));
+}
+
+// Move the modification times of the tree into the past like on a real media
+static void age(const string &path)
+{
+    string command = "find " + path + " -type d -exec touch -m -d '-1 hour' {} +";
+    assert(system(command.c_str()) == 0);
+}
+
+static bool hasBook(LibraryIndex &index, const string &media, const string &title)
+{
+    vector<LibraryIndex::Book> books;
+    index.books(media, books);
+    for (size_t i = 0; i < books.size(); i++)
+    {
+        if (books[i].title == title)
+            return true;
+    }
+    return false;
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/librarywatcherXXXXXX";
+    assert(mkdtemp(tmpl) != NULL);
+    workdir = tmpl;
+    string media = workdir + "/media";
+    vector<LibraryIndex::Book> books;
+    vector<string> dirs;
+
+    // 50 shelves of 20 books
+    mkdir(media.c_str(), 0755);
+    for (int shelf = 0; shelf < 50; shelf++)
+    {
+        ostringstream dir;
+        dir << media << "/shelf" << shelf;
+        mkdir(dir.str().c_str(), 0755);
+        for (int i = 0; i < 20; i++)
+        {
+            ostringstream book, title;
+            book << dir.str() << "/book" << i;
+            title << "Book " << shelf << "-" << i;
+            writeBook(book.str(), title.str());
+        }
+    }
+    age(media);
+
+    LibraryIndex index(workdir + "/library.db");
+    LibraryWatcher *watcher = new LibraryWatcher(&index, &changed);
+    watcher->setDebounce(200, 1000);
+    watcher->watch(media);
+    assert(watcher->watching(media));
+    assert(not watcher->watching(workdir));
+
+    // the media is scanned and every directory in the index is watched, the
+    // audio directories of the books are not
+    assert(waitChanges(1));
+    assert(index.books(media, books) && books.size() == 1000);
+    assert(index.directories(media, dirs) && dirs.size() == 1051);
+    for (int i = 0; i < 100 && watcher->watches() < 1051; i++)
+        usleep(10000);
+    assert(watcher->watches() == 1051);
+    assert(watcher->complete(media));
+
+    // a book copied onto the media, the events of the copy are one update
+    long read = index.directoriesRead();
+    long long copied = cq2::monotonicMicroseconds();
+    writeBook(media + "/shelf7/copied", "Copied book");
+    assert(waitChanges(2));
+    long long update = lastChange - copied;
+    long updateRead = index.directoriesRead() - read;
+    assert(hasBook(index, media, "Copied book"));
+    assert(updateRead <= 3);
+    usleep(500000);
+    assert(changeCount() == 2);
+    assert(watcher->watches() == 1052);
+
+    // a burst of books copied 50 ms apart is one update
+    long updates = watcher->updates();
+    for (int i = 0; i < 5; i++)
+    {
+        ostringstream book, title;
+        book << media << "/shelf9/burst" << i;
+        title << "Burst " << i;
+        writeBook(book.str(), title.str());
+        usleep(50000);
+    }
+    assert(waitChanges(3));
+    usleep(500000);
+    assert(changeCount() == 3);
+    assert(hasBook(index, media, "Burst 4"));
+    assert(watcher->updates() - updates <= 2);
+
+    // a changed title
+    writeFile(media + "/shelf2/book3/ncc.html", "<html><body><h1><a href=\"c0.smil#t0\">New title</a></h1></body></html>\n");
+    assert(waitChanges(4));
+    assert(hasBook(index, media, "New title") && not hasBook(index, media, "Book 2-3"));
+
+    // a removed book and a renamed shelf
+    string command = "rm -rf " + media + "/shelf1/book5 && mv " + media + "/shelf4 " + media + "/renamed";
+    assert(system(command.c_str()) == 0);
+    assert(waitChanges(5));
+    usleep(300000);
+    assert(index.books(media, books) && books.size() == 1005);
+    for (size_t i = 0; i < books.size(); i++)
+    {
+        assert(books[i].uri.find("/shelf4/") == string::npos);
+        assert(books[i].uri != media + "/shelf1/book5/ncc.html");
+    }
+    assert(hasBook(index, media, "Book 4-0"));
+    assert(index.directories(media, dirs) && (long) dirs.size() == watcher->watches());
+
+    // a book copied into the renamed shelf
+    writeBook(media + "/renamed/later", "Later book");
+    assert(waitChanges(6));
+    assert(hasBook(index, media, "Later book"));
+    delete watcher;
+
+    // the whole media rescanned with a cold index for comparison
+    LibraryIndex cold(workdir + "/cold.db");
+    long long start = cq2::monotonicMicroseconds();
+    cold.rescan(media);
+    long long rescan = cq2::monotonicMicroseconds() - start;
+    long rescanRead = cold.directoriesRead();
+
+    // with fewer watches than directories the media is rescanned
+    age(media);
+    watcher = new LibraryWatcher(&index, &changed);
+    watcher->setDebounce(200, 1000);
+    watcher->setRescanInterval(300);
+    watcher->setMaxWatches(100);
+    int count = changeCount();
+    watcher->watch(media);
+    for (int i = 0; i < 100 && watcher->watches() < 100; i++)
+        usleep(10000);
+    assert(watcher->watches() == 100 && not watcher->complete(media));
+    writeBook(media + "/shelf40/unwatched", "Unwatched book");
+    assert(waitChanges(count + 1));
+    assert(hasBook(index, media, "Unwatched book"));
+    delete watcher;
+
+    cout << "1000 books in 1051 directories, finding one copied book:" << endl;
+    cout << "  watcher           " << updateRead << " directories read, listed " << update / 1000
+         << " ms after the copy with 200 ms debounce" << endl;
+    cout << "  full rescan       " << rescanRead << " directories read in " << rescan / 1000 << " ms" << endl;
+
+    command = "rm -rf " + workdir;
+    assert(system(command.c_str()) == 0);
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "NarratorCompletion.h"
+
+#include <iostream>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <boost/bind.hpp>
+#include <boost/signals2.hpp>
+
+using namespace std;
+
+// Measures how long callers wait for narration to finish, with the fixed
+// delay and polling loop used before NarratorCompletion and with the
+// completion handle. A fake narrator starts speaking after a delay, speaks
+// for a given time and then signals that its audio has finished, on its own
+// thread like the real narrator.
+
+struct FakeNarrator
+{
+    FakeNarrator() : startAt(0), stopAt(0), generation(0) {}
+
+    long long startAt;
+    long long stopAt;
+    volatile long generation;
+    boost::signals2::signal<void()> audioFinished;
+
+    boost::signals2::connection connectAudioFinished(const boost::function<void()>& slot)
+    {
+        return audioFinished.connect(slot);
+    }
+
+    // Queue audio that starts after startDelay and lasts duration milliseconds
+    void play(long startDelay, long duration, bool signal = true)
+    {
+        startAt = cq2::monotonicMicroseconds() + startDelay * 1000LL;
+        stopAt = startAt + duration * 1000LL;
+        long current = __sync_add_and_fetch(&generation, 1);
+        if (not signal)
+            return;
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, finishThread, (void*) current);
+        pthread_detach(thread);
+    }
+
+    bool isSpeaking()
+    {
+        long long now = cq2::monotonicMicroseconds();
+        return now >= startAt && now < stopAt;
+    }
+
+    // Milliseconds from now until the audio has finished
+    long remaining()
+    {
+        long long left = stopAt - cq2::monotonicMicroseconds();
+        return left > 0 ? (long) (left / 1000) : 0;
+    }
+
+    static void* finishThread(void* arg);
+};
+
+static FakeNarrator narrator;
+
+// Signal the end of the audio unless other audio has been queued since
+void* FakeNarrator::finishThread(void* arg)
+{
+    long current = (long) arg;
+    long long left = narrator.stopAt - cq2::monotonicMicroseconds();
+    if (left > 0)
+        usleep((useconds_t) left);
+    if (current == narrator.generation)
+        narrator.audioFinished();
+    return NULL;
+}
+
+static long long elapsedSince(long long start)
+{
+    return (cq2::monotonicMicroseconds() - start) / 1000;
+}
+
+// The loop that was used in clientcore_thread, DaisyNavi and the DaisyOnline nodes
+static long oldWait()
+{
+    long long start = cq2::monotonicMicroseconds();
+    usleep(500000);
+    while (narrator.isSpeaking())
+        usleep(20000);
+    return elapsedSince(start);
+}
+
+static volatile bool running = true;
+static long long doneAt = 0;
+
+void handle_done(int)
+{
+    doneAt = cq2::monotonicMicroseconds();
+}
+
+void handle_request(long duration)
+{
+    // on the dispatching thread, ask for a command when the narration ends
+    narrator.play(20, duration, duration > 0);
+    NarratorCompletion done(&narrator);
+    done.whenDone(cq2::Command<int>(1), 500);
+}
+
+void* dispatch_thread(void*)
+{
+    while (running)
+        cq2::Dispatcher::instance().waitAndDispatch(-1);
+    pthread_exit(NULL);
+}
+
+// Ask the dispatching thread for a command when narration of the given
+// length ends, a length of 0 is never signalled
+static long long requestDone(long duration)
+{
+    doneAt = 0;
+    cq2::Command<long> request(duration);
+    request();
+    usleep(10000);
+    long long end = cq2::monotonicMicroseconds() + narrator.remaining() * 1000LL;
+    while (doneAt == 0)
+        usleep(1000);
+    return end;
+}
+
+int main()
+{
+    // start delay and duration of the narration in milliseconds, e.g. the
+    // welcome message, an error message and a short prompt
+    long cases[][2] = { { 30, 1200 }, { 20, 300 }, { 10, 80 } };
+    long oldTotal = 0, newTotal = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        long start = cases[i][0], duration = cases[i][1];
+        long end = start + duration;
+
+        narrator.play(start, duration);
+        long oldTime = oldWait();
+
+        long long begin = cq2::monotonicMicroseconds();
+        narrator.play(start, duration);
+        NarratorCompletion done(&narrator);
+        assert(done.wait(5000));
+        long newTime = elapsedSince(begin);
+
+        cout << "narration ends after " << end << " ms: old loop returned after " << oldTime
+             << " ms, completion after " << newTime << " ms" << endl;
+        assert(oldTime >= 500);
+        assert(newTime >= end && newTime < end + 50);
+        oldTotal += oldTime;
+        newTotal += newTime;
+    }
+    cout << "total wait: old " << oldTotal << " ms, completion " << newTotal << " ms" << endl;
+    assert(newTotal < oldTotal);
+
+    // the narrator never signals, e.g. nothing was queued, the handle gives up
+    // after the timeout and not before
+    narrator.play(10, 50, false);
+    long long begin = cq2::monotonicMicroseconds();
+    NarratorCompletion silent(&narrator);
+    assert(not silent.wait(200));
+    long gaveUp = elapsedSince(begin);
+    cout << "no signal: completion gave up after " << gaveUp << " ms" << endl;
+    assert(gaveUp >= 200 && gaveUp < 250);
+    assert(not silent.done());
+
+    // the narration outlasts the timeout
+    narrator.play(0, 500);
+    NarratorCompletion longNarration(&narrator);
+    assert(not longNarration.wait(100));
+    assert(longNarration.wait(1000));
+    assert(longNarration.done());
+
+    // a handle created after the narration has ended is not done by it
+    NarratorCompletion late(&narrator);
+    assert(not late.done());
+
+    // a command is sent from the dispatching thread when the narration is done
+    cq2::Handler<int> doneHandler(&handle_done);
+    doneHandler.listen();
+    cq2::Handler<long> requestHandler(&handle_request);
+    requestHandler.listen();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, dispatch_thread, NULL);
+
+    long long end = requestDone(300);
+    cout << "command sent " << (doneAt - end) / 1000 << " ms after the narration ended" << endl;
+    assert(doneAt - end > -2000 && doneAt - end < 50000);
+    assert(cq2::Dispatcher::instance().timers() == 0);
+
+    // without a signal the command is sent when the timeout timer fires
+    long long requested = cq2::monotonicMicroseconds();
+    requestDone(0);
+    cout << "command sent " << (doneAt - requested) / 1000 << " ms after the request without a signal" << endl;
+    assert(doneAt - requested >= 500000 && doneAt - requested < 600000);
+    assert(cq2::Dispatcher::instance().timers() == 0);
+
+    running = false;
+    cq2::Dispatcher::instance().wakeup();
+    pthread_join(thread, NULL);
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "NavCache.h"
+#include "CommandQueue2/Clock.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <assert.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <boost/regex.hpp>
+
+using namespace std;
+
+// Checks the cache entries and compares the time to get the navigation model
+// of a large book by parsing its ncc.html with loading it from the cache.
+
+static string workdir;
+
+// Write an ncc.html with the given number of sections and pages
+static string writeNcc(const string &name, int sections, int pages)
+{
+    string path = workdir + "/" + name;
+    ofstream ncc(path.c_str());
+    ncc << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<html><head><title>Large book</title>"
+        << "<meta name=\"ncc:totalTime\" content=\"12:34:56\" /></head><body>\n";
+    for (int i = 0, page = 0; i < sections; i++)
+    {
+        ncc << "<h" << (i % 3) + 1 << " class=\"section\" id=\"s" << i << "\"><a href=\"c" << i / 50
+            << ".smil#t" << i << "\">Chapter " << i << "</a></h" << (i % 3) + 1 << ">\n";
+        for (; page < (i + 1) * pages / sections; page++)
+            ncc << "<span class=\"page-normal\" id=\"p" << page << "\"><a href=\"c" << i / 50
+                << ".smil#q" << page << "\">" << page + 1 << "</a></span>\n";
+    }
+    ncc << "</body></html>\n";
+    return path;
+}
+
+// Parse the navigation points of an ncc.html, a stand-in for DaisyHandler
+static NavModel parseNcc(const string &path)
+{
+    ifstream in(path.c_str());
+    stringstream ss;
+    ss << in.rdbuf();
+    string html = ss.str();
+
+    NavModel model;
+    boost::regex title("<title>([^<]*)</title>");
+    boost::smatch m;
+    if (boost::regex_search(html, m, title))
+        model.title = m[1];
+
+    boost::regex point("<(h([1-6])|span) class=\"(section|page-normal)\" id=\"([^\"]*)\"><a href=\"([^\"]*)\">([^<]*)</a>");
+    boost::sregex_iterator it(html.begin(), html.end(), point), end;
+    int order = 0;
+    for (; it != end; ++it)
+    {
+        const boost::smatch &p = *it;
+        if (p[3] == "section")
+            model.sections.push_back(NavModel::Point(p[5], p[6], order++, atoi(p[2].str().c_str())));
+        else
+            model.pages.push_back(NavModel::Point(p[5], p[6], order++));
+    }
+    model.totalms = (12 * 3600 + 34 * 60 + 56) * 1000L;
+    return model;
+}
+
+static bool sameModel(const NavModel &a, const NavModel &b)
+{
+    if (a.title != b.title || a.totalms != b.totalms || a.sections.size() != b.sections.size() || a.pages.size() != b.pages.size()
+        || a.times.size() != b.times.size())
+        return false;
+    for (size_t i = 0; i < a.times.size(); i++)
+        if (a.times[i].startms != b.times[i].startms || a.times[i].smilms != b.times[i].smilms
+            || a.times[i].section != b.times[i].section || a.times[i].page != b.times[i].page
+            || a.times[i].ref != b.times[i].ref)
+            return false;
+    for (size_t i = 0; i < a.sections.size(); i++)
+        if (a.sections[i].ref != b.sections[i].ref || a.sections[i].text != b.sections[i].text
+            || a.sections[i].playOrder != b.sections[i].playOrder || a.sections[i].level != b.sections[i].level)
+            return false;
+    for (size_t i = 0; i < a.pages.size(); i++)
+        if (a.pages[i].ref != b.pages[i].ref || a.pages[i].text != b.pages[i].text || a.pages[i].playOrder != b.pages[i].playOrder)
+            return false;
+    return true;
+}
+
+static long long fileSize(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/navcacheXXXXXX";
+    assert(mkdtemp(tmpl) != NULL);
+    workdir = tmpl;
+    NavCache cache(workdir + "/cache", 3);
+
+    // round trip
+    string small = writeNcc("small.html", 12, 30);
+    NavModel model = parseNcc(small);
+    assert(model.sections.size() == 12 && model.pages.size() == 30);
+    for (int i = 0; i < 12; i++)
+        model.times.push_back(NavModel::Time(i * 61000L, i * 61000L, i, i * 30 / 12, i % 2 == 0 ? model.sections[i].ref : ""));
+    NavModel loaded;
+    assert(not cache.load(small, loaded));
+    assert(cache.store(small, model));
+    assert(cache.load(small, loaded));
+    assert(sameModel(model, loaded));
+    assert(cache.load("file://" + small, loaded) == false); // a different uri is a different entry
+
+    // remote books are not cached
+    assert(not cache.store("http://example.com/book/ncc.html", model));
+
+    // a changed navigation file makes the entry stale
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - 3600;
+    assert(utime(small.c_str(), &times) == 0);
+    assert(not cache.load(small, loaded));
+    assert(fileSize(cache.fileFor(small)) == -1);
+
+    // truncated and foreign files are rejected and removed
+    assert(cache.store(small, model));
+    assert(truncate(cache.fileFor(small).c_str(), fileSize(cache.fileFor(small)) - 5) == 0);
+    assert(not cache.load(small, loaded));
+    {
+        ofstream junk(cache.fileFor(small).c_str());
+        junk << "not a cache file";
+    }
+    assert(not cache.load(small, loaded));
+    assert(fileSize(cache.fileFor(small)) == -1);
+
+    // only the most recently used entries are kept
+    string books[5];
+    for (int i = 0; i < 5; i++)
+    {
+        ostringstream name;
+        name << "book" << i << ".html";
+        books[i] = writeNcc(name.str(), 3, 3);
+        NavModel m = parseNcc(books[i]);
+        assert(cache.store(books[i], m));
+        struct utimbuf used;
+        used.actime = used.modtime = time(NULL) - 100 + i;
+        utime(cache.fileFor(books[i]).c_str(), &used);
+    }
+    assert(cache.store(books[4], parseNcc(books[4])));
+    int kept = 0;
+    for (int i = 0; i < 5; i++)
+        kept += fileSize(cache.fileFor(books[i])) > 0 ? 1 : 0;
+    assert(kept == 3);
+    assert(fileSize(cache.fileFor(books[0])) == -1);
+
+    // cold and warm navigation model of a large book
+    string large = writeNcc("large.html", 5000, 12000);
+    const int rounds = 5;
+    long long start = cq2::monotonicMicroseconds();
+    NavModel parsed;
+    for (int i = 0; i < rounds; i++)
+        parsed = parseNcc(large);
+    long long cold = (cq2::monotonicMicroseconds() - start) / rounds;
+
+    start = cq2::monotonicMicroseconds();
+    assert(cache.store(large, parsed));
+    long long storeTime = cq2::monotonicMicroseconds() - start;
+
+    start = cq2::monotonicMicroseconds();
+    for (int i = 0; i < rounds; i++)
+        assert(cache.load(large, loaded));
+    long long warm = (cq2::monotonicMicroseconds() - start) / rounds;
+    assert(sameModel(parsed, loaded));
+
+    cout << "large book, " << parsed.sections.size() << " sections and " << parsed.pages.size() << " pages ("
+         << fileSize(large) / 1024 << " KiB ncc, " << fileSize(cache.fileFor(large)) / 1024 << " KiB cache entry)" << endl;
+    cout << "cold: parsing ncc.html " << cold << " us" << endl;
+    cout << "warm: loading from cache " << warm << " us, storing took " << storeTime << " us" << endl;
+    assert(warm < cold);
+
+    string command = "rm -rf " + workdir;
+    assert(system(command.c_str()) == 0);
+    return 0;
+}
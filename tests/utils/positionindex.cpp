@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PositionIndex.h"
+#include "CommandQueue2/Clock.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <assert.h>
+
+using namespace std;
+
+// Checks the PositionIndex and measures lookups in a large book: a linear
+// scan of the entries, seek() and at() on consecutive player time updates.
+
+static long linearScan(const vector<PositionIndex::Entry> &entries, long ms)
+{
+    long found = -1;
+    for (size_t i = 0; i < entries.size() && entries[i].startms <= ms; i++)
+        found = i;
+    return found;
+}
+
+int main()
+{
+    PositionIndex index;
+    PositionIndex::Entry entry;
+
+    // nothing is known before the first entry
+    assert(not index.seek(0, entry));
+    assert(not index.at(0, entry));
+
+    // only changes of section or page add entries
+    long revision = index.revision();
+    assert(index.record(0, 0, 1, -1));
+    assert(not index.record(500, 0, 1, -1));
+    assert(index.record(61000, 61000, 2, -1));
+    assert(index.record(65000, 61000, 2, 0));
+    assert(not index.record(70000, 61000, 2, 0));
+    assert(index.size() == 3);
+    assert(index.revision() == revision + 3);
+
+    assert(index.seek(64999, entry) && entry.section == 2 && entry.page == -1 && entry.smilms == 61000);
+    assert(index.seek(65000, entry) && entry.page == 0);
+    assert(index.at(30000, entry) && entry.section == 1);
+    assert(index.at(1000000, entry) && entry.section == 2 && entry.page == 0);
+
+    // a jump backwards into a part that was not played yet
+    assert(index.record(30000, 0, 1, 7));
+    assert(index.size() == 4);
+    assert(index.seek(40000, entry) && entry.page == 7);
+    assert(index.seek(62000, entry) && entry.section == 2 && entry.page == -1);
+
+    // entries at the same time are replaced
+    assert(index.record(30000, 0, 1, 8));
+    assert(index.size() == 4);
+    assert(index.at(30000, entry) && entry.page == 8);
+
+    // assign sorts the entries, e.g. from the cache
+    vector<PositionIndex::Entry> unsorted;
+    unsorted.push_back(PositionIndex::Entry(5000, 0, 2, 2));
+    unsorted.push_back(PositionIndex::Entry(0, 0, 1, 1));
+    index.assign(unsorted);
+    assert(index.entries()[0].startms == 0 && index.entries()[1].startms == 5000);
+    assert(index.at(4999, entry) && entry.section == 1);
+
+    // jumps land on starts read from the SMIL files, playback keeps their ids
+    vector<PositionIndex::Entry> scanned;
+    scanned.push_back(PositionIndex::Entry(0, 0, 1, -1, "ncc_1"));
+    scanned.push_back(PositionIndex::Entry(60000, 60000, 2, -1, "ncc_2"));
+    index.assign(scanned);
+    assert(not index.seekStart(-1, entry));
+    assert(index.record(70000, 60000, 2, 0));
+    assert(index.seekStart(75000, entry) && entry.startms == 60000 && entry.ref == "ncc_2");
+    assert(index.record(60000, 60000, 3, -1));
+    assert(index.seekStart(60000, entry) && entry.section == 3 && entry.ref == "ncc_2");
+    index.clear();
+    assert(index.size() == 0);
+
+    // a 40 hour book with a section or page change every 2 seconds
+    const long entries = 72000;
+    for (long i = 0; i < entries; i++)
+        index.record(i * 2000, (i / 30) * 60000, i / 10, i);
+    assert(index.size() == (size_t) entries);
+    vector<PositionIndex::Entry> copy = index.entries();
+
+    // player time updates every 100 ms through the first ten hours
+    const long ticks = 360000;
+    long long start = cq2::monotonicMicroseconds();
+    long checksum = 0;
+    for (long t = 0; t < ticks; t += 97)
+        checksum += linearScan(copy, t * 100);
+    long long linear = (cq2::monotonicMicroseconds() - start) * 97;
+
+    start = cq2::monotonicMicroseconds();
+    long sum = 0;
+    for (long t = 0; t < ticks; t++)
+    {
+        assert(index.seek(t * 100, entry));
+        if (t % 97 == 0)
+            sum += entry.page;
+    }
+    long long seeks = cq2::monotonicMicroseconds() - start;
+    assert(sum == checksum);
+
+    start = cq2::monotonicMicroseconds();
+    sum = 0;
+    for (long t = 0; t < ticks; t++)
+    {
+        assert(index.at(t * 100, entry));
+        if (t % 97 == 0)
+            sum += entry.page;
+    }
+    long long cursor = cq2::monotonicMicroseconds() - start;
+    assert(sum == checksum);
+
+    // random jumps, e.g. GotoPercent
+    srand(1);
+    start = cq2::monotonicMicroseconds();
+    for (int i = 0; i < 100000; i++)
+    {
+        long ms = rand() % (entries * 2000);
+        assert(index.seek(ms, entry) && entry.startms <= ms && ms < entry.startms + 2000);
+    }
+    long long jumps = cq2::monotonicMicroseconds() - start;
+
+    cout << entries << " entries, " << ticks << " time updates:" << endl;
+    cout << "  linear scan  " << linear / ticks << " us per update (estimated)" << endl;
+    cout << "  seek         " << seeks * 1000 / ticks << " ns per update" << endl;
+    cout << "  at           " << cursor * 1000 / ticks << " ns per update" << endl;
+    cout << "100000 random seeks: " << jumps * 1000 / 100000 << " ns per seek" << endl;
+    assert(cursor < linear / 100);
+
+    return 0;
+}
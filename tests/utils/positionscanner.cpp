@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PositionScanner.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <assert.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Checks the section and page start times read from the SMIL files of a
+// Daisy 2.02 and a Daisy 3 book.
+
+static string workdir;
+
+static void writeFile(const string &path, const string &content)
+{
+    ofstream out(path.c_str());
+    out << content;
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/positionscannerXXXXXX";
+    assert(mkdtemp(tmpl) != NULL);
+    workdir = tmpl;
+
+    // clock values
+    assert(PositionScanner::parseClock("npt=2.384s") == 2384);
+    assert(PositionScanner::parseClock("00:00:47.571") == 47571);
+    assert(PositionScanner::parseClock("1:02:03") == 3723000);
+    assert(PositionScanner::parseClock("01:30.5") == 90500);
+    assert(PositionScanner::parseClock("12.5") == 12500);
+    assert(PositionScanner::parseClock("500ms") == 500);
+    assert(PositionScanner::parseClock("2min") == 120000);
+    assert(PositionScanner::parseClock("") == -1);
+    assert(PositionScanner::parseClock("soon") == -1);
+
+    // Daisy 2.02, the second SMIL has no elapsed time and starts where the
+    // first ends, a page and a heading start at the same time
+    string book = workdir + "/daisy202";
+    mkdir(book.c_str(), 0755);
+    writeFile(book + "/ncc.html",
+            "<html><head><title>Book</title></head><body>\n"
+            "<h1 class=\"title\" id=\"h1\"><a href=\"a.smil#t1\">Book</a></h1>\n"
+            "<SPAN CLASS=\"page-normal\" ID=\"p1\"><A HREF=\"a.smil#t2\">1</A></SPAN>\n"
+            "<h2 id=\"h2\"><a href=\"a.smil#t3\">Chapter</a></h2>\n"
+            "<span class=\"page-normal\" id=\"p2\"><a href=\"a.smil#t3\">2</a></span>\n"
+            "<h1 id=\"h3\"><a href=\"b.smil#t4\">Next</a></h1>\n"
+            "</body></html>\n");
+    writeFile(book + "/a.smil",
+            "<smil><head><meta name=\"ncc:totalElapsedTime\" content=\"0:00:10\"/></head><body><seq>\n"
+            "<par id=\"par1\"><text src=\"x.html#1\" id=\"t1\"/><audio src=\"a.mp3\" clip-begin=\"npt=0.000s\" clip-end=\"npt=1.500s\"/></par>\n"
+            "<par id=\"par2\"><text src=\"x.html#2\" id=\"t2\"/><audio src=\"a.mp3\" clip-begin=\"npt=1.500s\" clip-end=\"npt=4.000s\"/></par>\n"
+            "<par id=\"par3\"><text src=\"x.html#3\" id=\"t3\"/><seq><audio src=\"a.mp3\" clip-begin=\"npt=4.000s\" clip-end=\"npt=5.000s\"/>"
+            "<audio src=\"a.mp3\" clip-begin=\"npt=5.000s\" clip-end=\"npt=6.000s\"/></seq></par>\n"
+            "</seq></body></smil>\n");
+    writeFile(book + "/b.smil",
+            "<smil><body><seq>\n"
+            "<par id=\"par4\"><text src=\"x.html#4\" id=\"t4\"/><audio src=\"b.mp3\" clip-begin=\"npt=0s\" clip-end=\"npt=3s\"/></par>\n"
+            "</seq></body></smil>\n");
+
+    vector<PositionIndex::Entry> entries;
+    assert(PositionScanner::scan(book + "/ncc.html", entries));
+    for (size_t i = 0; i < entries.size(); i++)
+        cout << entries[i].startms << " ms: section " << entries[i].section << ", page " << entries[i].page << ", " << entries[i].ref << endl;
+    assert(entries.size() == 4);
+    assert(entries[0].startms == 10000 && entries[0].smilms == 10000 && entries[0].section == 1 && entries[0].page == -1 && entries[0].ref == "h1");
+    assert(entries[1].startms == 11500 && entries[1].section == 1 && entries[1].page == 0 && entries[1].ref == "p1");
+    assert(entries[2].startms == 14000 && entries[2].section == 2 && entries[2].page == 1 && entries[2].ref == "h2");
+    assert(entries[3].startms == 16000 && entries[3].smilms == 16000 && entries[3].section == 3 && entries[3].page == 1 && entries[3].ref == "h3");
+    assert(PositionScanner::scan("file://" + book + "/ncc.html", entries) && entries.size() == 4);
+
+    // Daisy 3, navPoints and pageTargets of the NCX
+    book = workdir + "/daisy3";
+    mkdir(book.c_str(), 0755);
+    writeFile(book + "/book.opf",
+            "<package><manifest><item id=\"ncx\" href=\"nav.ncx\" media-type=\"application/x-dtbncx+xml\"/></manifest></package>\n");
+    writeFile(book + "/nav.ncx",
+            "<ncx><navMap>\n"
+            "<navPoint id=\"n1\" playOrder=\"1\"><navLabel><text>One</text></navLabel><content src=\"c.smil#s1\"/>\n"
+            "<navPoint id=\"n2\" playOrder=\"3\"><navLabel><text>Two</text></navLabel><content src=\"c.smil#s3\"/></navPoint>\n"
+            "</navPoint></navMap>\n"
+            "<pageList><pageTarget id=\"pt1\" type=\"normal\" playOrder=\"2\"><navLabel><text>1</text></navLabel><content src=\"c.smil#s2\"/></pageTarget></pageList>\n"
+            "</ncx>\n");
+    writeFile(book + "/c.smil",
+            "<smil><head><meta name=\"dtb:totalElapsedTime\" content=\"0:00:00\"/></head><body><seq>\n"
+            "<par id=\"s1\"><audio src=\"c.mp3\" clipBegin=\"0:00:00\" clipEnd=\"0:00:02\"/></par>\n"
+            "<par id=\"s2\"><audio src=\"c.mp3\" clipBegin=\"0:00:02\" clipEnd=\"0:00:07.250\"/></par>\n"
+            "<par id=\"s3\"><audio src=\"c.mp3\" clipBegin=\"0:00:07.250\" clipEnd=\"0:00:09\"/></par>\n"
+            "</seq></body></smil>\n");
+
+    assert(PositionScanner::scan(book + "/book.opf", entries));
+    assert(entries.size() == 3);
+    assert(entries[0].startms == 0 && entries[0].section == 1 && entries[0].page == -1 && entries[0].ref == "n1");
+    assert(entries[1].startms == 2000 && entries[1].section == 1 && entries[1].page == 0 && entries[1].ref == "pt1");
+    assert(entries[2].startms == 7250 && entries[2].section == 2 && entries[2].page == 0 && entries[2].ref == "n2");
+
+    // remote and missing books are not scanned
+    assert(not PositionScanner::scan("http://example.com/ncc.html", entries) && entries.empty());
+    assert(not PositionScanner::scan(workdir + "/missing/ncc.html", entries));
+
+    string command = "rm -rf " + workdir;
+    assert(system(command.c_str()) == 0);
+    return 0;
+}
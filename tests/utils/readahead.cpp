@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PhraseReadAhead.h"
+
+#include <cstdio>
+#include <iostream>
+#include <assert.h>
+
+using namespace std;
+
+// Plays a sequence of phrases and measures the silence between them,
+// resolving each phrase when the previous one has ended and with
+// PhraseReadAhead. Resolving a phrase costs more when the next SMIL has to be
+// parsed or fetched, as for the first phrase of every file here.
+
+// Phrases of 1.2 to 3.2 seconds in files of five phrases
+static PhraseReadAhead::Clip phrase(int n)
+{
+    char uri[32];
+    snprintf(uri, sizeof(uri), "audio%02d.mp3", n / 5);
+    long long start = (n % 5) * 2500;
+    return PhraseReadAhead::Clip(uri, start, start + 1200 + (n % 3) * 1000);
+}
+
+// Milliseconds taken by DaisyHandler to resolve phrase n
+static long resolveTime(int n)
+{
+    return n % 5 == 0 ? 180 : 15;
+}
+
+// Milliseconds of silence between phrases when the next phrase is resolved at the end of a clip
+static long playWithoutReadAhead(int phrases)
+{
+    long silence = 0;
+    for (int n = 1; n < phrases; n++)
+        silence += resolveTime(n);
+    return silence;
+}
+
+// Milliseconds of silence between phrases with read ahead. The player
+// reports its position every 100 ms and plays at the given tempo.
+static long playWithReadAhead(PhraseReadAhead &readAhead, int phrases, double tempo)
+{
+    long silence = 0;
+    int resolved = 0;
+    readAhead.opened(phrase(0));
+    for (int n = 0; n < phrases; n++)
+    {
+        PhraseReadAhead::Clip clip = phrase(n);
+        for (long long current = clip.startms; current < clip.stopms; current += (long long)(100 * tempo))
+        {
+            if (readAhead.due(current))
+            {
+                // resolved on the clientcore thread while the clip plays on
+                while (readAhead.wanted() && resolved + 1 < phrases)
+                {
+                    resolved++;
+                    readAhead.push(phrase(resolved));
+                }
+            }
+        }
+
+        if (n + 1 == phrases)
+            break;
+
+        PhraseReadAhead::Clip next;
+        if (not readAhead.pop(next))
+        {
+            resolved++;
+            next = phrase(resolved);
+            silence += resolveTime(resolved);
+        }
+        assert(next.uri == phrase(n + 1).uri && next.startms == phrase(n + 1).startms);
+        readAhead.opened(next);
+    }
+    return silence;
+}
+
+int main()
+{
+    // phrases are queued in order and due() is true once per clip
+    {
+        PhraseReadAhead readAhead(2, 500);
+        readAhead.opened(PhraseReadAhead::Clip("a.mp3", 0, 2000));
+        assert(not readAhead.due(0));
+        assert(not readAhead.due(1400));
+        assert(readAhead.due(1600));
+        assert(not readAhead.due(1700));
+        assert(readAhead.wanted());
+
+        readAhead.push(PhraseReadAhead::Clip("a.mp3", 2000, 3000));
+        assert(readAhead.wanted());
+        readAhead.push(PhraseReadAhead::Clip("b.mp3", 0, 1000));
+        assert(not readAhead.wanted());
+        assert(readAhead.size() == 2);
+
+        PhraseReadAhead::Clip clip;
+        assert(readAhead.pop(clip) && clip.uri == "a.mp3" && clip.startms == 2000);
+        readAhead.opened(clip);
+        // the position is compared with the stop time of the clip, not its length
+        assert(not readAhead.due(2000));
+        assert(not readAhead.due(2400));
+        // the queue is not full but the next phrase is already known
+        assert(readAhead.due(2600));
+        readAhead.push(PhraseReadAhead::Clip("b.mp3", 1000, 2000));
+        assert(readAhead.pop(clip) && clip.uri == "b.mp3" && clip.startms == 0);
+        assert(readAhead.size() == 1);
+
+        // navigation replaces the queued phrases
+        readAhead.clear();
+        assert(readAhead.size() == 0);
+        assert(not readAhead.wanted());
+        assert(not readAhead.pop(clip));
+    }
+
+    // a clip without a stop time, shorter than the window or an unknown position
+    {
+        PhraseReadAhead readAhead(1, 500);
+        readAhead.opened(PhraseReadAhead::Clip("a.mp3", 0, -1));
+        assert(not readAhead.due(10000));
+
+        readAhead.opened(PhraseReadAhead::Clip("a.mp3", 0, 300));
+        assert(not readAhead.due(-1));
+        assert(readAhead.due(0));
+    }
+
+    // a paused player keeps reporting the same position and never becomes due
+    {
+        PhraseReadAhead readAhead(1, 500);
+        readAhead.opened(PhraseReadAhead::Clip("a.mp3", 1000, 3000));
+        for (int update = 0; update < 1000; update++)
+            assert(not readAhead.due(1200));
+        assert(readAhead.due(2500));
+    }
+
+    const int phrases = 100;
+    long before = playWithoutReadAhead(phrases);
+    PhraseReadAhead readAhead;
+    long after = playWithReadAhead(readAhead, phrases, 1.0);
+    cout << phrases << " phrases: " << before << " ms of silence resolving at the end of each clip, "
+         << after << " ms with read ahead" << endl;
+    assert(after == 0);
+
+    // the phrases are still resolved in time at a faster tempo
+    PhraseReadAhead fastReadAhead;
+    after = playWithReadAhead(fastReadAhead, phrases, 2.0);
+    cout << phrases << " phrases at double tempo: " << after << " ms with read ahead" << endl;
+    assert(after == 0);
+
+    return 0;
+}
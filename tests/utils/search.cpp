@@ -1,10 +1,51 @@
 #include "Utils.h"
+#include "DirectoryWalker.h"
+#include "CommandQueue2/Clock.h"
 #include "../setup_logging.h"
 
 #include <string>
 #include <vector>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
 #include <assert.h>
 #include <iostream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// The previous search, one recursive_directory_iterator walk per pattern and
+// two stat calls per entry
+std::vector<std::string> boostSearch(std::string path, std::string pattern, bool extension)
+{
+    std::vector<std::string> matches;
+    for (boost::filesystem::recursive_directory_iterator end, dir(path); dir != end; ++dir)
+    {
+        boost::filesystem::path p(*dir);
+        if (boost::filesystem::exists(p) && boost::filesystem::is_regular_file(p))
+        {
+            if (extension ? p.extension() == pattern : p.filename() == pattern)
+                matches.push_back(p.string());
+        }
+    }
+    return matches;
+}
+
+void touch(const std::string &path)
+{
+    std::ofstream out(path.c_str());
+}
+
+struct FirstMatch
+{
+    FirstMatch(long long &t) : time(&t) {}
+    void operator()(const std::string&, int)
+    {
+        if (*time == 0)
+            *time = cq2::monotonicMicroseconds();
+    }
+    long long *time;
+};
 
 int main(int argc, char *argv[])
 {
@@ -25,5 +66,101 @@ int main(int argc, char *argv[])
     std::cout << "matches.size() = " << matches.size() << std::endl;
     assert(matches.size() == 4);
 
+    // search both kinds of books in one walk
+    DirectoryWalker books;
+    int ncc = books.addFilename("ncc.html");
+    int opf = books.addExtension(".opf");
+    books.setPruning(true);
+    std::vector<std::vector<std::string> > found = books.search(argv[1]);
+    assert(found[ncc].size() == 2 && found[opf].size() == 2);
+    assert(found[ncc] == Utils::recursiveSearchByFilename(argv[1], "ncc.html"));
+
+    // the subdirectories of a book are not searched when pruning, symbolic
+    // links to files match and links to directories are not followed
+    char tmpl[] = "/tmp/searchXXXXXX";
+    assert(mkdtemp(tmpl) != NULL);
+    std::string workdir = tmpl;
+    mkdir((workdir + "/book").c_str(), 0755);
+    mkdir((workdir + "/book/extra").c_str(), 0755);
+    mkdir((workdir + "/links").c_str(), 0755);
+    touch(workdir + "/book/ncc.html");
+    touch(workdir + "/book/extra/ncc.html");
+    touch(workdir + "/book/ncc.html.bak");
+    touch(workdir + "/links/.opf");
+    assert(symlink("../book/ncc.html", (workdir + "/links/ncc.html").c_str()) == 0);
+    assert(symlink("../book", (workdir + "/links/book").c_str()) == 0);
+    found = books.search(workdir);
+    assert(found[ncc].size() == 2 && found[opf].empty());
+    assert(found[ncc][0] == workdir + "/book/ncc.html" && found[ncc][1] == workdir + "/links/ncc.html");
+    books.setPruning(false);
+    found = books.search(workdir + "/");
+    assert(found[ncc].size() == 3 && found[ncc][0] == workdir + "/book/extra/ncc.html");
+    assert(books.search(workdir + "/missing")[ncc].empty());
+
+    // a large tree, 40 shelves of 25 books with audio, SMIL and image files
+    const int shelves = 40, booksPerShelf = 25;
+    for (int s = 0; s < shelves; s++)
+    {
+        std::ostringstream shelf;
+        shelf << workdir << "/tree/shelf" << s;
+        mkdir((workdir + "/tree").c_str(), 0755);
+        mkdir(shelf.str().c_str(), 0755);
+        for (int b = 0; b < booksPerShelf; b++)
+        {
+            std::ostringstream book;
+            book << shelf.str() << "/book" << b;
+            mkdir(book.str().c_str(), 0755);
+            mkdir((book.str() + "/images").c_str(), 0755);
+            touch(book.str() + ((s + b) % 4 == 0 ? "/book.opf" : "/ncc.html"));
+            for (int f = 0; f < 30; f++)
+            {
+                std::ostringstream file;
+                file << book.str() << "/part" << f;
+                touch(file.str() + ".mp3");
+                touch(file.str() + ".smil");
+                touch(book.str() + "/images/" + file.str().substr(book.str().size() + 1) + ".jpg");
+            }
+        }
+    }
+    std::string tree = workdir + "/tree";
+
+    long long start = cq2::monotonicMicroseconds();
+    std::vector<std::string> nccUris = boostSearch(tree, "ncc.html", false);
+    std::vector<std::string> opfUris = boostSearch(tree, ".opf", true);
+    long long twoPasses = cq2::monotonicMicroseconds() - start;
+    assert(nccUris.size() + opfUris.size() == shelves * booksPerShelf);
+
+    DirectoryWalker walker;
+    walker.addFilename("ncc.html");
+    walker.addExtension(".opf");
+    walker.setThreads(1);
+    start = cq2::monotonicMicroseconds();
+    found = walker.search(tree);
+    long long onePass = cq2::monotonicMicroseconds() - start;
+    assert(found[0].size() == nccUris.size() && found[1].size() == opfUris.size());
+
+    walker.setPruning(true);
+    start = cq2::monotonicMicroseconds();
+    found = walker.search(tree);
+    long long pruned = cq2::monotonicMicroseconds() - start;
+    assert(found[0].size() == nccUris.size() && found[1].size() == opfUris.size());
+
+    walker.setThreads(DIRECTORY_WALKER_THREADS);
+    long long first = 0;
+    start = cq2::monotonicMicroseconds();
+    long count = walker.walk(tree, FirstMatch(first));
+    long long parallel = cq2::monotonicMicroseconds() - start;
+    assert(count == shelves * booksPerShelf);
+
+    std::cout << shelves * booksPerShelf << " books, " << shelves * booksPerShelf * 91 << " files:" << std::endl;
+    std::cout << "  two recursive_directory_iterator walks  " << twoPasses / 1000 << " ms" << std::endl;
+    std::cout << "  one walk                                " << onePass / 1000 << " ms" << std::endl;
+    std::cout << "  one walk, pruned                        " << pruned / 1000 << " ms" << std::endl;
+    std::cout << "  one walk, pruned, " << DIRECTORY_WALKER_THREADS << " threads             " << parallel / 1000
+              << " ms, first book after " << (first - start) / 1000 << " ms" << std::endl;
+    assert(pruned < twoPasses);
+
+    std::string command = "rm -rf " + workdir;
+    assert(system(command.c_str()) == 0);
     return 0;
 }
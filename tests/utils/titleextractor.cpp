@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2012 Kolibre
+ *
+ * This file is part of kolibre-clientcore.
+ *
+ * Kolibre-clientcore is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Kolibre-clientcore is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with kolibre-clientcore. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TitleExtractor.h"
+#include "CommandQueue2/Clock.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/regex.hpp>
+
+using namespace std;
+
+// Checks the titles extracted from Daisy 2.02 and Daisy 3 books and compares
+// the time to list a tree of 1000 books by extracting their titles with
+// parsing their whole navigation files.
+
+static string workdir;
+
+static void writeFile(const string &path, const string &content)
+{
+    ofstream out(path.c_str());
+    out << content;
+}
+
+// Write a book with an ncc.html with the given number of sections, a SMIL
+// file per 50 sections and return the path of the ncc.html
+static string writeBook(const string &dir, const string &title, int sections)
+{
+    string path = workdir + "/" + dir;
+    mkdir(path.c_str(), 0755);
+
+    ostringstream ncc;
+    ncc << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<html><head><title>" << dir << "</title>\n"
+        << "<meta name=\"dc:title\" content=\"" << dir << "\" />\n"
+        << "<meta name=\"ncc:totalTime\" content=\"12:34:56\" /></head><body>\n"
+        << "<h1 class=\"title\" id=\"s0\"><a href=\"c0.smil#t0\">" << title << "</a></h1>\n";
+    for (int i = 1; i < sections; i++)
+        ncc << "<h" << (i % 3) + 1 << " class=\"section\" id=\"s" << i << "\"><a href=\"c" << i / 50
+            << ".smil#t" << i << "\">Chapter " << i << "</a></h" << (i % 3) + 1 << ">\n";
+    ncc << "</body></html>\n";
+    writeFile(path + "/ncc.html", ncc.str());
+
+    for (int s = 0; s * 50 < sections; s++)
+    {
+        ostringstream smil;
+        smil << "<smil><body><seq>\n";
+        for (int i = s * 50; i < (s + 1) * 50 && i < sections; i++)
+            smil << "<par id=\"p" << i << "\"><text src=\"c.html#x" << i << "\" id=\"t" << i << "\"/>"
+                 << "<audio src=\"audio " << i << ".mp3\" clip-begin=\"npt=0.000s\" clip-end=\"npt=3.578s\"/></par>\n";
+        smil << "</seq></body></smil>\n";
+        ostringstream name;
+        name << path << "/c" << s << ".smil";
+        writeFile(name.str(), smil.str());
+    }
+    return path + "/ncc.html";
+}
+
+// Read the title by parsing the whole ncc.html and its first SMIL file, a
+// stand-in for opening the book in DaisyHandler
+static BookTitle parseBook(const string &path)
+{
+    ifstream in(path.c_str());
+    stringstream ss;
+    ss << in.rdbuf();
+    string html = ss.str();
+
+    BookTitle title;
+    boost::regex heading("<h([1-6]) class=\"(title|section)\" id=\"([^\"]*)\"><a href=\"([^\"#]*)#([^\"]*)\">([^<]*)</a>");
+    boost::sregex_iterator it(html.begin(), html.end(), heading), end;
+    string smil;
+    for (; it != end; ++it)
+    {
+        if (not title.found)
+        {
+            title.title = (*it)[6];
+            smil = (*it)[4];
+            title.found = true;
+        }
+    }
+
+    string dir = path.substr(0, path.rfind('/') + 1);
+    ifstream smilIn((dir + smil).c_str());
+    stringstream smilSs;
+    smilSs << smilIn.rdbuf();
+    string body = smilSs.str();
+    boost::smatch m;
+    if (boost::regex_search(body, m, boost::regex("<audio src=\"([^\"]*)\"")))
+        title.titleSrc = dir + string(m[1]);
+    return title;
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/titleextractorXXXXXX";
+    assert(mkdtemp(tmpl) != NULL);
+    workdir = tmpl;
+    BookTitle title;
+
+    // Daisy 2.02, the first heading and the audio of its SMIL reference
+    string ncc = writeBook("plain", "Fire Safety &amp; you, by\n  Wendy &#197;berg", 120);
+    assert(TitleExtractor::extract(ncc, title));
+    assert(title.title == "Fire Safety & you, by Wendy \xc3\x85" "berg");
+    assert(title.titleSrc == workdir + "/plain/audio 0.mp3");
+    assert(TitleExtractor::extract("file://" + ncc, title) && title.found);
+
+    // HTML with upper case tags and a title reference into a later SMIL par
+    mkdir((workdir + "/upper").c_str(), 0755);
+    writeFile(workdir + "/upper/NCC.HTML",
+            "<HTML><HEAD><TITLE>x</TITLE></HEAD><BODY>\n"
+            "<H1 CLASS=title ID=a><A HREF='text%20one.smil#T2'>Upper <B>case</B></A></H1></BODY></HTML>\n");
+    writeFile(workdir + "/upper/text one.smil",
+            "<smil><body><par id='T1'><audio src='first.mp3'/></par>"
+            "<par><text id='T2' src='x.html'/><AUDIO SRC='sub/second.mp3'/></par></body></smil>");
+    assert(TitleExtractor::extract(workdir + "/upper/NCC.HTML", title));
+    assert(title.title == "Upper case");
+    assert(title.titleSrc == workdir + "/upper/sub/second.mp3");
+
+    // without headings the dc:title is used, there is no spoken title
+    mkdir((workdir + "/meta").c_str(), 0755);
+    writeFile(workdir + "/meta/ncc.html",
+            "<html><head><meta content=\"Meta title\" name=\"dc:title\"/></head><body></body></html>");
+    assert(TitleExtractor::extract(workdir + "/meta/ncc.html", title));
+    assert(title.title == "Meta title" && title.titleSrc.empty());
+
+    // Daisy 3, the dc:title of the OPF and the docTitle audio of the NCX
+    mkdir((workdir + "/daisy3").c_str(), 0755);
+    writeFile(workdir + "/daisy3/book.opf",
+            "<package><metadata><dc-metadata><dc:Format>ANSI/NISO Z39.86-2005</dc:Format><dc:Title>Daisy &lt;3&gt;</dc:Title>"
+            "</dc-metadata></metadata><manifest><item id=\"opf\" href=\"book.opf\" media-type=\"text/xml\"/>"
+            "<item id=\"ncx\" href=\"nav/book.ncx\" media-type=\"application/x-dtbncx+xml\"/></manifest></package>");
+    mkdir((workdir + "/daisy3/nav").c_str(), 0755);
+    writeFile(workdir + "/daisy3/nav/book.ncx",
+            "<ncx><head/><docTitle><text>NCX title</text><audio src=\"../audio/title.mp3\" clipBegin=\"0:00:00\"/>"
+            "</docTitle><navMap/></ncx>");
+    assert(TitleExtractor::extract(workdir + "/daisy3/book.opf", title));
+    assert(title.title == "Daisy <3>");
+    assert(title.titleSrc == workdir + "/daisy3/nav/../audio/title.mp3");
+
+    // missing files and remote books have no title
+    assert(not TitleExtractor::extract(workdir + "/missing/ncc.html", title));
+    assert(not title.found && title.title.empty());
+    assert(not TitleExtractor::extract("http://example.com/ncc.html", title));
+
+    // a tree of 1000 books with 200 sections each
+    const int books = 1000;
+    vector<string> uris;
+    for (int i = 0; i < books; i++)
+    {
+        ostringstream dir, name;
+        dir << "book" << i;
+        name << "Book number " << i;
+        uris.push_back(writeBook(dir.str(), name.str(), 200));
+    }
+    uris.push_back(workdir + "/missing/ncc.html");
+
+    long long start = cq2::monotonicMicroseconds();
+    vector<BookTitle> parsed;
+    for (size_t i = 0; i < uris.size(); i++)
+        parsed.push_back(parseBook(uris[i]));
+    long long full = cq2::monotonicMicroseconds() - start;
+
+    start = cq2::monotonicMicroseconds();
+    vector<BookTitle> serial = TitleExtractor::extractAll(uris, 1);
+    long long one = cq2::monotonicMicroseconds() - start;
+
+    start = cq2::monotonicMicroseconds();
+    vector<BookTitle> titles = TitleExtractor::extractAll(uris);
+    long long parallel = cq2::monotonicMicroseconds() - start;
+
+    assert(titles.size() == uris.size());
+    for (int i = 0; i < books; i++)
+    {
+        assert(titles[i].found && titles[i].title == parsed[i].title);
+        assert(titles[i].titleSrc == parsed[i].titleSrc);
+        assert(serial[i].title == titles[i].title);
+    }
+    assert(not titles[books].found);
+
+    cout << books << " books:" << endl;
+    cout << "  parsing navigation files   " << full / 1000 << " ms" << endl;
+    cout << "  extracting titles          " << one / 1000 << " ms" << endl;
+    cout << "  extracting on " << TITLE_EXTRACTOR_THREADS << " threads     " << parallel / 1000 << " ms" << endl;
+    assert(one < full);
+
+    string command = "rm -rf " + workdir;
+    assert(system(command.c_str()) == 0);
+    return 0;
+}